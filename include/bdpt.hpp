@@ -0,0 +1,173 @@
+#ifndef BDPT_HPP
+#define BDPT_HPP
+//bidirectional path tracing, follow the structure of PBRT-v3 (Veach's thesis, chapter 10)
+#include "utils.hpp"
+#include "emitter.hpp"
+#include "light_sampler.hpp"
+#include <vecmath.h>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+class Hit;
+class Ray;
+class Camera;
+class Group;
+class Material;
+class SceneParser;
+class Film;
+class Light;
+struct AOVSample;
+
+inline bool isBlack(const Vector3f& c) {
+    return c.x() == 0 && c.y() == 0 && c.z() == 0;
+}
+
+//nothing in group blocks the segment from a to b (hits at b itself do not count)
+bool visible(Group* group, const Vector3f& a, const Vector3f& b);
+
+//random numbers of one path sample, in [0, 1)
+//BDPT draws them independently, a Markov chain sampler can replay and mutate them instead
+class PathSampler {
+public:
+    virtual ~PathSampler() = default;
+    virtual float next() = 0;
+};
+
+class RandomSampler : public PathSampler {
+public:
+    explicit RandomSampler(unsigned short* Xi) : Xi(Xi) {}
+    //erand48 can round up to 1 as a float
+    float next() override { return std::min(float(erand48(Xi)), 0.99999994f); }
+
+private:
+    unsigned short* Xi;
+};
+
+//scattering at a path vertex, reduced to the lobes the materials have in the path tracer (radiance in render.cpp):
+//Lambert, ideal mirror and smooth glass (Schlick's Fresnel, ior 1.5 or the material's); the microfacet model of
+//EmpiricalMaterial has no pdf to weight the strategies with, its Lambert part stands for it
+//directions point away from the vertex, n is the normal of the hit (either side)
+struct VertexBSDF {
+    enum Lobe { NONE, LAMBERT, MIRROR, GLASS };
+    Lobe lobe = NONE;
+    Vector3f color = Vector3f::ZERO;
+    Vector3f n = Vector3f::ZERO;
+    float ior = 1.5f;
+
+    VertexBSDF() = default;
+    explicit VertexBSDF(const Hit& hit);
+
+    bool isDelta() const { return lobe == MIRROR || lobe == GLASS; }
+    //0 for the delta lobes
+    Vector3f f(const Vector3f& wo, const Vector3f& wi) const;
+    //pdf per solid angle of sampling wi from wo, 0 for the delta lobes
+    float pdf(const Vector3f& wo, const Vector3f& wi) const;
+    //wi from wo, returns f * |cos| / pdf (zero if nothing scatters), pdf per solid angle
+    Vector3f sample(const Vector3f& wo, PathSampler& sampler, Vector3f& wi, float& pdf) const;
+};
+
+//vertex of a camera or light subpath, the pdfs are per area (per solid angle at BACKGROUND vertices):
+//pdfFwd of generating it from the previous vertex of its own subpath, pdfRev from the next one (the other direction)
+struct PathVertex {
+    enum Type { CAMERA, LIGHT, SURFACE, BACKGROUND };
+    Type type = SURFACE;
+    Vector3f p = Vector3f::ZERO;
+    //surface normal, view direction at the camera
+    Vector3f n = Vector3f::ZERO;
+    //throughput of the subpath up to here
+    Vector3f beta = Vector3f::ZERO;
+    VertexBSDF bsdf;
+    const Material* material = nullptr;
+    //the light of a LIGHT vertex on a light of the Lights section, nullptr on the emitters
+    const Light* light = nullptr;
+    //emission at LIGHT vertices and emitters found by camera paths, the background color at BACKGROUND vertices
+    Vector3f Le = Vector3f::ZERO;
+    bool delta = false;
+    float pdfFwd = 0, pdfRev = 0;
+
+    bool onSurface() const { return type == SURFACE || type == LIGHT; }
+    //LIGHT and SURFACE vertices; whether the camera can be connected to is up to the camera
+    bool connectible() const { return type == LIGHT || (type == SURFACE && !bsdf.isDelta()); }
+};
+
+//where light paths start: the emissive geometry (emitter.hpp) and the lights of the Lights section (light.hpp),
+//the two in proportion to their power as the photons of sppm.cpp, a light by the power table of LightSampler
+class LightSources {
+public:
+    explicit LightSources(const SceneParser& scene);
+
+    bool empty() const { return emitters.empty() && lights.empty(); }
+    const EmitterSampler& getEmitters() const { return emitters; }
+    int numLights() const { return lights.size(); }
+    //nullptr: the emitters, u is rescaled to [0, 1) to choose among them; otherwise a light; pdf is the
+    //probability of the choice
+    const Light* choose(float& u, float& pdf) const;
+    //pdf per area of sampling a point of an emitter with this material, EmitterSampler::pdfPoint with the choice
+    float pdfPoint(const Material* material) const { return emitterShare * emitters.pdfPoint(material); }
+
+    //the visible part of the scene, distant lights shine from its bounding sphere
+    Vector3f sceneCenter;
+    float sceneRadius;
+
+private:
+    //the scene's own (SceneParser::getEmitters)
+    const EmitterSampler& emitters;
+    LightSampler lights;
+    float emitterShare = 1;
+};
+
+//every path sample traces a camera subpath from the pixel and a light subpath from a point on the emitters
+//or the lights (LightSources) and joins every prefix of the one with every prefix of the other: s light and t camera vertices,
+//path length s + t - 2 up to the maximal depth; the estimates of all (s, t) are weighted by the balance heuristic
+//s = 0: the camera path hits an emitter or leaves the scene (the background, which only this strategy finds);
+//the lights cannot be hit, they are found by the other strategies only
+//s = 1: a new point on the emitters or a light is connected to the camera path (next event estimation)
+//t = 1: a light path vertex is connected to the camera (light tracing), it lands in any pixel and is splatted
+class BDPTIntegrator {
+public:
+    //light tracing contribution at pixel coordinates (x, y)
+    struct Splat {
+        float x, y;
+        Vector3f value;
+    };
+
+    //maxDepth: maximal number of bounces
+    BDPTIntegrator(const SceneParser& scene, int maxDepth);
+
+    //pixelSamples path samples of every pixel into film
+    void render(Film& film, int pixelSamples) const;
+    //one path sample through the film point (x, y): the strategies t > 1 are summed into the result,
+    //the light tracing contributions are appended to splats; aov (may be nullptr) receives the first hit
+    //and the split of the result into direct (at most one bounce) and indirect light
+    Vector3f sample(float x, float y, PathSampler& sampler, std::vector<Splat>& splats, AOVSample* aov = nullptr) const;
+
+    //the pieces of sample, for integrators that pick a single strategy (mlt.hpp)
+    //subpaths of at most maxVertices vertices (by default as many as sample uses)
+    void cameraSubpath(float x, float y, PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices = -1) const;
+    void lightSubpath(PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices = -1) const;
+    //unweighted contribution of strategy (s, t) times its MIS weight; rasterX, rasterY: where t = 1 lands
+    Vector3f connect(std::vector<PathVertex>& lightPath, std::vector<PathVertex>& cameraPath, int s, int t, PathSampler& sampler, float& rasterX, float& rasterY) const;
+
+private:
+    //extends path from its last vertex along ray (pdf per solid angle) up to maxVertices vertices
+    //camera paths (radiance) keep the emission of their vertices and end in a BACKGROUND vertex on a miss
+    void walk(const Ray& ray, Vector3f beta, float pdf, PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices, bool radiance) const;
+    float misWeight(std::vector<PathVertex>& lightPath, std::vector<PathVertex>& cameraPath, const PathVertex& sampled, int s, int t) const;
+
+    //pdf per area at next of v scattering (emitting, looking) towards it, prev is the vertex before v
+    float pdf(const PathVertex& v, const PathVertex* prev, const PathVertex& next) const;
+    //pdf per area at next of the emitter vertex v emitting towards it
+    float pdfLight(const PathVertex& v, const PathVertex& next) const;
+    //f of the surface vertex v between prev and next
+    Vector3f f(const PathVertex& v, const PathVertex& prev, const PathVertex& next) const;
+
+    const SceneParser& scene;
+    Camera* camera;
+    Group* group;
+    LightSources sources;
+    const EmitterSampler& emitters;
+    int maxDepth;
+};
+
+#endif //BDPT_HPP
@@ -1,108 +1,132 @@
 #pragma once
 #include <vector>
+#include "object3d.hpp"
 #include "classical_object.hpp"
-#include "triangle.hpp"
+#include "ray_packet.hpp"
 #include <vecmath.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <omp.h>
+
+//flat preorder form of a BVHNode tree, used by the geometry cache
+//children are node indices (-1 for none), leaves reference [start, start + count) of the primitive order
+struct PackedBVHNode {
+    float min[3];
+    float max[3];
+    int32_t left;
+    int32_t right;
+    int32_t start;
+    int32_t count;
+};
+
+class BVHNode;
+
+//Binned SAH BVH builder
+//every node splits along the largest extent of its centroid bounds at the cheapest of NUM_BINS
+//bin borders, primitives are partitioned stably, so the tree only depends on the input order
+//large nodes bin and partition their range in parallel blocks, independent subtrees are built
+//as OpenMP tasks; the result is identical for any number of threads (OMP_NUM_THREADS=1 is the serial build)
+class BVHBuilder {
+public:
+    static const int NUM_BINS = 16;
+    static const int DEFAULT_LEAF_SIZE = 4;
+
+    struct Bounds {
+        float min[3];
+        float max[3];
+    };
+
+    explicit BVHBuilder(int leafSize = DEFAULT_LEAF_SIZE) : leafSize(leafSize) {}
+
+    //builds the tree under root, order receives the primitive order, every leaf lists
+    //a contiguous range of it (returned through the callback (leaf, begin, end))
+    template<typename Leaf>
+    void build(BVHNode* root, const std::vector<Bounds>& primitives, std::vector<int>& order, Leaf leaf);
+
+    int nodeCount() const { return nodes; }
+
+private:
+    void buildNode(BVHNode* node, int begin, int end);
+    void reduce(int begin, int end, Bounds& bounds, Bounds& centroidBounds) const;
+    int split(int begin, int end, const Bounds& centroidBounds, const Bounds& bounds);
+
+    int leafSize;
+    const std::vector<Bounds>* primitives = nullptr;
+    std::vector<float> centroids;
+    std::vector<int>* order = nullptr;
+    std::vector<int> scratch;
+    std::vector<std::pair<BVHNode*, std::pair<int, int>>> leaves;
+    std::atomic<int> nodes{0};
+    omp_lock_t leavesLock;
+};
 
 class BVHNode {
 public:
     BoundingBox box;
     BVHNode* left;
     BVHNode* right;
-    std::vector<Triangle*> triangles;
+    //leaves cover [start, start + count) of the primitive order
+    int start;
+    int count;
     BVHNode() {
         box = BoundingBox();
         left = nullptr;
         right = nullptr;
-        triangles = std::vector<Triangle*>();
+        start = 0;
+        count = 0;
     }
-    BVHNode(std::vector<Triangle*>& triangles) {
-        
-        this->box = BoundingBox();
-        for (auto triangle : triangles) {
-            this->box.extend(triangle->_vertices[0]);
-            this->box.extend(triangle->_vertices[1]);
-            this->box.extend(triangle->_vertices[2]);
-        }
-        if(triangles.size() <= 2000){
-            //this->children = std::vector<BVHNode*>();
-            this->left = nullptr;
-            this->right = nullptr;
-            this->triangles = triangles;
-            return;
-        }
-        //split
-        //randomly choose a axis
-        int axis = rand() % 3;
-        sort(triangles.begin(), triangles.end(), [axis](Triangle* a, Triangle* b) {
-            return a->_vertices[0][axis] < b->_vertices[0][axis];
-        });
-        float mid = triangles[triangles.size() / 2]->_vertices[0][axis];
-        std::vector<Triangle*> leftTriangles;
-        std::vector<Triangle*> rightTriangles;
-        for (auto triangle : triangles) {
-            if(triangle->_vertices[0][axis] < mid && triangle->_vertices[1][axis] < mid && triangle->_vertices[2][axis] < mid) {
-                leftTriangles.push_back(triangle);
-            }else if(triangle->_vertices[0][axis] > mid && triangle->_vertices[1][axis] > mid && triangle->_vertices[2][axis] > mid) {
-                rightTriangles.push_back(triangle);
-            }else{
-                leftTriangles.push_back(triangle);
-                rightTriangles.push_back(triangle);
-            }
+    //build over the primitive bounds with the binned SAH builder below,
+    //order receives the primitive order the leaf ranges index into
+    BVHNode(const std::vector<BVHBuilder::Bounds>& primitives, std::vector<int>& order);
+
+    //append this subtree to nodes in preorder
+    int pack(std::vector<PackedBVHNode>& nodes) const {
+        int index = nodes.size();
+        PackedBVHNode node;
+        for(int i = 0; i < 3; i++){
+            node.min[i] = box.min[i];
+            node.max[i] = box.max[i];
         }
-        if(leftTriangles.size() == 0 || rightTriangles.size() == 0) {
-            this->left = nullptr;
-            this->right = nullptr;
-            this->triangles = triangles;
-            return;
+        node.left = -1;
+        node.right = -1;
+        node.start = start;
+        node.count = count;
+        nodes.push_back(node);
+        //nodes grows while packing the children, index it only after they return
+        if(left != nullptr) {
+            int child = left->pack(nodes);
+            nodes[index].left = child;
         }
-        this->left = new BVHNode(leftTriangles);
-        this->right = new BVHNode(rightTriangles);
-
-        
-        
-        /* 
-        //auto is the middle point
-        sort(triangles.begin(), triangles.end(), [](Triangle* a, Triangle* b) {
-            return a->_vertices[0].x() < b->_vertices[0].x();
-        });
-        float midX = triangles[triangles.size() / 2]->_vertices[0].x();
-        sort(triangles.begin(), triangles.end(), [](Triangle* a, Triangle* b) {
-            return a->_vertices[0].y() < b->_vertices[0].y();
-        });
-        float midY = triangles[triangles.size() / 2]->_vertices[0].y();
-        sort(triangles.begin(), triangles.end(), [](Triangle* a, Triangle* b) {
-            return a->_vertices[0].z() < b->_vertices[0].z();
-        });
-        float midZ = triangles[triangles.size() / 2]->_vertices[0].z();
-
-        std::vector<Triangle*> childrenTriangles[8];
-        for (auto triangle : triangles) {
-            bool isXMin = triangle->_vertices[0].x() < midX;
-            bool isYMin = triangle->_vertices[0].y() < midY;
-            bool isZMin = triangle->_vertices[0].z() < midZ;
-            int index = 0;
-            if(isXMin) index += 1;
-            if(isYMin) index += 2;
-            if(isZMin) index += 4;
-            if(index >= 8) std::cout << "index is " << index << std::endl;
-            childrenTriangles[index].push_back(triangle);
+        if(right != nullptr) {
+            int child = right->pack(nodes);
+            nodes[index].right = child;
         }
-        for (int i = 0; i < 8; ++i) {
-            if(childrenTriangles[i].size() == 0) continue;
-            children.push_back(new BVHNode(childrenTriangles[i]));
-        } */
+        return index;
+    }
 
+    //rebuild the subtree rooted at nodes[index]
+    static BVHNode* unpack(const PackedBVHNode* nodes, int index) {
+        const PackedBVHNode& packed = nodes[index];
+        BVHNode* node = new BVHNode();
+        node->box = BoundingBox(Vector3f(packed.min[0], packed.min[1], packed.min[2]),
+                                Vector3f(packed.max[0], packed.max[1], packed.max[2]));
+        node->start = packed.start;
+        node->count = packed.count;
+        if(packed.left >= 0) node->left = unpack(nodes, packed.left);
+        if(packed.right >= 0) node->right = unpack(nodes, packed.right);
+        return node;
     }
-    
-    bool intersect(const Ray &ray, Hit &h, float tmin) {
+
+    //leaf(i, ray, h, tmin) intersects the primitive at position i of the order
+    template<typename Leaf>
+    bool intersect(const Ray &ray, Hit &h, float tmin, const Leaf& leaf) {
         if(!box.intersect(ray, h, tmin)) return false;
-        if(triangles.size() > 0) {
+        if(left == nullptr && right == nullptr) {
             bool isIntersect = false;
-            for (auto triangle : triangles) {
-                bool isIntersectWithTriangle = triangle->intersect(ray, h, tmin);
-                if(isIntersectWithTriangle) {
+            for (int i = start; i < start + count; i++) {
+                bool isIntersectWithPrimitive = leaf(i, ray, h, tmin);
+                if(isIntersectWithPrimitive) {
                     isIntersect = true;
                 }
             }
@@ -110,13 +134,13 @@ public:
         }
         bool isIntersect = false;
         if(left != nullptr) {
-            bool isIntersectWithLeft = left->intersect(ray, h, tmin);
+            bool isIntersectWithLeft = left->intersect(ray, h, tmin, leaf);
             if(isIntersectWithLeft) {
                 isIntersect = true;
             }
         }
         if(right != nullptr) {
-            bool isIntersectWithRight = right->intersect(ray, h, tmin);
+            bool isIntersectWithRight = right->intersect(ray, h, tmin, leaf);
             if(isIntersectWithRight) {
                 isIntersect = true;
             }
@@ -124,3 +148,121 @@ public:
         return isIntersect;
     }
 };
+
+//Packet traversal of a packed tree
+//a node is tested against all active lanes of the packet at once, the lanes that miss it are dropped
+//for its subtree; children are visited nearest first (for the lowest active lane), every node is
+//tested again when it is popped, so lanes that found closer hits meanwhile skip it
+//once fewer than PACKET_MIN_ACTIVE lanes are left (diverged packets) each of them walks the
+//rest of the subtree alone
+//the traversal stacks hold at most depth + 1 nodes, deeper trees are traced one ray at a time
+const int PACKET_MIN_ACTIVE = 3;
+const int PACKET_STACK_SIZE = 256;
+
+//number of levels of a packed tree (preorder, children after their parent)
+inline int packedDepth(const std::vector<PackedBVHNode>& nodes) {
+    std::vector<int> depth(nodes.size(), 1);
+    int result = 0;
+    for(size_t i = 0; i < nodes.size(); i++) {
+        if(nodes[i].left >= 0) depth[nodes[i].left] = depth[i] + 1;
+        if(nodes[i].right >= 0) depth[nodes[i].right] = depth[i] + 1;
+        result = std::max(result, depth[i]);
+    }
+    return result;
+}
+
+//leaf(i, mask) tests the primitive at position i of the order against the lanes in mask, lowers
+//tmax of the lanes it hits and returns them
+template<typename Leaf>
+int intersectLane(const PackedBVHNode* nodes, int root, const RayPacket& packet, int lane, float tmin, float* tmax, const Leaf& leaf) {
+    int stack[PACKET_STACK_SIZE];
+    int size = 0, hitMask = 0;
+    stack[size++] = root;
+    while(size > 0) {
+        const PackedBVHNode& node = nodes[stack[--size]];
+        if(!packet.boxLane(node.min, node.max, tmin, tmax[lane], lane)) continue;
+        if(node.left < 0 && node.right < 0) {
+            for(int i = node.start; i < node.start + node.count; i++) hitMask |= leaf(i, 1 << lane);
+            continue;
+        }
+        int first = node.left, second = node.right;
+        if(first >= 0 && second >= 0) {
+            const PackedBVHNode& l = nodes[first];
+            const PackedBVHNode& r = nodes[second];
+            float toRight = 0;
+            for(int a = 0; a < 3; a++) toRight += packet.d[a][lane] * (r.min[a] + r.max[a] - l.min[a] - l.max[a]);
+            if(toRight < 0) std::swap(first, second);
+        }
+        //the nearer child is pushed last and popped first
+        if(second >= 0) stack[size++] = second;
+        if(first >= 0) stack[size++] = first;
+    }
+    return hitMask;
+}
+
+//tmax[lane] is the closest hit so far of every lane (the Hit's t), lanes hit are returned
+template<typename Leaf>
+int intersectPacket(const PackedBVHNode* nodes, const RayPacket& packet, float tmin, float* tmax, int mask, const Leaf& leaf) {
+    int stack[PACKET_STACK_SIZE];
+    int masks[PACKET_STACK_SIZE];
+    int size = 0, hitMask = 0;
+    stack[size] = 0;
+    masks[size++] = mask;
+    while(size > 0) {
+        --size;
+        int index = stack[size];
+        const PackedBVHNode& node = nodes[index];
+        int active = packet.boxMask(node.min, node.max, tmin, tmax, masks[size]);
+        if(active == 0) continue;
+        if(popcount(active) < PACKET_MIN_ACTIVE) {
+            for(int m = active; m != 0; m &= m - 1) hitMask |= intersectLane(nodes, index, packet, firstLane(m), tmin, tmax, leaf);
+            continue;
+        }
+        if(node.left < 0 && node.right < 0) {
+            for(int i = node.start; i < node.start + node.count; i++) hitMask |= leaf(i, active);
+            continue;
+        }
+        int first = node.left, second = node.right;
+        if(first >= 0 && second >= 0) {
+            int lane = firstLane(active);
+            const PackedBVHNode& l = nodes[first];
+            const PackedBVHNode& r = nodes[second];
+            float toRight = 0;
+            for(int a = 0; a < 3; a++) toRight += packet.d[a][lane] * (r.min[a] + r.max[a] - l.min[a] - l.max[a]);
+            if(toRight < 0) std::swap(first, second);
+        }
+        if(second >= 0) {
+            stack[size] = second;
+            masks[size++] = active;
+        }
+        if(first >= 0) {
+            stack[size] = first;
+            masks[size++] = active;
+        }
+    }
+    return hitMask;
+}
+
+template<typename Leaf>
+void BVHBuilder::build(BVHNode* root, const std::vector<Bounds>& primitives, std::vector<int>& order, Leaf leaf) {
+    this->primitives = &primitives;
+    this->order = &order;
+    order.resize(primitives.size());
+    scratch.resize(primitives.size());
+    centroids.resize(primitives.size() * 3);
+    for(size_t i = 0; i < primitives.size(); i++) {
+        order[i] = i;
+        for(int a = 0; a < 3; a++) centroids[i * 3 + a] = 0.5f * (primitives[i].min[a] + primitives[i].max[a]);
+    }
+    leaves.clear();
+    nodes = 0;
+    omp_init_lock(&leavesLock);
+    #pragma omp parallel
+    #pragma omp single
+    buildNode(root, 0, primitives.size());
+    omp_destroy_lock(&leavesLock);
+    for(auto& l : leaves) leaf(l.first, l.second.first, l.second.second);
+    leaves.clear();
+    std::vector<int>().swap(scratch);
+    std::vector<float>().swap(centroids);
+}
@@ -2,11 +2,16 @@
 #define __CAMERA_H__
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include <vecmath.h>
 #include <float.h>
 #include <cmath>
 
 //Original Framework
+//the basis (horizontal, up, direction) is kept as plain floats, rays are built from it directly
+//generateRays writes a whole tile of rays into a RayBatch at once (packets, wavefront tracing),
+//generateRay is the same computation for a single ray
+//with depth of field every ray takes its own lens sample in [0, 1)^2 from the renderer's sampler
 class Camera {
 public:
     Camera(const Vector3f &center, const Vector3f &direction, const Vector3f &up, int imgW, int imgH) {
@@ -16,10 +21,21 @@ public:
         this->up = Vector3f::cross(this->horizontal, this->direction);
         this->width = imgW;
         this->height = imgH;
+        for(int a = 0; a < 3; a++) {
+            c[a] = this->center[a];
+            h[a] = this->horizontal[a];
+            u[a] = this->up[a];
+            w[a] = this->direction[a];
+        }
     }
 
-    // Generate rays for each screen-space coordinate
-    virtual Ray generateRay(const Vector2f &point) = 0;
+    // Generate rays for each screen-space coordinate, lens is the lens sample (depth of field only)
+    virtual Ray generateRay(const Vector2f &point, const Vector2f &lens) const = 0;
+    Ray generateRay(const Vector2f &point) const {
+        return generateRay(point, Vector2f(0.5f, 0.5f));
+    }
+    // n rays at pixel coordinates (x[i], y[i]) into rays, lensU/lensV may be nullptr (lens center)
+    virtual void generateRays(const float *x, const float *y, const float *lensU, const float *lensV, int n, RayBatch &rays) const = 0;
     virtual ~Camera() = default;
     void setDOF(bool dof, float aperture, float focalLength) {
         this->dof = dof;
@@ -27,22 +43,60 @@ public:
         this->focalLength = focalLength;
     }
 
+    //render imgW x imgH pixels instead, the view stays the same (micropt_bench renders at several resolutions)
+    virtual void setResolution(int imgW, int imgH) {
+        width = imgW;
+        height = imgH;
+    }
+
     int getWidth() const { return width; }
     int getHeight() const { return height; }
+    bool hasDOF() const { return dof; }
+    const Vector3f &getCenter() const { return center; }
+    const Vector3f &getDirection() const { return direction; }
+
+    //light tracing (bdpt.hpp) connects path vertices to the camera, which needs all rays to start at the center:
+    //only a perspective camera without depth of field can be connected to
+    virtual bool connectible() const { return false; }
+    //pixel coordinates (x, y) where the world point p is seen, false if it is behind the camera or off the image
+    virtual bool rasterPosition(const Vector3f &p, float &x, float &y) const { return false; }
+    //pdf per solid angle of a camera ray along d (the samples are uniform over the image), 0 if d misses the image
+    virtual float directionPdf(const Vector3f &d) const { return 0; }
 
 protected:
+    //concentric mapping of the unit square onto the unit disk (Shirley & Chiu), keeps the samples' stratification
+    static void sampleDisk(float su, float sv, float &dx, float &dy) {
+        float a = 2 * su - 1, b = 2 * sv - 1;
+        if(a == 0 && b == 0) {
+            dx = dy = 0;
+            return;
+        }
+        float r, theta;
+        if(std::fabs(a) > std::fabs(b)) {
+            r = a;
+            theta = float(M_PI / 4) * (b / a);
+        } else {
+            r = b;
+            theta = float(M_PI / 2) - float(M_PI / 4) * (a / b);
+        }
+        dx = r * std::cos(theta);
+        dy = r * std::sin(theta);
+    }
+
     // Extrinsic parameters
     Vector3f center;
     Vector3f direction;
     Vector3f up;
     Vector3f horizontal;
+    //the same as floats for the ray loops
+    float c[3], h[3], u[3], w[3];
     // Intrinsic parameters
     int width;
     int height;
     // Depth of field parameters
-    bool dof;
-    float aperture;
-    float focalLength;
+    bool dof = false;
+    float aperture = 0;
+    float focalLength = 1;
 };
 
 // You can add new functions or variables whenever needed.
@@ -51,6 +105,30 @@ protected:
     float angle;// means vertical angle
     float fx,fy;
     float cx,cy;
+
+    //ray through pixel (x, y): direction a * horizontal + b * up + direction with a, b the image plane
+    //coordinates at distance 1; with depth of field it starts on a disk of radius aperture around the center
+    //and goes through the point of that direction on the focal plane (distance focalLength along the view)
+    void rayAt(float x, float y, float lensU, float lensV, float *o, float *d) const {
+        float a = (x - cx) / fx, b = (y - cy) / fy;
+        float dir[3];
+        for(int k = 0; k < 3; k++) dir[k] = a * h[k] + b * u[k] + w[k];
+        if(dof) {
+            float lx, ly;
+            sampleDisk(lensU, lensV, lx, ly);
+            lx *= aperture;
+            ly *= aperture;
+            for(int k = 0; k < 3; k++) {
+                o[k] = c[k] + lx * h[k] + ly * u[k];
+                dir[k] = c[k] + focalLength * dir[k] - o[k];
+            }
+        } else {
+            for(int k = 0; k < 3; k++) o[k] = c[k];
+        }
+        float inv = 1 / std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+        for(int k = 0; k < 3; k++) d[k] = dir[k] * inv;
+    }
+
 public:
     PerspectiveCamera(const Vector3f &center, const Vector3f &direction,
             const Vector3f &up, int imgW, int imgH, float angle) : Camera(center, direction, up, imgW, imgH) {
@@ -62,36 +140,101 @@ public:
         this->cy = imgH / 2;
     }
 
-    Ray generateRay(const Vector2f &point) override {
-        // generate Ray in camera space
-        if(!dof) {
-            //Origin is the center of the camera
-            Vector3f rayDir = Vector3f((point.x() - cx) / fx, (point.y() - cy) / fy, 1).normalized();
-            // transform the ray to world space
-            Matrix3f R(horizontal, up, direction);
-            rayDir = R * rayDir;
-            return Ray(center, rayDir);
-        }else {
-            //Randomly sample a point on the lens
-            /* float r = (float)rand() / RAND_MAX;
-            float theta = (float)rand() / RAND_MAX * 2 * M_PI;
-            float x = sqrt(r) * cos(theta) * aperture ;
-            float y = sqrt(r) * sin(theta) * aperture ; */
-            unsigned short Xi[3] = {0, 0, 8192};
-            double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-            double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-            float x = dx * aperture;
-            float y = dy * aperture;
-            //Generate ray from lens point
-            Vector3f rayOrigin = center + x * horizontal + y * up;
-            Vector3f rayDir = Vector3f((point.x() - cx) / fx, (point.y() - cy) / fy, 1).normalized();
-            // transform the ray to world space
-            Matrix3f R(horizontal, up, direction);
-            rayDir = R * rayDir;
-            //Compute focal point
-            Vector3f focalPoint = center + focalLength * rayDir;
-            rayDir = (focalPoint - rayOrigin).normalized();
-            return Ray(rayOrigin, rayDir);
+    void setResolution(int imgW, int imgH) override {
+        Camera::setResolution(imgW, imgH);
+        this->fy = imgH / (2 * tan(angle / 2));
+        this->fx = this->fy;
+        this->cx = imgW / 2;
+        this->cy = imgH / 2;
+    }
+
+    using Camera::generateRay;
+
+    bool connectible() const override { return !dof; }
+
+    bool rasterPosition(const Vector3f &p, float &x, float &y) const override {
+        Vector3f v = p - center;
+        float z = Vector3f::dot(v, direction);
+        if(!(z > 0)) return false;
+        x = Vector3f::dot(v, horizontal) / z * fx + cx;
+        y = Vector3f::dot(v, up) / z * fy + cy;
+        return x >= 0 && x < width && y >= 0 && y < height;
+    }
+
+    //the image spans an area of width * height / (fx * fy) on the plane at distance 1, a direction at angle theta
+    //to the view sees 1 / cos^3(theta) of it per solid angle
+    float directionPdf(const Vector3f &d) const override {
+        float x, y, cosine = Vector3f::dot(d, direction);
+        if(!rasterPosition(center + d, x, y)) return 0;
+        return fx * fy / (float(width) * height * cosine * cosine * cosine);
+    }
+
+    Ray generateRay(const Vector2f &point, const Vector2f &lens) const override {
+        float o[3], d[3];
+        rayAt(point.x(), point.y(), lens.x(), lens.y(), o, d);
+        return Ray(Vector3f(o[0], o[1], o[2]), Vector3f(d[0], d[1], d[2]));
+    }
+
+    void generateRays(const float *x, const float *y, const float *lensU, const float *lensV, int n, RayBatch &rays) const override {
+        rays.resize(n);
+        for(int i = 0; i < n; i++) {
+            float o[3], d[3];
+            rayAt(x[i], y[i], lensU != nullptr ? lensU[i] : 0.5f, lensV != nullptr ? lensV[i] : 0.5f, o, d);
+            for(int k = 0; k < 3; k++) {
+                rays.o[k][i] = o[k];
+                rays.d[k][i] = d[k];
+            }
+        }
+    }
+};
+
+//parallel projection: all rays share the view direction and start on the image plane through the center,
+//size is the height of the view in world units; there is no lens, depth of field is ignored
+class OrthographicCamera : public Camera {
+protected:
+    float scale;
+    float cx, cy;
+
+    void rayAt(float x, float y, float *o, float *d) const {
+        float a = (x - cx) * scale, b = (y - cy) * scale;
+        for(int k = 0; k < 3; k++) {
+            o[k] = c[k] + a * h[k] + b * u[k];
+            d[k] = w[k];
+        }
+    }
+
+public:
+    OrthographicCamera(const Vector3f &center, const Vector3f &direction,
+            const Vector3f &up, int imgW, int imgH, float size) : Camera(center, direction, up, imgW, imgH) {
+        this->scale = size / imgH;
+        this->cx = imgW / 2;
+        this->cy = imgH / 2;
+    }
+
+    void setResolution(int imgW, int imgH) override {
+        this->scale = scale * height / imgH;
+        this->cx = imgW / 2;
+        this->cy = imgH / 2;
+        Camera::setResolution(imgW, imgH);
+    }
+
+    using Camera::generateRay;
+
+    Ray generateRay(const Vector2f &point, const Vector2f &lens) const override {
+        float o[3], d[3];
+        rayAt(point.x(), point.y(), o, d);
+        return Ray(Vector3f(o[0], o[1], o[2]), Vector3f(d[0], d[1], d[2]));
+    }
+
+    void generateRays(const float *x, const float *y, const float *lensU, const float *lensV, int n, RayBatch &rays) const override {
+        rays.resize(n);
+        for(int i = 0; i < n; i++) {
+            float o[3], d[3];
+            rayAt(x[i], y[i], o, d);
+            for(int k = 0; k < 3; k++) {
+                rays.o[k][i] = o[k];
+                rays.d[k][i] = d[k];
+            }
         }
     }
 };
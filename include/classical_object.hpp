@@ -8,6 +8,8 @@
 class Object3D;
 class Material;
 
+#include "emitter.hpp"
+
 // function: ax+by+cz=d
 // choose your representation , add more fields and fill in the functions
 
@@ -73,15 +75,16 @@ public:
         float tmax = h.getT();
         Vector3f d = ray.getDirection();
         Vector3f o = ray.getOrigin();
+        // 三个slab区间取交集
+        float t0 = tmin;
         for (int i = 0; i < 3; ++i) {
             float invRayDir = 1.0f / d[i];
             float tNear = (min[i] - o[i]) * invRayDir;
             float tFar = (max[i] - o[i]) * invRayDir;
             if (tNear > tFar) std::swap(tNear, tFar);
-            float minT = std::max(tNear, tmin);
-            float maxT = std::min(tFar, h.getT());
-            if (minT > maxT) return false;
-            tmax = std::min(tmax, maxT);
+            t0 = std::max(t0, tNear);
+            tmax = std::min(tmax, tFar);
+            if (t0 > tmax) return false;
         }
         return true;
     }
@@ -205,6 +208,12 @@ public:
         return false; */
     }
 
+    void collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) override {
+        float scale = uniformScale(toWorld);
+        if (!(luminance(emissionOf(material)) > 0) || scale == 0) return;
+        shapes.push_back(EmissiveShape::sphere(transformedPoint(toWorld, center), radius * scale, material));
+    }
+
 protected:
     Vector3f center;
     float radius;
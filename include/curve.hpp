@@ -6,101 +6,217 @@
 #include <iostream>
 #include "object3d.hpp"
 #include "classical_object.hpp"
+#include "curve_eval.hpp"
+#include "bvh.hpp"
 
 class Ray;
 class Hit;
+class Mesh;
 
 class Curve : public Object3D{
 public:
     virtual Vector3f evaluate(double t) const = 0;
     virtual Vector3f evaluateDerivative(double t) const = 0;
     virtual bool intersect(const Ray& ray, Hit& hit, float tmin) = 0;
+    //evaluate n parameters at once (tessellation), derivatives may be nullptr
+    virtual void evaluateBatch(const double* t, int n, Vector3f* points, Vector3f* derivatives) const {
+        for(int i = 0; i < n; i++) {
+            points[i] = evaluate(t[i]);
+            if(derivatives != nullptr) derivatives[i] = evaluateDerivative(t[i]);
+        }
+    }
+    //triangle mesh within tolerance (object space) of the geometry, see tessellation.hpp
+    //nullptr if the object can only be traced exactly
+    virtual Mesh* tessellate(float tolerance) const { return nullptr; }
 };
 
-//Revolution Surface
-class BezierCurve : public Curve {
-public:
-    BezierCurve(const std::vector<Vector3f>& controlVector3fs, Vector3f point1, Vector3f point2);
-    Vector3f evaluate(double t) const override;
-    Vector3f evaluateDerivative(double t) const override;
-    bool intersect(const Ray& ray, Hit& hit, float tmin) override;
-
-private:
-    std::vector<Vector3f> controlVector3fs;
-    Vector3f point1;
-    Vector3f point2;
-};
-
+//Revolution surface of a B-spline profile (x: radius, y: height) around the axis point1 -> point2
+//every nonempty knot span is bounded by a hollow cylinder (radius and height range of its Bezier
+//points, convex hull property), the spans are kept in a small binary hierarchy over the parameter
+//a ray only samples and root-finds (bracketed Newton) inside the spans whose cylinders it crosses,
+//every span is converted to a Bezier segment up front and evaluated with the degree specialized
+//evaluator of curve_eval.hpp: no allocation per ray
 class BSplineCurve : public Curve {
 public:
+    //f is sampled this many times per span to bracket its roots
+    static const int SPAN_SAMPLES = 4;
+
     BSplineCurve(const std::vector<Vector3f>& controlVector3fs, const std::vector<float>& knots, Vector3f point1, Vector3f point2, Material* m);
     Vector3f evaluate(double t) const override;
     Vector3f evaluateDerivative(double t) const override;
+    //t sorted ascending walks the spans instead of searching each one
+    void evaluateBatch(const double* t, int n, Vector3f* points, Vector3f* derivatives) const override;
     bool intersect(const Ray& ray, Hit& hit, float tmin)  override;
-    double f(double t, Vector3f o, Vector3f d) const;
-    double Newton(double t, Vector3f o, Vector3f d) const;
-    std::vector<double> init(Vector3f o, Vector3f d) const;
+    //profile refined by chord error, the angle split so the sagitta stays below tolerance
+    Mesh* tessellate(float tolerance) const override;
+
+protected:
+    std::vector<Point3d> controls;
+    curve_eval::BezierEvaluator evaluator;
 
 private:
+    struct Span {
+        int k;//knots[k] <= t < knots[k + 1]
+        double t0, t1;
+        float rmin, rmax, hmin, hmax;
+    };
+    //cylinder hierarchy node, span >= 0 for leaves
+    struct SpanNode {
+        float rmin, rmax, hmin, hmax;
+        int left, right, span;
+    };
+    //ray in the local frame of the axis (z along point1 -> point2)
+    struct LocalRay {
+        double o[3], d[3];
+    };
+
+    int buildSpanNodes(int begin, int end);
+    bool overlaps(const SpanNode& node, const LocalRay& ray, float tmin, float tmax) const;
+    //point and first derivative in span k, through the span's Bezier segment
+    void evaluate(double t, int k, Point3d& point, Point3d& derivative) const;
+    //f(t) = 0 where the ray meets the circle of the profile point at t (scaled by d.z^2 to stay polynomial)
+    double f(double t, int k, const LocalRay& ray, double& df) const;
+    double solve(double a, double b, double fa, int k, const LocalRay& ray) const;
+    void intersectSpan(const Span& span, const LocalRay& ray, float tmin, Hit& hit, bool& isIntersect) const;
+    bool hitAt(double t, int k, const LocalRay& ray, float tmin, Hit& hit) const;
+
     std::vector<Vector3f> controlVector3fs;
     std::vector<float> knots;
     Vector3f point1;
     Vector3f point2;
-    BoundingBox box;
+    int degree;
+    //Bezier form of every knot span, degree + 1 points per span starting at span degree
+    std::vector<Point3d> segments;
+    double selfIntersectionEps;
+    Matrix3f rotate;
+    Matrix3f rotateInverse;
+    std::vector<Span> spans;
+    std::vector<SpanNode> spanNodes;
     int findSpan(double t) const;
 };
 
-class CatmullRomCurve : public Curve {
+//Revolution surface of a Bezier profile: a B-spline with a single span (clamped knots) that
+//evaluates its control points directly, intersection and tessellation are the B-spline's
+class BezierCurve : public BSplineCurve {
 public:
-    CatmullRomCurve(const std::vector<Vector3f>& controlVector3fs, float tension, Vector3f point1, Vector3f point2);
+    BezierCurve(const std::vector<Vector3f>& controlVector3fs, Vector3f point1, Vector3f point2, Material* m);
     Vector3f evaluate(double t) const override;
     Vector3f evaluateDerivative(double t) const override;
-    bool intersect(const Ray& ray, Hit& hit, float tmin)  override;
+    void evaluateBatch(const double* t, int n, Vector3f* points, Vector3f* derivatives) const override;
 
 private:
-    std::vector<Vector3f> controlVector3fs;
-    float tension;
-    Vector3f point1;
-    Vector3f point2;
+    static std::vector<float> clampedKnots(int size);
 };
 
+//Revolution surface of a cardinal spline profile through the controls (the first and the last one
+//only give the end tangents), tangent tension * (P[i+1] - P[i-1]), 0.5 is Catmull-Rom
+//every segment is a cubic Bezier, the curve is kept as a B-spline with triple inner knots and
+//t in [0, 1] runs over the segments evenly
+class CatmullRomCurve : public BSplineCurve {
+public:
+    CatmullRomCurve(const std::vector<Vector3f>& controlVector3fs, float tension, Vector3f point1, Vector3f point2, Material* m);
+
+private:
+    static std::vector<Vector3f> bezierControls(const std::vector<Vector3f>& controlVector3fs, float tension);
+    static std::vector<float> bezierKnots(int size);
+};
+
+//Tensor product patches, controls[i][j]: i runs along u, j along v
+//partial derivatives come with the point from evaluateFrame, tessellation is shared
+//exact intersection: the surface is cut into Bezier pieces (B-spline spans first, then de Casteljau
+//halving until every piece is nearly flat), the pieces' control net boxes go into a BVH and a ray
+//runs Newton on (u, v) only in the pieces whose boxes it crosses, seeded from the piece's corner quad
 class Surface : public Curve{
 public:
+    //a patch is halved at most this many times in each direction
+    static const int MAX_SPLIT_DEPTH = 6;
+    //a piece is flat once no control point is farther than this (relative to its size) from the corner quad
+    static constexpr double FLATNESS = 0.02;
+    //larger nets than this are rejected
+    static const int MAX_ORDER = curve_eval::MAX_ORDER;
+    static const int NEWTON_ITERATIONS = 12;
+
     Vector3f evaluate(double t) const override{
         return this->evaluate(t, t);
     };
-    virtual Vector3f evaluate(double u, double v) const = 0;
-    virtual Vector3f evaluateDerivative(double t) const = 0;
-    virtual Vector3f evaluatePartialDerivativeU(double u, double v) const = 0;
-    virtual Vector3f evaluatePartialDerivativeV(double u, double v) const = 0;
+    Vector3f evaluate(double u, double v) const;
+    //derivative along the diagonal u = v = t
+    Vector3f evaluateDerivative(double t) const override;
+    Vector3f evaluatePartialDerivativeU(double u, double v) const;
+    Vector3f evaluatePartialDerivativeV(double u, double v) const;
+    virtual void evaluateFrame(double u, double v, Point3d& point, Point3d& du, Point3d& dv) const = 0;
+    bool intersect(const Ray& ray, Hit& hit, float tmin) override;
+    //u and v refined separately against isolines (knots and interval midpoints of the other direction)
+    Mesh* tessellate(float tolerance) const override;
+
+protected:
+    //sorted parameters where the patch pieces meet, the first and the last bound the domain
+    virtual void breakpoints(std::vector<double>& u, std::vector<double>& v) const = 0;
+    //Bezier patch of the given degrees over [u0, u1] x [v0, v1] of the surface, net row major along u
+    //derived classes add all their patches, then call buildPatchBVH
+    void addBezierPatch(const Point3d* net, int degreeU, int degreeV, double u0, double u1, double v0, double v1);
+    void buildPatchBVH();
+
+private:
+    struct Piece {
+        int net;//offset into pieceNets
+        double u0, u1, v0, v1;
+    };
+    //ray as the intersection of two planes n1.x + d1 = 0, n2.x + d2 = 0
+    struct PlaneRay {
+        double o[3], d[3], dd;
+        double n1[3], n2[3], d1, d2;
+    };
+
+    void splitPiece(std::vector<Point3d>& net, double u0, double u1, double v0, double v1, int depthU, int depthV);
+    void evaluatePiece(const Piece& piece, double s, double w, Point3d& point, Point3d& ds, Point3d& dw) const;
+    //(s, w) in, root out; false if it does not converge inside the piece
+    bool newton(const Piece& piece, const PlaneRay& ray, double& s, double& w, Point3d& point, Point3d& ds, Point3d& dw) const;
+    bool intersectPiece(const Piece& piece, const PlaneRay& ray, float tmin, Hit& hit) const;
+
+    int pieceDegreeU = 0, pieceDegreeV = 0;
+    std::vector<Point3d> pieceNets;
+    std::vector<Piece> pieces;
+    BVHNode* pieceRoot = nullptr;
+    curve_eval::BezierEvaluator pieceEvaluatorU, pieceEvaluatorV;
+    double domainU0 = 0, domainU1 = 1, domainV0 = 0, domainV1 = 1;
+    double selfIntersectionEps = 0;
+    //converged once |F| (distance to the ray's planes) is below this
+    double newtonEps = 0;
 };
 
 class BezierSurface : public Surface {
 public:
-    BezierSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs);
-    Vector3f evaluate(double u, double v) const override;
-    Vector3f evaluateDerivative(double t) const override;
-    Vector3f evaluatePartialDerivativeU(double u, double v) const override;
-    Vector3f evaluatePartialDerivativeV(double u, double v) const override;
-    bool intersect(const Ray& ray, Hit& hit, float tmin)  override;
+    BezierSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, Material* m);
+    void evaluateFrame(double u, double v, Point3d& point, Point3d& du, Point3d& dv) const override;
+
+protected:
+    void breakpoints(std::vector<double>& u, std::vector<double>& v) const override;
 
 private:
     std::vector<std::vector<Vector3f>> controlVector3fs;
+    int rows, cols;
+    //rows x cols, row major
+    std::vector<Point3d> net;
+    curve_eval::BezierEvaluator evaluatorU, evaluatorV;
 };
 
 class BSplineSurface : public Surface {
 public:
-    BSplineSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, const std::vector<float>& knotsU, const std::vector<float>& knotsV);
-    Vector3f evaluate(double u, double v) const override;
-    Vector3f evaluateDerivative(double t) const override;
-    Vector3f evaluatePartialDerivativeU(double u, double v) const override;
-    Vector3f evaluatePartialDerivativeV(double u, double v) const override;
-    bool intersect(const Ray& ray, Hit& hit, float tmin)  override;
+    BSplineSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, const std::vector<float>& knotsU, const std::vector<float>& knotsV, Material* m);
+    void evaluateFrame(double u, double v, Point3d& point, Point3d& du, Point3d& dv) const override;
+
+protected:
+    void breakpoints(std::vector<double>& u, std::vector<double>& v) const override;
 
 private:
     std::vector<std::vector<Vector3f>> controlVector3fs;
     std::vector<float> knotsU;
     std::vector<float> knotsV;
+    int rows, cols;
+    int degreeU, degreeV;
+    //rows x cols, row major
+    std::vector<Point3d> net;
 };
 
 // 添加其他类型的参数曲线和曲面的类实现
@@ -0,0 +1,168 @@
+#ifndef __CURVE_EVAL_H__
+#define __CURVE_EVAL_H__
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <vector>
+
+//Degree specialized Bezier evaluation
+//the degree is a template parameter: the Bernstein basis lives in a std::array and every loop has a
+//constant trip count the compiler unrolls (nearly all our curves are cubic); the basis is computed
+//on scalars and dotted with the control points, with -Ofast this is several times faster than a
+//de Casteljau triangle of points
+//a curve picks its evaluator once when it is constructed by the parser, degrees above
+//MAX_SPECIALIZED_DEGREE fall back to bezierGeneric, which takes the degree at run time
+//B-splines are converted to one Bezier segment per knot span up front (bsplineSpanToBezier) and
+//evaluated with the same code
+//every evaluator returns the point and the first derivative together
+
+typedef std::array<double, 3> Point3d;
+
+namespace curve_eval {
+
+const int MAX_SPECIALIZED_DEGREE = 5;
+//bezierGeneric keeps the basis on the stack up to this degree
+const int GENERIC_STACK_SIZE = 16;
+//B-spline kernels (blossom, deBoor, bsplineSpanToBezier) work on the stack, curves and surfaces of degree
+//MAX_ORDER or more are rejected when they are constructed
+const int MAX_ORDER = 16;
+
+typedef void (*BezierEvaluator)(const Point3d* controls, int degree, double t, Point3d& point, Point3d& derivative);
+
+//lower: Bernstein basis of degree - 1 at t, the point is sum B_i^n P_i with B_i^n = s B_i^n-1 + t B_i-1^n-1,
+//the derivative n sum B_i^n-1 (P_i+1 - P_i)
+inline void bernsteinCombine(const Point3d* controls, int degree, double t, const double* lower,
+                             Point3d& point, Point3d& derivative) {
+    double s = 1 - t;
+    Point3d p = {{0, 0, 0}}, d = {{0, 0, 0}};
+    for(int i = 0; i <= degree; i++) {
+        double b = (i < degree ? s * lower[i] : 0) + (i > 0 ? t * lower[i - 1] : 0);
+        for(int c = 0; c < 3; c++) p[c] += b * controls[i][c];
+    }
+    for(int i = 0; i < degree; i++) {
+        for(int c = 0; c < 3; c++) d[c] += degree * lower[i] * (controls[i + 1][c] - controls[i][c]);
+    }
+    point = p;
+    derivative = d;
+}
+
+//Bernstein basis of degree n at t, raised in place one degree at a time
+inline void bernstein(int n, double t, double* basis) {
+    double s = 1 - t;
+    basis[0] = 1;
+    for(int j = 1; j <= n; j++) {
+        basis[j] = t * basis[j - 1];
+        for(int i = j - 1; i > 0; i--) basis[i] = s * basis[i] + t * basis[i - 1];
+        basis[0] *= s;
+    }
+}
+
+template<int D>
+void bezier(const Point3d* controls, int, double t, Point3d& point, Point3d& derivative) {
+    std::array<double, D> lower;
+    bernstein(D - 1, t, lower.data());
+    bernsteinCombine(controls, D, t, lower.data(), point, derivative);
+}
+
+inline void bezierGeneric(const Point3d* controls, int degree, double t, Point3d& point, Point3d& derivative) {
+    if(degree == 0) {
+        point = controls[0];
+        derivative = Point3d{{0, 0, 0}};
+        return;
+    }
+    double stack[GENERIC_STACK_SIZE];
+    std::vector<double> heap;
+    double* lower = stack;
+    if(degree > GENERIC_STACK_SIZE) {
+        heap.resize(degree);
+        lower = heap.data();
+    }
+    bernstein(degree - 1, t, lower);
+    bernsteinCombine(controls, degree, t, lower, point, derivative);
+}
+
+static_assert(MAX_SPECIALIZED_DEGREE == 5, "bezierEvaluator lists the specialized degrees");
+
+inline BezierEvaluator bezierEvaluator(int degree) {
+    switch(degree) {
+        case 1: return bezier<1>;
+        case 2: return bezier<2>;
+        case 3: return bezier<3>;
+        case 4: return bezier<4>;
+        case 5: return bezier<5>;
+        default: return bezierGeneric;
+    }
+}
+
+//de Casteljau split of a Bezier curve at t, the controls are read and the halves written with a stride
+//(columns and rows of a patch net), left and right may not alias controls
+inline void subdivide(const Point3d* controls, int degree, int stride, double t, Point3d* left, Point3d* right) {
+    //right is the work array: after level r its entry degree - r is final
+    for(int i = 0; i <= degree; i++) right[i * stride] = controls[i * stride];
+    for(int r = 0; r <= degree; r++) {
+        left[r * stride] = right[0];
+        for(int i = 0; i < degree - r; i++) {
+            for(int c = 0; c < 3; c++) right[i * stride][c] = (1 - t) * right[i * stride][c] + t * right[(i + 1) * stride][c];
+        }
+    }
+}
+
+//blossom of the B-spline in span k (knots[k] <= t < knots[k + 1]) at x[0..degree): de Boor with
+//its own parameter on every level, all x equal to t is the curve point
+inline Point3d blossom(const Point3d* controls, const float* knots, int degree, int k, const double* x) {
+    assert(degree < MAX_ORDER);
+    Point3d d[MAX_ORDER];
+    std::copy(controls + k - degree, controls + k + 1, d);
+    for(int r = 1; r <= degree; r++) {
+        for(int i = degree; i >= r; i--) {
+            double alpha = (x[r - 1] - knots[k - degree + i]) / (knots[i + k - r + 1] - knots[k - degree + i]);
+            for(int c = 0; c < 3; c++) d[i][c] = (1 - alpha) * d[i - 1][c] + alpha * d[i][c];
+        }
+    }
+    return d[degree];
+}
+
+//span k of t with knots[k] <= t < knots[k + 1], n + 1 controls, clamped to the nonempty spans of the domain
+inline int findSpan(const float* knots, int degree, int n, double t) {
+    int k = int(std::upper_bound(knots + degree, knots + n + 1, float(t)) - knots) - 1;
+    k = std::max(degree, std::min(n, k));
+    while(k > degree && !(knots[k + 1] > knots[k])) k--;
+    return k;
+}
+
+//point and first derivative of the B-spline in span k at t, d holds controls[k - degree .. k]
+//(surfaces gather them from a row or column of their net)
+inline void deBoor(const Point3d* d, const float* knots, int degree, int k, double t, Point3d& point, Point3d& derivative) {
+    assert(degree < MAX_ORDER);
+    Point3d level[MAX_ORDER];
+    std::copy(d, d + degree + 1, level);
+    for(int r = 1; r <= degree; r++) {
+        if(r == degree) {
+            //the last level blends two points over the span itself, their difference is the derivative
+            double length = knots[k + 1] - knots[k];
+            for(int c = 0; c < 3; c++) derivative[c] = length > 0 ? degree * (level[degree][c] - level[degree - 1][c]) / length : 0;
+        }
+        for(int i = degree; i >= r; i--) {
+            double alpha = (t - knots[k - degree + i]) / (knots[i + k - r + 1] - knots[k - degree + i]);
+            for(int c = 0; c < 3; c++) level[i][c] = (1 - alpha) * level[i - 1][c] + alpha * level[i][c];
+        }
+    }
+    if(degree == 0) derivative = Point3d{{0, 0, 0}};
+    point = level[degree];
+}
+
+//Bezier control points of span k over [knots[k], knots[k + 1]]: b_i = blossom(knots[k] x (degree - i), knots[k + 1] x i)
+//bezier must hold degree + 1 points, the span must not be empty
+inline void bsplineSpanToBezier(const Point3d* controls, const float* knots, int degree, int k, Point3d* bezier) {
+    assert(degree < MAX_ORDER);
+    double x[MAX_ORDER];
+    for(int i = 0; i <= degree; i++) {
+        for(int j = 0; j < degree; j++) x[j] = j < degree - i ? knots[k] : knots[k + 1];
+        bezier[i] = blossom(controls, knots, degree, k, x);
+    }
+}
+
+}
+
+#endif //__CURVE_EVAL_H__
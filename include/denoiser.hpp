@@ -0,0 +1,42 @@
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+#include <vector>
+
+class Film;
+
+//Edge-avoiding à-trous wavelet denoiser (Dammertz et al. 2010), a post stage on the float film (--denoise <iterations>)
+//the color is divided by the albedo AOV first, so textures are not blurred, and multiplied back at the end
+//every iteration is a 5x5 B3 spline kernel whose taps lie 2^i pixels apart, a tap's weight is cut down by
+//its difference to the center in color, normal, albedo and depth (one exp for all four); the color
+//tolerance halves every iteration, so large flat regions are smoothed and edges stay sharp
+//the image is kept as planes of floats, a row is filtered tap by tap along x (contiguous loops the compiler
+//vectorizes, exp included) and the rows are spread over the threads
+//needs a film with AOVs
+class Denoiser {
+public:
+    //kernel taps of the B3 spline
+    static const int KERNEL_RADIUS = 2;
+
+    explicit Denoiser(int iterations, float sigmaColor = 1.0f, float sigmaNormal = 0.3f, float sigmaAlbedo = 0.1f, float sigmaDepth = 0.02f)
+        : iterations(iterations), sigmaColor(sigmaColor), sigmaNormal(sigmaNormal), sigmaAlbedo(sigmaAlbedo), sigmaDepth(sigmaDepth) {}
+
+    //replaces the film's colors with the filtered ones
+    void denoise(Film& film) const;
+
+    //AOV planes
+    struct Guide;
+
+private:
+    //one iteration with the taps step pixels apart from in into out
+    void iterate(const Guide& guide, const std::vector<float>* in, std::vector<float>* out, int step, float sigmaColor) const;
+
+    int iterations;
+    float sigmaColor;
+    float sigmaNormal;
+    float sigmaAlbedo;
+    //relative to the center's depth, per pixel of tap distance
+    float sigmaDepth;
+};
+
+#endif //__DENOISER_H__
@@ -0,0 +1,114 @@
+#ifndef EMITTER_HPP
+#define EMITTER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+#include <vecmath.h>
+
+class Material;
+class Group;
+class Camera;
+
+//emission of a material, zero for materials that cannot emit
+Vector3f emissionOf(const Material* material);
+
+//scale of m if its linear part is a rotation times a uniform scale, 0 otherwise (only then a sphere stays a sphere)
+float uniformScale(const Matrix4f& m);
+
+inline Vector3f transformedPoint(const Matrix4f& m, const Vector3f& p) {
+    return (m * Vector4f(p, 1)).xyz();
+}
+
+inline float luminance(const Vector3f& c) {
+    return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
+//cosine weighted direction around the unit vector w from (u1, u2) in [0, 1)^2
+Vector3f cosineDirection(const Vector3f& w, float u1, float u2);
+
+//radius of the bounding sphere of the first hits of a grid of camera rays, center (if not nullptr) receives its center
+float visibleRadius(Camera* camera, Group* group, Vector3f* center = nullptr);
+
+//a piece of emissive geometry in world space that can be sampled by area
+//the path tracer finds emission only where rays hit it, the bidirectional renderers (bdpt.hpp) also start
+//paths on it and connect to it; an emitter radiates wherever the path tracer can see it: spheres and two sided
+//triangles from both sides, back face culled triangles only to the front (counterclockwise) side
+struct EmissiveShape {
+    enum Type { SPHERE, TRIANGLE };
+    Type type;
+    //sphere: p[0] center; triangle: the corners
+    Vector3f p[3];
+    float radius = 0;
+    Material* material = nullptr;
+    Vector3f emission;
+    float area = 0;
+    bool twoSided = true;
+
+    static EmissiveShape sphere(const Vector3f& center, float radius, Material* material);
+    static EmissiveShape triangle(const Vector3f& a, const Vector3f& b, const Vector3f& c, Material* material, bool twoSided);
+
+    //uniform point over the area from (u, v) in [0, 1)^2, n is the unit normal there
+    void sample(float u, float v, Vector3f& point, Vector3f& n) const;
+    //sphere seen from ref outside of it: a direction uniform in the cone the sphere covers and the point it hits,
+    //pdf per solid angle at ref; false if ref is inside (sample by area then)
+    bool sampleCone(const Vector3f& ref, float u, float v, Vector3f& point, Vector3f& n, float& pdf) const;
+    //pdf of sampleCone, 0 if ref is inside
+    float pdfCone(const Vector3f& ref) const;
+    //radiated flux up to a constant: luminance(emission) * area per side
+    float power() const { return luminance(emission) * area * (twoSided ? 2 : 1); }
+    //emitted direction at a point with normal n, cosine weighted on the emitting side(s); pdf per solid angle
+    Vector3f sampleDirection(const Vector3f& n, float u0, float u1, float u2, float& pdf) const;
+    static float pdfDirection(bool twoSided, float cosine) {
+        return twoSided ? std::fabs(cosine) / float(2 * M_PI) : std::max(0.0f, cosine) / float(M_PI);
+    }
+};
+
+//all the emitters of a scene, chosen in proportion to their power
+//the power is proportional to the area, so the pdf per area of a sampled point only depends on the material
+//there: luminance(emission) * sides / total power, no matter which of the emitters it lies on
+//(hits do not know their object, the material stands for it; emitters sharing a material must agree on the sides)
+//infinite planes and non uniformly scaled spheres cannot be sampled, only found by rays
+class EmitterSampler {
+public:
+    //collects the emitters of the group (Object3D::collectEmitters)
+    explicit EmitterSampler(Group* group);
+
+    bool empty() const { return shapes.empty(); }
+    int size() const { return shapes.size(); }
+    const EmissiveShape& get(int i) const { return shapes[i]; }
+
+    //emitter for u in [0, 1), pdf is the probability to choose it
+    const EmissiveShape& choose(float u, float& pdf) const;
+    //point on the emitters: pdf per area of choosing the emitter and the point together
+    const EmissiveShape& sample(float u0, float u1, float u2, Vector3f& point, Vector3f& n, float& pdf) const;
+    //pdf per area of sampling a point of an emitter with this material, 0 if the material is not sampled
+    float pdfPoint(const Material* material) const;
+    //point on the emitters to light ref with: an emitter in proportion to its power, then a point on it seen
+    //from ref (EmissiveShape::sampleCone for spheres ref is outside of, by area otherwise); pdf per solid angle at ref
+    const EmissiveShape& sampleDirect(const Vector3f& ref, float u0, float u1, float u2, Vector3f& point, Vector3f& n, float& pdf) const;
+    //pdf per solid angle of sampleDirect from ref returning point (normal n) on an emitter with the material
+    float pdfDirect(const Vector3f& ref, const Vector3f& point, const Vector3f& n, const Material* material) const;
+    //flux of all the emitters as luminance, pi * power of the shapes (cosine weighted emission)
+    float totalPower() const { return cdf.empty() ? 0 : float(M_PI) * cdf.back(); }
+    //whether the emitters of the material radiate from both sides
+    bool twoSided(const Material* material) const;
+    //pdf per solid angle of emitting at cosine to the normal from an emitter with the material
+    float pdfDirection(const Material* material, float cosine) const {
+        return EmissiveShape::pdfDirection(twoSided(material), cosine);
+    }
+
+private:
+    std::vector<EmissiveShape> shapes;
+    //running power sums, cdf.back() is the total
+    std::vector<float> cdf;
+    //materials of the sampled emitters with their sides
+    std::vector<std::pair<const Material*, bool>> materials;
+    //the spheres among the shapes, pdfDirect finds the one a point lies on
+    std::vector<int> spheres;
+
+    int find(const Material* material) const;
+};
+
+#endif //EMITTER_HPP
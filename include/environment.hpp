@@ -0,0 +1,39 @@
+#ifndef ENVIRONMENT_HPP
+#define ENVIRONMENT_HPP
+//image based lighting from an HDR environment map, follow the structure of PBRT-v4's ImageInfiniteLight
+#include "light_sampler.hpp"
+#include <string>
+#include <vector>
+#include <vecmath.h>
+
+//radiance arriving from infinitely far away in every direction, an equirectangular (latitude-longitude) image:
+//y is up, the top row looks up, the center of the image looks along -z
+//texels are piecewise constant; one of them is chosen in proportion to luminance * sin(theta) (its solid angle)
+//by an alias table, then a point uniformly inside it, so the pdf per solid angle follows the radiance
+class EnvironmentMap {
+public:
+    //an .hdr (or any image stb_image reads, linearized), radiance scaled by scale; check valid() afterwards
+    EnvironmentMap(const std::string& filename, float scale);
+
+    bool valid() const { return width > 0; }
+    //radiance arriving from direction d (unit, pointing away from the scene)
+    Vector3f Le(const Vector3f& d) const;
+    //direction towards the environment from (u0, u1, u2) in [0, 1)^3, pdf per solid angle; returns its radiance
+    Vector3f sample(float u0, float u1, float u2, Vector3f& d, float& pdf) const;
+    //pdf per solid angle of sample returning d
+    float pdf(const Vector3f& d) const;
+    //flux through a disk of sceneRadius facing any direction as luminance, for choosing it among the lights
+    float power(float sceneRadius) const;
+
+private:
+    int width = 0, height = 0;
+    //linear RGB, row major from the top
+    std::vector<Vector3f> texels;
+    AliasTable distribution;
+    //luminance integrated over the sphere of directions
+    float integral = 0;
+
+    int texel(const Vector3f& d) const;
+};
+
+#endif //ENVIRONMENT_HPP
@@ -0,0 +1,140 @@
+#ifndef __FILM_H__
+#define __FILM_H__
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include <vecmath.h>
+#include "utils.hpp"
+
+//Reconstruction filter (--filter), all four kernels are separable: w(x, y) = f(x) f(y)
+//f is tabulated once over [0, radius], a sample only looks up the table
+class Filter {
+public:
+    static const int TABLE_SIZE = 64;
+
+    explicit Filter(FilterType type);
+
+    float getRadius() const { return radius; }
+    //f(d), 0 from the radius on
+    float profile(float d) const {
+        int i = int(std::fabs(d) * invStep);
+        return i < TABLE_SIZE ? table[i] : 0;
+    }
+    float weight(float dx, float dy) const { return profile(dx) * profile(dy); }
+
+private:
+    //the kernels themselves, x >= 0
+    static float evaluate(FilterType type, float x, float radius);
+
+    float radius;
+    float invStep;
+    float table[TABLE_SIZE];
+};
+
+class FilmTile;
+
+//auxiliary values of one camera sample (--aov 1), averaged per pixel without the filter
+struct AOVSample {
+    Vector3f albedo = Vector3f::ZERO;
+    //world space shading normal at the first hit
+    Vector3f normal = Vector3f::ZERO;
+    //distance to the first hit, 0 on a miss
+    float depth = 0;
+    //light reaching the camera after at most one bounce / the rest
+    Vector3f direct = Vector3f::ZERO;
+    Vector3f indirect = Vector3f::ZERO;
+};
+
+//Float accumulation framebuffer
+//samples are splatted with the filter weights into the weighted color sum and the weight sum of every
+//pixel within the filter radius; each thread renders into a FilmTile of its own (the tile's pixels
+//plus the filter margin) and merges it once when done, so there is no contention per sample
+//film coordinates: pixel (x, y) covers [x, x + 1) x [y, y + 1), y up as in the camera
+//the weighted averages are only formed at the end, by the post stages (denoiser.hpp, tonemap.hpp)
+//light tracing (bdpt.hpp) also splats contributions at arbitrary pixels: they are summed unfiltered with
+//atomic adds and scaled by the splat scale (1 / samples per pixel) on top of the weighted average
+//with AOVs the film also keeps the sums of the AOVSamples and the sample count of every pixel,
+//save writes the color and all the layers as float images in one pass (EXR or PFM, see save)
+class Film {
+public:
+    //renderers cut the image into square tiles of this size
+    static const int TILE_SIZE = 16;
+    //floats of an AOVSample: albedo, normal, depth, direct, indirect
+    static const int AOV_CHANNELS = 13;
+
+    Film(int width, int height, FilterType filter, bool aovs = false);
+    ~Film();
+    Film(const Film&) = delete;
+    Film& operator=(const Film&) = delete;
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    const Filter& getFilter() const { return filter; }
+    bool hasAOVs() const { return aovs; }
+
+    //local buffer for the samples of pixels [x0, x1) x [y0, y1)
+    FilmTile tile(int x0, int y0, int x1, int y1) const;
+    void merge(const FilmTile& tile);
+    //renderers that estimate whole pixels (SPPM, ray casting) write them directly,
+    //the caller must be the only thread writing pixel (x, y)
+    void setPixel(int x, int y, const Vector3f& value);
+    void addAOVSample(int x, int y, const AOVSample& sample);
+    //any thread, any pixel; setSplatScale must come first, it allocates the splat buffer
+    void addSplat(float x, float y, const Vector3f& value);
+    void setSplatScale(float scale);
+
+    //weighted average of the samples around pixel (x, y) plus the scaled splats, negative lobes clamped to 0
+    Vector3f getPixel(int x, int y) const;
+    //average of the AOVSamples of pixel (x, y), the normal is renormalized
+    AOVSample getAOVs(int x, int y) const;
+    int getSampleCount(int x, int y) const { return aovs ? samples[y * width + x] : 0; }
+    //getPixel of a whole row as rgb triples
+    void getRow(int y, float* rgb) const;
+
+    //float output, chosen by the suffix:
+    //.exr: one uncompressed scanline OpenEXR file, the color as R, G, B and the AOVs as the layers
+    //albedo.(R, G, B), normal.(X, Y, Z), depth.Z, direct.(R, G, B), indirect.(R, G, B), samples.Y
+    //.pfm: the color in filename, every AOV layer in <filename without .pfm>.<layer>.pfm
+    //false if the suffix is neither or the file cannot be written
+    bool save(const std::string& filename) const;
+    bool saveEXR(const std::string& filename) const;
+    bool savePFM(const std::string& filename) const;
+
+private:
+    int width, height;
+    Filter filter;
+    bool aovs;
+    //3 floats per pixel, row major from y = 0
+    std::vector<float> color;
+    std::vector<float> weight;
+    //3 floats per pixel, empty until the first splat
+    std::vector<float> splat;
+    float splatScale = 0;
+    //AOV_CHANNELS floats per pixel
+    std::vector<float> aov;
+    std::vector<int> samples;
+    omp_lock_t lock;
+};
+
+class FilmTile {
+public:
+    //(x, y) in film coordinates, the sample must come from one of the tile's pixels
+    //aovSample is ignored unless the film keeps AOVs
+    void addSample(float x, float y, const Vector3f& sample, const AOVSample* aovSample = nullptr);
+
+private:
+    friend class Film;
+
+    const Filter* filter;
+    //pixel bounds of the buffer, filter margin included and clipped to the film
+    int x0, y0, x1, y1;
+    std::vector<float> color;
+    std::vector<float> weight;
+    //empty without AOVs
+    std::vector<float> aov;
+    std::vector<int> samples;
+};
+
+#endif //__FILM_H__
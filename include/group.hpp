@@ -44,6 +44,20 @@ public:
         return isIntersect;
     }
 
+    int intersectPacket(const RayPacket &packet, Hit *hits, float tmin) override {
+        int hitMask = 0;
+        for (int i = 0; i < objects.size(); i++) {
+            hitMask |= objects[i]->intersectPacket(packet, hits, tmin);
+        }
+        return hitMask;
+    }
+
+    void collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) override {
+        for (int i = 0; i < objects.size(); i++) {
+            objects[i]->collectEmitters(toWorld, shapes);
+        }
+    }
+
     void addObject(int index, Object3D *obj) {
         objects[index] = obj;
     }
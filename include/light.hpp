@@ -4,6 +4,8 @@
 #include <Vector3f.h>
 #include "object3d.hpp"
 #include "texture.hpp"
+#include "light_sampler.hpp"
+#include "emitter.hpp"
 
 struct SPPMPixel {
     // SPPMPixel Public Members
@@ -49,14 +51,50 @@ struct Photon {
     Vector3f wi;//incoming direction
 };
 
+//a ray leaving a light (Light::sampleEmission)
+struct LightSample {
+    Vector3f p;//where it leaves, outside of the scene for distant lights
+    Vector3f n;//normal there, the direction of the light at points and for distant lights
+    Vector3f w;//direction
+    Vector3f Le;//radiance, the intensity at points and the irradiance of distant lights
+    float pdfPosition = 1;//per area, 1 at points
+    float pdfDirection = 1;//per solid angle, 1 for distant lights
+};
+
 class Light {
 public:
+    //how the bidirectional renderers (bdpt.hpp, vcm.hpp) see the light, as the flags of PBRT's lights; they leave
+    //NONE out. the lights are no geometry, paths never hit them
+    enum Type { NONE, AREA, DELTA_POSITION, DELTA_DIRECTION };
+
     Light() = default;
 
     virtual ~Light() = default;
 
     virtual void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col) const = 0;
+    //as getIllumination, distance: how far along dir the light is, for shadow rays (1e30 for lights infinitely far away)
+    virtual void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col, float &distance) const {
+        getIllumination(p, dir, col);
+        distance = 1e30f;
+    }
     virtual Photon emitPhotonSampler() const = 0;
+    //total flux, for choosing lights (light_sampler.hpp); lights infinitely far away give what falls on a disk of sceneRadius
+    virtual Vector3f power(float sceneRadius) const = 0;
+    //where the light is and where it shines, without the power (LightBounds::phi); false for lights infinitely far away
+    virtual bool bounds(LightBounds &b) const { return false; }
+
+    //emission with the numbers of the renderer's sampler in [0, 1); distant lights shine from the disk of radius
+    //sceneRadius around sceneCenter facing them (as the environment map in sppm.cpp)
+    virtual Type type() const { return NONE; }
+    //a ray leaving the light, false if it carries nothing
+    virtual bool sampleEmission(float u0, float u1, float u2, float u3, const Vector3f &sceneCenter, float sceneRadius, LightSample &s) const { return false; }
+    //a point p (normal n as in LightSample) to light ref from, col as in getIllumination: the light arriving at ref
+    //over the pdf of the point; false if none arrives
+    virtual bool sampleIncident(const Vector3f &ref, float u0, float u1, float sceneRadius, Vector3f &p, Vector3f &n, Vector3f &col) const { return false; }
+    //pdfs of sampleEmission leaving the light in direction w
+    virtual void pdfEmission(const Vector3f &w, float sceneRadius, float &pdfPosition, float &pdfDirection) const {
+        pdfPosition = pdfDirection = 0;
+    }
 };
 
 
@@ -84,6 +122,38 @@ public:
         return Photon(Vector3f::ZERO, color, -direction);
     }
 
+    Vector3f power(float sceneRadius) const override {
+        return color * (M_PI * sceneRadius * sceneRadius);
+    }
+
+    Type type() const override { return DELTA_DIRECTION; }
+
+    //a uniform point of the disk facing the light, color is the irradiance
+    bool sampleEmission(float u0, float u1, float u2, float u3, const Vector3f &sceneCenter, float sceneRadius, LightSample &s) const override {
+        Vector3f a = Vector3f::cross(std::fabs(direction.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0), direction).normalized();
+        Vector3f b = Vector3f::cross(direction, a);
+        float r = sceneRadius * std::sqrt(u0), phi = 2 * M_PI * u1;
+        s.p = sceneCenter - direction * sceneRadius + a * (r * std::cos(phi)) + b * (r * std::sin(phi));
+        s.n = s.w = direction;
+        s.Le = color;
+        s.pdfPosition = 1 / (M_PI * sceneRadius * sceneRadius);
+        s.pdfDirection = 1;
+        return true;
+    }
+
+    //beyond the scene against the direction of the light
+    bool sampleIncident(const Vector3f &ref, float u0, float u1, float sceneRadius, Vector3f &p, Vector3f &n, Vector3f &col) const override {
+        p = ref - direction * (2 * sceneRadius);
+        n = direction;
+        col = color;
+        return true;
+    }
+
+    void pdfEmission(const Vector3f &w, float sceneRadius, float &pdfPosition, float &pdfDirection) const override {
+        pdfPosition = 1 / (M_PI * sceneRadius * sceneRadius);
+        pdfDirection = 1;
+    }
+
 private:
 
     Vector3f direction;
@@ -113,6 +183,11 @@ public:
         //color is the intensity at distance 1
     }
 
+    void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col, float &distance) const override {
+        getIllumination(p, dir, col);
+        distance = (position - p).length();
+    }
+
     Photon emitPhotonSampler() const override {
         //sample a point on the sphere
         float theta = 2 * M_PI * (rand() / (RAND_MAX + 1.0));
@@ -121,6 +196,46 @@ public:
         return Photon(position, color, direction);
     }
 
+    Vector3f power(float sceneRadius) const override {
+        return color * (4 * M_PI);
+    }
+
+    bool bounds(LightBounds &b) const override {
+        //all directions
+        b.lo = b.hi = position;
+        b.cosThetaO = -1;
+        b.cosThetaE = 0;
+        return true;
+    }
+
+    Type type() const override { return DELTA_POSITION; }
+
+    //uniform directions, color is the intensity
+    bool sampleEmission(float u0, float u1, float u2, float u3, const Vector3f &sceneCenter, float sceneRadius, LightSample &s) const override {
+        float z = 1 - 2 * u2, r = std::sqrt(std::max(0.0f, 1 - z * z)), phi = 2 * M_PI * u3;
+        s.p = position;
+        s.n = s.w = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        s.Le = color;
+        s.pdfPosition = 1;
+        s.pdfDirection = 1 / (4 * M_PI);
+        return true;
+    }
+
+    bool sampleIncident(const Vector3f &ref, float u0, float u1, float sceneRadius, Vector3f &p, Vector3f &n, Vector3f &col) const override {
+        p = position;
+        n = ref - position;
+        float distance2 = n.squaredLength();
+        if(distance2 == 0) return false;
+        n = n / std::sqrt(distance2);
+        col = color / distance2;
+        return true;
+    }
+
+    void pdfEmission(const Vector3f &w, float sceneRadius, float &pdfPosition, float &pdfDirection) const override {
+        pdfPosition = 1;
+        pdfDirection = 1 / (4 * M_PI);
+    }
+
 private:
 
     Vector3f position;
@@ -149,8 +264,37 @@ public:
 
     ~AreaLight() override = default;
 
+    //the plane of the disk
+    void basis(Vector3f &u, Vector3f &v) const {
+        u = Vector3f::cross(normal, Vector3f::RIGHT);
+        if(u.length() < 0.0001)
+            u = Vector3f::cross(normal, Vector3f::UP);
+        u.normalize();
+        v = Vector3f::cross(normal, u).normalized();
+    }
+
     void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col) const override {
-        //TODO: calculate Illumination using Monte Carlo integration
+        float distance;
+        getIllumination(p, dir, col, distance);
+    }
+
+    //one point sampled uniformly on the disk: the light from it over its pdf, color * cos * disk area / distance^2
+    void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col, float &distance) const override {
+        Vector3f u, v;
+        basis(u, v);
+        float theta = 2 * M_PI * (rand() / (RAND_MAX + 1.0));
+        float r = sqrt((rand() / (RAND_MAX + 1.0))) * area;
+        Vector3f q = position + r * cos(theta) * u + r * sin(theta) * v;
+        dir = q - p;
+        distance = dir.length();
+        if (distance == 0) {
+            dir = normal;
+            col = Vector3f::ZERO;
+            return;
+        }
+        dir = dir / distance;
+        float cosLight = -Vector3f::dot(normal, dir);
+        col = cosLight > 0 ? color * (cosLight * M_PI * area * area / (distance * distance)) : Vector3f::ZERO;
     }
 
     Photon emitPhotonSampler() const override {
@@ -159,10 +303,8 @@ public:
         //sample a point on the circle
         float theta = 2 * M_PI * (rand() / (RAND_MAX + 1.0));
         float r = sqrt((rand() / (RAND_MAX + 1.0))) * area;
-        Vector3f u = Vector3f::cross(normal, Vector3f::RIGHT).normalized();
-        if(u.length() < 0.0001)
-            u = Vector3f::cross(normal, Vector3f::UP).normalized();
-        Vector3f v = Vector3f::cross(normal, u).normalized();
+        Vector3f u, v;
+        basis(u, v);
         Vector3f origin = position + r * cos(theta) * u + r * sin(theta) * v;
         //uniformly sample a direction on the hemisphere
         float theta2 = 2 * M_PI * (rand() / (RAND_MAX + 1.0));
@@ -171,6 +313,60 @@ public:
         Vector3f flux = color * area * area * cos(phi);
         return Photon(origin, flux, direction);
     }
+
+    //a disk of radius area (as in emitPhotonSampler) radiating color to the side of normal
+    Vector3f power(float sceneRadius) const override {
+        return color * (M_PI * M_PI * area * area);
+    }
+
+    bool bounds(LightBounds &b) const override {
+        b.lo = position - Vector3f(area);
+        b.hi = position + Vector3f(area);
+        b.w = normal.normalized();
+        b.cosThetaO = 1;
+        b.cosThetaE = 0;
+        return true;
+    }
+
+    Type type() const override { return AREA; }
+
+    //a uniform point of the disk and a cosine weighted direction to the side of normal, color is the radiance
+    bool sampleEmission(float u0, float u1, float u2, float u3, const Vector3f &sceneCenter, float sceneRadius, LightSample &s) const override {
+        s.p = diskPoint(u0, u1);
+        s.n = normal.normalized();
+        s.w = cosineDirection(s.n, u2, u3);
+        s.Le = color;
+        s.pdfPosition = 1 / (M_PI * area * area);
+        s.pdfDirection = Vector3f::dot(s.w, s.n) / M_PI;
+        return s.pdfDirection > 0;
+    }
+
+    //as getIllumination
+    bool sampleIncident(const Vector3f &ref, float u0, float u1, float sceneRadius, Vector3f &p, Vector3f &n, Vector3f &col) const override {
+        p = diskPoint(u0, u1);
+        n = normal.normalized();
+        Vector3f w = ref - p;
+        float distance2 = w.squaredLength();
+        if(distance2 == 0) return false;
+        float cosLight = Vector3f::dot(n, w) / std::sqrt(distance2);
+        if(cosLight <= 0) return false;
+        col = color * (cosLight * M_PI * area * area / distance2);
+        return true;
+    }
+
+    void pdfEmission(const Vector3f &w, float sceneRadius, float &pdfPosition, float &pdfDirection) const override {
+        pdfPosition = 1 / (M_PI * area * area);
+        pdfDirection = std::max(0.0f, Vector3f::dot(w, normal.normalized())) / float(M_PI);
+    }
+
+private:
+    //uniform point of the disk from (u, v) in [0, 1)^2
+    Vector3f diskPoint(float u, float v) const {
+        Vector3f a, b;
+        basis(a, b);
+        float r = std::sqrt(u) * area, theta = 2 * M_PI * v;
+        return position + a * (r * std::cos(theta)) + b * (r * std::sin(theta));
+    }
 };
 
 class AmbientLight : public Light {
@@ -193,6 +389,10 @@ public:
         return Photon(Vector3f::ZERO, color, Vector3f::ZERO);
     }
 
+    Vector3f power(float sceneRadius) const override {
+        return color * (M_PI * sceneRadius * sceneRadius);
+    }
+
 private:
     Vector3f color;
 };
@@ -229,6 +429,11 @@ public:
         }
     }
 
+    void getIllumination(const Vector3f &p, Vector3f &dir, Vector3f &col, float &distance) const override {
+        getIllumination(p, dir, col);
+        distance = (position - p).length();
+    }
+
     Photon  emitPhotonSampler() const override {
         //sample a point inside the cone
         float theta = 2 * M_PI * (rand() / (RAND_MAX + 1.0));
@@ -245,6 +450,20 @@ public:
 
     }
 
+    //the intensity is at most color, inside the cone only
+    Vector3f power(float sceneRadius) const override {
+        return color * (2 * M_PI * (1 - cos(coneAngle / 2.0f)));
+    }
+
+    bool bounds(LightBounds &b) const override {
+        //the cone ends sharply, the emission does not spread beyond it
+        b.lo = b.hi = position;
+        b.w = direction;
+        b.cosThetaO = cos(coneAngle / 2.0f);
+        b.cosThetaE = 1;
+        return true;
+    }
+
 private:
     Vector3f position;
     Vector3f direction;
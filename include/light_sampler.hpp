@@ -0,0 +1,103 @@
+#ifndef LIGHT_SAMPLER_HPP
+#define LIGHT_SAMPLER_HPP
+//choosing lights in many-light scenes, follow the structure of PBRT-v4 (PowerLightSampler, BVHLightSampler)
+#include <cstdint>
+#include <vector>
+#include <vecmath.h>
+
+class Light;
+
+//a discrete distribution sampled in constant time (Vose's alias method)
+class AliasTable {
+public:
+    AliasTable() = default;
+    //weights >= 0, not all zero
+    explicit AliasTable(const std::vector<float>& weights);
+
+    bool empty() const { return bins.empty(); }
+    int size() const { return bins.size(); }
+    //index for u in [0, 1), pmf is its probability
+    int sample(float u, float& pmf) const;
+    float pmf(int i) const { return bins[i].p; }
+
+private:
+    struct Bin {
+        //probability to keep the bin, otherwise alias is taken
+        float q = 0;
+        int alias = -1;
+        float p = 0;
+    };
+    std::vector<Bin> bins;
+};
+
+//where a light (or a group of lights) is and where it shines: a box, a cone of normals around w with half angle
+//acos(cosThetaO), and the emission spreading up to acos(cosThetaE) beyond the normals
+struct LightBounds {
+    Vector3f lo = Vector3f(1e38f), hi = Vector3f(-1e38f);
+    Vector3f w = Vector3f(0, 0, 1);
+    //power, luminance of the flux
+    float phi = 0;
+    float cosThetaO = 1, cosThetaE = 1;
+    bool twoSided = false;
+
+    Vector3f centroid() const { return (lo + hi) / 2; }
+    //a conservative estimate of the light arriving at p from the bounds, n is the normal there (zero: no surface)
+    float importance(const Vector3f& p, const Vector3f& n) const;
+    static LightBounds merge(const LightBounds& a, const LightBounds& b);
+};
+
+//binary tree over the bounds of the lights, built with PBRT-v4's surface area orientation heuristic
+//sampling walks down from the root choosing a child in proportion to its importance to the receiver, so
+//lights far away or facing away are rarely picked while nearby bright ones are picked often
+class LightBVH {
+public:
+    LightBVH() = default;
+    explicit LightBVH(const std::vector<LightBounds>& lights);
+
+    bool empty() const { return nodes.empty(); }
+    //index of a light for a receiver at p with normal n (zero: any direction), -1 if none can reach p
+    int sample(const Vector3f& p, const Vector3f& n, float u, float& pmf) const;
+    //probability of sample returning the light
+    float pmf(const Vector3f& p, const Vector3f& n, int light) const;
+
+private:
+    struct Node {
+        LightBounds bounds;
+        //leaf: the light; interior: the second child, the first one follows the node
+        int index;
+        bool leaf;
+    };
+    std::vector<Node> nodes;
+    //path from the root to the leaf of every light, bit i set: the second child at depth i
+    std::vector<uint64_t> trails;
+
+    int build(std::vector<std::pair<int, LightBounds>>& lights, int begin, int end, uint64_t trail, int depth);
+};
+
+//the lights of the Lights section (light.hpp): photons leave them in proportion to their power (alias table),
+//direct lighting picks them by their importance to the receiver (LightBVH); lights infinitely far away
+//(directional, ambient) have no bounds and share a probability in proportion to their count, as in PBRT-v4
+class LightSampler {
+public:
+    //sceneRadius: radius of the scene, the power of distant lights is what falls on a disk of that radius
+    LightSampler(const std::vector<Light*>& lights, float sceneRadius);
+
+    bool empty() const { return lights.empty(); }
+    int size() const { return lights.size(); }
+    //light for a photon, pmf is its probability
+    Light* samplePhoton(float u, float& pmf) const;
+    //light for direct lighting at p with normal n, nullptr if none reaches p
+    Light* sampleDirect(const Vector3f& p, const Vector3f& n, float u, float& pmf) const;
+    //flux of all the lights as luminance
+    float totalPower() const { return total; }
+
+private:
+    std::vector<Light*> lights;
+    AliasTable power;
+    //indices of the lights in the tree and of the distant ones
+    std::vector<int> bounded, infinite;
+    LightBVH bvh;
+    float total = 0;
+};
+
+#endif //LIGHT_SAMPLER_HPP
@@ -7,8 +7,10 @@
 #include "ray.hpp"
 #include "hit.hpp"
 #include "utils.hpp"
+#include "medium.hpp"
 
 #include <iostream>
+#include <memory>
 
 class Texture;
 class Light;
@@ -129,11 +131,19 @@ public:
     virtual BRDFType getMaterialType() const {
         return type;
     }
+    //what fills objects of MEDIA (index matched boundary) and SUBSURFACE (glass boundary) materials, nullptr otherwise
+    void setMedium(std::unique_ptr<Medium> m) {
+        medium = std::move(m);
+    }
+    const Medium* getMedium() const {
+        return medium.get();
+    }
 private:
     Vector3f diffuseColor;
     Vector3f specularColor;
     Vector3f emissionColor;
     BRDFType type;
+    std::unique_ptr<Medium> medium;
 };
 
 class EmpiricalMaterial : public Material {
@@ -0,0 +1,145 @@
+#ifndef MEDIUM_HPP
+#define MEDIUM_HPP
+//participating media inside MEDIA and SUBSURFACE materials, follow the structure of PBRT (v3 media, v4 majorant grids)
+#include "bdpt.hpp"
+#include <vecmath.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Ray;
+
+//Henyey-Greenstein phase function, g > 0 scatters forward
+//cosine: between the direction of travel before and after the scattering
+float phaseHG(float cosine, float g);
+//direction after scattering from direction d, its pdf is phaseHG
+Vector3f samplePhaseHG(const Vector3f& d, float g, float u1, float u2);
+
+//the inside of a closed object; sigmaA, sigmaS: absorption and scattering coefficients per unit length
+class Medium {
+public:
+    explicit Medium(float g) : g(g) {}
+    virtual ~Medium() = default;
+
+    //free flight along ray (unit direction) up to tMax: true and the distance t if the ray scatters before tMax,
+    //false if it gets there; weight: what the outcome does to the throughput divided by its probability
+    virtual bool sample(const Ray& ray, float tMax, PathSampler& sampler, float& t, Vector3f& weight) const = 0;
+    //transmittance from the origin of ray to ray(tMax), an unbiased estimate for heterogeneous media
+    virtual Vector3f transmittance(const Ray& ray, float tMax, PathSampler& sampler) const = 0;
+
+    float getG() const { return g; }
+
+protected:
+    float g;
+};
+
+//constant coefficients: exponential free flights sampled on a randomly picked color channel, exact transmittance
+class HomogeneousMedium : public Medium {
+public:
+    HomogeneousMedium(const Vector3f& sigmaA, const Vector3f& sigmaS, float g);
+
+    bool sample(const Ray& ray, float tMax, PathSampler& sampler, float& t, Vector3f& weight) const override;
+    Vector3f transmittance(const Ray& ray, float tMax, PathSampler& sampler) const override;
+
+private:
+    Vector3f sigmaS, sigmaT;
+};
+
+//coarse grid over a density grid, every cell keeps the largest density the trilinear interpolation reaches in it
+//a ray walks through the cells with a 3D DDA (Amanatides and Woo), empty cells are skipped at once and the others
+//are sampled with their own bound instead of the largest density of the whole grid
+class MajorantGrid {
+public:
+    static const int RESOLUTION = 16;
+
+    //density: nx * ny * nz voxels, x fastest
+    void build(const std::vector<float>& density, int nx, int ny, int nz);
+    //calls visit(t0, t1, majorant) for the cells along o + t d in [tMin, tMax] in order, while it returns true;
+    //o, d in grid space ([0, 1]^3 is the grid), t as along the world space ray
+    template<typename Visit>
+    void traverse(const Vector3f& o, const Vector3f& d, float tMin, float tMax, Visit visit) const;
+
+private:
+    int res[3] = {0, 0, 0};
+    std::vector<float> cells;
+};
+
+//density on a voxel grid inside an axis aligned box (the box of a Mitsuba .vol file), times sigmaA and sigmaS
+//free flights: delta tracking against the majorant grid; with colored coefficients the collision is real with
+//probability mean(sigma_t) / majorant and the throughput takes the ratio of the color to the mean (spectral tracking,
+//Kutz et al. 2017); transmittance: ratio tracking against the same majorants
+class GridMedium : public Medium {
+public:
+    GridMedium(const Vector3f& boundsMin, const Vector3f& boundsMax, int nx, int ny, int nz, std::vector<float> density,
+               const Vector3f& sigmaA, const Vector3f& sigmaS, float g);
+    //single channel float32 Mitsuba volume (VOL version 3), nullptr if it cannot be read
+    static std::unique_ptr<GridMedium> load(const std::string& filename, const Vector3f& sigmaA, const Vector3f& sigmaS, float g);
+
+    bool sample(const Ray& ray, float tMax, PathSampler& sampler, float& t, Vector3f& weight) const override;
+    Vector3f transmittance(const Ray& ray, float tMax, PathSampler& sampler) const override;
+
+private:
+    //trilinear density at p in grid space, 0 outside the grid
+    float density(const Vector3f& p) const;
+    float voxel(int x, int y, int z) const;
+
+    Vector3f boundsMin, extent;
+    int nx, ny, nz;
+    std::vector<float> grid;
+    Vector3f sigmaS, sigmaT;
+    //largest channel of sigmaT, majorants are densities times it
+    float sigmaTMax;
+    MajorantGrid majorants;
+};
+
+template<typename Visit>
+void MajorantGrid::traverse(const Vector3f& o, const Vector3f& d, float tMin, float tMax, Visit visit) const {
+    //clip to the unit box
+    for(int a = 0; a < 3; a++) {
+        if(d[a] == 0) {
+            if(o[a] < 0 || o[a] > 1) return;
+            continue;
+        }
+        float t0 = -o[a] / d[a], t1 = (1 - o[a]) / d[a];
+        if(t0 > t1) std::swap(t0, t1);
+        tMin = std::max(tMin, t0);
+        tMax = std::min(tMax, t1);
+    }
+    if(!(tMin < tMax)) return;
+    int cell[3], step[3], end[3];
+    float next[3], delta[3];
+    for(int a = 0; a < 3; a++) {
+        float p = (o[a] + d[a] * tMin) * res[a];
+        cell[a] = std::min(std::max(int(p), 0), res[a] - 1);
+        if(d[a] == 0) {
+            next[a] = INFINITY;
+            delta[a] = INFINITY;
+            step[a] = 0;
+            end[a] = -2;
+            continue;
+        }
+        delta[a] = 1 / (std::fabs(d[a]) * res[a]);
+        if(d[a] > 0) {
+            next[a] = tMin + (float(cell[a] + 1) / res[a] - (o[a] + d[a] * tMin)) / d[a];
+            step[a] = 1;
+            end[a] = res[a];
+        } else {
+            next[a] = tMin + (float(cell[a]) / res[a] - (o[a] + d[a] * tMin)) / d[a];
+            step[a] = -1;
+            end[a] = -1;
+        }
+    }
+    float t = tMin;
+    while(t < tMax) {
+        //axis of the nearest cell boundary
+        int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        float t1 = std::min(next[a], tMax);
+        if(t1 > t && !visit(t, t1, cells[(cell[2] * res[1] + cell[1]) * res[0] + cell[0]])) return;
+        t = t1;
+        cell[a] += step[a];
+        if(cell[a] == end[a]) return;
+        next[a] += delta[a];
+    }
+}
+
+#endif //MEDIUM_HPP
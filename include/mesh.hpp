@@ -11,54 +11,32 @@
 
 class Material;
 
-class Vertex{
-    // each vertex stores its position, normal and texcoord as index
-public:
-    int _vertex_index;
-    int _normal_index;
-    int _texcoord_index;
+//one triangle of the mesh as indices into the attribute arrays, -1 if absent
+//plain data, it is written to the geometry cache as is
+struct TriangleIndices {
+    int v[3];
+    int n[3];
+    int uv[3];
+    int material;
 };
 
-class Face{
+class Mesh;
+
+//a triangle of a Mesh addressed through the shared vertex/normal/texcoord buffers
+//meshes store no per-triangle objects, a TriangleRef is created on the stack for each test
+//and the attributes are only gathered once the ray actually hits
+class TriangleRef {
 public:
-    friend ostream& operator <<(ostream& os, const Face& f){
-        os << "Face: " << endl;
-        for(int i = 0; i < f._vertexes.size(); i++){
-            os << f._vertexes[i]._vertex_index << " ";
-        }
-        os << endl;
-        return os;
-    };
-    std::vector<Vertex> _vertexes;
-};
+    TriangleRef(const Mesh& mesh, const TriangleIndices& t);
 
-struct num_tags{
-    int int_num;
-    int float_num;
-    int string_num;
-};
+    bool intersect(const Ray& ray, Hit& hit, float tmin) const;
+    //textured triangles move their corners (bump mapping) before the test
+    bool hasBump() const { return material->hasTexture(); }
 
-class Shape{
-public:
-    friend ostream& operator <<(ostream& os, const Shape& s){
-        os << "Shape: " << endl;
-        os << "num of faces: " << s._faces.size() << endl;
-        for(int i = 0; i < s._faces.size(); i++){
-            os << s._faces[i];
-        }
-        return os;
-    };
-    std::vector<Face> _faces;
-    std::vector<int> _material_ids;
-
-    //something maybe not used
-    /* 
-    std::vector<int> _mesh_indices;
-    std::vector<int> _lines_indices;
-    std::vector<int> _points_indices;
-    std::vector<unsigned int> _smooth_group_ids; */
-    //num_tags _tags;
-    std::string _name;
+private:
+    const Mesh& mesh;
+    const TriangleIndices& t;
+    Material* material;
 };
 
 class Mesh : public Object3D {
@@ -66,18 +44,39 @@ class Mesh : public Object3D {
 public:
     Mesh():Object3D(nullptr){};
     Mesh(const char *filename, Material *m);
+    //generated geometry (tessellated curves and surfaces), the arrays are taken over
+    //open surfaces are two sided, obj meshes cull back faces
+    Mesh(std::vector<Vector3f>& v, std::vector<Vector3f>& n, std::vector<Vector2f>& uv,
+         std::vector<TriangleIndices>& triangles, Material *m, bool twoSided);
 
     ~Mesh() {};
 
     bool intersect(const Ray &r, Hit &h, float tmin) override;
+    //packet traversal of the packed BVH, see intersectPacket in bvh.hpp
+    int intersectPacket(const RayPacket &packet, Hit *hits, float tmin) override;
+    //every triangle with an emissive material (an obj's Ke) is an emitter of its own
+    void collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) override;
 
 private:
+    friend class TriangleRef;
+
+    //builds _root and puts _triangles in leaf order
+    void buildBVH();
+    //_nodes from the tree (or the cache), decides whether packets can walk it
+    void setPackedBVH();
+
     std::vector<Vector3f> _v;//attrib.vertices
     std::vector<Vector3f> _n;//attrib.normals
     std::vector<Vector2f> _uv;//attrib.texcoords
-    BVHNode* _root;
+    std::vector<TriangleIndices> _triangles;//in BVH leaf order once the BVH is built
+    BVHNode* _root = nullptr;
+    //the same tree flat, for packet traversal
+    std::vector<PackedBVHNode> _nodes;
+    bool _packetTraversal = false;
+    bool _twoSided = false;
+    //two sided meshes do not drop the back face a bounced ray starts on, hits closer than this are ignored
+    float _selfIntersectionEps = 0;
 
-    std::vector<Shape> _shapes;
     std::vector<Material *> _materials;
 };
 
@@ -0,0 +1,62 @@
+#ifndef __MESH_CACHE_H__
+#define __MESH_CACHE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include "tiny_obj_loader.h"
+
+//Binary geometry cache
+//the first load of an obj writes <obj>.cache next to it: vertex/normal/texcoord arrays,
+//triangle indices (in BVH leaf order), the MTL materials and the BVH in preorder
+//later loads mmap the file and copy the arrays out directly, no text parsing and no BVH build
+//the cache is rebuilt when the size/mtime of the obj or of one of its mtllib files, the smooth flag
+//or the format version changes; a cache whose indices point outside their sections is reparsed too
+
+class MeshCache {
+public:
+    //MTL_FILES: path, size and mtime of every mtllib of the obj (bytes, like MATERIALS)
+    enum Section { VERTICES, NORMALS, TEXCOORDS, TRIANGLES, MATERIALS, BVH_NODES, MTL_FILES, SECTION_COUNT };
+
+    explicit MeshCache(const std::string& objPath);
+    ~MeshCache();
+
+    const std::string& Path() const { return path; }
+
+    //maps the cache file, false if it is missing, corrupt or stale
+    bool open(bool smooth);
+    bool isOpen() const { return base != nullptr; }
+
+    //element count of a section (bytes for MATERIALS)
+    size_t count(Section s) const;
+    template<typename T>
+    const T* data(Section s) const { return reinterpret_cast<const T*>(base + offset(s)); }
+
+    //false if the material table is corrupt
+    bool readMaterials(std::vector<tinyobj::material_t>& materials) const;
+    //the mtllib paths recorded by write
+    void readMtlFiles(std::vector<std::string>& files) const;
+
+    //nodes may be empty, the BVH is then built on the next load
+    //mtlFiles: the mtllib paths the obj refers to, missing ones included
+    bool write(bool smooth, const std::vector<Vector3f>& v, const std::vector<Vector3f>& n,
+               const std::vector<Vector2f>& uv, const std::vector<TriangleIndices>& triangles,
+               const std::vector<tinyobj::material_t>& materials,
+               const std::vector<PackedBVHNode>& nodes, const std::vector<std::string>& mtlFiles);
+
+private:
+    uint64_t offset(Section s) const;
+    //the mtllib files are unchanged since the cache was written
+    bool mtlFilesUnchanged() const;
+    //every index Mesh and the BVH traversal follow stays inside its section
+    bool indicesValid() const;
+
+    std::string objPath;
+    std::string path;
+    const unsigned char* base = nullptr;
+    size_t size = 0;
+};
+
+#endif //__MESH_CACHE_H__
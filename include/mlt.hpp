@@ -0,0 +1,78 @@
+#ifndef MLT_HPP
+#define MLT_HPP
+//Metropolis light transport in primary sample space over the strategies of BDPT (multiplexed MLT,
+//Hachisuka et al. 2014), follow the structure of PBRT-v3
+#include "bdpt.hpp"
+#include <vector>
+
+class SceneParser;
+class Film;
+
+//the primary sample vector of a Markov chain, read in order through PathSampler::next
+//every iteration either draws all of it anew (large step) or perturbs every number that is read by a normal
+//offset (small step); numbers are only created and mutated when read, a number that was skipped for n iterations
+//gets the n small steps at once; a rejected iteration restores the numbers it changed
+//the numbers are split into interleaved streams (camera subpath, light subpath, connection), so a subpath that
+//reads more or fewer of them does not shift the numbers of the others
+class MLTSampler : public PathSampler {
+public:
+    //seed: chains started with the same seed replay the same first sample
+    MLTSampler(int seed, float sigma, float largeStepProbability, int streamCount);
+
+    void startIteration();
+    void accept();
+    void reject();
+    void startStream(int index);
+    float next() override;
+
+private:
+    struct PrimarySample {
+        float value = 0;
+        //iteration of the last change, the values before the current iteration
+        long lastModification = 0;
+        float valueBackup = 0;
+        long modifyBackup = 0;
+    };
+
+    //brings X[index] up to the current iteration
+    void ensureReady(int index);
+    float uniform() { return std::min(float(erand48(Xi)), 0.99999994f); }
+
+    unsigned short Xi[3];
+    float sigma, largeStepProbability;
+    int streamCount;
+    std::vector<PrimarySample> X;
+    long currentIteration = 0;
+    bool largeStep = true;
+    long lastLargeStepIteration = 0;
+    int streamIndex = 0, sampleIndex = 0;
+};
+
+//every Markov chain stays on paths of one depth and mutates the primary samples of a single BDPT strategy (s, t)
+//of that depth, s being one of the numbers; the contribution of the strategy times the number of strategies
+//is an unbiased estimate of all light of the depth
+//a bootstrap phase evaluates many independent samples of every depth: their mean brightness is the
+//normalization b, the chains start from among them in proportion to their brightness (so no start-up bias)
+//and every depth gets chains in proportion to its light
+//the chains run in parallel and splat into a buffer of their thread, the buffers are summed into the film at the end
+class MLTIntegrator {
+public:
+    //maxDepth: maximal number of bounces; bootstrapSamples per depth; mutationsPerPixel over all chains;
+    //sigma: standard deviation of the small steps; largeStepProbability: chance of a large step
+    MLTIntegrator(const SceneParser& scene, int maxDepth, int bootstrapSamples = 100000, int chains = 1000,
+                  int mutationsPerPixel = 100, float sigma = 0.01f, float largeStepProbability = 0.3f);
+
+    void render(Film& film);
+
+private:
+    //contribution of the path sample of the sampler at the given depth, x and y: its film point
+    Vector3f L(MLTSampler& sampler, int depth, float& x, float& y) const;
+
+    const SceneParser& scene;
+    BDPTIntegrator bdpt;
+    int width, height;
+    int maxDepth, bootstrapSamples, chains, mutationsPerPixel;
+    float sigma, largeStepProbability;
+};
+
+#endif //MLT_HPP
@@ -0,0 +1,24 @@
+#ifndef __OBJ_LOADER_H__
+#define __OBJ_LOADER_H__
+
+#include <string>
+#include <vector>
+#include "mesh.hpp"
+#include "tiny_obj_loader.h"
+
+//Parallel obj loader
+//the file is mmapped and cut into chunks at line boundaries, each chunk is handled by one thread
+//a counting pass sizes every chunk, prefix sums then give each chunk its range of the output,
+//and a second pass parses straight into the final arrays: no per-face containers, no copies
+//negative (relative) indices and usemtl state are resolved from the chunk's prefix
+//quads are split along the shorter diagonal like tinyobj, larger polygons as fans
+//mtllib files are still parsed with tinyobj::LoadMtl
+//faces without a normal/texcoord get -1 in TriangleIndices
+//mtlFiles receives the path of every mtllib, also the ones that are missing (the geometry cache watches them)
+
+bool loadObj(const std::string& filename, const std::string& basepath,
+             std::vector<Vector3f>& vertices, std::vector<Vector3f>& normals, std::vector<Vector2f>& texcoords,
+             std::vector<TriangleIndices>& triangles, std::vector<tinyobj::material_t>& materials,
+             std::vector<std::string>& mtlFiles);
+
+#endif //__OBJ_LOADER_H__
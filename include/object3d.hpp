@@ -2,8 +2,12 @@
 #define __OBJECT3D_H__
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include "hit.hpp"
 #include "material.hpp"
+#include <vector>
+
+struct EmissiveShape;
 
 // Base class for all 3d entities.
 class Object3D {
@@ -18,6 +22,18 @@ public:
 
     // Intersect Ray with this object. If hit, store information in hit structure.
     virtual bool intersect(const Ray &r, Hit &h, float tmin) = 0;
+    // Intersect the active lanes of a packet, hits[lane] as above. Returns the lanes that hit.
+    // Objects without packet traversal intersect the lanes one by one.
+    virtual int intersectPacket(const RayPacket &packet, Hit *hits, float tmin) {
+        int hitMask = 0;
+        for (int m = packet.mask; m != 0; m &= m - 1) {
+            int lane = firstLane(m);
+            if (intersect(packet.ray(lane), hits[lane], tmin)) hitMask |= 1 << lane;
+        }
+        return hitMask;
+    }
+    // Append the emissive parts that can be sampled by area (emitter.hpp), toWorld maps the object into the scene.
+    virtual void collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) {}
     Material *material;
 protected:
 
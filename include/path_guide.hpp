@@ -0,0 +1,82 @@
+#ifndef PATH_GUIDE_HPP
+#define PATH_GUIDE_HPP
+//practical path guiding for the path tracer, follow Müller et al. 2017 (Practical Path Guiding for Efficient
+//Light-Transport Simulation): an SD-tree learned over passes of doubling sample counts
+#include <vector>
+#include <vecmath.h>
+
+//incident radiance over the sphere of directions, a quadtree over the square of cylindrical coordinates
+//(cos(theta) = 2u - 1, phi = 2 pi v, equal area), every quadrant keeping the radiance recorded in it
+class DTree {
+public:
+    //a single node, uniform over the sphere
+    DTree();
+
+    //direction from (u0, u1, u2) in [0, 1)^3 in proportion to the radiance, pdf per solid angle
+    Vector3f sample(float u0, float u1, float u2, float& pdf) const;
+    float pdf(const Vector3f& d) const;
+    //quadrants of the nodes (4 per node), the index of the leaf quadrant of direction d
+    int size() const { return nodes.size() * 4; }
+    int locate(const Vector3f& d) const;
+    //takes the radiance recorded into the leaf quadrants (energy, size() of them) as the distribution, then splits
+    //the quadrants with more than RHO of it and merges the others into leaves for the next pass
+    void build(const float* energy);
+
+    static const int MAX_DEPTH = 20;
+    static constexpr float RHO = 0.01f;
+
+private:
+    struct Node {
+        float sum[4];
+        //0: the quadrant is a leaf
+        int child[4];
+    };
+    std::vector<Node> nodes;
+
+    float sumUp(int node, const float* energy);
+    //copies node (sums: its quadrants, node -1: a leaf quadrant of this tree split evenly) into out[outNode]
+    void refine(std::vector<Node>& out, int outNode, const float* sums, int node, float total, int depth) const;
+};
+
+//binary tree over space (split in the middle, the axes in turn), a DTree in every leaf
+//a pass samples from the trees learned before and records what the paths find; every thread records into its own
+//buffer without locks, endPass merges them, refines the DTrees and splits leaves that got many records
+class SDTree {
+public:
+    //center, radius: bounding sphere of the visible scene, points outside go to the nearest leaf
+    SDTree(const Vector3f& center, float radius);
+
+    const DTree& dtree(const Vector3f& p) const { return dtrees[leaf(p)]; }
+    //buffers for the threads of the next pass
+    void beginPass(int threads);
+    //radiance (luminance over its pdf) arriving at p from direction d, from thread
+    void record(const Vector3f& p, const Vector3f& d, float value, int thread);
+    //passSamples: samples per pixel of the pass, leaves split after SPLIT * sqrt(passSamples) records
+    void endPass(int passSamples);
+
+    static const int SPLIT = 4000;
+    static const int MAX_DEPTH = 24;
+
+private:
+    struct Node {
+        //0: a leaf, dtree is its DTree
+        int child[2];
+        int dtree;
+    };
+    struct Buffer {
+        std::vector<float> energy;
+        std::vector<int> records;
+    };
+    Vector3f lo, hi;
+    std::vector<Node> nodes;
+    std::vector<DTree> dtrees;
+    //start of the quadrants of every DTree in the buffers
+    std::vector<int> offsets;
+    std::vector<Buffer> buffers;
+
+    int leaf(const Vector3f& p) const;
+    //records: of the leaf node, -1 to take them from the merged buffer
+    void split(int node, int depth, int records, int threshold);
+};
+
+#endif //PATH_GUIDE_HPP
@@ -0,0 +1,39 @@
+#ifndef PHOTON_GUIDE_HPP
+#define PHOTON_GUIDE_HPP
+//guiding the emission of SPPM photons towards the visible points, after the importance driven photon emission of
+//Peter and Pietrek and the resampled importance sampling of Talbot et al.
+#include <vector>
+#include <vecmath.h>
+
+//a spatial-directional grid over where photons start (CELLS^3 cells over the visible scene) and where they go (equal
+//area bins of the sphere), learning how much a photon starting there adds to the visible points per unit flux
+//a pass emits every photon by resampling: CANDIDATES photons from the lights as before, one of them chosen in
+//proportion to its flux times the importance of its bin, its flux scaled by (sum of the weights / CANDIDATES) / its
+//weight; the estimate stays unbiased because every bin keeps a share of the average importance
+//what the photons of a pass find is recorded (lock-free, atomic adds) and used from the next pass on
+class PhotonGuide {
+public:
+    static const int CELLS = 8;
+    static const int THETA = 8, PHI = 16;
+    static const int CANDIDATES = 8;
+
+    //center, radius: bounding sphere of the visible scene, the grid covers twice the radius
+    PhotonGuide(const Vector3f& center, float radius);
+
+    //bin of a photon leaving origin in direction (unit)
+    int bin(const Vector3f& origin, const Vector3f& direction) const;
+    //learned importance of the bin, > 0
+    float importance(int bin) const { return guide[bin]; }
+    //a photon emitted from the bin added usefulness (contribution over its flux) to the visible points
+    void record(int bin, float usefulness);
+    //after a pass: the importance from everything recorded so far
+    void update();
+
+private:
+    Vector3f lo;
+    float cellSize;
+    std::vector<float> sum, count;
+    std::vector<float> guide;
+};
+
+#endif //PHOTON_GUIDE_HPP
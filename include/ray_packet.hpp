@@ -0,0 +1,188 @@
+#ifndef __RAY_PACKET_H__
+#define __RAY_PACKET_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <vecmath.h>
+#include "ray.hpp"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//8 rays in SoA form for packet traversal (one AVX2 register per coordinate)
+//coherent rays (camera rays of neighbouring samples, shadow rays from one point) cross mostly the
+//same BVH nodes, a packet tests each node once for all its rays instead of once per ray
+//lanes not in mask are ignored, their slots may hold anything
+//without AVX2 the same code runs as plain loops over the lanes
+struct alignas(32) RayPacket {
+    static const int SIZE = 8;
+    //triangleMask keeps hits this close (barycentric, relative t) to an edge as candidates
+    static constexpr float TRIANGLE_SLACK = 1e-4f;
+
+    float o[3][SIZE];
+    float d[3][SIZE];
+    //1 / d, the slab test multiplies instead of dividing
+    float invD[3][SIZE];
+    int mask = 0;
+
+    void set(int lane, const Ray& ray) {
+        set(lane, ray.getOrigin(), ray.getDirection());
+    }
+
+    void set(int lane, const float* origin, const float* direction) {
+        for(int a = 0; a < 3; a++) {
+            o[a][lane] = origin[a];
+            d[a][lane] = direction[a];
+            invD[a][lane] = 1.0f / direction[a];
+        }
+        mask |= 1 << lane;
+    }
+
+    Ray ray(int lane) const {
+        return Ray(Vector3f(o[0][lane], o[1][lane], o[2][lane]), Vector3f(d[0][lane], d[1][lane], d[2][lane]));
+    }
+
+    //lanes of mask whose ray crosses the box inside [tmin, tmax[lane]], same rules as BoundingBox::intersect
+    int boxMask(const float* min, const float* max, float tmin, const float* tmax, int mask) const {
+#ifdef __AVX2__
+        //a NaN bound (0 * inf, a ray in the plane of a box face) leaves the interval as it is, like the
+        //scalar test: no swap on NaN, and the running bounds are the second operand of max/min,
+        //which return it when the other one is NaN
+        __m256 t0 = _mm256_set1_ps(tmin), t1 = _mm256_load_ps(tmax);
+        for(int a = 0; a < 3; a++) {
+            __m256 origin = _mm256_load_ps(o[a]), inverse = _mm256_load_ps(invD[a]);
+            __m256 tNear = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min[a]), origin), inverse);
+            __m256 tFar = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max[a]), origin), inverse);
+            __m256 swap = _mm256_cmp_ps(tNear, tFar, _CMP_GT_OQ);
+            t0 = _mm256_max_ps(_mm256_blendv_ps(tNear, tFar, swap), t0);
+            t1 = _mm256_min_ps(_mm256_blendv_ps(tFar, tNear, swap), t1);
+        }
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) & mask;
+#else
+        int result = 0;
+        for(int lane = 0; lane < SIZE; lane++) {
+            if((mask >> lane & 1) && boxLane(min, max, tmin, tmax[lane], lane)) result |= 1 << lane;
+        }
+        return result;
+#endif
+    }
+
+    //single lane slab test, for packets that have diverged
+    bool boxLane(const float* min, const float* max, float tmin, float tmax, int lane) const {
+        float t0 = tmin, t1 = tmax;
+        for(int a = 0; a < 3; a++) {
+            float tNear = (min[a] - o[a][lane]) * invD[a][lane];
+            float tFar = (max[a] - o[a][lane]) * invD[a][lane];
+            if(tNear > tFar) std::swap(tNear, tFar);
+            t0 = std::max(t0, tNear);
+            t1 = std::min(t1, tFar);
+            if(t0 > t1) return false;
+        }
+        return true;
+    }
+
+    //candidate lanes of mask that hit the triangle a, E1 = b - a, E2 = c - a inside [tmin, tmax[lane])
+    //Möller–Trumbore as in Triangle::intersect, 8 lanes against one triangle; loosened by TRIANGLE_SLACK
+    //so rounding never drops a hit, the caller confirms every candidate with the exact single ray test
+    int triangleMask(const float* a, const float* e1, const float* e2, float tmin, const float* tmax, int mask, bool twoSided) const {
+#ifdef __AVX2__
+        __m256 dx = _mm256_load_ps(d[0]), dy = _mm256_load_ps(d[1]), dz = _mm256_load_ps(d[2]);
+        __m256 e1x = _mm256_set1_ps(e1[0]), e1y = _mm256_set1_ps(e1[1]), e1z = _mm256_set1_ps(e1[2]);
+        __m256 e2x = _mm256_set1_ps(e2[0]), e2y = _mm256_set1_ps(e2[1]), e2z = _mm256_set1_ps(e2[2]);
+        //P = d x E2
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_add_ps(_mm256_mul_ps(e1y, py), _mm256_mul_ps(e1z, pz)));
+        __m256 zero = _mm256_setzero_ps();
+        __m256 valid = twoSided ? _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ) : _mm256_cmp_ps(det, zero, _CMP_GT_OQ);
+        __m256 invdet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        //T = o - a
+        __m256 tx = _mm256_sub_ps(_mm256_load_ps(o[0]), _mm256_set1_ps(a[0]));
+        __m256 ty = _mm256_sub_ps(_mm256_load_ps(o[1]), _mm256_set1_ps(a[1]));
+        __m256 tz = _mm256_sub_ps(_mm256_load_ps(o[2]), _mm256_set1_ps(a[2]));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_add_ps(_mm256_mul_ps(ty, py), _mm256_mul_ps(tz, pz))), invdet);
+        //Q = T x E1
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_add_ps(_mm256_mul_ps(dy, qy), _mm256_mul_ps(dz, qz))), invdet);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_add_ps(_mm256_mul_ps(e2y, qy), _mm256_mul_ps(e2z, qz))), invdet);
+        __m256 slack = _mm256_set1_ps(TRIANGLE_SLACK), low = _mm256_set1_ps(-TRIANGLE_SLACK), high = _mm256_set1_ps(1 + TRIANGLE_SLACK);
+        __m256 tSlack = _mm256_mul_ps(slack, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), t));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, low, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, high, _CMP_LE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, low, _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), high, _CMP_LE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(t, tSlack), _mm256_set1_ps(tmin), _CMP_GE_OQ));
+        valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_sub_ps(t, tSlack), _mm256_load_ps(tmax), _CMP_LT_OQ));
+        return _mm256_movemask_ps(valid) & mask;
+#else
+        int result = 0;
+        for(int lane = 0; lane < SIZE; lane++) {
+            if((mask >> lane & 1) && triangleLane(a, e1, e2, tmin, tmax[lane], twoSided, lane)) result |= 1 << lane;
+        }
+        return result;
+#endif
+    }
+
+    bool triangleLane(const float* a, const float* e1, const float* e2, float tmin, float tmax, bool twoSided, int lane) const {
+        float dx = d[0][lane], dy = d[1][lane], dz = d[2][lane];
+        float px = dy * e2[2] - dz * e2[1], py = dz * e2[0] - dx * e2[2], pz = dx * e2[1] - dy * e2[0];
+        float det = e1[0] * px + e1[1] * py + e1[2] * pz;
+        if(twoSided ? !(det != 0) : !(det > 0)) return false;
+        float invdet = 1 / det;
+        float tx = o[0][lane] - a[0], ty = o[1][lane] - a[1], tz = o[2][lane] - a[2];
+        float u = (tx * px + ty * py + tz * pz) * invdet;
+        float qx = ty * e1[2] - tz * e1[1], qy = tz * e1[0] - tx * e1[2], qz = tx * e1[1] - ty * e1[0];
+        float v = (dx * qx + dy * qy + dz * qz) * invdet;
+        float t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * invdet;
+        float tSlack = TRIANGLE_SLACK * std::fabs(t);
+        return u >= -TRIANGLE_SLACK && u <= 1 + TRIANGLE_SLACK && v >= -TRIANGLE_SLACK && u + v <= 1 + TRIANGLE_SLACK &&
+               t + tSlack >= tmin && t - tSlack < tmax;
+    }
+};
+
+//any number of rays in SoA form (Camera::generateRays writes a whole tile at once), cut into packets by load
+struct RayBatch {
+    std::vector<float> o[3];
+    std::vector<float> d[3];
+
+    void resize(int n) {
+        for(int a = 0; a < 3; a++) {
+            o[a].resize(n);
+            d[a].resize(n);
+        }
+    }
+
+    int size() const {
+        return o[0].size();
+    }
+
+    Ray ray(int i) const {
+        return Ray(Vector3f(o[0][i], o[1][i], o[2][i]), Vector3f(d[0][i], d[1][i], d[2][i]));
+    }
+
+    //rays [begin, begin + count) into lanes 0 .. count - 1
+    void load(int begin, int count, RayPacket& packet) const {
+        packet.mask = 0;
+        for(int lane = 0; lane < count; lane++) {
+            int i = begin + lane;
+            float origin[3] = {o[0][i], o[1][i], o[2][i]};
+            float direction[3] = {d[0][i], d[1][i], d[2][i]};
+            packet.set(lane, origin, direction);
+        }
+    }
+};
+
+inline int popcount(int mask) {
+    return __builtin_popcount(mask);
+}
+
+//index of the lowest lane in mask, mask != 0
+inline int firstLane(int mask) {
+    return __builtin_ctz(mask);
+}
+
+#endif //__RAY_PACKET_H__
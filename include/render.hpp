@@ -5,6 +5,7 @@
 #include <memory>
 
 #include "utils.hpp"
+#include "film.hpp"
 
 class Image;
 class RgbImage;
@@ -12,9 +13,19 @@ class SceneParser;
 
 
 // 基类：渲染器
+//every renderer only fills its float framebuffer film (with the AOVs if --aov 1 or --denoise),
+//develop turns it into the 8 bit image: denoiser (--denoise), then tone mapping and sRGB encoding
 class Renderer {
 public:
+    virtual ~Renderer() = default;
     virtual void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) = 0;
+    Film* getFilm() const { return film.get(); }
+
+protected:
+    void createFilm(int width, int height);
+    RgbImage* develop();
+
+    std::unique_ptr<Film> film;
 };
 
 class PathTracingRenderer : public Renderer {
@@ -27,6 +38,26 @@ public:
     void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) override ;
 };
 
+class BDPTRenderer : public Renderer {
+public:
+    void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) override ;
+};
+
+class VCMRenderer : public Renderer {
+public:
+    void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) override ;
+};
+
+class MLTRenderer : public Renderer {
+public:
+    void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) override ;
+};
+
+class VRPTRenderer : public Renderer {
+public:
+    void render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) override ;
+};
+
 
 class RayCastingRenderer : public Renderer {
 public:
@@ -41,14 +72,14 @@ public:
                 return std::make_unique<PathTracingRenderer>();
             case SPPM:
                 return std::make_unique<SPPMRenderer>();
-            /* case VCM:
+            case VCM:
                 return std::make_unique<VCMRenderer>();
             case BDPT:
                 return std::make_unique<BDPTRenderer>();
             case MLT:
                 return std::make_unique<MLTRenderer>();
             case VRPT:
-                return std::make_unique<VRPTRenderer>(); */
+                return std::make_unique<VRPTRenderer>();
             case RC:
                 return std::make_unique<RayCastingRenderer>();
             default:
@@ -0,0 +1,58 @@
+#ifndef __RENDER_STATS_H__
+#define __RENDER_STATS_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//Throughput counters for benchmarking (micropt_bench)
+//rays are counted by kind where the path tracer, ray casting and SPPM trace them, SPPM also counts its photons
+//and their segments (PHOTON_RAYS) apart from the camera side rays
+//counting is off unless enabled is set (micropt_bench does), the renderer then only pays a predictable branch
+//every thread adds to a block of its own, registered on its first count as the texture cache statistics,
+//so counting takes no lock; the totals are summed on demand
+//BVH builds (meshes, surface patches) add the time they took
+class RenderStats {
+public:
+    enum Counter { PRIMARY_RAYS, SHADOW_RAYS, SECONDARY_RAYS, PHOTON_RAYS, PHOTONS, COUNTERS };
+
+    //set before rendering, no thread may be counting meanwhile
+    static bool enabled;
+
+    static RenderStats& instance();
+
+    //add n to counter on the calling thread
+    static void count(Counter counter, uint64_t n = 1) {
+        if(!enabled) return;
+        ThreadCounters* counters = localCounters;
+        if(!counters) counters = registerLocal();
+        //only this thread writes its block: a relaxed load and store, no locked add
+        counters->values[counter].store(counters->values[counter].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void addBVHBuildTime(double milliseconds);
+
+    uint64_t total(Counter counter);
+    double getBVHBuildTime();
+    //zero everything, no thread may be counting meanwhile
+    void reset();
+
+    struct ThreadCounters {
+        std::atomic<uint64_t> values[COUNTERS] = {};
+    };
+    std::shared_ptr<ThreadCounters> registerThread();
+
+private:
+    RenderStats() = default;
+    //registers the block of the calling thread
+    static ThreadCounters* registerLocal();
+
+    static thread_local ThreadCounters* localCounters;
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadCounters>> threadCounters;
+    double bvhBuildTime = 0;
+};
+
+#endif //__RENDER_STATS_H__
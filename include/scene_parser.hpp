@@ -17,6 +17,8 @@ class Mesh;
 class Curve;
 class Surface;
 class Texture;
+class EmitterSampler;
+class EnvironmentMap;
 
 #define MAX_PARSER_TOKEN_LENGTH 1024
 
@@ -36,6 +38,14 @@ public:
         return background_color;
     }
 
+    //what a ray leaving the scene in direction d (unit) finds: the environment map if there is one, else the color
+    Vector3f getBackground(const Vector3f &d) const;
+
+    //the HDR environment of the Background section, nullptr if it has none
+    EnvironmentMap *getEnvironment() const {
+        return environment;
+    }
+
     int getNumLights() const {
         return num_lights;
     }
@@ -62,10 +72,16 @@ public:
         return group;
     }
 
+    //the emissive spheres and triangles of the group, collected once the file is parsed
+    EmitterSampler *getEmitters() const {
+        return emitters;
+    }
+
 private:
 
     void parseFile();
     void parsePerspectiveCamera();
+    void parseOrthographicCamera();
     void parseBackground();
     void parseLights();
     Light *parsePointLight();
@@ -82,18 +98,21 @@ private:
     Triangle *parseTriangle();
     Mesh *parseTriangleMesh();
     Transform *parseTransform();
-    Curve *parseCurves();
+    Object3D *parseCurves();
     Curve *parseBezierCurve();
     Curve *parseBSplineCurve();
     Curve *parseCatmullRomCurve();
     Surface *parseBezierSurface();
     Surface *parseBSplineSurface();
+    float parseTessellation(char token[MAX_PARSER_TOKEN_LENGTH]);
     void parseTextures();
     Texture *parseTexture();
 
     int getToken(char token[MAX_PARSER_TOKEN_LENGTH]);
 
     Vector3f readVector3f();
+    void readVector3fs(std::vector<Vector3f> &list);
+    void readFloats(std::vector<float> &list);
 
     float readFloat();
     int readInt();
@@ -107,8 +126,12 @@ private:
     std::vector<Material *> materials;
     Material *current_material;
     Group *group;
+    EmitterSampler *emitters;
+    EnvironmentMap *environment;
     int num_curves;
     std::vector<Curve *> curves;
+    //tessellate tolerance of the curve being parsed, 0: traced exactly
+    float curve_tolerance;
     int num_textures;
     std::vector<Texture *> textures;
 };
@@ -8,8 +8,8 @@
 
 class Material;
 class Group;
-class RgbImage;
 class SceneParser;
+class Film;
 class SPPMIntegrator {
 public:
     SPPMIntegrator() = default;
@@ -23,7 +23,8 @@ public:
         photonMap->reserve(photonCount);
     }
 
-    void render(const SceneParser& scene, RgbImage *&image);
+    //the radiance estimates go into film, with the first hits and the direct/indirect split as AOVs
+    void render(const SceneParser& scene, Film& film);
 
 private:
     int photonCount;                   //单pass有效光子数
@@ -0,0 +1,65 @@
+#ifndef __TESSELLATION_H__
+#define __TESSELLATION_H__
+
+#include <algorithm>
+#include <vector>
+#include "mesh.hpp"
+
+//Adaptive tessellation of curves and surfaces into meshes
+//the parameter range is cut at the given breakpoints (knots, Bezier segment ends), every interval
+//is then halved until the chord is within the tolerance of the geometry (object space distance,
+//measured at 1/4, 1/2 and 3/4 of the interval), so flat parts stay coarse and curved parts fine
+//surfaces refine u and v separately against several isolines and use the tensor grid of both:
+//neighbouring quads always share their edges, no cracks
+//the grid becomes an ordinary Mesh (indexed triangles and BVH), as fast to trace as any obj
+
+namespace tessellation {
+
+//an interval is halved at most this many times
+const int MAX_DEPTH = 12;
+
+//error(a, b): distance of the chord over [a, b] from the geometry
+//appends a and the interior points of [a, b] that refinement needs, b is left to the next interval
+template<typename Error>
+void refine(double a, double b, float tolerance, const Error& error, std::vector<double>& out, int depth = 0) {
+    if(depth >= MAX_DEPTH || error(a, b) <= tolerance) {
+        out.push_back(a);
+        return;
+    }
+    double m = 0.5 * (a + b);
+    refine(a, m, tolerance, error, out, depth + 1);
+    refine(m, b, tolerance, error, out, depth + 1);
+}
+
+//refines every interval between consecutive breakpoints (sorted, duplicates allowed)
+template<typename Error>
+std::vector<double> refineAll(const std::vector<double>& breakpoints, float tolerance, const Error& error) {
+    std::vector<double> out;
+    for(size_t i = 0; i + 1 < breakpoints.size(); i++) {
+        if(breakpoints[i + 1] > breakpoints[i]) refine(breakpoints[i], breakpoints[i + 1], tolerance, error, out);
+    }
+    if(!breakpoints.empty()) out.push_back(breakpoints.back());
+    return out;
+}
+
+//largest distance of f at 1/4, 1/2, 3/4 of [a, b] from the linear interpolation of f(a) and f(b)
+//f(t) returns a Vector3f
+template<typename F>
+float chordError(const F& f, double a, double b) {
+    Vector3f pa = f(a), pb = f(b);
+    float error = 0;
+    for(int i = 1; i < 4; i++) {
+        float s = i / 4.0f;
+        error = std::max(error, (f(a + s * (b - a)) - ((1 - s) * pa + s * pb)).length());
+    }
+    return error;
+}
+
+//rows x cols grid of vertices (row major) to a mesh, every quad is split along its shorter diagonal
+//and triangles without area (poles of revolution surfaces, collapsed patch edges) are dropped
+Mesh* gridMesh(int rows, int cols, std::vector<Vector3f>& points, std::vector<Vector3f>& normals,
+               std::vector<Vector2f>& texCoords, Material* material);
+
+}
+
+#endif //__TESSELLATION_H__
@@ -9,6 +9,8 @@
 #include <vector>
 
 #include "image.hpp"
+#include "texture_cache.hpp"
+#include "utils.hpp"
 
 class Texture {
     public:
@@ -28,6 +30,7 @@ class Texture {
 
 class EmpiricalImageTexture : public Texture {
 public:
+    //images are shared through the TextureCache and only decoded when first sampled
     EmpiricalImageTexture(const std::string &imagePath) {
         // default image: diffuse
         diffuseTexture = loadImage(imagePath);
@@ -52,29 +55,29 @@ public:
 
     bool loadSpecularTexture(const std::string &imagePath) {
         //specular texture should be gray
-        specularTexture = new GrayImage(imagePath);
+        specularTexture = loadGrayImage(imagePath);
         return true;
     }
 
     bool loadSpecularHighlightTexture(const std::string &imagePath) {
         //specular highlight texture should be gray
-        specularHighlightTexture = new GrayImage(imagePath);
+        specularHighlightTexture = loadGrayImage(imagePath);
         return true;
     }
 
     bool loadBumpTexture(const std::string &imagePath, const double& bumpMultiplier) {
-        bumpTexture = new GrayImage(imagePath);
+        bumpTexture = loadGrayImage(imagePath);
         this->bumpMultiplier = bumpMultiplier;
         return true;
     }
 
     bool loadAlphaTexture(const std::string &imagePath) {
-        alphaTexture = new GrayImage(imagePath);
+        alphaTexture = loadGrayImage(imagePath);
         return true;
     }
 
     bool loadDisplacementTexture(const std::string &imagePath) { 
-        displacementTexture = new GrayImage(imagePath);
+        displacementTexture = loadGrayImage(imagePath);
         //TODO: edit mesh in obj file?
         return true;
     }
@@ -83,7 +86,7 @@ public:
         //std::cout<<"get color: "<<uv.x()<<" "<<uv.y()<<std::endl;
         
         //bilinear interpolation
-        RgbImage* img = static_cast<RgbImage*>(diffuseTexture);
+        CachedImage* img = diffuseTexture;
         float u = uv.x() * img->Width() - 0.5;
         float v = (1 - uv.y()) * img->Height() - 0.5;
 
@@ -99,14 +102,6 @@ public:
         Vector3f color1 = lerp(color10, color11, v - floor(v));
         Vector3f color = lerp(color0, color1, u - floor(u));
         return color/255.0;
-        
-        /* int x = uv.x() * diffuseTexture->Width();
-        int y = (1 - uv.y()) * diffuseTexture->Height();
-        while(x < 0) x += diffuseTexture->Width();
-        while(y < 0) y += diffuseTexture->Height();
-        x %= diffuseTexture->Width();
-        y %= diffuseTexture->Height();
-        return static_cast<RgbImage*>(diffuseTexture)->GetPixel(x, y)/255.0; */
     }
 
     float getSpecular(const Vector2f &uv) const {
@@ -116,11 +111,7 @@ public:
         while(y < 0) y += specularTexture->Height();
         x %= specularTexture->Width();
         y %= specularTexture->Height();
-        if(dynamic_cast<RgbImage*>(specularTexture)) {
-            return static_cast<RgbImage*>(specularTexture)->GetPixel(x, y).x()/255.0;
-        } else {
-            return static_cast<GrayImage*>(specularTexture)->GetPixel(x, y)/255.0;
-        }
+        return specularTexture->GetGray(x, y)/255.0;
     }
 
     Vector3f getNormal(const Vector2f &uv) const override {
@@ -128,9 +119,8 @@ public:
         return Vector3f::ZERO;
     }
     std::pair<float, float> getBump(const Vector2f &uv) {
-        GrayImage* img = dynamic_cast<GrayImage*>(bumpTexture);
+        CachedImage* img = bumpTexture;
         if(!img){
-            //std::cout<<"bump texture is not gray image"<<std::endl;
             return std::make_pair(0, 0);
         }
         float u = uv.x() * img->Width() - 0.5;
@@ -140,10 +130,10 @@ public:
         Vector2f uv01 = mapToImage(Vector2f(floor(u), ceil(v)), img->Width(), img->Height());
         Vector2f uv10 = mapToImage(Vector2f(ceil(u), floor(v)), img->Width(), img->Height());
         Vector2f uv11 = mapToImage(Vector2f(ceil(u), ceil(v)), img->Width(), img->Height());
-        float bump00 = img->GetPixel(uv00.x(), uv00.y());
-        float bump01 = img->GetPixel(uv01.x(), uv01.y());
-        float bump10 = img->GetPixel(uv10.x(), uv10.y());
-        float bump11 = img->GetPixel(uv11.x(), uv11.y());
+        float bump00 = img->GetGray(uv00.x(), uv00.y());
+        float bump01 = img->GetGray(uv01.x(), uv01.y());
+        float bump10 = img->GetGray(uv10.x(), uv10.y());
+        float bump11 = img->GetGray(uv11.x(), uv11.y());
         float bump0 = bump00 * (1 - (v - floor(v))) + bump01 * (v - floor(v));
         float bump1 = bump10 * (1 - (v - floor(v))) + bump11 * (v - floor(v));
         float bump = bump0 * (1 - (u - floor(u))) + bump1 * (u - floor(u));
@@ -153,20 +143,20 @@ public:
     bool hasSpecular() const { return specularTexture != nullptr; }
 
 private:
-    Image* loadImage(const std::string &imagePath) {
-        std::cout<<"load image: "<<imagePath<<std::endl;
-        Image* image = new RgbImage(imagePath);
-        assert(image!=nullptr);
-        return image;
+    CachedImage* loadImage(const std::string &imagePath) {
+        return TextureCache::instance().acquire(imagePath, 3);
     }
-    Image* ambientTexture;
-    Image* diffuseTexture;
-    Image* specularTexture;
-    Image* specularHighlightTexture;
-    Image* bumpTexture;
+    CachedImage* loadGrayImage(const std::string &imagePath) {
+        return TextureCache::instance().acquire(imagePath, 1);
+    }
+    CachedImage* ambientTexture;
+    CachedImage* diffuseTexture;
+    CachedImage* specularTexture;
+    CachedImage* specularHighlightTexture;
+    CachedImage* bumpTexture;
     double bumpMultiplier;
-    Image* alphaTexture;
-    Image* displacementTexture;
+    CachedImage* alphaTexture;
+    CachedImage* displacementTexture;
 };
 
 class PBRTexture : public Texture {
@@ -174,30 +164,30 @@ public:
     PBRTexture() = delete;
     PBRTexture(const std::string &imagePath) {
         //default image: roughness
-        roughnessTexture = new GrayImage(imagePath);
+        roughnessTexture = TextureCache::instance().acquire(imagePath, 1);
         metallicTexture = nullptr;
         sheenTexture = nullptr;
         normalTexture = nullptr;
         emissiveTexture = nullptr;
     }
     bool loadEmissiveTexture(const std::string &imagePath) {
-        emissiveTexture = new RgbImage(imagePath);
+        emissiveTexture = TextureCache::instance().acquire(imagePath, 3);
         return true;
     }
     bool loadRoughnessTexture(const std::string &imagePath) {
-        roughnessTexture = new GrayImage(imagePath);
+        roughnessTexture = TextureCache::instance().acquire(imagePath, 1);
         return true;
     }
     bool loadMetallicTexture(const std::string &imagePath) {
-        metallicTexture = new GrayImage(imagePath);
+        metallicTexture = TextureCache::instance().acquire(imagePath, 1);
         return true;
     }
     bool loadSheenTexture(const std::string &imagePath) {
-        sheenTexture = new GrayImage(imagePath);
+        sheenTexture = TextureCache::instance().acquire(imagePath, 1);
         return true;
     }
     bool loadNormalTexture(const std::string &imagePath) {
-        normalTexture = new RgbImage(imagePath);
+        normalTexture = TextureCache::instance().acquire(imagePath, 3);
         return true;
     }
 
@@ -208,6 +198,10 @@ public:
 
     Vector3f getNormal(const Vector2f &uv) const override {
         //TODO: normal map
+        //normal maps are rgb, the gradient below is only meant for gray height maps
+        if(!normalTexture || normalTexture->Channels() != 1){
+            return Vector3f::ZERO;
+        }
         int x = uv.x() * normalTexture->Width();
         int y = (1 - uv.y()) * normalTexture->Height();
         while(x < 0) x += normalTexture->Width();
@@ -215,27 +209,22 @@ public:
         x%=normalTexture->Width();
         y%=normalTexture->Height();
         
-        GrayImage* img = dynamic_cast<GrayImage*>(normalTexture);
-        if(!img){
-            std::cout<<"bump texture is not gray image"<<std::endl;
-            return Vector3f::ZERO;
-        }
         int x1 = (x + 1) % normalTexture->Width();
         int y1 = (y + 1) % normalTexture->Height();
         int x_ = (x - 1 + normalTexture->Width()) % normalTexture->Width();
         int y_ = (y - 1 + normalTexture->Height()) % normalTexture->Height();
         
-        float dx = img->GetPixel(x1, y) - img->GetPixel(x_, y);
-        float dy = img->GetPixel(x, y1) - img->GetPixel(x, y_);
+        float dx = normalTexture->GetGray(x1, y) - normalTexture->GetGray(x_, y);
+        float dy = normalTexture->GetGray(x, y1) - normalTexture->GetGray(x, y_);
         return Vector3f(dx, dy, 1);
     }
 
 private:
-    Image* emissiveTexture;
-    Image* roughnessTexture;
-    Image* metallicTexture;
-    Image* sheenTexture;
-    Image* normalTexture;
+    CachedImage* emissiveTexture;
+    CachedImage* roughnessTexture;
+    CachedImage* metallicTexture;
+    CachedImage* sheenTexture;
+    CachedImage* normalTexture;
 };
 
 class ProceduralTexture : public Texture {
@@ -0,0 +1,121 @@
+#ifndef __TEXTURE_CACHE_H__
+#define __TEXTURE_CACHE_H__
+
+#include <vecmath.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//Global texture cache
+//textures are keyed by path and decoded on first access, not when the MTL is parsed
+//texels are stored as 8-bit fixed-size tiles, least-recently-used tiles are evicted
+//once the resident size exceeds the budget (--texture-cache <MB>)
+//the first miss decodes the whole image once and writes it tile by tile into an unlinked temporary file,
+//later misses copy the tile from that file instead of decoding again
+//every thread keeps a small direct-mapped table of tiles it touched recently,
+//so most lookups never take the shared lock; those tiles stay alive after eviction,
+//so the budget reserves room for a full table per rendering thread
+
+class TextureCache;
+
+class CachedImage {
+public:
+    friend class TextureCache;
+
+    int Width();
+    int Height();
+    int Channels() const { return channels; }
+    const std::string& Path() const { return path; }
+    ~CachedImage();
+
+    //texel value in [0, 255], gray images are replicated to rgb
+    Vector3f GetPixel(int x, int y);
+    //first channel in [0, 255]
+    float GetGray(int x, int y);
+
+private:
+    CachedImage(int id, const std::string& path, int channels) : id(id), path(path), channels(channels) {}
+    void loadInfo();
+    const unsigned char* texel(int x, int y);
+
+    int id;
+    std::string path;
+    int channels;
+    int width = 0;
+    int height = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    std::once_flag infoFlag;
+    std::mutex decodeMutex;
+    //resident tiles, guarded by TextureCache::mutex
+    std::vector<std::shared_ptr<const std::vector<unsigned char>>> tiles;
+    std::vector<std::list<std::pair<int, int>>::iterator> lruPosition;
+    //tiled backing file, mapped read-only, guarded by decodeMutex
+    //nullptr before the first decode or if the file could not be written
+    const unsigned char* backing = nullptr;
+    size_t backingSize = 0;
+    std::vector<size_t> tileOffsets;
+};
+
+class TextureCache {
+public:
+    static const int TILE_SIZE = 64;
+
+    static TextureCache& instance();
+
+    //returns the shared image for (path, channels), the file is not touched until first access
+    CachedImage* acquire(const std::string& path, int channels);
+
+    void setBudget(size_t bytes);
+    size_t getBudget() const { return budget; }
+
+    void printStats();
+
+    //slow path: returns a resident tile, decoding the image if necessary
+    std::shared_ptr<const std::vector<unsigned char>> fetchTile(CachedImage* image, int tile);
+
+    //every counter is written by its own thread only (a relaxed load and store, no locked add),
+    //printStats may read them while the threads are still rendering
+    struct ThreadStats {
+        std::atomic<uint64_t> lookups{0};
+        std::atomic<uint64_t> localHits{0};
+        static void add(std::atomic<uint64_t>& counter) {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    };
+    //registers per-thread counters so they can be summed by printStats
+    std::shared_ptr<ThreadStats> registerThread();
+
+private:
+    TextureCache() = default;
+    void touch(CachedImage* image, int tile);
+    void insertTile(CachedImage* image, int tile, std::vector<unsigned char>&& texels, bool evict);
+    void evictOne();
+    //bytes available to the shared tiles once the thread-local tables are accounted for
+    size_t sharedBudget() const;
+    std::vector<std::vector<unsigned char>> decode(CachedImage* image);
+    bool writeBacking(CachedImage* image, const std::vector<std::vector<unsigned char>>& decoded);
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, int>, std::unique_ptr<CachedImage>> images;
+    std::vector<CachedImage*> imageList;
+    //front: most recently used
+    std::list<std::pair<int, int>> lru;
+    size_t budget = size_t(512) << 20;
+    size_t resident = 0;
+    size_t peakResident = 0;
+    uint64_t sharedHits = 0;
+    uint64_t misses = 0;
+    uint64_t decodes = 0;
+    uint64_t backingReads = 0;
+    //worst-case bytes pinned by the thread-local tables of the registered threads
+    size_t pinnedReserve = 0;
+    uint64_t evictions = 0;
+    std::vector<std::shared_ptr<ThreadStats>> threadStats;
+};
+
+#endif //__TEXTURE_CACHE_H__
@@ -0,0 +1,33 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+
+#include "utils.hpp"
+
+class Film;
+class RgbImage;
+
+//Output transform: the last post stage, from the float film to the 8 bit image
+//exposure (--exposure, in stops) scales the linear color, the operator (--tonemap) maps it into [0, 1]:
+//clip (hard clamp), Reinhard (L / (1 + L) on the luminance, hue kept) or ACES filmic (Narkowicz' fit)
+//and the result is sRGB encoded through a table of LUT_SIZE entries built once, no pow per pixel
+//rows are mapped in parallel, the per channel loops over a row are vectorized
+class ToneMapper {
+public:
+    static const int LUT_SIZE = 4096;
+
+    ToneMapper(ToneMapType type, float exposure);
+
+    //maps n linear rgb triples to display values in [0, 1] in place
+    void map(float* rgb, int n) const;
+    //display value in [0, 1] to an 8 bit sRGB code
+    unsigned char encode(float v) const { return lut[int(v * (LUT_SIZE - 1) + 0.5f)]; }
+    //the whole film, flipped so the image's first row is the top one
+    RgbImage* apply(const Film& film) const;
+
+private:
+    ToneMapType type;
+    float scale;
+    unsigned char lut[LUT_SIZE];
+};
+
+#endif //__TONEMAP_H__
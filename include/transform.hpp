@@ -37,6 +37,26 @@ public:
         return inter;
     }
 
+    int intersectPacket(const RayPacket &packet, Hit *hits, float tmin) override {
+        RayPacket tr;
+        for (int m = packet.mask; m != 0; m &= m - 1) {
+            int lane = firstLane(m);
+            tr.set(lane, Ray(transformPoint(transform, Vector3f(packet.o[0][lane], packet.o[1][lane], packet.o[2][lane])),
+                             transformDirection(transform, Vector3f(packet.d[0][lane], packet.d[1][lane], packet.d[2][lane]))));
+        }
+        int hitMask = o->intersectPacket(tr, hits, tmin);
+        for (int m = hitMask; m != 0; m &= m - 1) {
+            Hit &h = hits[firstLane(m)];
+            h.set(h.getT(), h.getMaterial(), transformDirection(transform.transposed(), h.getNormal()).normalized(),
+                  h.getTexCoord());
+        }
+        return hitMask;
+    }
+
+    void collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) override {
+        o->collectEmitters(toWorld * transform.inverse(), shapes);
+    }
+
 protected:
     Object3D *o; //un-transformed object
     Matrix4f transform;
@@ -2,6 +2,7 @@
 #define TRIANGLE_H
 
 #include "object3d.hpp"
+#include "emitter.hpp"
 #include <vecmath.h>
 #include <cmath>
 #include <iostream>
@@ -41,6 +42,11 @@ public:
 		_normals[2] = nc;
 	}
 
+	//hit from both sides instead of only from the front (counterclockwise) side
+	void setTwoSided(bool twoSided){
+		this->twoSided = twoSided;
+	}
+
 	bool intersect( const Ray& ray,  Hit& hit , float tmin) override {
 		Vector3f vertices[3] = {_vertices[0], _vertices[1], _vertices[2]};
 		//bump map before intersect
@@ -62,26 +68,10 @@ public:
 
 
 		//a faster algorithm
-		//source: luuyiran
-		Vector3f origin = ray.getOrigin();
-		Vector3f direction = ray.getDirection();
 		Vector3f E1 = vertices[1] - vertices[0];
 		Vector3f E2 = vertices[2] - vertices[0];
-		Vector3f P = Vector3f::cross(direction, E2);
-		float det = Vector3f::dot(E1, P);
-		if(det < tmin ) return false;
-		float invdet = 1 / det;
-
-		Vector3f T = origin - _vertices[0];
-		float u = Vector3f::dot(T, P) * invdet;
-		if(u < 0 || u > 1) return false;
-
-		Vector3f Q = Vector3f::cross(T, E1);
-		float v = Vector3f::dot(direction, Q) * invdet;
-		if(v < 0 || u + v > 1) return false;
-
-		float t = Vector3f::dot(E2, Q) * invdet;
-		if(t < tmin || t >= hit.getT()) return false;
+		float t, u, v;
+		if(!intersect(_vertices[0], E1, E2, ray, tmin, hit.getT(), t, u, v, twoSided)) return false;
 
 		//set texcoord according to barycentric coordinates
 		Vector2f texCoord = Vector2f::ZERO;
@@ -115,10 +105,43 @@ public:
 		hit.set(t, material, hitNormal, texCoord);
 		return true;
 	}
+
+	//Möller–Trumbore with the edges E1 = b - a, E2 = c - a given, t in [tmin, tmax) and the barycentrics on a hit
+	//shared with TriangleRef, whose corners live in the mesh buffers
+	//back faces are culled unless twoSided (open surfaces such as tessellated patches)
+	//source: luuyiran
+	static bool intersect(const Vector3f& a, const Vector3f& E1, const Vector3f& E2, const Ray& ray,
+						  float tmin, float tmax, float& t, float& u, float& v, bool twoSided = false){
+		const Vector3f& origin = ray.getOrigin();
+		const Vector3f& direction = ray.getDirection();
+		Vector3f P = Vector3f::cross(direction, E2);
+		float det = Vector3f::dot(E1, P);
+		if(twoSided ? det == 0 : det < tmin) return false;
+		float invdet = 1 / det;
+
+		Vector3f T = origin - a;
+		u = Vector3f::dot(T, P) * invdet;
+		if(u < 0 || u > 1) return false;
+
+		Vector3f Q = Vector3f::cross(T, E1);
+		v = Vector3f::dot(direction, Q) * invdet;
+		if(v < 0 || u + v > 1) return false;
+
+		t = Vector3f::dot(E2, Q) * invdet;
+		return t >= tmin && t < tmax;
+	}
+
+	void collectEmitters(const Matrix4f& toWorld, std::vector<EmissiveShape>& shapes) override {
+		if(!(luminance(emissionOf(material)) > 0)) return;
+		shapes.push_back(EmissiveShape::triangle(transformedPoint(toWorld, _vertices[0]), transformedPoint(toWorld, _vertices[1]),
+												 transformedPoint(toWorld, _vertices[2]), material, twoSided));
+	}
+
 	Vector3f normal;
 	Vector3f _vertices[3];
 	Vector2f _texCoords[3];
 	Vector3f _normals[3];
+	bool twoSided = false;
 
 protected:
 };
@@ -12,6 +12,20 @@ const double EPS2 = 1e-12;
 
 extern bool smooth;
 extern bool useBVH;
+//texture cache budget in MB
+extern int textureCacheMB;
+//load/write the binary geometry cache next to obj files
+extern bool meshCache;
+//trace camera and shadow rays in packets of 8 (ray_packet.hpp)
+extern bool rayPackets;
+//guide the emission of SPPM photons towards the visible points (photon_guide.hpp)
+extern bool photonGuiding;
+//learn an SD-tree over passes and guide the diffuse bounces of the path tracer with it (path_guide.hpp), off by default
+extern bool pathGuiding;
+//keep the AOV layers (film.hpp) and write them with the float output
+extern bool writeAOVs;
+//iterations of the à-trous denoiser (denoiser.hpp), 0: off
+extern int denoiseIterations;
 
 enum BRDFType { DIFFUSE, SPECULAR, REFRACTION, EMISSION, SUBSURFACE, MEDIA, MICROFACET, EMPIRICAL, PBR, NONE };
 
@@ -33,6 +47,11 @@ extern SamplerType SAMPLER;
 enum FilterType { BOX, GAUSSIAN, MITCHELL, LANCZOS, NONE_FILTER };
 extern FilterType FILTER;
 
+enum ToneMapType { CLIP, REINHARD, ACES, NONE_TONEMAP };
+extern ToneMapType TONEMAP;
+//exposure of the output in stops (tonemap.hpp)
+extern float exposure;
+
 void parse_arg(int argc, char *argv[], int& width, int& height, int& samples, int& threads, int& depth, int& quality, std::string& input, std::string& output, bool& DOF, float& aperture, float& focus_length);
 
 inline double clamp(double x){ return x<0 ? 0 : x>1 ? 1 : x; }
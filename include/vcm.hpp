@@ -0,0 +1,140 @@
+#ifndef VCM_HPP
+#define VCM_HPP
+//vertex connection and merging (Georgiev et al. 2012), follow the structure of SmallVCM
+#include "bdpt.hpp"
+#include "emitter.hpp"
+#include "ray.hpp"
+#include "hit.hpp"
+#include <vecmath.h>
+#include <vector>
+
+class Camera;
+class Group;
+class SceneParser;
+class Film;
+struct AOVSample;
+
+//uniform hash grid over points for fixed radius queries, rebuilt for every iteration
+//cells are 2 * radius wide, so the sphere around a query point touches at most 2 x 2 x 2 of them;
+//the cells are hashed into as many buckets as there are points, a counting sort puts every bucket's
+//points next to each other
+class HashGrid {
+public:
+    void build(const std::vector<Vector3f>& points, float radius);
+    //calls visit(i) for every point i closer than the radius to p
+    template<typename Visit>
+    void query(const Vector3f& p, Visit visit) const;
+
+private:
+    int bucket(int x, int y, int z) const {
+        unsigned int h = (unsigned int)(x * 73856093) ^ (unsigned int)(y * 19349663) ^ (unsigned int)(z * 83492791);
+        return h % (unsigned int)bucketEnds.size();
+    }
+
+    const std::vector<Vector3f>* points = nullptr;
+    Vector3f boundsMin;
+    float radius2 = 0, invCellSize = 0;
+    //indices of the points, grouped by bucket; bucket b holds [bucketEnds[b - 1], bucketEnds[b])
+    std::vector<int> indices;
+    std::vector<int> bucketEnds;
+};
+
+template<typename Visit>
+void HashGrid::query(const Vector3f& p, Visit visit) const {
+    if(indices.empty()) return;
+    //the cell of p and on each axis the neighbour on the side p is closer to
+    int cell[3], step[3];
+    for(int a = 0; a < 3; a++) {
+        float c = (p[a] - boundsMin[a]) * invCellSize;
+        cell[a] = int(std::floor(c));
+        step[a] = c - cell[a] < 0.5f ? -1 : 1;
+    }
+    int visited[8], count = 0;
+    for(int k = 0; k < 8; k++) {
+        int b = bucket(cell[0] + (k & 1 ? step[0] : 0), cell[1] + (k & 2 ? step[1] : 0), cell[2] + (k & 4 ? step[2] : 0));
+        //two of the cells may share a bucket
+        bool seen = false;
+        for(int i = 0; i < count; i++) seen |= visited[i] == b;
+        if(seen) continue;
+        visited[count++] = b;
+        for(int i = b > 0 ? bucketEnds[b - 1] : 0; i < bucketEnds[b]; i++) {
+            if(((*points)[indices[i]] - p).squaredLength() <= radius2) visit(indices[i]);
+        }
+    }
+}
+
+//every iteration traces one light subpath per pixel from the emitters or the lights (LightSources), splats their
+//connections to the camera (light tracing) and puts their vertices into a HashGrid; then one camera subpath per
+//pixel hits emitters, connects to a new point on the emitters or a light and to the vertices of one light subpath
+//(as BDPT) and merges with the light vertices
+//within the merging radius (as photon mapping, the radius shrinks as in SPPM)
+//all these estimators are weighted against each other by the balance heuristic, the weights are carried
+//along the subpaths as the three partial sums dVCM, dVC, dVM of SmallVCM
+class VCMIntegrator {
+public:
+    //maxDepth: maximal number of bounces; radiusFactor: initial merging radius relative to the radius of the
+    //visible part of the scene; alpha: radius reduction as in SPPM (r_i = r_1 / i^((1 - alpha) / 2))
+    VCMIntegrator(const SceneParser& scene, int maxDepth, float radiusFactor = 0.01f, float alpha = 0.75f);
+
+    void render(Film& film, int iterations);
+
+private:
+    //state of a subpath between two vertices
+    struct SubpathState {
+        //the ray leaving the last vertex
+        Vector3f origin, direction = Vector3f(0, 0, 1);
+        Vector3f throughput;
+        //number of segments so far
+        int length = 0;
+        float dVCM = 0, dVC = 0, dVM = 0;
+        //a light subpath from a distant light: its first segment has no distance to weigh
+        bool infiniteLight = false;
+    };
+
+    //stored vertex of a light subpath
+    struct LightVertex {
+        Vector3f p;
+        //towards the previous vertex
+        Vector3f wo;
+        VertexBSDF bsdf;
+        Vector3f throughput;
+        int length;
+        float dVCM, dVC, dVM;
+    };
+
+    bool lightSample(PathSampler& sampler, SubpathState& state) const;
+    //the next hit of state's ray: rewrites the partial sums for it, false on a miss
+    bool advance(SubpathState& state, Hit& hit, Vector3f& p) const;
+    //samples the next direction at a hit, false if the path ends
+    bool scatter(const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, PathSampler& sampler, SubpathState& state) const;
+    void traceLightPath(PathSampler& sampler, std::vector<LightVertex>& vertices, Film& film) const;
+    //aov (may be nullptr) receives the first hit and the split into direct and indirect light
+    Vector3f traceCameraPath(float x, float y, PathSampler& sampler, const LightVertex* lightBegin, const LightVertex* lightEnd, AOVSample* aov) const;
+
+    Vector3f emitted(const SubpathState& state, const Material* material, const Vector3f& n) const;
+    Vector3f directIllumination(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, PathSampler& sampler) const;
+    Vector3f connectVertices(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, const LightVertex& vertex) const;
+    void connectToCamera(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, Film& film) const;
+
+    const SceneParser& scene;
+    Camera* camera;
+    Group* group;
+    LightSources sources;
+    const EmitterSampler& emitters;
+    int maxDepth;
+    float radiusFactor, alpha;
+
+    //of the current iteration
+    float radius = 0;
+    //light subpaths of the iteration (one per pixel)
+    float lightPaths = 0;
+    //weight of merging relative to connecting and back, and the density estimation kernel 1 / (pi r^2 lightPaths)
+    float vmWeight = 0, vcWeight = 0, vmNormalization = 0;
+    std::vector<LightVertex> lightVertices;
+    //light vertices of path i: [pathEnds[i - 1], pathEnds[i])
+    std::vector<int> pathEnds;
+    std::vector<Vector3f> lightPoints;
+    HashGrid grid;
+};
+
+#endif //VCM_HPP
@@ -0,0 +1,53 @@
+#ifndef VRPT_HPP
+#define VRPT_HPP
+//volumetric path tracing with participating media (medium.hpp), follow the structure of PBRT-v3's VolPathIntegrator
+#include "bdpt.hpp"
+#include "medium.hpp"
+#include "emitter.hpp"
+#include <vecmath.h>
+
+class Ray;
+class Camera;
+class Group;
+class Material;
+class SceneParser;
+class Film;
+struct AOVSample;
+
+//the path tracer of radiance (render.cpp) with next event estimation at every surface and medium vertex: a point on
+//the emitters (emitter.hpp) or a light of the Lights section, chosen as the light paths of BDPT (LightSources), and a
+//direction of the environment map; emitters and environment are weighted against hitting them by the power
+//heuristic, the lights cannot be hit
+//a path knows the medium it is in: MEDIA boundaries are index matched and only switch it, SUBSURFACE boundaries are
+//glass (VertexBSDF) and switch it when the ray refracts; inside a medium the free flight (Medium::sample) decides
+//between scattering (Henyey-Greenstein) and reaching the next surface, shadow rays pass MEDIA boundaries and take the
+//transmittance of the media on the way (ratio tracking in grids), everything else blocks them
+//no Russian roulette up to maxDepth scattering events (surfaces and media), then on the throughput; walks in dense
+//media (subsurface scattering) need many events, so the hard cut is at 1024
+class VolumetricPathIntegrator {
+public:
+    //maxDepth: scattering events before Russian roulette
+    VolumetricPathIntegrator(const SceneParser& scene, int maxDepth);
+
+    void render(Film& film, int pixelSamples) const;
+    //radiance along a camera ray; aov (may be nullptr) receives the first hit and the split into direct and indirect light
+    Vector3f Li(const Ray& ray, PathSampler& sampler, AOVSample* aov = nullptr) const;
+
+private:
+    //counts a scattering event, false if the path ends (Russian roulette divides beta by the survival probability)
+    bool survive(int& events, Vector3f& beta, PathSampler& sampler) const;
+    //light arriving at p from the emitters or a light and from the environment, times the bsdf (nullptr: the phase
+    //function of medium)
+    Vector3f sampleLight(const Vector3f& p, const Vector3f& wo, const VertexBSDF* bsdf, const Medium* medium, PathSampler& sampler) const;
+    //transmittance from a to b for a ray starting in medium, zero if something other than a MEDIA boundary is in the way
+    Vector3f transmittance(Vector3f a, const Vector3f& b, const Medium* medium, PathSampler& sampler) const;
+
+    const SceneParser& scene;
+    Camera* camera;
+    Group* group;
+    LightSources sources;
+    const EmitterSampler& emitters;
+    int maxDepth;
+};
+
+#endif //VRPT_HPP
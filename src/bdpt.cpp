@@ -0,0 +1,466 @@
+#include "../include/bdpt.hpp"
+#include "../include/utils.hpp"
+#include "../include/group.hpp"
+#include "../include/scene_parser.hpp"
+#include "../include/camera.hpp"
+#include "../include/material.hpp"
+#include "../include/light.hpp"
+#include "../include/film.hpp"
+#include "../include/render_stats.hpp"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+
+//pdf per solid angle at from towards to as pdf per area at to
+static float toArea(float pdf, const PathVertex& from, const PathVertex& to) {
+    Vector3f w = to.p - from.p;
+    float d2 = w.squaredLength();
+    if(d2 == 0) return 0;
+    if(to.onSurface()) pdf *= std::fabs(Vector3f::dot(to.n, w)) / std::sqrt(d2);
+    return pdf / d2;
+}
+
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+//delta vertices have pdf 0 in both directions, they cancel in the ratios
+static float remap0(float pdf) {
+    return pdf != 0 ? pdf : 1;
+}
+
+VertexBSDF::VertexBSDF(const Hit& hit) {
+    n = hit.getNormal().normalized();
+    if(DiscreteMaterial* m = dynamic_cast<DiscreteMaterial*>(hit.getMaterial())) {
+        color = m->getDiffuseColor();
+        switch(m->getMaterialType()) {
+            case BRDFType::DIFFUSE: lobe = LAMBERT; break;
+            case BRDFType::SPECULAR: lobe = MIRROR; break;
+            case BRDFType::EMISSION: lobe = NONE; break;
+            default: lobe = GLASS; break;
+        }
+    } else if(EmpiricalMaterial* m = dynamic_cast<EmpiricalMaterial*>(hit.getMaterial())) {
+        color = m->hasTexture() ? m->getDiffuseColor(hit.getTexCoord()) : m->getDiffuseColor();
+        switch(m->getMaterialType()) {
+            case BRDFType::REFRACTION: lobe = GLASS; ior = m->getIOR(); break;
+            case BRDFType::EMISSION: lobe = NONE; break;
+            default: lobe = LAMBERT; break;
+        }
+    }
+}
+
+Vector3f VertexBSDF::f(const Vector3f& wo, const Vector3f& wi) const {
+    if(lobe != LAMBERT || Vector3f::dot(wo, n) * Vector3f::dot(wi, n) <= 0) return Vector3f::ZERO;
+    return color / M_PI;
+}
+
+float VertexBSDF::pdf(const Vector3f& wo, const Vector3f& wi) const {
+    if(lobe != LAMBERT) return 0;
+    float cosine = Vector3f::dot(wi, n);
+    if(Vector3f::dot(wo, n) * cosine <= 0) return 0;
+    return std::fabs(cosine) / M_PI;
+}
+
+Vector3f VertexBSDF::sample(const Vector3f& wo, PathSampler& sampler, Vector3f& wi, float& pdf) const {
+    //normal on the side of wo
+    Vector3f nl = Vector3f::dot(wo, n) > 0 ? n : -n;
+    if(lobe == LAMBERT) {
+        float u1 = sampler.next(), u2 = sampler.next();
+        wi = cosineDirection(nl, u1, u2);
+        pdf = Vector3f::dot(wi, nl) / M_PI;
+        return pdf > 0 ? color : Vector3f::ZERO;
+    }
+    Vector3f d = -wo;
+    Vector3f reflection = d - n * 2 * Vector3f::dot(n, d);
+    if(lobe == MIRROR) {
+        wi = reflection;
+        pdf = 1;
+        return color;
+    }
+    if(lobe == GLASS) {
+        //as in radiance, with the lobe picked by its Fresnel weight
+        bool into = Vector3f::dot(n, nl) > 0;
+        float nnt = into ? 1 / ior : ior, ddn = Vector3f::dot(d, nl), cos2t = 1 - nnt * nnt * (1 - ddn * ddn);
+        if(cos2t < 0) {
+            wi = reflection;
+            pdf = 1;
+            return color;
+        }
+        Vector3f refraction = (d * nnt - n * ((into ? 1 : -1) * (ddn * nnt + std::sqrt(cos2t)))).normalized();
+        float a = ior - 1, b = ior + 1, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refraction, n));
+        float Re = R0 + (1 - R0) * c * c * c * c * c;
+        if(sampler.next() < Re) {
+            wi = reflection;
+            pdf = Re;
+        } else {
+            wi = refraction;
+            pdf = 1 - Re;
+        }
+        return color;
+    }
+    return Vector3f::ZERO;
+}
+
+//the lights the bidirectional renderers can start paths on
+static std::vector<Light*> emittingLights(const SceneParser& scene) {
+    std::vector<Light*> lights;
+    for(Light* light : scene.getLights()) {
+        if(light->type() != Light::NONE) lights.push_back(light);
+    }
+    return lights;
+}
+
+LightSources::LightSources(const SceneParser& scene) : sceneRadius(visibleRadius(scene.getCamera(), scene.getGroup(), &sceneCenter)),
+        emitters(*scene.getEmitters()), lights(emittingLights(scene), sceneRadius) {
+    float emitterPower = emitters.totalPower(), allPower = emitterPower + (lights.empty() ? 0 : lights.totalPower());
+    emitterShare = allPower > 0 ? emitterPower / allPower : lights.empty() ? 1 : 0;
+}
+
+const Light* LightSources::choose(float& u, float& pdf) const {
+    if(u < emitterShare) {
+        u = std::min(u / emitterShare, ONE_MINUS_EPSILON);
+        pdf = emitterShare;
+        return nullptr;
+    }
+    float pmf;
+    const Light* light = lights.samplePhoton(std::min((u - emitterShare) / (1 - emitterShare), ONE_MINUS_EPSILON), pmf);
+    pdf = (1 - emitterShare) * pmf;
+    return light;
+}
+
+BDPTIntegrator::BDPTIntegrator(const SceneParser& scene, int maxDepth) : scene(scene), camera(scene.getCamera()),
+        group(scene.getGroup()), sources(scene), emitters(sources.getEmitters()), maxDepth(maxDepth) {
+}
+
+void BDPTIntegrator::render(Film& film, int pixelSamples) const {
+    std::cout << "emitters: " << emitters.size() << ", lights: " << sources.numLights() << std::endl;
+    //every pixel traces pixelSamples light paths on average, the splats sum them
+    film.setSplatScale(1.0f / pixelSamples);
+    int tilesX = (film.getWidth() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesY = (film.getHeight() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesDone = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int tile = 0; tile < tilesX * tilesY; ++tile) {
+        int x0 = tile % tilesX * Film::TILE_SIZE, y0 = tile / tilesX * Film::TILE_SIZE;
+        int x1 = std::min(x0 + Film::TILE_SIZE, film.getWidth()), y1 = std::min(y0 + Film::TILE_SIZE, film.getHeight());
+        unsigned short Xi[3] = {0, (unsigned short)(tile >> 16), (unsigned short)(tile * tile * tile)};
+        RandomSampler sampler(Xi);
+        FilmTile filmTile = film.tile(x0, y0, x1, y1);
+        std::vector<Splat> splats;
+        //2 x 2 strata, jittered, as the path tracer
+        int perStratum = std::max(1, pixelSamples / 4);
+        for(int y = y0; y < y1; ++y) for(int x = x0; x < x1; ++x) {
+            for(int k = 0; k < pixelSamples; ++k) {
+                int sub = k / perStratum % 4;
+                float sx = x + (sub % 2 + sampler.next()) / 2, sy = y + (sub / 2 + sampler.next()) / 2;
+                splats.clear();
+                AOVSample aov;
+                Vector3f color = sample(sx, sy, sampler, splats, film.hasAOVs() ? &aov : nullptr);
+                filmTile.addSample(sx, sy, color, &aov);
+                for(const Splat& splat : splats) film.addSplat(splat.x, splat.y, splat.value);
+            }
+        }
+        film.merge(filmTile);
+        int done;
+#pragma omp atomic capture
+        done = ++tilesDone;
+        fprintf(stderr, "\rRendering %5.2f%%", 100. * done / (tilesX * tilesY));
+    }
+    std::cout << std::endl << "Rendering finished" << std::endl;
+}
+
+Vector3f BDPTIntegrator::sample(float x, float y, PathSampler& sampler, std::vector<Splat>& splats, AOVSample* aov) const {
+    std::vector<PathVertex> cameraPath, lightPath;
+    cameraSubpath(x, y, sampler, cameraPath);
+    lightSubpath(sampler, lightPath);
+    Vector3f L = Vector3f::ZERO, direct = Vector3f::ZERO;
+    int nCamera = cameraPath.size(), nLight = lightPath.size();
+    for(int t = 1; t <= nCamera; ++t) {
+        for(int s = 0; s <= nLight; ++s) {
+            int depth = s + t - 2;
+            if((s == 1 && t == 1) || depth < 0 || depth > maxDepth) continue;
+            float rasterX, rasterY;
+            Vector3f contribution = connect(lightPath, cameraPath, s, t, sampler, rasterX, rasterY);
+            if(isBlack(contribution)) continue;
+            if(t == 1) {
+                splats.push_back({rasterX, rasterY, contribution});
+                continue;
+            }
+            L += contribution;
+            if(depth <= 1) direct += contribution;
+        }
+    }
+    if(aov != nullptr) {
+        if(nCamera > 1 && cameraPath[1].type == PathVertex::SURFACE) {
+            aov->albedo = cameraPath[1].bsdf.color;
+            aov->normal = cameraPath[1].n;
+            aov->depth = (cameraPath[1].p - cameraPath[0].p).length();
+        }
+        aov->direct = direct;
+        aov->indirect = L - direct;
+    }
+    return L;
+}
+
+void BDPTIntegrator::cameraSubpath(float x, float y, PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices) const {
+    if(maxVertices < 0) maxVertices = maxDepth + 2;
+    if(maxVertices == 0) return;
+    path.reserve(maxVertices);
+    float lensU = sampler.next(), lensV = sampler.next();
+    Ray ray = camera->generateRay(Vector2f(x, y), Vector2f(lensU, lensV));
+    PathVertex v;
+    v.type = PathVertex::CAMERA;
+    v.p = ray.getOrigin();
+    v.n = camera->getDirection();
+    v.beta = Vector3f(1);
+    //a camera that cannot be connected to takes no part in the weights, as a delta vertex
+    v.delta = !camera->connectible();
+    path.push_back(v);
+    walk(ray, v.beta, camera->connectible() ? camera->directionPdf(ray.getDirection()) : 1, sampler, path, maxVertices, true);
+}
+
+void BDPTIntegrator::lightSubpath(PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices) const {
+    if(maxVertices < 0) maxVertices = maxDepth + 1;
+    if(sources.empty() || maxVertices == 0) return;
+    path.reserve(maxVertices);
+    float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+    float u3 = sampler.next(), u4 = sampler.next(), u5 = sampler.next();
+    float pdfChoice;
+    const Light* light = sources.choose(u0, pdfChoice);
+    PathVertex v;
+    v.type = PathVertex::LIGHT;
+    if(light != nullptr) {
+        LightSample e;
+        if(!light->sampleEmission(u1, u2, u3, u4, sources.sceneCenter, sources.sceneRadius, e)) return;
+        v.light = light;
+        v.p = e.p;
+        v.n = e.n;
+        v.Le = e.Le;
+        v.pdfFwd = pdfChoice * e.pdfPosition;
+        v.beta = v.Le / v.pdfFwd;
+        path.push_back(v);
+        walk(Ray(e.p, e.w), e.Le * (std::fabs(Vector3f::dot(e.w, e.n)) / (v.pdfFwd * e.pdfDirection)), e.pdfDirection, sampler, path, maxVertices, false);
+        //distant lights: the next vertex is found by the point on the disk, as in pdfLight
+        if(light->type() == Light::DELTA_DIRECTION && path.size() > 1) {
+            path[1].pdfFwd = e.pdfPosition * (path[1].onSurface() ? std::fabs(Vector3f::dot(path[1].n, e.w)) : 1);
+        }
+        return;
+    }
+    float pdfPos;
+    const EmissiveShape& shape = emitters.sample(u0, u1, u2, v.p, v.n, pdfPos);
+    pdfPos *= pdfChoice;
+    v.material = shape.material;
+    v.Le = shape.emission;
+    v.beta = v.Le / pdfPos;
+    v.pdfFwd = pdfPos;
+    path.push_back(v);
+    float pdfDir;
+    Vector3f w = shape.sampleDirection(v.n, u3, u4, u5, pdfDir);
+    if(!(pdfDir > 0)) return;
+    walk(Ray(v.p, w), v.Le * (std::fabs(Vector3f::dot(w, v.n)) / (pdfPos * pdfDir)), pdfDir, sampler, path, maxVertices, false);
+}
+
+void BDPTIntegrator::walk(const Ray& start, Vector3f beta, float pdf, PathSampler& sampler, std::vector<PathVertex>& path, int maxVertices, bool radiance) const {
+    Vector3f origin = start.getOrigin(), direction = start.getDirection();
+    while(int(path.size()) < maxVertices) {
+        Ray ray(origin, direction);
+        Hit hit;
+        if(!group->intersect(ray, hit, EPS)) {
+            if(radiance) {
+                PathVertex v;
+                v.type = PathVertex::BACKGROUND;
+                v.p = ray.getOrigin() + ray.getDirection();
+                v.beta = beta;
+                v.Le = scene.getBackground(ray.getDirection());
+                v.pdfFwd = pdf;
+                path.push_back(v);
+            }
+            return;
+        }
+        PathVertex v;
+        v.p = ray.pointAtParameter(hit.getT());
+        v.n = hit.getNormal().normalized();
+        v.beta = beta;
+        v.bsdf = VertexBSDF(hit);
+        v.material = hit.getMaterial();
+        if(radiance) v.Le = emissionOf(v.material);
+        v.pdfFwd = toArea(pdf, path.back(), v);
+        path.push_back(v);
+        if(int(path.size()) >= maxVertices) return;
+
+        PathVertex& current = path.back();
+        PathVertex& previous = path[path.size() - 2];
+        Vector3f wo = -ray.getDirection(), wi;
+        float pdfFwd;
+        Vector3f weight = current.bsdf.sample(wo, sampler, wi, pdfFwd);
+        if(isBlack(weight)) return;
+        float pdfRev = current.bsdf.pdf(wi, wo);
+        if(current.bsdf.isDelta()) {
+            current.delta = true;
+            pdfFwd = pdfRev = 0;
+        }
+        beta = beta * weight;
+        previous.pdfRev = toArea(pdfRev, current, previous);
+        pdf = pdfFwd;
+        origin = current.p;
+        direction = wi;
+    }
+}
+
+Vector3f BDPTIntegrator::f(const PathVertex& v, const PathVertex& prev, const PathVertex& next) const {
+    return v.bsdf.f((prev.p - v.p).normalized(), (next.p - v.p).normalized());
+}
+
+float BDPTIntegrator::pdfLight(const PathVertex& v, const PathVertex& next) const {
+    Vector3f w = next.p - v.p;
+    float d2 = w.squaredLength();
+    if(d2 == 0) return 0;
+    w = w / std::sqrt(d2);
+    float pdf;
+    if(v.light != nullptr) {
+        float pdfPosition, pdfDirection;
+        v.light->pdfEmission(w, sources.sceneRadius, pdfPosition, pdfDirection);
+        //distant lights: per area of the disk, at any distance
+        pdf = v.light->type() == Light::DELTA_DIRECTION ? pdfPosition : pdfDirection / d2;
+    } else {
+        pdf = emitters.pdfDirection(v.material, Vector3f::dot(v.n, w)) / d2;
+    }
+    if(next.onSurface()) pdf *= std::fabs(Vector3f::dot(next.n, w));
+    return pdf;
+}
+
+float BDPTIntegrator::pdf(const PathVertex& v, const PathVertex* prev, const PathVertex& next) const {
+    if(v.type == PathVertex::LIGHT) return pdfLight(v, next);
+    Vector3f wn = next.p - v.p;
+    if(wn.squaredLength() == 0) return 0;
+    wn.normalize();
+    float pdf;
+    if(v.type == PathVertex::CAMERA) {
+        pdf = camera->directionPdf(wn);
+    } else {
+        pdf = v.bsdf.pdf((prev->p - v.p).normalized(), wn);
+    }
+    return toArea(pdf, v, next);
+}
+
+bool visible(Group* group, const Vector3f& a, const Vector3f& b) {
+    Vector3f d = b - a;
+    float distance = d.length();
+    //only hits clearly before b block
+    Hit hit(distance * (1 - 1e-3f), nullptr, Vector3f::ZERO);
+    RenderStats::count(RenderStats::SHADOW_RAYS);
+    return !group->intersect(Ray(a, d / distance), hit, EPS);
+}
+
+Vector3f BDPTIntegrator::connect(std::vector<PathVertex>& lightPath, std::vector<PathVertex>& cameraPath, int s, int t, PathSampler& sampler, float& rasterX, float& rasterY) const {
+    const PathVertex& pt = cameraPath[t - 1];
+    if(t > 1 && s != 0 && pt.type == PathVertex::BACKGROUND) return Vector3f::ZERO;
+    PathVertex sampled;
+    Vector3f L;
+    if(s == 0) {
+        L = pt.beta * pt.Le;
+        //the background and emitters that are not sampled are found by this strategy only
+        if(isBlack(L) || pt.type == PathVertex::BACKGROUND || sources.pdfPoint(pt.material) == 0) return L;
+    } else if(t == 1) {
+        const PathVertex& qs = lightPath[s - 1];
+        if(!qs.connectible() || !camera->connectible() || !camera->rasterPosition(qs.p, rasterX, rasterY)) return Vector3f::ZERO;
+        Vector3f w = camera->getCenter() - qs.p;
+        float d2 = w.squaredLength();
+        w = w / std::sqrt(d2);
+        float pdfDir = camera->directionPdf(-w);
+        if(pdfDir == 0) return Vector3f::ZERO;
+        sampled.type = PathVertex::CAMERA;
+        sampled.p = camera->getCenter();
+        sampled.n = camera->getDirection();
+        //importance We = pdfDir / cos, times cos at the camera / d2
+        sampled.beta = Vector3f(pdfDir / d2);
+        L = qs.beta * f(qs, lightPath[s - 2], sampled) * sampled.beta * std::fabs(Vector3f::dot(w, qs.n));
+        if(isBlack(L) || !visible(group, qs.p, sampled.p)) return Vector3f::ZERO;
+    } else if(s == 1) {
+        if(!pt.connectible()) return Vector3f::ZERO;
+        float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+        float pdfChoice;
+        const Light* light = sources.choose(u0, pdfChoice);
+        sampled.type = PathVertex::LIGHT;
+        if(light != nullptr) {
+            Vector3f col;
+            if(!light->sampleIncident(pt.p, u1, u2, sources.sceneRadius, sampled.p, sampled.n, col)) return Vector3f::ZERO;
+            Vector3f w = (sampled.p - pt.p).normalized();
+            float pdfDir;
+            light->pdfEmission(-w, sources.sceneRadius, sampled.pdfFwd, pdfDir);
+            sampled.pdfFwd *= pdfChoice;
+            sampled.light = light;
+            sampled.beta = col / pdfChoice;
+            L = pt.beta * f(pt, cameraPath[t - 2], sampled) * sampled.beta * std::fabs(Vector3f::dot(w, pt.n));
+        } else {
+            float pdfPos;
+            const EmissiveShape& shape = emitters.sample(u0, u1, u2, sampled.p, sampled.n, pdfPos);
+            pdfPos *= pdfChoice;
+            sampled.material = shape.material;
+            sampled.Le = shape.emission;
+            sampled.pdfFwd = pdfPos;
+            Vector3f w = sampled.p - pt.p;
+            float d2 = w.squaredLength();
+            if(d2 == 0) return Vector3f::ZERO;
+            w = w / std::sqrt(d2);
+            float cosLight = Vector3f::dot(sampled.n, w);
+            if(!shape.twoSided && cosLight >= 0) return Vector3f::ZERO;
+            sampled.beta = sampled.Le / pdfPos;
+            L = pt.beta * f(pt, cameraPath[t - 2], sampled) * sampled.beta * (std::fabs(Vector3f::dot(w, pt.n)) * std::fabs(cosLight) / d2);
+        }
+        if(isBlack(L) || !visible(group, pt.p, sampled.p)) return Vector3f::ZERO;
+    } else {
+        const PathVertex& qs = lightPath[s - 1];
+        if(!qs.connectible() || !pt.connectible()) return Vector3f::ZERO;
+        Vector3f w = qs.p - pt.p;
+        float d2 = w.squaredLength();
+        if(d2 == 0) return Vector3f::ZERO;
+        w = w / std::sqrt(d2);
+        float G = std::fabs(Vector3f::dot(w, pt.n)) * std::fabs(Vector3f::dot(w, qs.n)) / d2;
+        L = qs.beta * f(qs, lightPath[s - 2], pt) * f(pt, cameraPath[t - 2], qs) * pt.beta * G;
+        if(isBlack(L) || !visible(group, pt.p, qs.p)) return Vector3f::ZERO;
+    }
+    return L * misWeight(lightPath, cameraPath, sampled, s, t);
+}
+
+float BDPTIntegrator::misWeight(std::vector<PathVertex>& lightPath, std::vector<PathVertex>& cameraPath, const PathVertex& sampled, int s, int t) const {
+    if(s + t == 2) return 1;
+    //the connection changes the vertices at its ends and their neighbours' reverse pdfs, they are restored at the end
+    PathVertex saved[4];
+    if(s > 0) saved[0] = lightPath[s - 1];
+    if(s > 1) saved[1] = lightPath[s - 2];
+    saved[2] = cameraPath[t - 1];
+    if(t > 1) saved[3] = cameraPath[t - 2];
+    if(s == 1) lightPath[0] = sampled;
+    if(t == 1) cameraPath[0] = sampled;
+    PathVertex* qs = s > 0 ? &lightPath[s - 1] : nullptr;
+    PathVertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+    PathVertex* pt = &cameraPath[t - 1];
+    PathVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+    pt->delta = false;
+    if(qs != nullptr) qs->delta = false;
+    //s = 0: pt is a point on the emitters
+    pt->pdfRev = s > 0 ? pdf(*qs, qsMinus, *pt) : sources.pdfPoint(pt->material);
+    if(ptMinus != nullptr) ptMinus->pdfRev = s > 0 ? pdf(*pt, qs, *ptMinus) : pdfLight(*pt, *ptMinus);
+    if(qs != nullptr) qs->pdfRev = pdf(*pt, ptMinus, *qs);
+    if(qsMinus != nullptr) qsMinus->pdfRev = pdf(*qs, pt, *qsMinus);
+
+    //ratios of the pdfs of the other strategies to this one's, walking along the camera path, then the light path
+    float sum = 0, ri = 1;
+    for(int i = t - 1; i > 0; --i) {
+        ri *= remap0(cameraPath[i].pdfRev) / remap0(cameraPath[i].pdfFwd);
+        if(!cameraPath[i].delta && !cameraPath[i - 1].delta) sum += ri;
+    }
+    ri = 1;
+    for(int i = s - 1; i >= 0; --i) {
+        ri *= remap0(lightPath[i].pdfRev) / remap0(lightPath[i].pdfFwd);
+        //s = 0 does not find the lights
+        if(!lightPath[i].delta && (i > 0 ? !lightPath[i - 1].delta : lightPath[0].light == nullptr)) sum += ri;
+    }
+
+    if(s > 0) lightPath[s - 1] = saved[0];
+    if(s > 1) lightPath[s - 2] = saved[1];
+    cameraPath[t - 1] = saved[2];
+    if(t > 1) cameraPath[t - 2] = saved[3];
+    return 1 / (1 + sum);
+}
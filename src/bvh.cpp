@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cfloat>
+
+#include "../include/bvh.hpp"
+
+namespace {
+//ranges are binned and partitioned in blocks of this size, the blocks are fixed so that
+//the result does not depend on how they are distributed over threads
+const int BLOCK_SIZE = 4096;
+//ranges larger than this bin and partition their blocks as tasks
+const int PARALLEL_THRESHOLD = 8 * BLOCK_SIZE;
+//subtrees larger than this are built as separate tasks
+const int TASK_THRESHOLD = 1024;
+//a node this small becomes a leaf when splitting does not pay off by SAH
+const int MAX_LEAF_SIZE = 16;
+
+typedef BVHBuilder::Bounds Bounds;
+
+Bounds emptyBounds() {
+    Bounds b;
+    for(int a = 0; a < 3; a++) {
+        b.min[a] = FLT_MAX;
+        b.max[a] = -FLT_MAX;
+    }
+    return b;
+}
+
+void extend(Bounds& b, const Bounds& o) {
+    for(int a = 0; a < 3; a++) {
+        b.min[a] = std::min(b.min[a], o.min[a]);
+        b.max[a] = std::max(b.max[a], o.max[a]);
+    }
+}
+
+void extend(Bounds& b, const float* p) {
+    for(int a = 0; a < 3; a++) {
+        b.min[a] = std::min(b.min[a], p[a]);
+        b.max[a] = std::max(b.max[a], p[a]);
+    }
+}
+
+float halfArea(const Bounds& b) {
+    float d[3];
+    for(int a = 0; a < 3; a++) d[a] = std::max(0.0f, b.max[a] - b.min[a]);
+    return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+int numBlocks(int begin, int end) {
+    return (end - begin + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+//run f(block) for every block of a range, as tasks when the range is large
+template<typename F>
+void forBlocks(int begin, int end, F f) {
+    int blocks = numBlocks(begin, end);
+    if(end - begin > PARALLEL_THRESHOLD) {
+        #pragma omp taskloop grainsize(1)
+        for(int b = 0; b < blocks; b++) f(b);
+    } else {
+        for(int b = 0; b < blocks; b++) f(b);
+    }
+}
+}
+
+void BVHBuilder::reduce(int begin, int end, Bounds& bounds, Bounds& centroidBounds) const {
+    int blocks = numBlocks(begin, end);
+    std::vector<Bounds> blockBounds(blocks, emptyBounds()), blockCentroids(blocks, emptyBounds());
+    forBlocks(begin, end, [&](int b) {
+        int last = std::min(end, begin + (b + 1) * BLOCK_SIZE);
+        for(int i = begin + b * BLOCK_SIZE; i < last; i++) {
+            int p = (*order)[i];
+            extend(blockBounds[b], (*primitives)[p]);
+            extend(blockCentroids[b], &centroids[p * 3]);
+        }
+    });
+    bounds = emptyBounds();
+    centroidBounds = emptyBounds();
+    for(int b = 0; b < blocks; b++) {
+        extend(bounds, blockBounds[b]);
+        extend(centroidBounds, blockCentroids[b]);
+    }
+}
+
+int BVHBuilder::split(int begin, int end, const Bounds& centroidBounds, const Bounds& bounds) {
+    int n = end - begin;
+    int axis = 0;
+    for(int a = 1; a < 3; a++) {
+        if(centroidBounds.max[a] - centroidBounds.min[a] > centroidBounds.max[axis] - centroidBounds.min[axis]) axis = a;
+    }
+    float low = centroidBounds.min[axis];
+    float extent = centroidBounds.max[axis] - low;
+    //all centroids coincide, nothing to bin: halve the range as it is
+    if(!(extent > 0)) return n > MAX_LEAF_SIZE ? begin + n / 2 : -1;
+
+    float scale = NUM_BINS / extent;
+    auto binOf = [&](int p) {
+        return std::min(NUM_BINS - 1, int((centroids[p * 3 + axis] - low) * scale));
+    };
+
+    //binning, per block then merged in block order
+    int blocks = numBlocks(begin, end);
+    std::vector<int> blockCounts(blocks * NUM_BINS, 0);
+    std::vector<Bounds> blockBins(blocks * NUM_BINS, emptyBounds());
+    forBlocks(begin, end, [&](int b) {
+        int last = std::min(end, begin + (b + 1) * BLOCK_SIZE);
+        for(int i = begin + b * BLOCK_SIZE; i < last; i++) {
+            int p = (*order)[i];
+            int bin = binOf(p);
+            blockCounts[b * NUM_BINS + bin]++;
+            extend(blockBins[b * NUM_BINS + bin], (*primitives)[p]);
+        }
+    });
+    int counts[NUM_BINS] = {0};
+    Bounds bins[NUM_BINS];
+    for(int k = 0; k < NUM_BINS; k++) bins[k] = emptyBounds();
+    for(int b = 0; b < blocks; b++) {
+        for(int k = 0; k < NUM_BINS; k++) {
+            counts[k] += blockCounts[b * NUM_BINS + k];
+            extend(bins[k], blockBins[b * NUM_BINS + k]);
+        }
+    }
+
+    //sweep: cost of splitting in front of bin k
+    float leftCost[NUM_BINS];
+    Bounds acc = emptyBounds();
+    int count = 0;
+    for(int k = 1; k < NUM_BINS; k++) {
+        extend(acc, bins[k - 1]);
+        count += counts[k - 1];
+        leftCost[k] = count == 0 ? 0 : halfArea(acc) * count;
+    }
+    acc = emptyBounds();
+    count = 0;
+    int best = -1;
+    float bestCost = FLT_MAX;
+    for(int k = NUM_BINS - 1; k >= 1; k--) {
+        extend(acc, bins[k]);
+        count += counts[k];
+        if(count == 0 || count == n) continue;
+        float cost = leftCost[k] + halfArea(acc) * count;
+        if(cost <= bestCost) {
+            bestCost = cost;
+            best = k;
+        }
+    }
+    if(best < 0) return n > MAX_LEAF_SIZE ? begin + n / 2 : -1;
+    //SAH with unit traversal and intersection cost
+    if(n <= MAX_LEAF_SIZE && 1 + bestCost / halfArea(bounds) >= n) return -1;
+
+    //stable partition: per block counts, prefix sums, then every block scatters its elements
+    std::vector<int> leftOffset(blocks + 1, 0);
+    forBlocks(begin, end, [&](int b) {
+        int last = std::min(end, begin + (b + 1) * BLOCK_SIZE);
+        int c = 0;
+        for(int i = begin + b * BLOCK_SIZE; i < last; i++) c += binOf((*order)[i]) < best;
+        leftOffset[b + 1] = c;
+    });
+    for(int b = 0; b < blocks; b++) leftOffset[b + 1] += leftOffset[b];
+    int numLeft = leftOffset[blocks];
+    forBlocks(begin, end, [&](int b) {
+        int first = begin + b * BLOCK_SIZE;
+        int last = std::min(end, first + BLOCK_SIZE);
+        int l = begin + leftOffset[b];
+        int r = begin + numLeft + (first - begin - leftOffset[b]);
+        for(int i = first; i < last; i++) {
+            int p = (*order)[i];
+            if(binOf(p) < best) scratch[l++] = p;
+            else scratch[r++] = p;
+        }
+    });
+    forBlocks(begin, end, [&](int b) {
+        int first = begin + b * BLOCK_SIZE;
+        int last = std::min(end, first + BLOCK_SIZE);
+        std::copy(scratch.begin() + first, scratch.begin() + last, order->begin() + first);
+    });
+    return begin + numLeft;
+}
+
+void BVHBuilder::buildNode(BVHNode* node, int begin, int end) {
+    nodes++;
+    Bounds bounds, centroidBounds;
+    reduce(begin, end, bounds, centroidBounds);
+    node->box = BoundingBox(Vector3f(bounds.min[0], bounds.min[1], bounds.min[2]),
+                            Vector3f(bounds.max[0], bounds.max[1], bounds.max[2]));
+    int mid = end - begin <= leafSize ? -1 : split(begin, end, centroidBounds, bounds);
+    if(mid < 0) {
+        omp_set_lock(&leavesLock);
+        leaves.push_back(std::make_pair(node, std::make_pair(begin, end)));
+        omp_unset_lock(&leavesLock);
+        return;
+    }
+    node->left = new BVHNode();
+    node->right = new BVHNode();
+    BVHNode* left = node->left;
+    if(end - begin > TASK_THRESHOLD) {
+        #pragma omp task
+        buildNode(left, begin, mid);
+        buildNode(node->right, mid, end);
+        #pragma omp taskwait
+    } else {
+        buildNode(left, begin, mid);
+        buildNode(node->right, mid, end);
+    }
+}
+
+BVHNode::BVHNode(const std::vector<BVHBuilder::Bounds>& primitives, std::vector<int>& order) : BVHNode() {
+    BVHBuilder builder;
+    builder.build(this, primitives, order, [](BVHNode* leaf, int begin, int end) {
+        leaf->start = begin;
+        leaf->count = end - begin;
+    });
+}
@@ -4,71 +4,159 @@
 #include "../include/utils.hpp"
 #include "../include/material.hpp"
 #include "../include/classical_object.hpp"
+#include "../include/tessellation.hpp"
+#include "../include/render_stats.hpp"
 #include <iostream>
-#include <queue>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
 
-// BezierCurve
-BezierCurve::BezierCurve(const std::vector<Vector3f>& controlVector3fs, Vector3f point1, Vector3f point2) {
+// BSplineCurve
+BSplineCurve::BSplineCurve(const std::vector<Vector3f>& controlVector3fs, const std::vector<float>& knots, Vector3f point1, Vector3f point2, Material* m = nullptr) {
     this->controlVector3fs = controlVector3fs;
+    this->knots = knots;
     this->point1 = point1;
     this->point2 = point2;
-}
-
-Vector3f BezierCurve::evaluate(double t) const {
-    //de Casteljau's algorithm
-    std::vector<Vector3f> controlVector3fs = this->controlVector3fs;
+    this->material = m;
+    for(const auto& c : controlVector3fs){
+        controls.push_back(Point3d{{c.x(), c.y(), c.z()}});
+    }
+    degree = knots.size() - controlVector3fs.size() - 1;
+    if(degree < 1){
+        std::cout << "Error: B-spline needs more knots than control points plus one." << std::endl;
+        exit(1);
+    }
+    if(degree >= curve_eval::MAX_ORDER){
+        std::cout << "Error: B-spline of degree above " << curve_eval::MAX_ORDER - 1 << "." << std::endl;
+        exit(1);
+    }
+    evaluator = curve_eval::bezierEvaluator(degree);
     int n = controlVector3fs.size() - 1;
-    for (int r = 1; r <= n; r++) {
-        for (int i = 0; i <= n - r; i++) {
-            controlVector3fs[i] = (1 - t) * controlVector3fs[i] + t * controlVector3fs[i + 1];
+    segments.resize((n - degree + 1) * (degree + 1));
+    for(int k = degree; k <= n; k++){
+        Point3d* segment = &segments[(k - degree) * (degree + 1)];
+        if(knots[k + 1] > knots[k]){
+            curve_eval::bsplineSpanToBezier(controls.data(), knots.data(), degree, k, segment);
+        }else{
+            //empty span, only reached by parameters outside the curve
+            std::fill(segment, segment + degree + 1, controls[k]);
         }
     }
-    return controlVector3fs[0];
-}
 
-Vector3f BezierCurve::evaluateDerivative(double t) const {
-    //de Casteljau's algorithm
-    //default: first derivative
-    std::vector<Vector3f> controlVector3fs = this->controlVector3fs;
-    int n = controlVector3fs.size() - 1;
-    int prefix = 1;
-    int derivative = 1;
-    for(int i = 0; i < derivative; i++){
-        prefix *= n - i;
-    }
-    for (int k = 0; k < derivative; k++) {
-        for (int r = 0; r <= n - derivative; r++) {
-            controlVector3fs[r] =  (controlVector3fs[r + 1] - controlVector3fs[r]);
-        }
+    //rotate matrix that lets line [point1, point2] be the z axis, fixed for the curve
+    Vector3f rz = point2 - point1;
+    rz.normalize();
+    Vector3f rx = Vector3f::cross(Vector3f(0,0,1), rz);
+    if(rx.length() < EPS){
+        rx = Vector3f::cross(Vector3f(0,1,0), rz);
+    }
+    rx.normalize();
+    Vector3f ry = Vector3f::cross(rz, rx);
+    ry.normalize();
+    rotate = Matrix3f(rx, ry, rz);
+    rotateInverse = rotate.transposed();
+
+    //span bounds from the Bezier points of each span (convex hull property, tighter than the B-spline polygon)
+    float scale = 0;
+    for(const auto& c : controlVector3fs){
+        scale = std::max(scale, std::max(std::fabs(c.x()), std::fabs(c.y())));
     }
-    for (int i = 0; i < n - derivative; i++) {
-        for(int j = 0; j < n - derivative - i; j++){
-            controlVector3fs[j] = ( 1 - t ) * controlVector3fs[j] + t * controlVector3fs[j + 1];
+    float pad = 1e-5f * std::max(scale, 1.0f);
+    //ray origins on the surface come back rounded to float, a root this close is the surface the ray leaves from
+    selfIntersectionEps = 1e-4f * std::max(scale, 1.0f);
+    for(int k = degree; k <= n; k++){
+        if(!(knots[k + 1] > knots[k])) continue;
+        Span span;
+        span.k = k;
+        span.t0 = knots[k];
+        span.t1 = knots[k + 1];
+        float xmin = FLT_MAX, xmax = -FLT_MAX;
+        span.hmin = FLT_MAX;
+        span.hmax = -FLT_MAX;
+        const Point3d* segment = &segments[(k - degree) * (degree + 1)];
+        for(int i = 0; i <= degree; i++){
+            xmin = std::min(xmin, float(segment[i][0]));
+            xmax = std::max(xmax, float(segment[i][0]));
+            span.hmin = std::min(span.hmin, float(segment[i][1]));
+            span.hmax = std::max(span.hmax, float(segment[i][1]));
         }
+        //the radius may change sign inside the span, it then reaches the axis
+        span.rmin = xmin <= 0 && xmax >= 0 ? 0 : std::max(0.0f, std::min(std::fabs(xmin), std::fabs(xmax)) - pad);
+        span.rmax = std::max(std::fabs(xmin), std::fabs(xmax)) + pad;
+        span.hmin -= pad;
+        span.hmax += pad;
+        spans.push_back(span);
+    }
+    if(!spans.empty()){
+        spanNodes.reserve(2 * spans.size() - 1);
+        buildSpanNodes(0, spans.size());
     }
-    return prefix * controlVector3fs[0];
-
 }
 
-bool BezierCurve::intersect(const Ray& ray, Hit& hit, float tmin){
-    //
+int BSplineCurve::buildSpanNodes(int begin, int end){
+    int index = spanNodes.size();
+    spanNodes.push_back(SpanNode());
+    SpanNode node;
+    if(end - begin == 1){
+        const Span& span = spans[begin];
+        node.rmin = span.rmin;
+        node.rmax = span.rmax;
+        node.hmin = span.hmin;
+        node.hmax = span.hmax;
+        node.left = node.right = -1;
+        node.span = begin;
+    }else{
+        int mid = (begin + end) / 2;
+        node.left = buildSpanNodes(begin, mid);
+        node.right = buildSpanNodes(mid, end);
+        node.span = -1;
+        const SpanNode& l = spanNodes[node.left];
+        const SpanNode& r = spanNodes[node.right];
+        node.rmin = std::min(l.rmin, r.rmin);
+        node.rmax = std::max(l.rmax, r.rmax);
+        node.hmin = std::min(l.hmin, r.hmin);
+        node.hmax = std::max(l.hmax, r.hmax);
+    }
+    spanNodes[index] = node;
+    return index;
 }
 
-
-// BSplineCurve
-BSplineCurve::BSplineCurve(const std::vector<Vector3f>& controlVector3fs, const std::vector<float>& knots, Vector3f point1, Vector3f point2, Material* m = nullptr) {
-    this->controlVector3fs = controlVector3fs;
-    this->knots = knots;
-    this->point1 = point1;
-    this->point2 = point2;
-    this->material = m;
-    box = BoundingBox();
-    for(int i = 0; i < controlVector3fs.size(); i++){
-        box.extend(Vector3f(controlVector3fs[i].x(), 0, controlVector3fs[i].y()));
-        box.extend(Vector3f(-controlVector3fs[i].x(), 0, controlVector3fs[i].y()));
-        box.extend(Vector3f(0, controlVector3fs[i].x(), controlVector3fs[i].y()));
-        box.extend(Vector3f(0, -controlVector3fs[i].x(), controlVector3fs[i].y()));
+bool BSplineCurve::overlaps(const SpanNode& node, const LocalRay& ray, float tmin, float tmax) const{
+    const double* o = ray.o;
+    const double* d = ray.d;
+    double t0 = tmin, t1 = tmax;
+    //height slab
+    if(fabs(d[2]) < EPS2){
+        if(o[2] < node.hmin || o[2] > node.hmax) return false;
+    }else{
+        double a = (node.hmin - o[2]) / d[2], b = (node.hmax - o[2]) / d[2];
+        if(a > b) std::swap(a, b);
+        t0 = std::max(t0, a);
+        t1 = std::min(t1, b);
+        if(t0 > t1) return false;
+    }
+    //outer cylinder
+    double A = d[0] * d[0] + d[1] * d[1];
+    double B = o[0] * d[0] + o[1] * d[1];
+    double C = o[0] * o[0] + o[1] * o[1] - double(node.rmax) * node.rmax;
+    if(A < EPS2){
+        if(C > 0) return false;
+    }else{
+        double delta = B * B - A * C;
+        if(delta < 0) return false;
+        double sq = sqrt(delta);
+        t0 = std::max(t0, (-B - sq) / A);
+        t1 = std::min(t1, (-B + sq) / A);
+        if(t0 > t1) return false;
     }
+    //inner cylinder: the squared distance to the axis is convex in t, inside at both ends means inside throughout
+    if(node.rmin > 0){
+        double r2 = double(node.rmin) * node.rmin;
+        if(A * t0 * t0 + 2 * B * t0 + C + double(node.rmax) * node.rmax < r2 &&
+           A * t1 * t1 + 2 * B * t1 + C + double(node.rmax) * node.rmax < r2) return false;
+    }
+    return true;
 }
 
 int BSplineCurve::findSpan(double t) const{
@@ -94,348 +182,726 @@ int BSplineCurve::findSpan(double t) const{
     return mid;
 }
 
-Vector3f BSplineCurve::evaluate(double t) const {
-    //de Boor Cox algorithm
-    int k = findSpan(t);
-    int p = knots.size() - controlVector3fs.size() - 1;
-    assert(p >= 0);
-    std::vector<Vector3f> d(p + 1);
-    for (int i = 0; i <= p; i++) {
-        d[i] = controlVector3fs[k - p + i];
-    }
-    for (int r = 1; r <= p; r++) {
-        for (int i = p; i >= r; i--) {
-            float alpha = (t - knots[k - p + i]) / (knots[i + k - r + 1] - knots[k - p + i]);
-            d[i] = (1.0 - alpha) * d[i - 1] + alpha * d[i];
-        }
+void BSplineCurve::evaluate(double t, int k, Point3d& point, Point3d& derivative) const {
+    double length = knots[k + 1] - knots[k];
+    double u = length > 0 ? (t - knots[k]) / length : 0;
+    evaluator(&segments[(k - degree) * (degree + 1)], degree, u, point, derivative);
+    if(length > 0){
+        for(int c = 0; c < 3; c++) derivative[c] /= length;
     }
-    return d[p];
+}
+
+Vector3f BSplineCurve::evaluate(double t) const {
+    Point3d point, derivative;
+    evaluate(t, findSpan(t), point, derivative);
+    return Vector3f(point[0], point[1], point[2]);
 }
 
 Vector3f BSplineCurve::evaluateDerivative(double t) const {
-    //de Boor Cox algorithm
-    std::vector<Vector3f> controlVector3fs = this->controlVector3fs;
-    // sum_i=1^n p(P_i - P_i-1) / (u_p+i - u_i) N_i,p-1(u)
-    /* int k = findSpan(t);
-    int p = knots.size() - controlVector3fs.size() - 1;
-    assert(p >= 0);
-    std::vector<Vector3f> d(p + 1);
-    
-    for (int i = 0; i <= p; i++) {
-        d[i] = controlVector3fs[k - p + i];
-    }
-    for (int r = 1; r <= p; r++) {
-        for (int i = p; i >= r; i--) {
-            float alpha = (t - knots[k - p + i]) / (knots[i + k - r + 1] - knots[k - p + i]);
-            d[i] = (1.0 - alpha) * d[i - 1] + alpha * d[i];
+    Point3d point, derivative;
+    evaluate(t, findSpan(t), point, derivative);
+    return Vector3f(derivative[0], derivative[1], derivative[2]);
+}
+
+void BSplineCurve::evaluateBatch(const double* t, int n, Vector3f* points, Vector3f* derivatives) const {
+    Point3d point, derivative;
+    int last = controlVector3fs.size() - 1;
+    int k = -1;
+    for(int i = 0; i < n; i++){
+        //ascending parameters stay in the span or move to one of the next ones
+        if(k >= 0 && t[i] >= knots[k]){
+            while(k < last && t[i] >= knots[k + 1]) k++;
         }
+        if(k < 0 || t[i] < knots[k] || (k < last && t[i] >= knots[k + 1]) || t[i] > knots[knots.size() - degree]){
+            k = findSpan(t[i]);
+        }
+        evaluate(t[i], k, point, derivative);
+        points[i] = Vector3f(point[0], point[1], point[2]);
+        if(derivatives != nullptr) derivatives[i] = Vector3f(derivative[0], derivative[1], derivative[2]);
     }
-    return p * (d[p] - d[p - 1]) / (knots[k + p] - knots[k]); */
-    std::vector<Vector3f> q(controlVector3fs.size() - 1);
-    int p = knots.size() - controlVector3fs.size() - 1;
-    for(int i = 0; i < q.size(); i++){
-        q[i] = p * (controlVector3fs[i + 1] - controlVector3fs[i]) / (knots[i + p + 1] - knots[i + 1]);
-    }
-    BSplineCurve curve(q, knots, point1, point2);
-    return curve.evaluate(t);
 }
 
+double BSplineCurve::f(double t, int k, const LocalRay& ray, double& df) const{
+    Point3d p, dp;
+    evaluate(t, k, p, dp);
+    const double* o = ray.o;
+    const double* d = ray.d;
+    //rotate along z axis
+    double q = p[1] - o[2];
+    double a = q * d[0] + o[0] * d[2];
+    double b = q * d[1] + o[1] * d[2];
+    df = 2 * (a * d[0] + b * d[1]) * dp[1] - 2 * p[0] * dp[0] * d[2] * d[2];
+    return a * a + b * b - p[0] * p[0] * d[2] * d[2];
+}
 
+double BSplineCurve::solve(double a, double b, double fa, int k, const LocalRay& ray) const{
+    //Newton's Method, falling back to bisection whenever a step leaves the bracket
+    double lo = a, hi = b, x = 0.5 * (a + b);
+    //TODO: Tune the depth of Newton's Method
+    for(int i = 0; i < 30; i++){
+        double df, fx = f(x, k, ray, df);
+        if(fx == 0) return x;
+        if((fx < 0) == (fa < 0)) lo = x;
+        else hi = x;
+        double next = x - fx / df;
+        if(!(next > lo && next < hi)) next = 0.5 * (lo + hi);
+        if(fabs(next - x) <= 1e-9 * (b - a)) return next;
+        x = next;
+    }
+    return x;
+}
 
-std::vector<double> BSplineCurve::init(Vector3f o, Vector3f d) const{
-    //initialize x0
-    /* std::vector<double> x ;
-    int p = knots.size() - controlVector3fs.size() - 1;
-    int n = controlVector3fs.size() - 1;
-    std::queue<float> start , end;
-    start.push(knots[p]);
-    end.push(knots[n + 1]);
-    while (true) {
-        if(start.empty() || end.empty()){
-            break;
-        }
-        float s = start.front();
-        float e = end.front();
-        start.pop();
-        end.pop();
-        if(s > e || fabs(s - e) < 0.001){
-            break;
+void BSplineCurve::intersectSpan(const Span& span, const LocalRay& ray, float tmin, Hit& hit, bool& isIntersect) const{
+    double step = (span.t1 - span.t0) / SPAN_SAMPLES;
+    double a = span.t0, ga, fa = f(a, span.k, ray, ga);
+    if(fa == 0) isIntersect |= hitAt(a, span.k, ray, tmin, hit);
+    for(int j = 1; j <= SPAN_SAMPLES; j++){
+        double b = j == SPAN_SAMPLES ? span.t1 : span.t0 + j * step, gb, fb = f(b, span.k, ray, gb);
+        if(fb == 0){
+            isIntersect |= hitAt(b, span.k, ray, tmin, hit);
+        }else if(fa != 0 && (fa < 0) != (fb < 0)){
+            isIntersect |= hitAt(solve(a, b, fa, span.k, ray), span.k, ray, tmin, hit);
+        }else if(ga * gb < 0 && (fa > 0) == (ga < 0)){
+            //f heads for zero and turns back inside [a, b]: locate the extremum, two roots if it crosses
+            double lo = a, hi = b;
+            for(int i = 0; i < 12; i++){
+                double m = 0.5 * (lo + hi), gm;
+                f(m, span.k, ray, gm);
+                if((gm < 0) == (ga < 0)) lo = m;
+                else hi = m;
+            }
+            double m = 0.5 * (lo + hi), gm, fm = f(m, span.k, ray, gm);
+            if(fm != 0 && (fm < 0) != (fa < 0)){
+                isIntersect |= hitAt(solve(a, m, fa, span.k, ray), span.k, ray, tmin, hit);
+                isIntersect |= hitAt(solve(m, b, fm, span.k, ray), span.k, ray, tmin, hit);
+            }
         }
-        float mid = (s + e) / 2.0f;
-        if(f(mid, o, d) * f(s, o, d) < 0){
-            x.push_back((s + mid) / 2.0f);
-        }else{
-            start.push(s);
-            end.push(mid);
+        a = b;
+        fa = fb;
+        ga = gb;
+    }
+}
+
+bool BSplineCurve::hitAt(double t, int k, const LocalRay& ray, float tmin, Hit& hit) const{
+    Point3d p, dp;
+    evaluate(t, k, p, dp);
+    const double* o = ray.o;
+    const double* d = ray.d;
+    double tr;
+    if(d[2] * d[2] > 0.01 * (d[0] * d[0] + d[1] * d[1] + d[2] * d[2])){
+        tr = (p[1] - o[2]) / d[2];
+    }else{
+        //nearly perpendicular to the axis: the height is ill-conditioned, solve the circle of
+        //radius p.x for the ray and keep the root at the height of p
+        double a = d[0] * d[0] + d[1] * d[1];
+        double b = 2 * (d[0] * o[0] + d[1] * o[1]);
+        double c = o[0] * o[0] + o[1] * o[1] - p[0] * p[0];
+        double delta = b * b - 4 * a * c;
+        if(delta < 0) return false;
+        double roots[2] = {(-b - sqrt(delta)) / (2 * a), (-b + sqrt(delta)) / (2 * a)};
+        double error = DBL_MAX;
+        tr = -1;
+        for(double root : roots){
+            double e = fabs(o[2] + root * d[2] - p[1]);
+            if(root > tmin && e < error){
+                error = e;
+                tr = root;
+            }
         }
-        if(f(mid, o, d) * f(e, o, d) < 0){
-            x.push_back((e + mid) / 2.0f);
+    }
+    if(!(tr > std::max(double(tmin), selfIntersectionEps) && tr < hit.getT())) return false;
+
+    //theta: -pi ~ pi, the profile radius may be negative
+    double x = o[0] + tr * d[0], y = o[1] + tr * d[1];
+    double theta = p[0] >= 0 ? atan2(y, x) : atan2(-y, -x);
+    Vector3f normal = Vector3f::cross(Vector3f(dp[0] * cos(theta), dp[0] * sin(theta), dp[1]), Vector3f(-sin(theta), cos(theta), 0));
+    normal = rotate * normal;
+    normal.normalize();
+    Vector2f texCoord = Vector2f((t - knots[degree]) / (knots[knots.size() - degree] - knots[degree]), (theta + PI) / (2 * PI));
+    hit.set(tr, this->material, normal, texCoord);
+    return true;
+}
+
+bool BSplineCurve::intersect(const Ray& ray, Hit& hit, float tmin){
+    if(spanNodes.empty()) return false;
+    Vector3f o = rotateInverse * (ray.getOrigin() - point1);
+    Vector3f d = rotateInverse * ray.getDirection();
+    LocalRay local = {{o.x(), o.y(), o.z()}, {d.x(), d.y(), d.z()}};
+
+    //walk the span hierarchy, hit.getT() shrinks as hits are found
+    bool isIntersect = false;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0){
+        const SpanNode& node = spanNodes[stack[--top]];
+        if(!overlaps(node, local, tmin, hit.getT())) continue;
+        if(node.span >= 0){
+            intersectSpan(spans[node.span], local, tmin, hit, isIntersect);
         }else{
-            start.push(mid);
-            end.push(e);
+            stack[top++] = node.right;
+            stack[top++] = node.left;
         }
     }
-    return x; */
-    //tranverse
-    std::vector<double> x;
-    double start = knots[knots.size() - controlVector3fs.size() - 1];
-    double end = knots[controlVector3fs.size()];
-    double t = start;
-    //TODO: Tune the number of points
-    for(;t < end; t += (end - start) / 200.0f){
-        if(fabs(f(t, o, d)) < 0.01){
-            x.push_back(t);
+    return isIntersect;
+}
+
+Mesh* BSplineCurve::tessellate(float tolerance) const {
+    int n = controlVector3fs.size() - 1;
+    std::vector<double> breakpoints(knots.begin() + degree, knots.begin() + n + 2);
+    //profile in the (radius, height) plane, z is always 0
+    auto profile = [this](double t){
+        Vector3f p = evaluate(t);
+        return Vector3f(p.x(), p.y(), 0);
+    };
+    std::vector<double> ts = tessellation::refineAll(breakpoints, tolerance, [&](double a, double b){
+        return tessellation::chordError(profile, a, b);
+    });
+    float radius = 0;
+    for(double t : ts) radius = std::max(radius, std::fabs(evaluate(t).x()));
+    //sagitta of a chord over 2 pi / steps: radius * (1 - cos(pi / steps))
+    int steps = 8;
+    if(radius > tolerance) steps = std::max(steps, int(std::ceil(PI / std::acos(1 - tolerance / radius))));
+    steps = std::min(steps, 4096);
+
+    int rows = ts.size(), cols = steps + 1;
+    double t0 = knots[degree], t1 = knots[n + 1];
+    std::vector<Vector3f> points(rows * cols), normals(rows * cols);
+    std::vector<Vector2f> texCoords(rows * cols);
+    for(int i = 0; i < rows; i++){
+        Point3d p, dp;
+        int k = findSpan(ts[i]);
+        evaluate(ts[i], k, p, dp);
+        if(dp[0] * dp[0] + dp[1] * dp[1] < EPS2){
+            //stationary end of the profile (repeated controls): the tangent just inside
+            Point3d q;
+            double inside = ts[i] + 1e-3 * (0.5 * (t0 + t1) - ts[i]);
+            evaluate(inside, findSpan(inside), q, dp);
+        }
+        for(int j = 0; j < cols; j++){
+            //same angle, normal and texture coordinates as hitAt (its point is radius * (cos, sin) for either sign)
+            double theta = -PI + 2 * PI * j / steps;
+            Vector3f normal = Vector3f::cross(Vector3f(dp[0] * cos(theta), dp[0] * sin(theta), dp[1]), Vector3f(-sin(theta), cos(theta), 0));
+            normal = rotate * normal;
+            normal.normalize();
+            points[i * cols + j] = point1 + rotate * Vector3f(p[0] * cos(theta), p[0] * sin(theta), p[1]);
+            normals[i * cols + j] = normal;
+            texCoords[i * cols + j] = Vector2f((ts[i] - t0) / (t1 - t0), double(j) / steps);
         }
     }
-    return x;
+    return tessellation::gridMesh(rows, cols, points, normals, texCoords, material);
 }
 
-double BSplineCurve::Newton(double t, Vector3f o, Vector3f d) const{
-    Vector3f p = evaluate(t);
-    Vector3f dp = evaluateDerivative(t);
-    // rotate along x axis
-    /* double q = p.x() - o.x();
-    double f = pow((q * d.z() + o.z() * d.x()), 2) + pow((q * d.y() + o.y() * d.x()), 2) - pow(p.y() * d.x(), 2);
-    double df = 2 * d.z() * dp.x() * (q * d.z() + o.z() * d.x()) + 2 * d.y() * dp.x() * (q * d.y() + o.y() * d.x()) - 2 * p.y() * dp.y() * d.x() * d.x();
-    return f / df; */
-    //rotate along z axis
-    double q = (p.y() - o.z());
-    double f = (q * d.x() + o.x() * d.z()) * (q * d.x() + o.x() * d.z()) + (q * d.y() + o.y() * d.z()) * (q * d.y() + o.y() * d.z()) - p.x() * p.x() * d.z()* d.z();
-    double df = 2 * d.x() * dp.y() * (q * d.x() + o.x() * d.z()) + 2 * d.y() * dp.y() * (q * d.y() + o.y() * d.z()) - 2 * p.x() * dp.x() * d.z() * d.z();
-    //two-dimensional
-    //double f = d.y() * p.x() - d.x() * p.y() - o.x() * d.y() + o.y() * d.x();
-    //double df = d.y() * dp.x() - d.x() * dp.y();
-    return f / df;
-}
-
-double BSplineCurve::f(double t, Vector3f o, Vector3f d) const{
-    Vector3f p = evaluate(t);
-    // rotate along x axis
-    //double q = p.x() - o.x();
-    //return pow((q * d.z() + o.z() * d.x()), 2) + pow((q * d.y() + o.y() * d.x()), 2) - pow(p.y() * d.x(), 2);
-    // rotate along z axis
-    double q = (p.y() - o.z()) ;
-    return pow((q * d.x() + o.x() * d.z()), 2) + pow((q * d.y() + o.y() * d.z()), 2) - pow(p.x() * d.z(), 2);
-    //return (q * d.x() + o.x() * d.z()) * (q * d.x() + o.x() * d.z()) + (q * d.y() + o.y() * d.z()) * (q * d.y() + o.y() * d.z()) - p.x() * p.x() * d.z()* d.z();
-    //two-dimensional
-    //return d.y() * p.x() - d.x() * p.y() - o.x() * d.y() + o.y() * d.x();
+// BezierCurve
+
+BezierCurve::BezierCurve(const std::vector<Vector3f>& controlVector3fs, Vector3f point1, Vector3f point2, Material* m)
+    : BSplineCurve(controlVector3fs, clampedKnots(controlVector3fs.size()), point1, point2, m) {}
+
+std::vector<float> BezierCurve::clampedKnots(int size){
+    //n + 1 controls, degree n: n + 1 zeros and n + 1 ones
+    std::vector<float> knots(2 * size, 0);
+    std::fill(knots.begin() + size, knots.end(), 1);
+    return knots;
 }
 
-bool BSplineCurve::intersect(const Ray& ray, Hit& hit, float tmin){
-    //Newton's Method
-    //acceleration: bounding box
-    //create rotate matrix to let line [point1, point2] to be z axis
-    Vector3f rz = point2 - point1;
-    rz.normalize();
-    Vector3f rx = Vector3f::cross(Vector3f(0,0,1), rz);
-    if(rx.length() < EPS){
-        rx = Vector3f::cross(Vector3f(0,1,0), rz);
+Vector3f BezierCurve::evaluate(double t) const {
+    Point3d point, derivative;
+    evaluator(controls.data(), controls.size() - 1, t, point, derivative);
+    return Vector3f(point[0], point[1], point[2]);
+}
+
+Vector3f BezierCurve::evaluateDerivative(double t) const {
+    Point3d point, derivative;
+    evaluator(controls.data(), controls.size() - 1, t, point, derivative);
+    return Vector3f(derivative[0], derivative[1], derivative[2]);
+}
+
+void BezierCurve::evaluateBatch(const double* t, int n, Vector3f* points, Vector3f* derivatives) const {
+    Point3d point, derivative;
+    for(int i = 0; i < n; i++){
+        evaluator(controls.data(), controls.size() - 1, t[i], point, derivative);
+        points[i] = Vector3f(point[0], point[1], point[2]);
+        if(derivatives != nullptr) derivatives[i] = Vector3f(derivative[0], derivative[1], derivative[2]);
     }
-    rx.normalize();
-    Vector3f ry = Vector3f::cross(rz, rx);
-    ry.normalize();
-    Matrix3f rotate = Matrix3f(rx, ry, rz);
-    Matrix3f rotateInverse = rotate.inverse();
-    Vector3f o = rotateInverse * (ray.getOrigin() - point1);
-    Vector3f d = rotateInverse * ray.getDirection();
-    //std::cout << "o is " << o << std::endl;
-    //std::cout << "d is " << d << std::endl;
+}
 
-    
-    if(!box.intersect(Ray(o,d), hit, tmin)){
-        return false;
+// CatmullRomCurve
+
+CatmullRomCurve::CatmullRomCurve(const std::vector<Vector3f>& controlVector3fs, float tension, Vector3f point1, Vector3f point2, Material* m)
+    : BSplineCurve(bezierControls(controlVector3fs, tension), bezierKnots(controlVector3fs.size()), point1, point2, m) {}
+
+std::vector<Vector3f> CatmullRomCurve::bezierControls(const std::vector<Vector3f>& controlVector3fs, float tension){
+    const std::vector<Vector3f>& p = controlVector3fs;
+    if(p.size() < 4){
+        std::cout << "Error: Catmull-Rom curve needs at least 4 control points." << std::endl;
+        exit(1);
     }
-    bool isIntersect = false;
+    //Hermite segment P[i] -> P[i + 1] with tangents m[i], m[i + 1] as a cubic Bezier
+    std::vector<Vector3f> bezier;
+    for(size_t i = 1; i + 2 < p.size(); i++){
+        Vector3f m0 = tension * (p[i + 1] - p[i - 1]);
+        Vector3f m1 = tension * (p[i + 2] - p[i]);
+        if(i == 1) bezier.push_back(p[i]);
+        bezier.push_back(p[i] + m0 / 3);
+        bezier.push_back(p[i + 1] - m1 / 3);
+        bezier.push_back(p[i + 1]);
+    }
+    return bezier;
+}
 
-    int k = knots.size() - controlVector3fs.size() - 1;
-    //temporarily set the middle point of the curve
-    //double mid = (knots[k] + knots[knots.size()-k]) / 2.0f;
-    //Vector3f o = ray.getOrigin();
-    //Vector3f d = ray.getDirection();
-    std::vector<double> x = init(o, d);
-
-    for(int i = 0; i < x.size(); i++){
-        double x0 = x[i], x1 = 0;    
-        int time = 0;
-        //TODO: Tune the depth of Newton's Method
-        while(time < 20){
-            //use special case of rotate surface
-            if(x0 < knots[k] || x0 > knots[controlVector3fs.size()]){
-                break;
-            }
-            x1 = x0;
-            x0 = x1 - Newton(x1, o, d);
-            time ++;
-            if(fabs(x1 - x0) < EPS)
-                break;
+std::vector<float> CatmullRomCurve::bezierKnots(int size){
+    //segments joined with C0 knots: 0 0 0 0 1 1 1 2 2 2 ... s s s s, scaled to [0, 1]
+    int segments = size - 3;
+    std::vector<float> knots;
+    knots.push_back(0);
+    for(int i = 0; i <= segments; i++){
+        for(int j = 0; j < 3; j++) knots.push_back(float(i) / segments);
+    }
+    knots.push_back(1);
+    return knots;
+}
+
+// Surface
+
+Vector3f Surface::evaluate(double u, double v) const {
+    Point3d point, du, dv;
+    evaluateFrame(u, v, point, du, dv);
+    return Vector3f(point[0], point[1], point[2]);
+}
+
+Vector3f Surface::evaluateDerivative(double t) const {
+    Point3d point, du, dv;
+    evaluateFrame(t, t, point, du, dv);
+    return Vector3f(du[0] + dv[0], du[1] + dv[1], du[2] + dv[2]);
+}
+
+Vector3f Surface::evaluatePartialDerivativeU(double u, double v) const {
+    Point3d point, du, dv;
+    evaluateFrame(u, v, point, du, dv);
+    return Vector3f(du[0], du[1], du[2]);
+}
+
+Vector3f Surface::evaluatePartialDerivativeV(double u, double v) const {
+    Point3d point, du, dv;
+    evaluateFrame(u, v, point, du, dv);
+    return Vector3f(dv[0], dv[1], dv[2]);
+}
+
+Mesh* Surface::tessellate(float tolerance) const {
+    std::vector<double> knotsU, knotsV;
+    breakpoints(knotsU, knotsV);
+    //isolines: the breakpoints of the other direction and the midpoints between them
+    auto isolines = [](const std::vector<double>& knots){
+        std::vector<double> lines;
+        for(size_t i = 0; i < knots.size(); i++){
+            lines.push_back(knots[i]);
+            if(i + 1 < knots.size()) lines.push_back(0.5 * (knots[i] + knots[i + 1]));
+        }
+        return lines;
+    };
+    std::vector<double> linesU = isolines(knotsU), linesV = isolines(knotsV);
+    std::vector<double> us = tessellation::refineAll(knotsU, tolerance, [&](double a, double b){
+        float error = 0;
+        for(double v : linesV){
+            error = std::max(error, tessellation::chordError([&](double u){ return evaluate(u, v); }, a, b));
         }
-        if(x0 < knots[k] || x0 > knots[controlVector3fs.size()]){
-            continue;
+        return error;
+    });
+    std::vector<double> vs = tessellation::refineAll(knotsV, tolerance, [&](double a, double b){
+        float error = 0;
+        for(double u : linesU){
+            error = std::max(error, tessellation::chordError([&](double v){ return evaluate(u, v); }, a, b));
         }
-        if(fabs(x1 - x0) > EPS)
-            continue;
-
-        if(fabs(f(x0, o, d)) < EPS){
-            Vector3f p = evaluate(x0);
-            if(fabs(d.z()) > EPS){
-                double tr = (p.y() - o.z()) / d.z();
-                if((p.y() - (o.z() + tr * d.z())) > EPS){
-                    //std::cout << p.y() - (o.z() + tr * d.z()) << std::endl;
-                    //continue;
-                }
-                if(tr < hit.getT()){
-                    //PhongMaterial* m = new PhongMaterial(Vector3f(0.5,0.5,0.5), Vector3f(0.5,0.5,0.5), 1);
-                    double sint = asin(map((tr * d.y() + o.y())/p.x()));
-                    double cost = acos(map((tr * d.x() + o.x())/p.x()));
-                    //sint: -pi/2 ~ pi/2
-                    //cost: 0 ~ pi
-                    //theta: -pi ~ pi
-                    double theta = sint >= 0 ? cost : -cost;
-                    if(fabs(sint) < EPS){
-                        theta = cost >= 0 ? 0 : PI;
-                    }
-                    if(fabs(cost) < EPS){
-                        theta = sint >= 0 ? PI / 2 : -PI / 2;
-                    }
-                    Vector3f dp = evaluateDerivative(x0);
-                    Vector3f normal = Vector3f::cross(Vector3f(dp.x() * cos(theta), dp.x() * sin(theta), dp.y()), Vector3f(-sin(theta),cos(theta),0));
-                    
-                    normal = rotate * normal;
-                    normal.normalize();
-                    Vector2f texCoord = Vector2f((x0 - knots[k])/(knots[knots.size()-k] - knots[k]), (theta + PI) / (2 * PI));
-                    hit.set(tr, this->material, normal, texCoord);
-                    isIntersect = true;
-                }
-            }else{
-                //std::cout << d.z() << std::endl;
-
-                float a = d.x() * d.x() + d.y() * d.y();
-                float b = 2 * (d.x() * o.x() + d.y() * o.y());
-                float c = o.x() * o.x() + o.y() * o.y() - p.x() * p.x();
-                float delta = b * b - 4 * a * c;
-                if(delta < 0){
-                    continue;
-                }
-                float t1 = (-b + sqrt(delta)) / (2 * a);
-                float t2 = (-b - sqrt(delta)) / (2 * a);
-                float tr = 0;
-
-                if(t1 > tmin && t2 > tmin){
-                    tr = std::min(t1, t2);
-                }else if(t1 > tmin){
-                    tr = t1;
-                }else if(t2 > tmin){
-                    tr = t2;
-                }else{
-                    continue;
-                }
-                if(tr < hit.getT()){
-                    //PhongMaterial* m = new PhongMaterial(Vector3f(0.5,0.5,0.5), Vector3f(0.5,0.5,0.5), 1);
-                    double sint = asin(map((tr * d.y() + o.y())/p.x()));
-                    double cost = acos(map((tr * d.x() + o.x())/p.x()));
-                    //sint: -pi/2 ~ pi/2
-                    //cost: 0 ~ pi
-                    //theta: -pi ~ pi
-                    double theta = sint >= 0 ? cost : -cost;
-                    if(fabs(sint) < EPS){
-                        theta = cost >= 0 ? 0 : PI;
-                    }
-                    if(fabs(cost) < EPS){
-                        theta = sint >= 0 ? PI / 2 : -PI / 2;
-                    }
-                    if((p.y() - (o.z() + tr * d.z())) > EPS){
-                        //std::cout << p.y() - (o.z() + tr * d.z()) << std::endl;
-                        //continue;
-                    }
-                    Vector3f dp = evaluateDerivative(x0);
-                    Vector3f normal = Vector3f::cross(Vector3f(dp.x() * cos(theta), dp.x() * sin(theta), dp.y()), Vector3f(-sin(theta),cos(theta),0));
-                    normal = rotate * normal;
-                    normal.normalize();
-                    Vector2f texCoord = Vector2f((x0 - knots[k])/(knots[knots.size()-k] - knots[k]), (theta + PI) / (2 * PI));
-                    hit.set(tr, this->material, normal, texCoord);
-                    isIntersect = true;
-                }
-                
+        return error;
+    });
+
+    int rows = us.size(), cols = vs.size();
+    double u0 = knotsU.front(), u1 = knotsU.back(), v0 = knotsV.front(), v1 = knotsV.back();
+    std::vector<Vector3f> points(rows * cols), normals(rows * cols);
+    std::vector<Vector2f> texCoords(rows * cols);
+    for(int i = 0; i < rows; i++){
+        for(int j = 0; j < cols; j++){
+            Point3d p, du, dv;
+            evaluateFrame(us[i], vs[j], p, du, dv);
+            Vector3f normal = Vector3f::cross(Vector3f(du[0], du[1], du[2]), Vector3f(dv[0], dv[1], dv[2]));
+            if(normal.squaredLength() < EPS2){
+                //collapsed edge: the normal of a point slightly inside the patch
+                Point3d q;
+                evaluateFrame(us[i] + 1e-3 * (0.5 * (u0 + u1) - us[i]), vs[j] + 1e-3 * (0.5 * (v0 + v1) - vs[j]), q, du, dv);
+                normal = Vector3f::cross(Vector3f(du[0], du[1], du[2]), Vector3f(dv[0], dv[1], dv[2]));
             }
+            normal.normalize();
+            points[i * cols + j] = Vector3f(p[0], p[1], p[2]);
+            normals[i * cols + j] = normal;
+            texCoords[i * cols + j] = Vector2f((us[i] - u0) / (u1 - u0), (vs[j] - v0) / (v1 - v0));
         }
     }
-    return isIntersect;
+    return tessellation::gridMesh(rows, cols, points, normals, texCoords, material);
 }
 
-// CatmullRomCurve
+void Surface::addBezierPatch(const Point3d* net, int degreeU, int degreeV, double u0, double u1, double v0, double v1){
+    pieceDegreeU = degreeU;
+    pieceDegreeV = degreeV;
+    pieceEvaluatorU = curve_eval::bezierEvaluator(degreeU);
+    pieceEvaluatorV = curve_eval::bezierEvaluator(degreeV);
+    std::vector<Point3d> copy(net, net + (degreeU + 1) * (degreeV + 1));
+    splitPiece(copy, u0, u1, v0, v1, 0, 0);
+}
 
-CatmullRomCurve::CatmullRomCurve(const std::vector<Vector3f>& controlVector3fs, float tension, Vector3f point1, Vector3f point2) {
-    this->controlVector3fs = controlVector3fs;
-    this->tension = tension;
-    this->point1 = point1;
-    this->point2 = point2;
+void Surface::splitPiece(std::vector<Point3d>& net, double u0, double u1, double v0, double v1, int depthU, int depthV){
+    int p = pieceDegreeU, q = pieceDegreeV, cols = q + 1;
+    auto at = [&](int i, int j) -> const Point3d& { return net[i * cols + j]; };
+    //squared distances: of the net from the bilinear corner quad, of the columns (rows) from their end chords
+    double flat = 0, bendU = 0, bendV = 0;
+    double low[3] = {DBL_MAX, DBL_MAX, DBL_MAX}, high[3] = {-DBL_MAX, -DBL_MAX, -DBL_MAX};
+    for(int i = 0; i <= p; i++){
+        for(int j = 0; j <= q; j++){
+            double a = p > 0 ? double(i) / p : 0, b = q > 0 ? double(j) / q : 0;
+            double eq = 0, eu = 0, ev = 0;
+            for(int c = 0; c < 3; c++){
+                double x = at(i, j)[c];
+                double quad = (1 - a) * ((1 - b) * at(0, 0)[c] + b * at(0, q)[c]) + a * ((1 - b) * at(p, 0)[c] + b * at(p, q)[c]);
+                double chordU = (1 - a) * at(0, j)[c] + a * at(p, j)[c];
+                double chordV = (1 - b) * at(i, 0)[c] + b * at(i, q)[c];
+                eq += (x - quad) * (x - quad);
+                eu += (x - chordU) * (x - chordU);
+                ev += (x - chordV) * (x - chordV);
+                low[c] = std::min(low[c], x);
+                high[c] = std::max(high[c], x);
+            }
+            flat = std::max(flat, eq);
+            bendU = std::max(bendU, eu);
+            bendV = std::max(bendV, ev);
+        }
+    }
+    double size = 0;
+    for(int c = 0; c < 3; c++) size += (high[c] - low[c]) * (high[c] - low[c]);
+    bool canSplitU = depthU < MAX_SPLIT_DEPTH, canSplitV = depthV < MAX_SPLIT_DEPTH;
+    if(flat <= FLATNESS * FLATNESS * size || (!canSplitU && !canSplitV)){
+        Piece piece = {int(pieceNets.size()), u0, u1, v0, v1};
+        pieceNets.insert(pieceNets.end(), net.begin(), net.end());
+        pieces.push_back(piece);
+        return;
+    }
+    std::vector<Point3d> left(net.size()), right(net.size());
+    if(canSplitU && (bendU >= bendV || !canSplitV)){
+        for(int j = 0; j <= q; j++) curve_eval::subdivide(&net[j], p, cols, 0.5, &left[j], &right[j]);
+        double um = 0.5 * (u0 + u1);
+        splitPiece(left, u0, um, v0, v1, depthU + 1, depthV);
+        splitPiece(right, um, u1, v0, v1, depthU + 1, depthV);
+    }else{
+        for(int i = 0; i <= p; i++) curve_eval::subdivide(&net[i * cols], q, 1, 0.5, &left[i * cols], &right[i * cols]);
+        double vm = 0.5 * (v0 + v1);
+        splitPiece(left, u0, u1, v0, vm, depthU, depthV + 1);
+        splitPiece(right, u0, u1, vm, v1, depthU, depthV + 1);
+    }
 }
 
-Vector3f CatmullRomCurve::evaluate(double t) const {
-    return Vector3f();
+void Surface::buildPatchBVH(){
+    if(pieces.empty()) return;
+    auto start = std::chrono::steady_clock::now();
+    int size = (pieceDegreeU + 1) * (pieceDegreeV + 1);
+    std::vector<BVHBuilder::Bounds> bounds(pieces.size());
+    double scale = 1;
+    for(size_t i = 0; i < pieces.size(); i++){
+        //convex hull property: the net bounds the piece, padded for the float boxes
+        for(int c = 0; c < 3; c++){
+            double low = DBL_MAX, high = -DBL_MAX;
+            for(int k = 0; k < size; k++){
+                low = std::min(low, pieceNets[pieces[i].net + k][c]);
+                high = std::max(high, pieceNets[pieces[i].net + k][c]);
+            }
+            scale = std::max(scale, std::max(std::fabs(low), std::fabs(high)));
+            bounds[i].min[c] = low;
+            bounds[i].max[c] = high;
+        }
+    }
+    float pad = 1e-5f * scale;
+    for(auto& b : bounds){
+        for(int c = 0; c < 3; c++){
+            b.min[c] -= pad;
+            b.max[c] += pad;
+        }
+    }
+    std::vector<int> order;
+    pieceRoot = new BVHNode(bounds, order);
+    std::vector<Piece> sorted(pieces.size());
+    for(size_t i = 0; i < order.size(); i++) sorted[i] = pieces[order[i]];
+    pieces.swap(sorted);
+    RenderStats::instance().addBVHBuildTime(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    //same rule as the revolution surfaces: hit points come back rounded to float
+    selfIntersectionEps = 1e-4 * scale;
+    newtonEps = 1e-9 * scale;
+    domainU0 = domainV0 = DBL_MAX;
+    domainU1 = domainV1 = -DBL_MAX;
+    for(const auto& piece : pieces){
+        domainU0 = std::min(domainU0, piece.u0);
+        domainU1 = std::max(domainU1, piece.u1);
+        domainV0 = std::min(domainV0, piece.v0);
+        domainV1 = std::max(domainV1, piece.v1);
+    }
 }
 
-Vector3f CatmullRomCurve::evaluateDerivative(double t) const {
-    return Vector3f();
+void Surface::evaluatePiece(const Piece& piece, double s, double w, Point3d& point, Point3d& ds, Point3d& dw) const {
+    const Point3d* net = &pieceNets[piece.net];
+    int cols = pieceDegreeV + 1;
+    Point3d column[MAX_ORDER], columnW[MAX_ORDER], unused;
+    for(int i = 0; i <= pieceDegreeU; i++){
+        pieceEvaluatorV(net + i * cols, pieceDegreeV, w, column[i], columnW[i]);
+    }
+    pieceEvaluatorU(column, pieceDegreeU, s, point, ds);
+    pieceEvaluatorU(columnW, pieceDegreeU, s, dw, unused);
 }
 
-bool CatmullRomCurve::intersect(const Ray& ray, Hit& hit, float tmin){
-    //
+namespace {
+//ray against triangle a, b, c in double, two sided and unbounded in t: barycentrics of the hit on the plane
+bool planeBarycentrics(const double* o, const double* d, const Point3d& a, const Point3d& b, const Point3d& c, double& beta, double& gamma){
+    double e1[3], e2[3], t[3];
+    for(int k = 0; k < 3; k++){
+        e1[k] = b[k] - a[k];
+        e2[k] = c[k] - a[k];
+        t[k] = o[k] - a[k];
+    }
+    double p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0]};
+    double det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if(det == 0) return false;
+    double q[3] = {t[1] * e1[2] - t[2] * e1[1], t[2] * e1[0] - t[0] * e1[2], t[0] * e1[1] - t[1] * e1[0]};
+    beta = (t[0] * p[0] + t[1] * p[1] + t[2] * p[2]) / det;
+    gamma = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) / det;
     return true;
 }
+}
 
-// BezierSurface
-
-BezierSurface::BezierSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs) {
-    this->controlVector3fs = controlVector3fs;
+bool Surface::newton(const Piece& piece, const PlaneRay& ray, double& s, double& w, Point3d& point, Point3d& ds, Point3d& dw) const {
+    //Newton on the distances of S(s, w) to both planes of the ray
+    for(int iteration = 0; iteration < NEWTON_ITERATIONS; iteration++){
+        evaluatePiece(piece, s, w, point, ds, dw);
+        double f1 = ray.d1, f2 = ray.d2, a = 0, b = 0, c = 0, d = 0;
+        for(int k = 0; k < 3; k++){
+            f1 += ray.n1[k] * point[k];
+            f2 += ray.n2[k] * point[k];
+            a += ray.n1[k] * ds[k];
+            b += ray.n1[k] * dw[k];
+            c += ray.n2[k] * ds[k];
+            d += ray.n2[k] * dw[k];
+        }
+        if(std::fabs(f1) + std::fabs(f2) < newtonEps){
+            //a root outside belongs to a neighbouring piece
+            const double margin = 1e-9;
+            return s >= -margin && s <= 1 + margin && w >= -margin && w <= 1 + margin;
+        }
+        double det = a * d - b * c;
+        if(det == 0) return false;
+        s -= (d * f1 - b * f2) / det;
+        w -= (a * f2 - c * f1) / det;
+        //left the piece for good
+        if(s < -0.5 || s > 1.5 || w < -0.5 || w > 1.5) return false;
+    }
+    return false;
 }
 
-Vector3f BezierSurface::evaluate(double u, double v) const {
-    return Vector3f();
+bool Surface::intersectPiece(const Piece& piece, const PlaneRay& ray, float tmin, Hit& hit) const {
+    const Point3d* net = &pieceNets[piece.net];
+    int cols = pieceDegreeV + 1;
+    const Point3d& p00 = net[0];
+    const Point3d& p01 = net[pieceDegreeV];
+    const Point3d& p10 = net[pieceDegreeU * cols];
+    const Point3d& p11 = net[pieceDegreeU * cols + pieceDegreeV];
+
+    //first step of Bezier clipping: in the frame of the ray's planes the piece lies in the hull of its
+    //net, the ray (the origin) must be inside the bounds of the projected net
+    int size = (pieceDegreeU + 1) * cols;
+    double low1 = DBL_MAX, high1 = -DBL_MAX, low2 = DBL_MAX, high2 = -DBL_MAX;
+    for(int i = 0; i < size; i++){
+        double f1 = ray.d1, f2 = ray.d2;
+        for(int k = 0; k < 3; k++){
+            f1 += ray.n1[k] * net[i][k];
+            f2 += ray.n2[k] * net[i][k];
+        }
+        low1 = std::min(low1, f1);
+        high1 = std::max(high1, f1);
+        low2 = std::min(low2, f2);
+        high2 = std::max(high2, f2);
+    }
+    if(low1 > newtonEps || high1 < -newtonEps || low2 > newtonEps || high2 < -newtonEps) return false;
+
+    //seed from the corner quad (nearly the piece, it is flat): triangle p00 p10 p11 or p00 p11 p01
+    double s = 0.5, w = 0.5, beta, gamma;
+    if(planeBarycentrics(ray.o, ray.d, p00, p10, p11, beta, gamma) && beta >= 0){
+        s = beta + gamma;
+        w = gamma;
+    }else if(planeBarycentrics(ray.o, ray.d, p00, p11, p01, beta, gamma)){
+        s = beta;
+        w = beta + gamma;
+    }
+    s = std::min(1.0, std::max(0.0, s));
+    w = std::min(1.0, std::max(0.0, w));
+
+    //grazing rays can send Newton off the piece from the quad seed, then retry from fixed seeds
+    const double seeds[][2] = {{s, w}, {0.5, 0.5}, {0.15, 0.15}, {0.85, 0.15}, {0.15, 0.85}, {0.85, 0.85}};
+    Point3d point, ds, dw;
+    bool found = false;
+    for(int i = 0; i < 6 && !found; i++){
+        const double* seed = seeds[i];
+        s = seed[0];
+        w = seed[1];
+        found = newton(piece, ray, s, w, point, ds, dw);
+    }
+    if(!found) return false;
+
+    double t = 0;
+    for(int k = 0; k < 3; k++) t += (point[k] - ray.o[k]) * ray.d[k];
+    t /= ray.dd;
+    if(!(t > std::max(double(tmin), selfIntersectionEps) && t < hit.getT())) return false;
+
+    //the piece's derivatives are the surface's partials scaled by the piece size
+    Vector3f normal = Vector3f::cross(Vector3f(ds[0], ds[1], ds[2]), Vector3f(dw[0], dw[1], dw[2]));
+    if(normal.squaredLength() < EPS2){
+        //collapsed edge: the normal of a point slightly inside the piece
+        evaluatePiece(piece, s + 1e-3 * (0.5 - s), w + 1e-3 * (0.5 - w), point, ds, dw);
+        normal = Vector3f::cross(Vector3f(ds[0], ds[1], ds[2]), Vector3f(dw[0], dw[1], dw[2]));
+    }
+    normal.normalize();
+    double u = piece.u0 + s * (piece.u1 - piece.u0), v = piece.v0 + w * (piece.v1 - piece.v0);
+    Vector2f texCoord((u - domainU0) / (domainU1 - domainU0), (v - domainV0) / (domainV1 - domainV0));
+    hit.set(t, material, normal, texCoord);
+    return true;
 }
 
-Vector3f BezierSurface::evaluateDerivative(double t) const {
-    return Vector3f();
+bool Surface::intersect(const Ray& ray, Hit& hit, float tmin){
+    if(pieceRoot == nullptr) return false;
+    PlaneRay r;
+    const Vector3f& o = ray.getOrigin();
+    const Vector3f& d = ray.getDirection();
+    for(int k = 0; k < 3; k++){
+        r.o[k] = o[k];
+        r.d[k] = d[k];
+    }
+    r.dd = r.d[0] * r.d[0] + r.d[1] * r.d[1] + r.d[2] * r.d[2];
+    //n1 perpendicular to d, n2 = n1 x d
+    double n1[3];
+    if(std::fabs(r.d[0]) > std::fabs(r.d[1]) && std::fabs(r.d[0]) > std::fabs(r.d[2])){
+        n1[0] = r.d[1]; n1[1] = -r.d[0]; n1[2] = 0;
+    }else{
+        n1[0] = 0; n1[1] = r.d[2]; n1[2] = -r.d[1];
+    }
+    double n2[3] = {n1[1] * r.d[2] - n1[2] * r.d[1], n1[2] * r.d[0] - n1[0] * r.d[2], n1[0] * r.d[1] - n1[1] * r.d[0]};
+    double l1 = std::sqrt(n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+    double l2 = std::sqrt(n2[0] * n2[0] + n2[1] * n2[1] + n2[2] * n2[2]);
+    r.d1 = r.d2 = 0;
+    for(int k = 0; k < 3; k++){
+        r.n1[k] = n1[k] / l1;
+        r.n2[k] = n2[k] / l2;
+        r.d1 -= r.n1[k] * r.o[k];
+        r.d2 -= r.n2[k] * r.o[k];
+    }
+    return pieceRoot->intersect(ray, hit, tmin, [this, &r](int i, const Ray&, Hit& h, float tmin){
+        return intersectPiece(pieces[i], r, tmin, h);
+    });
 }
 
-Vector3f BezierSurface::evaluatePartialDerivativeU(double u, double v) const {
-    return Vector3f();
+// BezierSurface
+
+BezierSurface::BezierSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, Material* m) {
+    this->controlVector3fs = controlVector3fs;
+    this->material = m;
+    rows = controlVector3fs.size();
+    cols = rows > 0 ? controlVector3fs[0].size() : 0;
+    for(const auto& row : controlVector3fs){
+        if(int(row.size()) != cols || cols == 0){
+            std::cout << "Error: Bezier surface needs a rectangular control net." << std::endl;
+            exit(1);
+        }
+        for(const auto& c : row) net.push_back(Point3d{{c.x(), c.y(), c.z()}});
+    }
+    if(rows > MAX_ORDER || cols > MAX_ORDER){
+        std::cout << "Error: Bezier surface of degree above " << MAX_ORDER - 1 << "." << std::endl;
+        exit(1);
+    }
+    evaluatorU = curve_eval::bezierEvaluator(rows - 1);
+    evaluatorV = curve_eval::bezierEvaluator(cols - 1);
+    addBezierPatch(net.data(), rows - 1, cols - 1, 0, 1, 0, 1);
+    buildPatchBVH();
 }
 
-Vector3f BezierSurface::evaluatePartialDerivativeV(double u, double v) const {
-    return Vector3f();
+void BezierSurface::evaluateFrame(double u, double v, Point3d& point, Point3d& du, Point3d& dv) const {
+    //every row along v, then the column of row points (and of their v derivatives) along u
+    Point3d column[MAX_ORDER], columnV[MAX_ORDER], unused;
+    for(int i = 0; i < rows; i++){
+        evaluatorV(&net[i * cols], cols - 1, v, column[i], columnV[i]);
+    }
+    evaluatorU(column, rows - 1, u, point, du);
+    evaluatorU(columnV, rows - 1, u, dv, unused);
 }
 
-bool BezierSurface::intersect(const Ray& ray, Hit& hit, float tmin){
-    //
-    return true;
+void BezierSurface::breakpoints(std::vector<double>& u, std::vector<double>& v) const {
+    u = {0, 1};
+    v = {0, 1};
 }
 
 // BSplineSurface
 
-BSplineSurface::BSplineSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, const std::vector<float>& knotsU, const std::vector<float>& knotsV) {
+BSplineSurface::BSplineSurface(const std::vector<std::vector<Vector3f>>& controlVector3fs, const std::vector<float>& knotsU, const std::vector<float>& knotsV, Material* m) {
     this->controlVector3fs = controlVector3fs;
     this->knotsU = knotsU;
     this->knotsV = knotsV;
-}
-
-Vector3f BSplineSurface::evaluate(double u, double v) const {
-    return Vector3f();
-}
-
-Vector3f BSplineSurface::evaluateDerivative(double t) const {
-    return Vector3f();
-}
+    this->material = m;
+    rows = controlVector3fs.size();
+    cols = rows > 0 ? controlVector3fs[0].size() : 0;
+    for(const auto& row : controlVector3fs){
+        if(int(row.size()) != cols || cols == 0){
+            std::cout << "Error: B-spline surface needs a rectangular control net." << std::endl;
+            exit(1);
+        }
+        for(const auto& c : row) net.push_back(Point3d{{c.x(), c.y(), c.z()}});
+    }
+    degreeU = int(knotsU.size()) - rows - 1;
+    degreeV = int(knotsV.size()) - cols - 1;
+    if(degreeU < 1 || degreeV < 1){
+        std::cout << "Error: B-spline surface needs more knots than control points plus one in u and v." << std::endl;
+        exit(1);
+    }
+    if(degreeU >= MAX_ORDER || degreeV >= MAX_ORDER){
+        std::cout << "Error: B-spline surface of degree above " << MAX_ORDER - 1 << "." << std::endl;
+        exit(1);
+    }
 
-Vector3f BSplineSurface::evaluatePartialDerivativeU(double u, double v) const {
-    return Vector3f();
+    //every nonempty span pair as a Bezier patch: the rows of the span to Bezier along v, then the columns along u
+    int orderV = degreeV + 1;
+    std::vector<Point3d> rowsBezier((degreeU + 1) * orderV), patch((degreeU + 1) * orderV);
+    std::vector<Point3d> column(rows), columnBezier(degreeU + 1);
+    for(int ku = degreeU; ku < rows; ku++){
+        if(!(knotsU[ku + 1] > knotsU[ku])) continue;
+        for(int kv = degreeV; kv < cols; kv++){
+            if(!(knotsV[kv + 1] > knotsV[kv])) continue;
+            for(int r = 0; r <= degreeU; r++){
+                curve_eval::bsplineSpanToBezier(&net[(ku - degreeU + r) * cols], knotsV.data(), degreeV, kv, &rowsBezier[r * orderV]);
+            }
+            for(int j = 0; j < orderV; j++){
+                for(int r = 0; r <= degreeU; r++) column[ku - degreeU + r] = rowsBezier[r * orderV + j];
+                curve_eval::bsplineSpanToBezier(column.data(), knotsU.data(), degreeU, ku, columnBezier.data());
+                for(int r = 0; r <= degreeU; r++) patch[r * orderV + j] = columnBezier[r];
+            }
+            addBezierPatch(patch.data(), degreeU, degreeV, knotsU[ku], knotsU[ku + 1], knotsV[kv], knotsV[kv + 1]);
+        }
+    }
+    buildPatchBVH();
 }
 
-Vector3f BSplineSurface::evaluatePartialDerivativeV(double u, double v) const {
-    return Vector3f();
+void BSplineSurface::evaluateFrame(double u, double v, Point3d& point, Point3d& du, Point3d& dv) const {
+    int ku = curve_eval::findSpan(knotsU.data(), degreeU, rows - 1, u);
+    int kv = curve_eval::findSpan(knotsV.data(), degreeV, cols - 1, v);
+    //the rows of the span along v, then the resulting column along u
+    Point3d column[MAX_ORDER], columnV[MAX_ORDER], unused;
+    for(int i = 0; i <= degreeU; i++){
+        const Point3d* row = &net[(ku - degreeU + i) * cols + kv - degreeV];
+        curve_eval::deBoor(row, knotsV.data(), degreeV, kv, v, column[i], columnV[i]);
+    }
+    curve_eval::deBoor(column, knotsU.data(), degreeU, ku, u, point, du);
+    curve_eval::deBoor(columnV, knotsU.data(), degreeU, ku, u, dv, unused);
 }
 
-bool BSplineSurface::intersect(const Ray& ray, Hit& hit, float tmin){
-    //
-    return true;
+void BSplineSurface::breakpoints(std::vector<double>& u, std::vector<double>& v) const {
+    u.assign(knotsU.begin() + degreeU, knotsU.begin() + rows + 1);
+    v.assign(knotsV.begin() + degreeV, knotsV.begin() + cols + 1);
 }
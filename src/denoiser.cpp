@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+#include "../include/denoiser.hpp"
+#include "../include/film.hpp"
+
+//the guides, one plane per channel, row major from y = 0 like the film
+struct Denoiser::Guide {
+    int width, height;
+    std::vector<float> normal[3];
+    std::vector<float> albedo[3];
+    //1 / (sigmaDepth * depth), 0 on a miss
+    std::vector<float> invDepth;
+    std::vector<float> depth;
+};
+
+void Denoiser::denoise(Film& film) const {
+    if(!film.hasAOVs() || iterations <= 0) return;
+    int width = film.getWidth(), height = film.getHeight(), n = width * height;
+    Guide guide;
+    guide.width = width;
+    guide.height = height;
+    std::vector<float> color[3], scratch[3], divisor[3];
+    for(int c = 0; c < 3; c++) {
+        guide.normal[c].resize(n);
+        guide.albedo[c].resize(n);
+        color[c].resize(n);
+        scratch[c].resize(n);
+        divisor[c].resize(n);
+    }
+    guide.depth.resize(n);
+    guide.invDepth.resize(n);
+#pragma omp parallel for schedule(dynamic, 16)
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            int i = y * width + x;
+            Vector3f value = film.getPixel(x, y);
+            AOVSample aov = film.getAOVs(x, y);
+            for(int c = 0; c < 3; c++) {
+                guide.normal[c][i] = aov.normal[c];
+                guide.albedo[c][i] = aov.albedo[c];
+                //filter the illumination, not the texture: divide by the albedo where there is one
+                divisor[c][i] = aov.albedo[c] > 0.01f ? aov.albedo[c] : 1;
+                color[c][i] = value[c] / divisor[c][i];
+            }
+            guide.depth[i] = aov.depth;
+            guide.invDepth[i] = aov.depth > 0 ? 1 / (sigmaDepth * aov.depth) : 0;
+        }
+    }
+    std::vector<float>* in = color;
+    std::vector<float>* out = scratch;
+    float sigma = sigmaColor;
+    for(int i = 0, step = 1; i < iterations; i++, step *= 2, sigma *= 0.5f) {
+        iterate(guide, in, out, step, sigma);
+        std::swap(in, out);
+    }
+#pragma omp parallel for schedule(dynamic, 16)
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            int i = y * width + x;
+            film.setPixel(x, y, Vector3f(in[0][i] * divisor[0][i], in[1][i] * divisor[1][i], in[2][i] * divisor[2][i]));
+        }
+    }
+}
+
+static inline float square(float x) {
+    return x * x;
+}
+
+//inverse squared tolerances of the edge stopping terms
+struct EdgeScales {
+    float color, normal, albedo, depth;
+};
+
+//one kernel tap for the centers p + x0 .. p + x1 - 1, tap pixels q + x0 .. q + x1 - 1
+//omp simd: with this many arrays the compiler gives up on its own (alias checks)
+static void accumulateTap(const Denoiser::Guide& guide, const std::vector<float>* mapped, const std::vector<float>* in,
+                          std::vector<float>* sum, float* weight, const EdgeScales& scales, int p, int q, int x0, int x1, float h) {
+    const float *m0 = mapped[0].data(), *m1 = mapped[1].data(), *m2 = mapped[2].data();
+    const float *n0 = guide.normal[0].data(), *n1 = guide.normal[1].data(), *n2 = guide.normal[2].data();
+    const float *a0 = guide.albedo[0].data(), *a1 = guide.albedo[1].data(), *a2 = guide.albedo[2].data();
+    const float *z = guide.depth.data(), *invZ = guide.invDepth.data();
+    const float *c0 = in[0].data(), *c1 = in[1].data(), *c2 = in[2].data();
+    float *s0 = sum[0].data(), *s1 = sum[1].data(), *s2 = sum[2].data();
+#pragma omp simd
+    for(int x = x0; x < x1; x++) {
+        float dc = square(m0[p + x] - m0[q + x]) + square(m1[p + x] - m1[q + x]) + square(m2[p + x] - m2[q + x]);
+        float dn = square(n0[p + x] - n0[q + x]) + square(n1[p + x] - n1[q + x]) + square(n2[p + x] - n2[q + x]);
+        float da = square(a0[p + x] - a0[q + x]) + square(a1[p + x] - a1[q + x]) + square(a2[p + x] - a2[q + x]);
+        float dz = std::fabs(z[p + x] - z[q + x]) * invZ[p + x];
+        float w = h * std::exp(-(dc * scales.color + dn * scales.normal + da * scales.albedo + dz * scales.depth));
+        s0[x] += w * c0[q + x];
+        s1[x] += w * c1[q + x];
+        s2[x] += w * c2[q + x];
+        weight[x] += w;
+    }
+}
+
+void Denoiser::iterate(const Guide& guide, const std::vector<float>* in, std::vector<float>* out, int step, float sigmaColor) const {
+    const float kernel[2 * KERNEL_RADIUS + 1] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    int width = guide.width, height = guide.height, n = width * height;
+    //colors are compared tone compressed (c / (1 + c)), so a firefly does not stop everything around it
+    std::vector<float> mapped[3];
+    for(int c = 0; c < 3; c++) mapped[c].resize(n);
+#pragma omp parallel for schedule(static)
+    for(int i = 0; i < n; i++) {
+        for(int c = 0; c < 3; c++) mapped[c][i] = in[c][i] / (1 + in[c][i]);
+    }
+    EdgeScales scales;
+    scales.color = 1 / (sigmaColor * sigmaColor);
+    scales.normal = 1 / (sigmaNormal * sigmaNormal);
+    scales.albedo = 1 / (sigmaAlbedo * sigmaAlbedo);
+    //the depth difference grows with the distance of the taps
+    scales.depth = 1.0f / step;
+#pragma omp parallel
+    {
+        std::vector<float> sum[3], weight(width);
+        for(int c = 0; c < 3; c++) sum[c].resize(width);
+#pragma omp for schedule(dynamic, 4)
+        for(int y = 0; y < height; y++) {
+            for(int c = 0; c < 3; c++) std::fill(sum[c].begin(), sum[c].end(), 0.0f);
+            std::fill(weight.begin(), weight.end(), 0.0f);
+            const int p = y * width;
+            for(int ty = -KERNEL_RADIUS; ty <= KERNEL_RADIUS; ty++) {
+                int qy = y + ty * step;
+                if(qy < 0 || qy >= height) continue;
+                for(int tx = -KERNEL_RADIUS; tx <= KERNEL_RADIUS; tx++) {
+                    //the taps of this offset that stay inside the image form one contiguous run of x
+                    int dx = tx * step, x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+                    if(x0 >= x1) continue;
+                    const int q = qy * width + dx;
+                    float h = kernel[ty + KERNEL_RADIUS] * kernel[tx + KERNEL_RADIUS];
+                    accumulateTap(guide, mapped, in, sum, weight.data(), scales, p, q, x0, x1, h);
+                }
+            }
+            //the center tap always has weight h > 0
+            for(int c = 0; c < 3; c++) {
+                for(int x = 0; x < width; x++) out[c][p + x] = sum[c][x] / weight[x];
+            }
+        }
+    }
+}
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cmath>
+
+#include "../include/emitter.hpp"
+#include "../include/material.hpp"
+#include "../include/group.hpp"
+#include "../include/camera.hpp"
+#include "../include/utils.hpp"
+
+Vector3f emissionOf(const Material* material) {
+    if(const DiscreteMaterial* m = dynamic_cast<const DiscreteMaterial*>(material)) return m->getEmissionColor();
+    if(const EmpiricalMaterial* m = dynamic_cast<const EmpiricalMaterial*>(material)) return m->getEmissionColor();
+    return Vector3f::ZERO;
+}
+
+float uniformScale(const Matrix4f& m) {
+    Vector3f axes[3];
+    for(int j = 0; j < 3; j++) axes[j] = m.getCol(j).xyz();
+    float scale = axes[0].length();
+    for(int j = 0; j < 3; j++) {
+        if(std::fabs(axes[j].length() - scale) > 1e-4f * scale) return 0;
+        if(std::fabs(Vector3f::dot(axes[j], axes[(j + 1) % 3])) > 1e-4f * scale * scale) return 0;
+    }
+    return scale;
+}
+
+Vector3f cosineDirection(const Vector3f& w, float u1, float u2) {
+    float angle = 2 * M_PI * u1, r = std::sqrt(u2);
+    Vector3f u = (Vector3f::cross((std::fabs(w.x()) > 0.1f ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)), w)).normalized(), v = Vector3f::cross(w, u);
+    return (u * std::cos(angle) * r + v * std::sin(angle) * r + w * std::sqrt(1 - u2)).normalized();
+}
+
+float visibleRadius(Camera* camera, Group* group, Vector3f* center) {
+    const int n = 32;
+    Vector3f lo(1e38f), hi(-1e38f);
+    int hits = 0;
+    for(int j = 0; j < n; j++) for(int i = 0; i < n; i++) {
+        Ray ray = camera->generateRay(Vector2f((i + 0.5f) * camera->getWidth() / n, (j + 0.5f) * camera->getHeight() / n));
+        Hit hit;
+        if(!group->intersect(ray, hit, EPS)) continue;
+        Vector3f p = ray.pointAtParameter(hit.getT());
+        for(int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+        hits++;
+    }
+    if(center != nullptr) *center = hits > 0 ? (lo + hi) / 2 : Vector3f::ZERO;
+    return hits > 0 ? std::max((hi - lo).length() / 2, 1e-3f) : 1;
+}
+
+EmissiveShape EmissiveShape::sphere(const Vector3f& center, float radius, Material* material) {
+    EmissiveShape shape;
+    shape.type = SPHERE;
+    shape.p[0] = center;
+    shape.radius = radius;
+    shape.material = material;
+    shape.emission = emissionOf(material);
+    shape.area = 4 * M_PI * radius * radius;
+    return shape;
+}
+
+EmissiveShape EmissiveShape::triangle(const Vector3f& a, const Vector3f& b, const Vector3f& c, Material* material, bool twoSided) {
+    EmissiveShape shape;
+    shape.twoSided = twoSided;
+    shape.type = TRIANGLE;
+    shape.p[0] = a;
+    shape.p[1] = b;
+    shape.p[2] = c;
+    shape.material = material;
+    shape.emission = emissionOf(material);
+    shape.area = 0.5f * Vector3f::cross(b - a, c - a).length();
+    return shape;
+}
+
+void EmissiveShape::sample(float u, float v, Vector3f& point, Vector3f& n) const {
+    if(type == SPHERE) {
+        float z = 1 - 2 * u, r = std::sqrt(std::max(0.0f, 1 - z * z)), phi = 2 * M_PI * v;
+        n = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        point = p[0] + radius * n;
+        return;
+    }
+    //uniform barycentrics by the square root warp
+    float su = std::sqrt(u), b0 = 1 - su, b1 = v * su;
+    point = b0 * p[0] + b1 * p[1] + (1 - b0 - b1) * p[2];
+    n = Vector3f::cross(p[1] - p[0], p[2] - p[0]).normalized();
+}
+
+bool EmissiveShape::sampleCone(const Vector3f& ref, float u, float v, Vector3f& point, Vector3f& n, float& pdf) const {
+    Vector3f wc = p[0] - ref;
+    float dc2 = wc.squaredLength(), r2 = radius * radius;
+    if(dc2 <= r2 * 1.0001f) return false;
+    float dc = std::sqrt(dc2);
+    wc = wc / dc;
+    //1 - cos(theta_max) without cancellation for small spheres far away
+    float sinThetaMax2 = r2 / dc2, cosThetaMax = std::sqrt(std::max(0.0f, 1 - sinThetaMax2));
+    float oneMinusCosThetaMax = sinThetaMax2 / (1 + cosThetaMax);
+    float oneMinusCosTheta = u * oneMinusCosThetaMax, cosTheta = 1 - oneMinusCosTheta;
+    float sinTheta2 = oneMinusCosTheta * (1 + cosTheta), sinTheta = std::sqrt(std::max(0.0f, sinTheta2));
+    float phi = 2 * M_PI * v;
+    Vector3f a = Vector3f::cross(std::fabs(wc.x()) > 0.1f ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0), wc).normalized(), b = Vector3f::cross(wc, a);
+    Vector3f w = (wc * cosTheta + a * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi))).normalized();
+    //distance to the near side of the sphere along w
+    float ds = dc * cosTheta - std::sqrt(std::max(0.0f, r2 - dc2 * sinTheta2));
+    point = ref + w * ds;
+    n = (point - p[0]).normalized();
+    pdf = 1 / (2 * M_PI * oneMinusCosThetaMax);
+    return true;
+}
+
+float EmissiveShape::pdfCone(const Vector3f& ref) const {
+    float dc2 = (p[0] - ref).squaredLength(), r2 = radius * radius;
+    if(dc2 <= r2 * 1.0001f) return 0;
+    float sinThetaMax2 = r2 / dc2, cosThetaMax = std::sqrt(std::max(0.0f, 1 - sinThetaMax2));
+    return 1 / (2 * M_PI * sinThetaMax2 / (1 + cosThetaMax));
+}
+
+Vector3f EmissiveShape::sampleDirection(const Vector3f& n, float u0, float u1, float u2, float& pdf) const {
+    //two sided emitters pick the side first
+    Vector3f side = twoSided && u0 < 0.5f ? -n : n;
+    Vector3f w = cosineDirection(side, u1, u2);
+    pdf = pdfDirection(twoSided, Vector3f::dot(w, n));
+    return w;
+}
+
+EmitterSampler::EmitterSampler(Group* group) {
+    std::vector<EmissiveShape> all;
+    if(group != nullptr) group->collectEmitters(Matrix4f::identity(), all);
+    float total = 0;
+    for(const EmissiveShape& shape : all) {
+        float power = shape.power();
+        if(!(power > 0)) continue;
+        if(shape.type == EmissiveShape::SPHERE) spheres.push_back(shapes.size());
+        shapes.push_back(shape);
+        total += power;
+        cdf.push_back(total);
+        if(find(shape.material) < 0) materials.push_back(std::make_pair(shape.material, shape.twoSided));
+    }
+}
+
+int EmitterSampler::find(const Material* material) const {
+    for(int i = 0; i < int(materials.size()); i++) {
+        if(materials[i].first == material) return i;
+    }
+    return -1;
+}
+
+const EmissiveShape& EmitterSampler::choose(float u, float& pdf) const {
+    float total = cdf.back();
+    int i = std::upper_bound(cdf.begin(), cdf.end(), u * total) - cdf.begin();
+    i = std::min(i, int(shapes.size()) - 1);
+    pdf = (cdf[i] - (i > 0 ? cdf[i - 1] : 0)) / total;
+    return shapes[i];
+}
+
+const EmissiveShape& EmitterSampler::sample(float u0, float u1, float u2, Vector3f& point, Vector3f& n, float& pdf) const {
+    float choice;
+    const EmissiveShape& shape = choose(u0, choice);
+    shape.sample(u1, u2, point, n);
+    pdf = choice / shape.area;
+    return shape;
+}
+
+float EmitterSampler::pdfPoint(const Material* material) const {
+    int i = find(material);
+    if(i < 0) return 0;
+    return luminance(emissionOf(material)) * (materials[i].second ? 2 : 1) / cdf.back();
+}
+
+const EmissiveShape& EmitterSampler::sampleDirect(const Vector3f& ref, float u0, float u1, float u2, Vector3f& point, Vector3f& n, float& pdf) const {
+    float choice;
+    const EmissiveShape& shape = choose(u0, choice);
+    if(shape.type == EmissiveShape::SPHERE && shape.sampleCone(ref, u1, u2, point, n, pdf)) {
+        pdf *= choice;
+        return shape;
+    }
+    shape.sample(u1, u2, point, n);
+    Vector3f w = point - ref;
+    float d2 = w.squaredLength(), cosine = d2 > 0 ? std::fabs(Vector3f::dot(n, w)) / std::sqrt(d2) : 0;
+    pdf = cosine > 0 ? choice / shape.area * d2 / cosine : 0;
+    return shape;
+}
+
+float EmitterSampler::pdfDirect(const Vector3f& ref, const Vector3f& point, const Vector3f& n, const Material* material) const {
+    float pdfArea = pdfPoint(material);
+    if(pdfArea == 0) return 0;
+    for(int i : spheres) {
+        const EmissiveShape& sphere = shapes[i];
+        if(sphere.material != material || std::fabs((point - sphere.p[0]).length() - sphere.radius) > 1e-3f * sphere.radius) continue;
+        float cone = sphere.pdfCone(ref);
+        if(cone > 0) return cone * sphere.power() / cdf.back();
+        break;
+    }
+    Vector3f w = point - ref;
+    float d2 = w.squaredLength(), cosine = d2 > 0 ? std::fabs(Vector3f::dot(n, w)) / std::sqrt(d2) : 0;
+    return cosine > 0 ? pdfArea * d2 / cosine : 0;
+}
+
+bool EmitterSampler::twoSided(const Material* material) const {
+    int i = find(material);
+    return i < 0 || materials[i].second;
+}
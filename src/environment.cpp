@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "../include/environment.hpp"
+#include "../include/emitter.hpp"
+#include "../include/stb_image.h"
+
+EnvironmentMap::EnvironmentMap(const std::string& filename, float scale) {
+    int channels;
+    float* data = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+    if(data == nullptr) {
+        printf("load environment map %s failed\n", filename.c_str());
+        width = height = 0;
+        return;
+    }
+    texels.resize(width * height);
+    std::vector<float> weights(width * height);
+    double sum = 0;
+    for(int j = 0; j < height; j++) {
+        //solid angle of the texels of the row over (2 pi^2 / (width * height))
+        float sinTheta = std::sin(M_PI * (j + 0.5f) / height);
+        for(int i = 0; i < width; i++) {
+            int k = j * width + i;
+            texels[k] = Vector3f(data[3 * k], data[3 * k + 1], data[3 * k + 2]) * scale;
+            weights[k] = std::max(0.0f, luminance(texels[k])) * sinTheta;
+            sum += weights[k];
+        }
+    }
+    stbi_image_free(data);
+    integral = float(sum * 2 * M_PI * M_PI / (width * height));
+    //a black map: uniform over the image
+    if(sum == 0) std::fill(weights.begin(), weights.end(), 1.0f);
+    distribution = AliasTable(weights);
+}
+
+int EnvironmentMap::texel(const Vector3f& d) const {
+    float theta = std::acos(std::min(1.0f, std::max(-1.0f, d.y())));
+    float phi = std::atan2(d.x(), -d.z());
+    int i = std::min(int((phi + M_PI) / (2 * M_PI) * width), width - 1);
+    int j = std::min(int(theta / M_PI * height), height - 1);
+    return std::max(j, 0) * width + std::max(i, 0);
+}
+
+Vector3f EnvironmentMap::Le(const Vector3f& d) const {
+    return texels[texel(d)];
+}
+
+Vector3f EnvironmentMap::sample(float u0, float u1, float u2, Vector3f& d, float& pdf) const {
+    float pmf;
+    int k = distribution.sample(u0, pmf);
+    float u = (k % width + u1) / width, v = (k / width + u2) / height;
+    float theta = v * M_PI, phi = u * 2 * M_PI - M_PI;
+    float sinTheta = std::sin(theta);
+    d = Vector3f(sinTheta * std::sin(phi), std::cos(theta), -sinTheta * std::cos(phi));
+    //uniform in the texel: pmf * width * height per unit (u, v), (u, v) covers 2 pi^2 sin(theta) per unit solid angle
+    pdf = sinTheta > 0 ? pmf * width * height / (2 * M_PI * M_PI * sinTheta) : 0;
+    return texels[k];
+}
+
+float EnvironmentMap::pdf(const Vector3f& d) const {
+    float sinTheta = std::sqrt(std::max(0.0f, 1 - d.y() * d.y()));
+    return sinTheta > 0 ? distribution.pmf(texel(d)) * width * height / (2 * M_PI * M_PI * sinTheta) : 0;
+}
+
+float EnvironmentMap::power(float sceneRadius) const {
+    return integral * M_PI * sceneRadius * sceneRadius;
+}
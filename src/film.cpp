@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "../include/film.hpp"
+
+Filter::Filter(FilterType type) {
+    switch(type) {
+        case GAUSSIAN: radius = 1.5f; break;
+        case MITCHELL: radius = 2; break;
+        case LANCZOS: radius = 2; break;
+        default: radius = 0.5f; break;
+    }
+    invStep = TABLE_SIZE / radius;
+    //every entry holds the kernel at the middle of its interval
+    for(int i = 0; i < TABLE_SIZE; i++) table[i] = evaluate(type, (i + 0.5f) / invStep, radius);
+}
+
+float Filter::evaluate(FilterType type, float x, float radius) {
+    switch(type) {
+        case GAUSSIAN: {
+            //sigma 0.5, shifted to reach 0 at the radius
+            const float alpha = 2;
+            return std::max(0.0f, std::exp(-alpha * x * x) - std::exp(-alpha * radius * radius));
+        }
+        case MITCHELL: {
+            //Mitchell-Netravali, B = C = 1/3
+            const float B = 1.0f / 3, C = 1.0f / 3;
+            if(x < 1) return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6;
+            return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x + (8 * B + 24 * C)) / 6;
+        }
+        case LANCZOS: {
+            //windowed sinc, a = radius lobes
+            if(x < 1e-5f) return 1;
+            float px = float(M_PI) * x;
+            return std::sin(px) / px * std::sin(px / radius) / (px / radius);
+        }
+        default:
+            return 1;
+    }
+}
+
+Film::Film(int width, int height, FilterType filter, bool aovs) : width(width), height(height), filter(filter), aovs(aovs),
+        color(3 * width * height, 0.0f), weight(width * height, 0.0f) {
+    if(aovs) {
+        aov.assign(AOV_CHANNELS * width * height, 0.0f);
+        samples.assign(width * height, 0);
+    }
+    omp_init_lock(&lock);
+}
+
+Film::~Film() {
+    omp_destroy_lock(&lock);
+}
+
+FilmTile Film::tile(int x0, int y0, int x1, int y1) const {
+    //a sample reaches the pixels whose centers are closer than the radius
+    int margin = int(std::ceil(filter.getRadius()));
+    FilmTile tile;
+    tile.filter = &filter;
+    tile.x0 = std::max(0, x0 - margin);
+    tile.y0 = std::max(0, y0 - margin);
+    tile.x1 = std::min(width, x1 + margin);
+    tile.y1 = std::min(height, y1 + margin);
+    int pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    tile.color.assign(3 * pixels, 0.0f);
+    tile.weight.assign(pixels, 0.0f);
+    if(aovs) {
+        tile.aov.assign(AOV_CHANNELS * pixels, 0.0f);
+        tile.samples.assign(pixels, 0);
+    }
+    return tile;
+}
+
+void Film::merge(const FilmTile& tile) {
+    int tileWidth = tile.x1 - tile.x0;
+    omp_set_lock(&lock);
+    for(int y = tile.y0; y < tile.y1; y++) {
+        const float* tileColor = &tile.color[3 * (y - tile.y0) * tileWidth];
+        const float* tileWeight = &tile.weight[(y - tile.y0) * tileWidth];
+        float* filmColor = &color[3 * (y * width + tile.x0)];
+        float* filmWeight = &weight[y * width + tile.x0];
+        for(int i = 0; i < 3 * tileWidth; i++) filmColor[i] += tileColor[i];
+        for(int i = 0; i < tileWidth; i++) filmWeight[i] += tileWeight[i];
+        if(aovs) {
+            const float* tileAOV = &tile.aov[AOV_CHANNELS * (y - tile.y0) * tileWidth];
+            const int* tileSamples = &tile.samples[(y - tile.y0) * tileWidth];
+            float* filmAOV = &aov[AOV_CHANNELS * (y * width + tile.x0)];
+            int* filmSamples = &samples[y * width + tile.x0];
+            for(int i = 0; i < AOV_CHANNELS * tileWidth; i++) filmAOV[i] += tileAOV[i];
+            for(int i = 0; i < tileWidth; i++) filmSamples[i] += tileSamples[i];
+        }
+    }
+    omp_unset_lock(&lock);
+}
+
+//sample into the AOV_CHANNELS floats at sum
+static void accumulateAOV(float* sum, const AOVSample& sample) {
+    const Vector3f* vectors[4] = {&sample.albedo, &sample.normal, &sample.direct, &sample.indirect};
+    const int offsets[4] = {0, 3, 7, 10};
+    for(int v = 0; v < 4; v++) {
+        for(int k = 0; k < 3; k++) sum[offsets[v] + k] += (*vectors[v])[k];
+    }
+    sum[6] += sample.depth;
+}
+
+void Film::setPixel(int x, int y, const Vector3f& value) {
+    int i = y * width + x;
+    for(int k = 0; k < 3; k++) color[3 * i + k] = value[k];
+    weight[i] = 1;
+    //value is the whole pixel
+    if(!splat.empty()) for(int k = 0; k < 3; k++) splat[3 * i + k] = 0;
+}
+
+void Film::addAOVSample(int x, int y, const AOVSample& sample) {
+    if(!aovs) return;
+    int i = y * width + x;
+    accumulateAOV(&aov[AOV_CHANNELS * i], sample);
+    samples[i]++;
+}
+
+void Film::setSplatScale(float scale) {
+    splatScale = scale;
+    if(splat.empty()) splat.assign(3 * width * height, 0.0f);
+}
+
+void Film::addSplat(float x, float y, const Vector3f& value) {
+    int px = std::min(int(x), width - 1), py = std::min(int(y), height - 1);
+    if(px < 0 || py < 0) return;
+    float* pixel = &splat[3 * (py * width + px)];
+    for(int k = 0; k < 3; k++) {
+#pragma omp atomic
+        pixel[k] += value[k];
+    }
+}
+
+Vector3f Film::getPixel(int x, int y) const {
+    int i = y * width + x;
+    float inv = weight[i] > 0 ? 1 / weight[i] : 0;
+    Vector3f result;
+    for(int k = 0; k < 3; k++) {
+        float value = color[3 * i + k] * inv;
+        if(!splat.empty()) value += splat[3 * i + k] * splatScale;
+        result[k] = std::max(0.0f, value);
+    }
+    return result;
+}
+
+AOVSample Film::getAOVs(int x, int y) const {
+    AOVSample result;
+    int i = y * width + x;
+    if(!aovs || samples[i] == 0) return result;
+    const float* sum = &aov[AOV_CHANNELS * i];
+    float inv = 1.0f / samples[i];
+    result.albedo = Vector3f(sum[0], sum[1], sum[2]) * inv;
+    Vector3f normal(sum[3], sum[4], sum[5]);
+    result.normal = normal.length() > 0 ? normal.normalized() : normal;
+    result.depth = sum[6] * inv;
+    result.direct = Vector3f(sum[7], sum[8], sum[9]) * inv;
+    result.indirect = Vector3f(sum[10], sum[11], sum[12]) * inv;
+    return result;
+}
+
+void Film::getRow(int y, float* rgb) const {
+    const float* rowColor = &color[3 * y * width];
+    const float* rowWeight = &weight[y * width];
+    for(int x = 0; x < width; x++) {
+        float inv = rowWeight[x] > 0 ? 1 / rowWeight[x] : 0;
+        for(int k = 0; k < 3; k++) rgb[3 * x + k] = rowColor[3 * x + k] * inv;
+    }
+    if(!splat.empty()) {
+        const float* rowSplat = &splat[3 * y * width];
+        for(int i = 0; i < 3 * width; i++) rgb[i] += rowSplat[i] * splatScale;
+    }
+    for(int i = 0; i < 3 * width; i++) rgb[i] = std::max(0.0f, rgb[i]);
+}
+
+//AOV layers of the float output: name, first AOV channel (-1: the sample count), number of channels
+struct AOVLayer {
+    const char* name;
+    int offset;
+    int channels;
+    //EXR channel suffixes
+    const char* suffixes[3];
+};
+
+static const AOVLayer AOV_LAYERS[] = {
+    {"albedo", 0, 3, {"R", "G", "B"}},
+    {"normal", 3, 3, {"X", "Y", "Z"}},
+    {"depth", 6, 1, {"Z"}},
+    {"direct", 7, 3, {"R", "G", "B"}},
+    {"indirect", 10, 3, {"R", "G", "B"}},
+    {"samples", -1, 1, {"Y"}},
+};
+
+//an output channel: its name and where its value of pixel (x, y) comes from
+struct FilmChannel {
+    std::string name;
+    int layer;//-1: the color
+    int component;
+};
+
+//value of channel of pixel (x, y) (film coordinates)
+static float channelValue(const Film& film, const FilmChannel& channel, int x, int y) {
+    if(channel.layer < 0) return film.getPixel(x, y)[channel.component];
+    const AOVLayer& layer = AOV_LAYERS[channel.layer];
+    if(layer.offset < 0) return film.getSampleCount(x, y);
+    AOVSample sample = film.getAOVs(x, y);
+    switch(layer.offset) {
+        case 0: return sample.albedo[channel.component];
+        case 3: return sample.normal[channel.component];
+        case 6: return sample.depth;
+        case 7: return sample.direct[channel.component];
+        default: return sample.indirect[channel.component];
+    }
+}
+
+//row y of every channel, one channel after another
+static void channelRows(const Film& film, const std::vector<FilmChannel>& channels, int y, std::vector<float>& row) {
+    int width = film.getWidth();
+    row.resize(channels.size() * width);
+    for(size_t c = 0; c < channels.size(); c++) {
+        for(int x = 0; x < width; x++) row[c * width + x] = channelValue(film, channels[c], x, y);
+    }
+}
+
+bool Film::save(const std::string& filename) const {
+    std::string suffix = filename.substr(filename.find_last_of('.') + 1);
+    if(suffix == "exr") return saveEXR(filename);
+    if(suffix == "pfm") return savePFM(filename);
+    printf("unsupported float image format\n");
+    return false;
+}
+
+//little endian, as the files are
+template<typename T>
+static void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void putAttribute(std::string& out, const char* name, const char* type, const std::string& value) {
+    out.append(name, std::strlen(name) + 1);
+    out.append(type, std::strlen(type) + 1);
+    put<int32_t>(out, value.size());
+    out += value;
+}
+
+bool Film::saveEXR(const std::string& filename) const {
+    std::vector<FilmChannel> channels;
+    const char* rgb[3] = {"R", "G", "B"};
+    for(int k = 0; k < 3; k++) channels.push_back({rgb[k], -1, k});
+    if(aovs) {
+        for(int l = 0; l < int(sizeof(AOV_LAYERS) / sizeof(AOV_LAYERS[0])); l++) {
+            for(int k = 0; k < AOV_LAYERS[l].channels; k++) {
+                channels.push_back({std::string(AOV_LAYERS[l].name) + "." + AOV_LAYERS[l].suffixes[k], l, k});
+            }
+        }
+    }
+    //readers expect the channels sorted by name, the pixel data follows the same order
+    std::sort(channels.begin(), channels.end(), [](const FilmChannel& a, const FilmChannel& b) { return a.name < b.name; });
+
+    std::string header;
+    put<int32_t>(header, 20000630);//magic
+    put<int32_t>(header, 2);//version 2, single part scanline
+    std::string list;
+    for(const FilmChannel& channel : channels) {
+        list.append(channel.name.c_str(), channel.name.size() + 1);
+        put<int32_t>(list, 2);//FLOAT
+        put<int32_t>(list, 0);//pLinear, reserved
+        put<int32_t>(list, 1);//x sampling
+        put<int32_t>(list, 1);//y sampling
+    }
+    list.push_back('\0');
+    putAttribute(header, "channels", "chlist", list);
+    putAttribute(header, "compression", "compression", std::string(1, '\0'));
+    std::string window;
+    put<int32_t>(window, 0);
+    put<int32_t>(window, 0);
+    put<int32_t>(window, width - 1);
+    put<int32_t>(window, height - 1);
+    putAttribute(header, "dataWindow", "box2i", window);
+    putAttribute(header, "displayWindow", "box2i", window);
+    putAttribute(header, "lineOrder", "lineOrder", std::string(1, '\0'));
+    std::string value;
+    put<float>(value, 1);
+    putAttribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put<float>(value, 0);
+    put<float>(value, 0);
+    putAttribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put<float>(value, 1);
+    putAttribute(header, "screenWindowWidth", "float", value);
+    header.push_back('\0');
+
+    //one scanline per chunk: y, size, then the row of every channel in turn; EXR rows go from the top
+    int rowBytes = channels.size() * width * sizeof(float);
+    uint64_t offset = header.size() + height * sizeof(uint64_t);
+    for(int row = 0; row < height; row++) {
+        put<uint64_t>(header, offset + uint64_t(row) * (8 + rowBytes));
+    }
+    FILE* file = fopen(filename.c_str(), "wb");
+    if(file == nullptr) {
+        printf("save film as exr failed\n");
+        return false;
+    }
+    fwrite(header.data(), 1, header.size(), file);
+    std::vector<float> data;
+    for(int row = 0; row < height; row++) {
+        int32_t chunk[2] = {row, rowBytes};
+        fwrite(chunk, sizeof(int32_t), 2, file);
+        channelRows(*this, channels, height - 1 - row, data);
+        fwrite(data.data(), sizeof(float), data.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+//PFM: "PF" (rgb) or "Pf" (gray), negative scale for little endian, rows from the bottom like the film
+static bool writePFM(const Film& film, const std::string& filename, const std::vector<FilmChannel>& channels) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if(file == nullptr) {
+        printf("save film as pfm failed\n");
+        return false;
+    }
+    int width = film.getWidth();
+    fprintf(file, "%s\n%d %d\n-1.0\n", channels.size() == 3 ? "PF" : "Pf", width, film.getHeight());
+    std::vector<float> data, pixels(channels.size() * width);
+    for(int y = 0; y < film.getHeight(); y++) {
+        channelRows(film, channels, y, data);
+        for(size_t c = 0; c < channels.size(); c++) {
+            for(int x = 0; x < width; x++) pixels[x * channels.size() + c] = data[c * width + x];
+        }
+        fwrite(pixels.data(), sizeof(float), pixels.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+bool Film::savePFM(const std::string& filename) const {
+    std::vector<FilmChannel> channels;
+    for(int k = 0; k < 3; k++) channels.push_back({"", -1, k});
+    bool ok = writePFM(*this, filename, channels);
+    if(!aovs) return ok;
+    std::string stem = filename.substr(0, filename.size() - 4);
+    for(int l = 0; l < int(sizeof(AOV_LAYERS) / sizeof(AOV_LAYERS[0])); l++) {
+        channels.clear();
+        for(int k = 0; k < AOV_LAYERS[l].channels; k++) channels.push_back({"", l, k});
+        ok = writePFM(*this, stem + "." + AOV_LAYERS[l].name + ".pfm", channels) && ok;
+    }
+    return ok;
+}
+
+void FilmTile::addSample(float x, float y, const Vector3f& sample, const AOVSample* aovSample) {
+    //pixel p is centered at p + 0.5, the weights along each axis are looked up once
+    const int MAX_EXTENT = 8;
+    float radius = filter->getRadius();
+    int px0 = std::max(x0, int(std::ceil(x - 0.5f - radius))), px1 = std::min(x1 - 1, int(std::floor(x - 0.5f + radius)));
+    int py0 = std::max(y0, int(std::ceil(y - 0.5f - radius))), py1 = std::min(y1 - 1, int(std::floor(y - 0.5f + radius)));
+    float wx[MAX_EXTENT], wy[MAX_EXTENT];
+    for(int px = px0; px <= px1; px++) wx[px - px0] = filter->profile(px + 0.5f - x);
+    for(int py = py0; py <= py1; py++) wy[py - py0] = filter->profile(py + 0.5f - y);
+    int tileWidth = x1 - x0;
+    for(int py = py0; py <= py1; py++) {
+        int i = (py - y0) * tileWidth + px0 - x0;
+        for(int px = px0; px <= px1; px++, i++) {
+            float w = wx[px - px0] * wy[py - py0];
+            color[3 * i] += w * sample.x();
+            color[3 * i + 1] += w * sample.y();
+            color[3 * i + 2] += w * sample.z();
+            weight[i] += w;
+        }
+    }
+    if(!samples.empty()) {
+        //the AOVs are a plain average over the samples of the pixel the sample lies in
+        int i = (std::min(y1 - 1, int(y)) - y0) * tileWidth + std::min(x1 - 1, int(x)) - x0;
+        if(aovSample != nullptr) accumulateAOV(&aov[Film::AOV_CHANNELS * i], *aovSample);
+        samples[i]++;
+    }
+}
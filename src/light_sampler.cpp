@@ -0,0 +1,304 @@
+#include "../include/light_sampler.hpp"
+#include "../include/light.hpp"
+#include "../include/emitter.hpp"
+#include <algorithm>
+#include <cmath>
+
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+static float safeSqrt(float x) {
+    return std::sqrt(std::max(0.0f, x));
+}
+
+//cosine of the angle a - b clamped at 0 (b larger than a gives 1), from their sines and cosines
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+}
+
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+}
+
+AliasTable::AliasTable(const std::vector<float>& weights) : bins(weights.size()) {
+    double sum = 0;
+    for(float w : weights) sum += w;
+    int n = weights.size();
+    std::vector<int> under, over;
+    std::vector<double> q(n);
+    for(int i = 0; i < n; i++) {
+        bins[i].p = float(weights[i] / sum);
+        q[i] = weights[i] / sum * n;
+        (q[i] < 1 ? under : over).push_back(i);
+    }
+    while(!under.empty() && !over.empty()) {
+        int small = under.back(), large = over.back();
+        under.pop_back();
+        over.pop_back();
+        bins[small].q = float(q[small]);
+        bins[small].alias = large;
+        //the large bin gives away what fills the small one
+        q[large] -= 1 - q[small];
+        (q[large] < 1 ? under : over).push_back(large);
+    }
+    //what is left is 1 up to rounding
+    for(int i : under) bins[i].q = 1;
+    for(int i : over) bins[i].q = 1;
+}
+
+int AliasTable::sample(float u, float& pmf) const {
+    int n = bins.size();
+    int i = std::min(int(u * n), n - 1);
+    float up = std::min(u * n - i, ONE_MINUS_EPSILON);
+    if(up >= bins[i].q) i = bins[i].alias;
+    pmf = bins[i].p;
+    return i;
+}
+
+float LightBounds::importance(const Vector3f& p, const Vector3f& n) const {
+    Vector3f pc = centroid();
+    float d2 = (p - pc).squaredLength();
+    //not closer than half the diagonal, the receiver may be inside the bounds
+    d2 = std::max(d2, (hi - lo).length() / 2);
+    Vector3f wi = (p - pc).normalized();
+    float cosThetaW = Vector3f::dot(w, wi);
+    if(twoSided) cosThetaW = std::fabs(cosThetaW);
+    float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+    //half angle of the bounding sphere of the box seen from p
+    float cosThetaB = -1;
+    float radius2 = (hi - lo).squaredLength() / 4;
+    float distance2 = (p - pc).squaredLength();
+    if(distance2 > radius2) cosThetaB = safeSqrt(1 - radius2 / distance2);
+    float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+    float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+    //smallest angle between the direction to p and the normals, seen from anywhere in the box
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if(cosThetaP < cosThetaE) return 0;
+    float result = phi * cosThetaP / d2;
+    //the receiver's cosine, also at its best over the box
+    if(n.squaredLength() > 0) {
+        float cosThetaI = std::fabs(Vector3f::dot(wi, n));
+        float sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+        result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+    return std::max(result, 0.0f);
+}
+
+//rotation of v by angle around the unit axis (Rodrigues)
+static Vector3f rotate(const Vector3f& v, const Vector3f& axis, float angle) {
+    float c = std::cos(angle), s = std::sin(angle);
+    return v * c + Vector3f::cross(axis, v) * s + axis * (Vector3f::dot(axis, v) * (1 - c));
+}
+
+LightBounds LightBounds::merge(const LightBounds& a, const LightBounds& b) {
+    if(a.phi == 0) return b;
+    if(b.phi == 0) return a;
+    LightBounds m;
+    for(int i = 0; i < 3; i++) {
+        m.lo[i] = std::min(a.lo[i], b.lo[i]);
+        m.hi[i] = std::max(a.hi[i], b.hi[i]);
+    }
+    m.phi = a.phi + b.phi;
+    m.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+    m.twoSided = a.twoSided || b.twoSided;
+    //the smallest cone around both cones of normals
+    float thetaA = std::acos(std::max(-1.0f, std::min(1.0f, a.cosThetaO)));
+    float thetaB = std::acos(std::max(-1.0f, std::min(1.0f, b.cosThetaO)));
+    float thetaD = std::acos(std::max(-1.0f, std::min(1.0f, Vector3f::dot(a.w, b.w))));
+    if(std::min(thetaD + thetaB, float(M_PI)) <= thetaA) {
+        m.w = a.w;
+        m.cosThetaO = a.cosThetaO;
+    } else if(std::min(thetaD + thetaA, float(M_PI)) <= thetaB) {
+        m.w = b.w;
+        m.cosThetaO = b.cosThetaO;
+    } else {
+        float thetaO = (thetaA + thetaD + thetaB) / 2;
+        Vector3f axis = Vector3f::cross(a.w, b.w);
+        if(thetaO >= M_PI || axis.squaredLength() == 0) {
+            m.w = a.w;
+            m.cosThetaO = -1;
+        } else {
+            m.w = rotate(a.w, axis.normalized(), thetaO - thetaA).normalized();
+            m.cosThetaO = std::cos(thetaO);
+        }
+    }
+    return m;
+}
+
+//cost of a node in the surface area orientation heuristic: power times the measure of the directions it
+//may emit to times the surface area of the box, penalizing thin boxes split along their short side
+static float orientationCost(const LightBounds& b, int axis) {
+    float thetaO = std::acos(std::max(-1.0f, std::min(1.0f, b.cosThetaO)));
+    float thetaE = std::acos(std::max(-1.0f, std::min(1.0f, b.cosThetaE)));
+    float thetaW = std::min(thetaO + thetaE, float(M_PI));
+    float sinThetaO = safeSqrt(1 - b.cosThetaO * b.cosThetaO);
+    float solidAngle = 2 * M_PI * (1 - b.cosThetaO) +
+                       M_PI / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO + b.cosThetaO);
+    Vector3f d = b.hi - b.lo;
+    float area = 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    float longest = std::max(d.x(), std::max(d.y(), d.z()));
+    float kr = d[axis] > 0 ? longest / d[axis] : 1;
+    return b.phi * solidAngle * kr * area;
+}
+
+LightBVH::LightBVH(const std::vector<LightBounds>& lights) : trails(lights.size(), 0) {
+    std::vector<std::pair<int, LightBounds>> items;
+    for(int i = 0; i < int(lights.size()); i++) {
+        if(lights[i].phi > 0) items.emplace_back(i, lights[i]);
+    }
+    if(!items.empty()) build(items, 0, items.size(), 0, 0);
+}
+
+int LightBVH::build(std::vector<std::pair<int, LightBounds>>& lights, int begin, int end, uint64_t trail, int depth) {
+    int index = nodes.size();
+    nodes.push_back(Node());
+    if(end - begin == 1) {
+        nodes[index].bounds = lights[begin].second;
+        nodes[index].index = lights[begin].first;
+        nodes[index].leaf = true;
+        trails[lights[begin].first] = trail;
+        return index;
+    }
+    LightBounds all;
+    Vector3f centroidLo(1e38f), centroidHi(-1e38f);
+    for(int i = begin; i < end; i++) {
+        all = LightBounds::merge(all, lights[i].second);
+        Vector3f c = lights[i].second.centroid();
+        for(int a = 0; a < 3; a++) {
+            centroidLo[a] = std::min(centroidLo[a], c[a]);
+            centroidHi[a] = std::max(centroidHi[a], c[a]);
+        }
+    }
+    //the cheapest of 12 bucket boundaries along each axis
+    const int BUCKETS = 12;
+    float bestCost = 1e38f;
+    int bestAxis = -1, bestBucket = -1;
+    for(int axis = 0; axis < 3; axis++) {
+        float extent = centroidHi[axis] - centroidLo[axis];
+        if(extent <= 0) continue;
+        LightBounds buckets[BUCKETS];
+        for(int i = begin; i < end; i++) {
+            int b = std::min(int(BUCKETS * (lights[i].second.centroid()[axis] - centroidLo[axis]) / extent), BUCKETS - 1);
+            buckets[b] = LightBounds::merge(buckets[b], lights[i].second);
+        }
+        for(int split = 0; split < BUCKETS - 1; split++) {
+            LightBounds below, above;
+            for(int b = 0; b <= split; b++) below = LightBounds::merge(below, buckets[b]);
+            for(int b = split + 1; b < BUCKETS; b++) above = LightBounds::merge(above, buckets[b]);
+            float cost = (below.phi > 0 ? orientationCost(below, axis) : 0) + (above.phi > 0 ? orientationCost(above, axis) : 0);
+            if(cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBucket = split;
+            }
+        }
+    }
+    int middle = (begin + end) / 2;
+    if(bestAxis >= 0) {
+        float extent = centroidHi[bestAxis] - centroidLo[bestAxis];
+        auto it = std::partition(lights.begin() + begin, lights.begin() + end, [&](const std::pair<int, LightBounds>& l) {
+            int b = std::min(int(BUCKETS * (l.second.centroid()[bestAxis] - centroidLo[bestAxis]) / extent), BUCKETS - 1);
+            return b <= bestBucket;
+        });
+        middle = it - lights.begin();
+    }
+    //all in one bucket or at the same place: halves
+    if(middle == begin || middle == end) middle = (begin + end) / 2;
+    //trails hold 64 levels, deeper trees (only with degenerate splits) end in arbitrary halves anyway
+    build(lights, begin, middle, trail, depth + 1);
+    int second = build(lights, middle, end, depth < 64 ? trail | uint64_t(1) << depth : trail, depth + 1);
+    nodes[index].bounds = all;
+    nodes[index].index = second;
+    nodes[index].leaf = false;
+    return index;
+}
+
+int LightBVH::sample(const Vector3f& p, const Vector3f& n, float u, float& pmf) const {
+    pmf = 0;
+    if(nodes.empty()) return -1;
+    int i = 0;
+    float probability = 1;
+    while(!nodes[i].leaf) {
+        float c0 = nodes[i + 1].bounds.importance(p, n), c1 = nodes[nodes[i].index].bounds.importance(p, n);
+        if(c0 == 0 && c1 == 0) return -1;
+        float p0 = c0 / (c0 + c1);
+        if(u < p0) {
+            i = i + 1;
+            u = std::min(u / p0, ONE_MINUS_EPSILON);
+            probability *= p0;
+        } else {
+            i = nodes[i].index;
+            u = std::min((u - p0) / (1 - p0), ONE_MINUS_EPSILON);
+            probability *= 1 - p0;
+        }
+    }
+    //a single light is chosen without looking at its importance, it must still reach p
+    if(i == 0 && nodes[0].bounds.importance(p, n) == 0) return -1;
+    pmf = probability;
+    return nodes[i].index;
+}
+
+float LightBVH::pmf(const Vector3f& p, const Vector3f& n, int light) const {
+    if(nodes.empty() || light < 0 || light >= int(trails.size())) return 0;
+    uint64_t trail = trails[light];
+    int i = 0, depth = 0;
+    float probability = 1;
+    while(!nodes[i].leaf) {
+        float c0 = nodes[i + 1].bounds.importance(p, n), c1 = nodes[nodes[i].index].bounds.importance(p, n);
+        if(c0 == 0 && c1 == 0) return 0;
+        bool second = depth < 64 && (trail >> depth & 1);
+        probability *= (second ? c1 : c0) / (c0 + c1);
+        i = second ? nodes[i].index : i + 1;
+        depth++;
+    }
+    return nodes[i].index == light ? probability : 0;
+}
+
+LightSampler::LightSampler(const std::vector<Light*>& lights, float sceneRadius) : lights(lights) {
+    if(lights.empty()) return;
+    std::vector<float> weights(lights.size());
+    std::vector<LightBounds> bounds(lights.size());
+    for(int i = 0; i < int(lights.size()); i++) {
+        weights[i] = std::max(0.0f, luminance(lights[i]->power(sceneRadius)));
+        if(lights[i]->bounds(bounds[i])) {
+            bounds[i].phi = weights[i];
+            bounded.push_back(i);
+        } else {
+            bounds[i].phi = 0;
+            infinite.push_back(i);
+        }
+    }
+    double sum = 0;
+    for(float w : weights) sum += w;
+    total = sum;
+    //no light has power: all equally likely
+    if(sum == 0) std::fill(weights.begin(), weights.end(), 1.0f);
+    power = AliasTable(weights);
+    bvh = LightBVH(bounds);
+}
+
+Light* LightSampler::samplePhoton(float u, float& pmf) const {
+    if(lights.empty()) {
+        pmf = 0;
+        return nullptr;
+    }
+    return lights[power.sample(u, pmf)];
+}
+
+Light* LightSampler::sampleDirect(const Vector3f& p, const Vector3f& n, float u, float& pmf) const {
+    pmf = 0;
+    float pInfinite = float(infinite.size()) / (infinite.size() + (bvh.empty() ? 0 : 1));
+    if(u < pInfinite) {
+        int i = std::min(int(u / pInfinite * infinite.size()), int(infinite.size()) - 1);
+        pmf = pInfinite / infinite.size();
+        return lights[infinite[i]];
+    }
+    if(bvh.empty()) return nullptr;
+    u = std::min((u - pInfinite) / (1 - pInfinite), ONE_MINUS_EPSILON);
+    float bvhPmf;
+    int light = bvh.sample(p, n, u, bvhPmf);
+    if(light < 0) return nullptr;
+    pmf = (1 - pInfinite) * bvhPmf;
+    return lights[light];
+}
@@ -21,6 +21,7 @@
 #include "../include/curve.hpp"
 #include "../include/hit.hpp"
 #include "../include/render.hpp"
+#include "../include/texture_cache.hpp"
 
 #define __DEBUG__
 
@@ -64,6 +65,7 @@ int main(int argc, char *argv[]){
       height: height of the image
       samples: number of samples per pixel
       output: output file name and path should be an image format
+        .exr / .pfm write the float framebuffer instead of the 8 bit image
       input: input file name and path should be a scene file (txt)
       quality: quality of the image (0-100)
       rendermode:
@@ -80,6 +82,14 @@ int main(int argc, char *argv[]){
       depth-of-field:
       0: off
       1: on
+
+      texture-cache: memory budget of the shared texture cache in MB
+      mesh-cache: 1 loads/writes <obj>.cache next to the obj, 0 (default) always parses the obj
+      aov: 1 also writes albedo, normal, depth, direct, indirect and sample count layers
+        (into the .exr, next to the .pfm, or into <output>.exr next to an 8 bit image)
+      tonemap: 0 (default): clip, 1: Reinhard, 2: ACES filmic; the image is sRGB encoded afterwards
+      exposure: exposure in stops applied before the tone mapping, 0 (default)
+      denoise: iterations of the edge-avoiding denoiser applied to the float image, 0 (default): off
     */
     /* if(argc < 2){
       std::cout << "Usage: " << argv[0] << " --width 1024 --height 768 --samples 100 --output ../output/result.png --input ../test/scene.txt --quality 100 --rendermode 0 --depth 5 --threads 28 --depth-of-field 0 --aperture 1 --focus-length 5" << std::endl;
@@ -102,7 +112,17 @@ int main(int argc, char *argv[]){
     std::cout << "depth-of-field: " << DOF << std::endl;
     std::cout << "aperture: " << aperture << std::endl;
     std::cout << "focus-length: " << focus_length << std::endl;
+    std::cout << "texture-cache: " << textureCacheMB << " MB" << std::endl;
+    std::cout << "mesh-cache: " << meshCache << std::endl;
+    std::cout << "packets: " << rayPackets << std::endl;
+    std::cout << "photon-guiding: " << photonGuiding << std::endl;
+    std::cout << "path-guiding: " << pathGuiding << std::endl;
+    std::cout << "aov: " << writeAOVs << std::endl;
+    std::cout << "denoise: " << denoiseIterations << std::endl;
+    std::cout << "tonemap: " << TONEMAP << std::endl;
+    std::cout << "exposure: " << exposure << std::endl;
     #endif
+    TextureCache::instance().setBudget(size_t(textureCacheMB) << 20);
 
     //cli arguments: x1 y1 x2 y2 
     //x1 y1: start point
@@ -126,10 +146,19 @@ int main(int argc, char *argv[]){
 
     // 使用渲染器进行渲染
     renderer->render(sceneParser, image, samples, threads, depth, DOF, aperture, focus_length);
+    TextureCache::instance().printStats();
 
     
     assert(image!=nullptr);
-    image->SaveImage(output.c_str());
+    std::string suffix = output.substr(output.find_last_of('.') + 1);
+    Film* film = renderer->getFilm();
+    if(suffix == "exr" || suffix == "pfm") {
+        assert(film!=nullptr);
+        film->save(output);
+    } else {
+        image->SaveImage(output.c_str());
+        if(writeAOVs && film != nullptr) film->saveEXR(output.substr(0, output.find_last_of('.')) + ".exr");
+    }
     std::cout << "Image saved." << std::endl;
     #ifdef __PICTURE__DEBUG__
     std::string outputFile = output;
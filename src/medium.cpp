@@ -0,0 +1,197 @@
+#include "../include/medium.hpp"
+#include "../include/ray.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+static float average(const Vector3f& v) {
+    return (v.x() + v.y() + v.z()) / 3;
+}
+
+static float maxComponent(const Vector3f& v) {
+    return std::max(v.x(), std::max(v.y(), v.z()));
+}
+
+static Vector3f expNegative(const Vector3f& v) {
+    return Vector3f(std::exp(-v.x()), std::exp(-v.y()), std::exp(-v.z()));
+}
+
+float phaseHG(float cosine, float g) {
+    float denominator = 1 + g * g - 2 * g * cosine;
+    return (1 - g * g) / (4 * M_PI * denominator * std::sqrt(std::max(denominator, 1e-12f)));
+}
+
+Vector3f samplePhaseHG(const Vector3f& d, float g, float u1, float u2) {
+    float cosine;
+    if(std::fabs(g) < 1e-3f) {
+        cosine = 1 - 2 * u1;
+    } else {
+        float s = (1 - g * g) / (1 - g + 2 * g * u1);
+        cosine = (1 + g * g - s * s) / (2 * g);
+    }
+    cosine = std::min(std::max(cosine, -1.0f), 1.0f);
+    float sine = std::sqrt(std::max(0.0f, 1 - cosine * cosine)), phi = 2 * M_PI * u2;
+    Vector3f u = Vector3f::cross(std::fabs(d.x()) > 0.1f ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0), d).normalized();
+    Vector3f v = Vector3f::cross(d, u);
+    return (u * (sine * std::cos(phi)) + v * (sine * std::sin(phi)) + d * cosine).normalized();
+}
+
+HomogeneousMedium::HomogeneousMedium(const Vector3f& sigmaA, const Vector3f& sigmaS, float g) : Medium(g),
+        sigmaS(sigmaS), sigmaT(sigmaA + sigmaS) {
+}
+
+bool HomogeneousMedium::sample(const Ray& ray, float tMax, PathSampler& sampler, float& t, Vector3f& weight) const {
+    int channel = std::min(int(sampler.next() * 3), 2);
+    float u = sampler.next();
+    float distance = sigmaT[channel] > 0 ? -std::log(1 - u) / sigmaT[channel] : INFINITY;
+    bool scattered = distance < tMax;
+    t = std::min(distance, tMax);
+    Vector3f Tr = expNegative(sigmaT * t);
+    //probability (density) of the outcome averaged over the channels it could have been sampled on
+    Vector3f density = scattered ? sigmaT * Tr : Tr;
+    float pdf = average(density);
+    if(pdf == 0) {
+        weight = Vector3f::ZERO;
+        return false;
+    }
+    weight = scattered ? Tr * sigmaS / pdf : Tr / pdf;
+    return scattered;
+}
+
+Vector3f HomogeneousMedium::transmittance(const Ray& ray, float tMax, PathSampler& sampler) const {
+    return expNegative(sigmaT * tMax);
+}
+
+void MajorantGrid::build(const std::vector<float>& density, int nx, int ny, int nz) {
+    int n[3] = {nx, ny, nz};
+    for(int a = 0; a < 3; a++) res[a] = std::max(1, std::min(RESOLUTION, n[a]));
+    cells.assign(res[0] * res[1] * res[2], 0.0f);
+    for(int z = 0; z < res[2]; z++) for(int y = 0; y < res[1]; y++) for(int x = 0; x < res[0]; x++) {
+        //voxels whose trilinear support overlaps the cell, voxel centers at (i + 0.5) / n
+        int c[3] = {x, y, z}, lo[3], hi[3];
+        for(int a = 0; a < 3; a++) {
+            lo[a] = std::max(0, int(std::floor(float(c[a]) / res[a] * n[a] - 0.5f)));
+            hi[a] = std::min(n[a] - 1, int(std::floor(float(c[a] + 1) / res[a] * n[a] - 0.5f)) + 1);
+        }
+        float m = 0;
+        for(int k = lo[2]; k <= hi[2]; k++) for(int j = lo[1]; j <= hi[1]; j++) for(int i = lo[0]; i <= hi[0]; i++) {
+            m = std::max(m, density[(k * ny + j) * nx + i]);
+        }
+        cells[(z * res[1] + y) * res[0] + x] = m;
+    }
+}
+
+GridMedium::GridMedium(const Vector3f& boundsMin, const Vector3f& boundsMax, int nx, int ny, int nz, std::vector<float> density,
+                       const Vector3f& sigmaA, const Vector3f& sigmaS, float g) : Medium(g), boundsMin(boundsMin),
+        extent(boundsMax - boundsMin), nx(nx), ny(ny), nz(nz), grid(std::move(density)), sigmaS(sigmaS),
+        sigmaT(sigmaA + sigmaS), sigmaTMax(maxComponent(sigmaA + sigmaS)) {
+    majorants.build(grid, nx, ny, nz);
+}
+
+std::unique_ptr<GridMedium> GridMedium::load(const std::string& filename, const Vector3f& sigmaA, const Vector3f& sigmaS, float g) {
+    std::ifstream file(filename, std::ios::binary);
+    if(!file) {
+        std::cout << "cannot open volume " << filename << std::endl;
+        return nullptr;
+    }
+    char header[4];
+    int32_t encoding, res[3], channels;
+    float bounds[6];
+    file.read(header, 4);
+    file.read((char*)&encoding, 4);
+    file.read((char*)res, 12);
+    file.read((char*)&channels, 4);
+    file.read((char*)bounds, 24);
+    if(!file || strncmp(header, "VOL", 3) != 0 || header[3] != 3 || encoding != 1 || channels != 1 ||
+       res[0] <= 0 || res[1] <= 0 || res[2] <= 0) {
+        std::cout << "unsupported volume " << filename << " (expected single channel float32 VOL version 3)" << std::endl;
+        return nullptr;
+    }
+    std::vector<float> density(size_t(res[0]) * res[1] * res[2]);
+    file.read((char*)density.data(), density.size() * sizeof(float));
+    if(!file) {
+        std::cout << "truncated volume " << filename << std::endl;
+        return nullptr;
+    }
+    for(float& d : density) d = std::max(d, 0.0f);
+    return std::unique_ptr<GridMedium>(new GridMedium(Vector3f(bounds[0], bounds[1], bounds[2]), Vector3f(bounds[3], bounds[4], bounds[5]),
+                                                      res[0], res[1], res[2], std::move(density), sigmaA, sigmaS, g));
+}
+
+float GridMedium::voxel(int x, int y, int z) const {
+    if(x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz) return 0;
+    return grid[(size_t(z) * ny + y) * nx + x];
+}
+
+float GridMedium::density(const Vector3f& p) const {
+    float gx = p.x() * nx - 0.5f, gy = p.y() * ny - 0.5f, gz = p.z() * nz - 0.5f;
+    int x = int(std::floor(gx)), y = int(std::floor(gy)), z = int(std::floor(gz));
+    float fx = gx - x, fy = gy - y, fz = gz - z;
+    auto lerp = [](float t, float a, float b) { return a + t * (b - a); };
+    float d00 = lerp(fx, voxel(x, y, z), voxel(x + 1, y, z)), d10 = lerp(fx, voxel(x, y + 1, z), voxel(x + 1, y + 1, z));
+    float d01 = lerp(fx, voxel(x, y, z + 1), voxel(x + 1, y, z + 1)), d11 = lerp(fx, voxel(x, y + 1, z + 1), voxel(x + 1, y + 1, z + 1));
+    return lerp(fz, lerp(fy, d00, d10), lerp(fy, d01, d11));
+}
+
+bool GridMedium::sample(const Ray& ray, float tMax, PathSampler& sampler, float& t, Vector3f& weight) const {
+    Vector3f o = ray.getOrigin() - boundsMin, d = ray.getDirection();
+    for(int a = 0; a < 3; a++) {
+        o[a] /= extent[a];
+        d[a] /= extent[a];
+    }
+    weight = Vector3f(1);
+    bool scattered = false;
+    majorants.traverse(o, d, 0, tMax, [&](float t0, float t1, float cellMax) {
+        float majorant = cellMax * sigmaTMax;
+        if(majorant <= 0) return true;
+        float s = t0;
+        while(true) {
+            s -= std::log(1 - sampler.next()) / majorant;
+            if(s >= t1) return true;
+            float rho = density(o + d * s);
+            Vector3f sigmaTp = sigmaT * rho;
+            float real = average(sigmaTp);
+            //null collisions, and real ones with the colors of the coefficients against their mean
+            if(sampler.next() * majorant < real) {
+                weight = weight * sigmaS * (rho / real);
+                t = s;
+                scattered = true;
+                return false;
+            }
+            Vector3f sigmaN = Vector3f(majorant) - sigmaTp;
+            weight = weight * sigmaN / (majorant - real);
+        }
+    });
+    return scattered;
+}
+
+Vector3f GridMedium::transmittance(const Ray& ray, float tMax, PathSampler& sampler) const {
+    Vector3f o = ray.getOrigin() - boundsMin, d = ray.getDirection();
+    for(int a = 0; a < 3; a++) {
+        o[a] /= extent[a];
+        d[a] /= extent[a];
+    }
+    Vector3f Tr(1);
+    majorants.traverse(o, d, 0, tMax, [&](float t0, float t1, float cellMax) {
+        float majorant = cellMax * sigmaTMax;
+        if(majorant <= 0) return true;
+        float s = t0;
+        while(true) {
+            s -= std::log(1 - sampler.next()) / majorant;
+            if(s >= t1) return true;
+            Tr = Tr * (Vector3f(1) - sigmaT * (density(o + d * s) / majorant));
+            //Russian roulette once almost nothing gets through
+            if(maxComponent(Tr) < 0.05f) {
+                if(sampler.next() < 0.75f) {
+                    Tr = Vector3f::ZERO;
+                    return false;
+                }
+                Tr = Tr / 0.25f;
+            }
+        }
+    });
+    return Tr;
+}
@@ -5,8 +5,13 @@
 #include <cstdlib>
 #include <utility>
 #include <sstream>
+#include <chrono>
+#include <sys/resource.h>
 #include "../include/texture.hpp"
 #include "../include/utils.hpp"
+#include "../include/mesh_cache.hpp"
+#include "../include/obj_loader.hpp"
+#include "../include/render_stats.hpp"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -218,347 +223,341 @@
 }
  */
 
+//parse an obj into flat attribute and triangle index arrays and settle the normal of every corner
+static bool parseObj(const char *filename, const std::string& basepath,
+                     std::vector<Vector3f>& _v, std::vector<Vector3f>& _n, std::vector<Vector2f>& _uv,
+                     std::vector<TriangleIndices>& _triangles, std::vector<tinyobj::material_t>& materials,
+                     std::vector<std::string>& mtlFiles) {
+    if(!loadObj(filename, basepath, _v, _n, _uv, _triangles, materials, mtlFiles)){
+        printf("Failed to load/parse .obj.\n");
+        return false;
+    }
+
+    bool vertexNormals = _n.size() == _v.size();
+    if(smooth && (_n.size() == 0 || _n.size() != _v.size())){
+        std::cout << "No/In appropriate normals in obj file, use normal of vertex interpolation" << std::endl;
+        _n = std::vector<Vector3f>(_v.size(), Vector3f::ZERO);
+        for(auto& t : _triangles){
+            Vector3f normal = Vector3f::cross(_v[t.v[1]] - _v[t.v[0]], _v[t.v[2]] - _v[t.v[0]]);
+            for(int k = 0; k < 3; k++){
+                _n[t.v[k]] += normal;
+                t.n[k] = -1;
+            }
+        }
+        for(size_t i = 0; i < _n.size(); i++){
+            _n[i].normalize();
+        }
+        vertexNormals = true;
+    }
+    //faces without normal indices fall back to the normal of the same index as the vertex
+    for(auto& t : _triangles){
+        if(t.n[0] != -1) continue;
+        for(int k = 0; k < 3; k++) t.n[k] = vertexNormals ? t.v[k] : -1;
+    }
+    return true;
+}
+
+//EmpiricalMaterial (or PBRMaterial) of one MTL entry, texture paths are relative to the obj
+static Material* createMaterial(const tinyobj::material_t& mtl, const std::string& basepath) {
+    Material *m;
+    //default material: EmpiricalMaterial
+    m = new EmpiricalMaterial(
+        Vector3f(mtl.ambient[0], mtl.ambient[1], mtl.ambient[2]),
+        Vector3f(mtl.diffuse[0], mtl.diffuse[1], mtl.diffuse[2]),
+        Vector3f(mtl.specular[0], mtl.specular[1], mtl.specular[2]),
+        Vector3f(mtl.transmittance[0], mtl.transmittance[1], mtl.transmittance[2]),
+        Vector3f(mtl.emission[0], mtl.emission[1], mtl.emission[2]),
+        mtl.shininess,
+        mtl.ior,
+        mtl.dissolve,
+        mtl.illum);
+    if(mtl.diffuse_texname != ""){
+        EmpiricalImageTexture *texture = new EmpiricalImageTexture(basepath + mtl.diffuse_texname);
+        if(mtl.ambient_texname != ""){
+            texture->loadAmbientTexture(basepath + mtl.ambient_texname);
+        }
+        if(mtl.specular_texname != ""){
+            texture->loadSpecularTexture(basepath + mtl.specular_texname);
+        }
+        if(mtl.specular_highlight_texname != ""){
+            texture->loadSpecularHighlightTexture(basepath + mtl.specular_highlight_texname);
+        }
+        if(mtl.bump_texname != ""){
+            texture->loadBumpTexture(basepath + mtl.bump_texname, mtl.bump_texopt.bump_multiplier);
+        }
+        if(mtl.alpha_texname != ""){
+            texture->loadAlphaTexture(basepath + mtl.alpha_texname);
+        }
+        if(mtl.displacement_texname != ""){
+            texture->loadDisplacementTexture(basepath + mtl.displacement_texname);
+        }
+
+        dynamic_cast<EmpiricalMaterial *>(m)->setTexture(texture);
+    }
+
+    //PBR pipeline
+    if(mtl.roughness != 0.0f || mtl.metallic != 0.0f || mtl.sheen != 0.0f || mtl.clearcoat_thickness != 0.0f || mtl.clearcoat_roughness != 0.0f || mtl.anisotropy != 0.0f || mtl.anisotropy_rotation != 0.0f){
+        m = new PBRMaterial(static_cast<const double>(mtl.roughness),
+                            static_cast<const double>(mtl.metallic),
+                            static_cast<const double>(mtl.sheen),
+                            static_cast<const double>(mtl.clearcoat_thickness),
+                            static_cast<const double>(mtl.clearcoat_roughness),
+                            static_cast<const double>(mtl.anisotropy),
+                            static_cast<const double>(mtl.anisotropy_rotation));
+    }
+    if(mtl.roughness_texname != ""){
+        PBRTexture* texture = new PBRTexture(basepath + mtl.roughness_texname);
+        if(mtl.emissive_texname != ""){
+            texture->loadEmissiveTexture(basepath + mtl.emissive_texname);
+        }
+        if(mtl.metallic_texname != ""){
+            texture->loadMetallicTexture(basepath + mtl.metallic_texname);
+        }
+        if(mtl.sheen_texname != ""){
+            texture->loadSheenTexture(basepath + mtl.sheen_texname);
+        }
+        if(mtl.normal_texname != ""){
+            texture->loadNormalTexture(basepath + mtl.normal_texname);
+        }
+    }
+    return m;
+}
+
+//peak resident set size of the process
+static double peakMemoryMB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
 Mesh::Mesh(const char *filename, Material *material) : Object3D(material) {
     std::cout << "Mesh constructor" << std::endl;
     std::cout << "Loading " << filename << std::endl;
+    auto start = std::chrono::steady_clock::now();
 
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
     std::vector<tinyobj::material_t> materials;
-    bool triangulate = true;
-
-    std::string warn;
-    std::string err;
+    std::vector<std::string> mtlFiles;
     std::string inputfile = filename;
     
     string::size_type iPos = (inputfile .find_last_of('\\') + 1) == 0 ?  inputfile .find_last_of('/') + 1: inputfile .find_last_of('\\') + 1 ;
     string basepath = inputfile.substr(0,iPos);//获取文件路径
 
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename,
-                                basepath.c_str(), triangulate);
-
-    if (!warn.empty()) {
-    std::cout << "WARN: " << warn << std::endl;
+    //warm start: copy the arrays straight out of the mapped cache
+    MeshCache cache(inputfile);
+    bool cached = meshCache && cache.open(smooth);
+    bool parsed = true;
+    if(cached){
+        const Vector3f* v = cache.data<Vector3f>(MeshCache::VERTICES);
+        _v.assign(v, v + cache.count(MeshCache::VERTICES));
+        const Vector3f* n = cache.data<Vector3f>(MeshCache::NORMALS);
+        _n.assign(n, n + cache.count(MeshCache::NORMALS));
+        const Vector2f* uv = cache.data<Vector2f>(MeshCache::TEXCOORDS);
+        _uv.assign(uv, uv + cache.count(MeshCache::TEXCOORDS));
+        const TriangleIndices* t = cache.data<TriangleIndices>(MeshCache::TRIANGLES);
+        _triangles.assign(t, t + cache.count(MeshCache::TRIANGLES));
+        cache.readMaterials(materials);
+        cache.readMtlFiles(mtlFiles);
+        std::cout << "Geometry loaded from " << cache.Path() << " in " << millisecondsSince(start) << " ms" << std::endl;
+    }else{
+        parsed = parseObj(filename, basepath, _v, _n, _uv, _triangles, materials, mtlFiles);
+        std::cout << "Obj parsed in " << millisecondsSince(start) << " ms, peak memory " << peakMemoryMB() << " MB" << std::endl;
     }
 
-    if (!err.empty()) {
-    std::cerr << "ERR: " << err << std::endl;
-    }
+    std::cout << "vertices: " << _v.size() << std::endl;
+    std::cout << "normals: " << _n.size() << std::endl;
+    std::cout << "texcoords: " << _uv.size() << std::endl;
+    std::cout << "triangles: " << _triangles.size() << std::endl;
+    std::cout<<"materials size:"<<materials.size()<<std::endl;
 
-    if (!ret) {
-    printf("Failed to load/parse .obj.\n");
+    //materials
+    for(size_t i = 0; i < materials.size(); i++) {
+        _materials.push_back(createMaterial(materials[i], basepath));
     }
+    
     #ifdef __DEBUG__
-    PrintInfo(attrib, shapes, materials);
+    std::cout << "materials: " << _materials.size() << std::endl;
     #endif
-    //parse attrib, shapes and materials from tinyobjloader to mesh
-    //attrib
-    for(size_t i = 0; i < attrib.vertices.size(); i+=3){
-        Vector3f vertex(attrib.vertices[i], attrib.vertices[i+1], attrib.vertices[i+2]);
-        _v.push_back(vertex);
-    }
 
-    for(size_t i = 0; i < attrib.normals.size(); i+=3){
-        Vector3f normal(attrib.normals[i], attrib.normals[i+1], attrib.normals[i+2]);
-        _n.push_back(normal);
-    }
-
-    for(size_t i = 0; i < attrib.texcoords.size(); i+=2){
-        Vector2f texcoord(attrib.texcoords[i], attrib.texcoords[i+1]);
-        _uv.push_back(texcoord);
+    bool hasCachedBVH = cached && cache.count(MeshCache::BVH_NODES) > 0;
+    if(useBVH){
+        if(hasCachedBVH){
+            //the cached triangles are already in leaf order
+            auto bvhStart = std::chrono::steady_clock::now();
+            const PackedBVHNode* nodes = cache.data<PackedBVHNode>(MeshCache::BVH_NODES);
+            _root = BVHNode::unpack(nodes, 0);
+            _nodes.assign(nodes, nodes + cache.count(MeshCache::BVH_NODES));
+            setPackedBVH();
+            std::cout << "BVH restored in " << millisecondsSince(bvhStart) << " ms" << std::endl;
+        }else{
+            buildBVH();
+        }
     }
 
-    std::cout << "vertices: " << _v.size() << std::endl;
-    std::cout << "normals: " << _n.size() << std::endl;
-    std::cout << "texcoords: " << _uv.size() << std::endl;
-
-
-    //shapes
-    for(size_t i = 0; i < shapes.size(); i++) {
-        Shape shape;
-        shape._name = shapes[i].name;
-        size_t index_offset = 0;
-
-        assert(shapes[i].mesh.num_face_vertices.size() ==
-            shapes[i].mesh.material_ids.size());
-
-        assert(shapes[i].mesh.num_face_vertices.size() ==
-            shapes[i].mesh.smoothing_group_ids.size());
-        
-        for(size_t f = 0; f < shapes[i].mesh.num_face_vertices.size(); f++){
-            Face face;
-            size_t fnum = shapes[i].mesh.num_face_vertices[f];
-            //std::cout << "face[" << f << "].fnum = " << fnum << std::endl;
-            for(size_t v = 0; v < fnum; v++){
-                Vertex vertex;
-                tinyobj::index_t idx = shapes[i].mesh.indices[index_offset + v];
-                vertex._vertex_index = idx.vertex_index;
-                vertex._normal_index = idx.normal_index;
-                vertex._texcoord_index = idx.texcoord_index;
-                face._vertexes.push_back(vertex);
-            }
-            index_offset += fnum;
-            shape._faces.push_back(face);
+    //cold start (or a cache written without BVH): write the cache for the next run
+    if(meshCache && parsed && (!cached || (useBVH && !hasCachedBVH))){
+        if(cache.write(smooth, _v, _n, _uv, _triangles, materials, _nodes, mtlFiles)){
+            std::cout << "Geometry cache written to " << cache.Path() << std::endl;
+        }else{
+            std::cout << "WARN: failed to write geometry cache " << cache.Path() << std::endl;
         }
+    }
+    
+    std::cout << "Constructing Finished in " << millisecondsSince(start) << " ms, peak memory " << peakMemoryMB() << " MB" << std::endl;
+}
 
-        shape._material_ids.swap(shapes[i].mesh.material_ids);
-
-        _shapes.push_back(shape);
+Mesh::Mesh(std::vector<Vector3f>& v, std::vector<Vector3f>& n, std::vector<Vector2f>& uv,
+           std::vector<TriangleIndices>& triangles, Material *material, bool twoSided) : Object3D(material) {
+    _twoSided = twoSided;
+    _v.swap(v);
+    _n.swap(n);
+    _uv.swap(uv);
+    _triangles.swap(triangles);
+    if(_twoSided){
+        //hit points come back rounded to float, relative to the size of the coordinates
+        float scale = 1;
+        for(const auto& p : _v) scale = std::max(scale, std::max(std::fabs(p.x()), std::max(std::fabs(p.y()), std::fabs(p.z()))));
+        _selfIntersectionEps = 1e-4f * scale;
     }
-    if(smooth){
-        if(_n.size() == 0 || _n.size() != _v.size()){
-            std::cout << "No/In appropriate normals in obj file, use normal of vertex interpolation" << std::endl;
-            _n = std::vector<Vector3f>(_v.size(), Vector3f::ZERO);
-            for(size_t i = 0; i < _shapes.size(); i++){
-                for(size_t j = 0; j < _shapes[i]._faces.size(); j++){
-                    Face face = _shapes[i]._faces[j];
-                    assert(face._vertexes.size() == 3);
-                    Vector3f normal = Vector3f::cross(_v[face._vertexes[1]._vertex_index] - _v[face._vertexes[0]._vertex_index], _v[face._vertexes[2]._vertex_index] - _v[face._vertexes[0]._vertex_index]);
-                    _n[face._vertexes[0]._vertex_index] += normal;
-                    face._vertexes[0]._normal_index = face._vertexes[0]._vertex_index;
-                    //std::cout<<face._vertexes[0]._normal_index<<std::endl;
-                    _n[face._vertexes[1]._vertex_index] += normal;
-                    face._vertexes[1]._normal_index = face._vertexes[1]._vertex_index;
-                    _n[face._vertexes[2]._vertex_index] += normal;
-                    face._vertexes[2]._normal_index = face._vertexes[2]._vertex_index;
-                }
-            }
-            for(size_t i = 0; i < _n.size(); i++){
-                _n[i].normalize();
+    if(useBVH) buildBVH();
+}
+
+void Mesh::buildBVH() {
+    auto bvhStart = std::chrono::steady_clock::now();
+    std::vector<int> order;
+    {
+        std::vector<BVHBuilder::Bounds> bounds(_triangles.size());
+        for(size_t i = 0; i < _triangles.size(); i++){
+            const Vector3f& a = _v[_triangles[i].v[0]];
+            const Vector3f& b = _v[_triangles[i].v[1]];
+            const Vector3f& c = _v[_triangles[i].v[2]];
+            for(int k = 0; k < 3; k++){
+                bounds[i].min[k] = std::min(a[k], std::min(b[k], c[k]));
+                bounds[i].max[k] = std::max(a[k], std::max(b[k], c[k]));
             }
         }
+        _root = new BVHNode(bounds, order);
     }
-    //no need to parse tags
-    std::cout<<"materials size:"<<materials.size()<<std::endl;
+    //store the triangles in leaf order, the leaves then index _triangles directly
+    std::vector<TriangleIndices> sorted(_triangles.size());
+    for(size_t i = 0; i < order.size(); i++) sorted[i] = _triangles[order[i]];
+    _triangles.swap(sorted);
+    _nodes.clear();
+    _root->pack(_nodes);
+    setPackedBVH();
+    double bvhTime = millisecondsSince(bvhStart);
+    RenderStats::instance().addBVHBuildTime(bvhTime);
+    std::cout << "BVH built in " << bvhTime << " ms with " << omp_get_max_threads() << " threads" << std::endl;
+}
 
-    //materials
-    for(size_t i = 0; i < materials.size(); i++) {
-        Material *m;
-        //default material: EmpiricalMaterial
-        m = new EmpiricalMaterial(
-            Vector3f(materials[i].ambient[0], materials[i].ambient[1], materials[i].ambient[2]),
-            Vector3f(materials[i].diffuse[0], materials[i].diffuse[1], materials[i].diffuse[2]),
-            Vector3f(materials[i].specular[0], materials[i].specular[1], materials[i].specular[2]),
-            Vector3f(materials[i].transmittance[0], materials[i].transmittance[1], materials[i].transmittance[2]),
-            Vector3f(materials[i].emission[0], materials[i].emission[1], materials[i].emission[2]),
-            materials[i].shininess,
-            materials[i].ior,
-            materials[i].dissolve,
-            materials[i].illum);
-        if(materials[i].diffuse_texname != ""){
-            EmpiricalImageTexture *texture = new EmpiricalImageTexture(basepath + materials[i].diffuse_texname);
-            if(materials[i].ambient_texname != ""){
-                texture->loadAmbientTexture(materials[i].ambient_texname);
-            }
-            if(materials[i].specular_texname != ""){
-                texture->loadSpecularTexture(materials[i].specular_texname);
-            }
-            if(materials[i].specular_highlight_texname != ""){
-                texture->loadSpecularHighlightTexture(materials[i].specular_highlight_texname);
-            }
-            if(materials[i].bump_texname != ""){
-                texture->loadBumpTexture(materials[i].bump_texname, materials[i].bump_texopt.bump_multiplier);
-            }
-            if(materials[i].alpha_texname != ""){
-                texture->loadAlphaTexture(materials[i].alpha_texname);
-            }
-            if(materials[i].displacement_texname != ""){
-                texture->loadDisplacementTexture(materials[i].displacement_texname);
-            }
+void Mesh::setPackedBVH() {
+    _packetTraversal = !_nodes.empty() && packedDepth(_nodes) < PACKET_STACK_SIZE;
+}
 
-            dynamic_cast<EmpiricalMaterial *>(m)->setTexture(texture);
-        }
+TriangleRef::TriangleRef(const Mesh& mesh, const TriangleIndices& t) : mesh(mesh), t(t) {
+    //material overlap
+    material = t.material != -1 ? mesh._materials[t.material] : mesh.material;
+    assert(material != nullptr);
+}
 
-        //PBR pipeline
-        if(materials[i].roughness != 0.0f || materials[i].metallic != 0.0f || materials[i].sheen != 0.0f || materials[i].clearcoat_thickness != 0.0f || materials[i].clearcoat_roughness != 0.0f || materials[i].anisotropy != 0.0f || materials[i].anisotropy_rotation != 0.0f){
-            m = new PBRMaterial(static_cast<const double>(materials[i].roughness),
-                                static_cast<const double>(materials[i].metallic),
-                                static_cast<const double>(materials[i].sheen),
-                                static_cast<const double>(materials[i].clearcoat_thickness),
-                                static_cast<const double>(materials[i].clearcoat_roughness),
-                                static_cast<const double>(materials[i].anisotropy),
-                                static_cast<const double>(materials[i].anisotropy_rotation));
+bool TriangleRef::intersect(const Ray& ray, Hit& hit, float tmin) const {
+    const std::vector<Vector3f>& v = mesh._v;
+    if(material->hasTexture()){
+        //bump mapping moves the corners, gather everything and let Triangle handle it (on the stack)
+        Vector2f uv[3];
+        if(t.uv[0] != -1){
+            for(int k = 0; k < 3; k++) uv[k] = mesh._uv[t.uv[k]];
         }
-        if(materials[i].roughness_texname != ""){
-            PBRTexture* texture = new PBRTexture(materials[i].roughness_texname);
-            if(materials[i].emissive_texname != ""){
-                texture->loadEmissiveTexture(materials[i].emissive_texname);
-            }
-            if(materials[i].metallic_texname != ""){
-                texture->loadMetallicTexture(materials[i].metallic_texname);
-            }
-            if(materials[i].sheen_texname != ""){
-                texture->loadSheenTexture(materials[i].sheen_texname);
-            }
-            if(materials[i].normal_texname != ""){
-                texture->loadNormalTexture(materials[i].normal_texname);
-            }
+        Triangle triangle(v[t.v[0]], v[t.v[1]], v[t.v[2]], uv[0], uv[1], uv[2], material);
+        if(t.n[0] != -1){
+            triangle.setNormals(mesh._n[t.n[0]], mesh._n[t.n[1]], mesh._n[t.n[2]]);
         }
-        _materials.push_back(m);
+        triangle.setTwoSided(mesh._twoSided);
+        return triangle.intersect(ray, hit, tmin);
     }
-    
-    #ifdef __DEBUG__
-    std::cout << "shapes: " << _shapes.size() << std::endl;
-    std::cout << "materials: " << _materials.size() << std::endl;
-    std::cout << "vertexes: " << _v.size() << std::endl;
-    std::cout << "normals: " << _n.size() << std::endl;
-    std::cout << "texcoords: " << _uv.size() << std::endl;
-    #endif
-    //output material info
-    
-    
-    if(useBVH){
-    //construct all triangles
-    std::vector<Triangle*> _triangles;
-    for(auto shape : _shapes){
-        size_t index_offset = 0;
-        
-        for(auto face : shape._faces){
-            Material *m = this->material;
-            //material overlap
-            if(shape._material_ids[index_offset]!=-1){
-                m = _materials[shape._material_ids[index_offset]];
-            }
 
-            if(_uv.size() <= 0){
-                Triangle* triangle = new Triangle
-                        (_v[face._vertexes[0]._vertex_index],
-                        _v[face._vertexes[1]._vertex_index],
-                        _v[face._vertexes[2]._vertex_index],
-                        Vector2f(), Vector2f(), Vector2f(),
-                        m);
-                if(_n.size() > 0){
-                    //std::cout << face._vertexes[0]._normal_index << std::endl;
-                    if(face._vertexes[0]._normal_index != -1){
-                        triangle->setNormals(_n[face._vertexes[0]._normal_index],
-                                            _n[face._vertexes[1]._normal_index],
-                                            _n[face._vertexes[2]._normal_index]);
-                    }else {
-                        triangle->setNormals(_n[face._vertexes[0]._vertex_index],
-                                            _n[face._vertexes[1]._vertex_index],
-                                            _n[face._vertexes[2]._vertex_index]);
-                    }
-                }
-                _triangles.push_back(triangle);
-            }else{
-                Triangle* triangle = new Triangle
-                        (_v[face._vertexes[0]._vertex_index],
-                        _v[face._vertexes[1]._vertex_index],
-                        _v[face._vertexes[2]._vertex_index],
-                        _uv[face._vertexes[0]._texcoord_index],
-                        _uv[face._vertexes[1]._texcoord_index],
-                        _uv[face._vertexes[2]._texcoord_index],
-                        m);
-                if(_n.size() > 0){
-                    if(face._vertexes[0]._normal_index != -1){
-                        triangle->setNormals(_n[face._vertexes[0]._normal_index],
-                                            _n[face._vertexes[1]._normal_index],
-                                            _n[face._vertexes[2]._normal_index]);
-                    }else {
-                        triangle->setNormals(_n[face._vertexes[0]._vertex_index],
-                                            _n[face._vertexes[1]._vertex_index],
-                                            _n[face._vertexes[2]._vertex_index]);
-                    }
-                }
-                _triangles.push_back(triangle);
-            }
-
-        }
-        index_offset += shape._faces.size();
+    const Vector3f& a = v[t.v[0]];
+    Vector3f E1 = v[t.v[1]] - a;
+    Vector3f E2 = v[t.v[2]] - a;
+    float tHit, u, w;
+    if(!Triangle::intersect(a, E1, E2, ray, tmin, hit.getT(), tHit, u, w, mesh._twoSided)) return false;
 
+    //hit: now interpolate the attributes, same rules as Triangle::intersect
+    Vector2f texCoord = Vector2f::ZERO;
+    if(t.uv[0] != -1){
+        texCoord = (1 - u - w) * mesh._uv[t.uv[0]] + u * mesh._uv[t.uv[1]] + w * mesh._uv[t.uv[2]];
     }
-    //construct BVH
-    _root = new BVHNode(_triangles);
+    Vector3f hitNormal;
+    if(t.n[0] != -1 && !(mesh._n[t.n[0]] == Vector3f::ZERO && mesh._n[t.n[1]] == Vector3f::ZERO && mesh._n[t.n[2]] == Vector3f::ZERO)){
+        hitNormal = (1 - u - w) * mesh._n[t.n[0]] + u * mesh._n[t.n[1]] + w * mesh._n[t.n[2]];
+    }else{
+        hitNormal = Vector3f::cross(E1, E2);
     }
-    
-    std::cout << "Constructing Finished" << std::endl;
+    hitNormal.normalize();
+    hit.set(tHit, material, hitNormal, texCoord);
+    return true;
 }
 
 bool Mesh::intersect(const Ray &r, Hit &h, float tmin) {
+    tmin = std::max(tmin, _selfIntersectionEps);
     if(useBVH){
         //std::cout<<"BVH intersect"<<std::endl;
-        return _root->intersect(r, h, tmin);
+        return _root->intersect(r, h, tmin, [this](int i, const Ray &r, Hit &h, float tmin) {
+            return TriangleRef(*this, _triangles[i]).intersect(r, h, tmin);
+        });
 
     }
     //std::cout << "Mesh intersect" << std::endl;
-    //std::cout << "Hit: "<< h.getT() << h.getTexCoord() << std::endl;
     bool result = false;
-    for(size_t i = 0; i < _shapes.size(); i++){
-        #ifdef __DEBUG__
-        std::cout << "shape[" << i << "]" << std::endl;
-        //std::cout << _shapes[i] << std::endl;
-        #endif
-        for(size_t j = 0; j < _shapes[i]._faces.size(); j++){
-            #ifdef __DEBUG__
-            std::cout << "face[" << j << "]" << std::endl;
-            #endif
-            Face face = _shapes[i]._faces[j];
-            //std::cout << face << std::endl;
-            assert(face._vertexes.size() == 3);
-
-            #ifdef __DEBUG__
-            std::cout<<"vertexes:"<<std::endl;
-            std::cout<< _v[face._vertexes[0]._vertex_index] << std::endl;
-            std::cout<< _v[face._vertexes[1]._vertex_index] << std::endl;
-            std::cout<< _v[face._vertexes[2]._vertex_index] << std::endl;
-            std::cout<<"material:"<<std::endl;
-            std::cout<< _shapes[i]._material_ids[j] << std::endl;
-            std::cout<< _materials.size() << std::endl;
-            #endif
-            Material *m = this->material;
-            //material overlap
-            assert(j < _shapes[i]._material_ids.size());
-            if(_shapes[i]._material_ids[j]!=-1){
-                m = _materials[_shapes[i]._material_ids[j]];
-            }
-            assert(m != nullptr);
-            if(_uv.size() <= 0){
-                Triangle triangle(_v[face._vertexes[0]._vertex_index],
-                                  _v[face._vertexes[1]._vertex_index],
-                                  _v[face._vertexes[2]._vertex_index],
-                                  Vector2f(), Vector2f(), Vector2f(),
-                                  m);
-                if(_n.size() > 0){
-                    //std::cout << face._vertexes[0]._normal_index << std::endl;
-                    if(face._vertexes[0]._normal_index != -1){
-                        triangle.setNormals(_n[face._vertexes[0]._normal_index],
-                                            _n[face._vertexes[1]._normal_index],
-                                            _n[face._vertexes[2]._normal_index]);
-                    }else {
-                        triangle.setNormals(_n[face._vertexes[0]._vertex_index],
-                                            _n[face._vertexes[1]._vertex_index],
-                                            _n[face._vertexes[2]._vertex_index]);
-                    }
-                }
-                result |= triangle.intersect(r, h, tmin);
-            }else{
-                Triangle triangle(_v[face._vertexes[0]._vertex_index],
-                                _v[face._vertexes[1]._vertex_index],
-                                _v[face._vertexes[2]._vertex_index],
-                                _uv[face._vertexes[0]._texcoord_index],
-                                _uv[face._vertexes[1]._texcoord_index],
-                                _uv[face._vertexes[2]._texcoord_index],
-                                m);
-                if(_n.size() > 0){
-                    if(face._vertexes[0]._normal_index != -1){
-                        triangle.setNormals(_n[face._vertexes[0]._normal_index],
-                                            _n[face._vertexes[1]._normal_index],
-                                            _n[face._vertexes[2]._normal_index]);
-                    }else {
-                        triangle.setNormals(_n[face._vertexes[0]._vertex_index],
-                                            _n[face._vertexes[1]._vertex_index],
-                                            _n[face._vertexes[2]._vertex_index]);
-                    }
-                }
-                result |= triangle.intersect(r, h, tmin);
-            }
-        }
+    for(size_t i = 0; i < _triangles.size(); i++){
+        result |= TriangleRef(*this, _triangles[i]).intersect(r, h, tmin);
     }
-    //std::cout << "Hit: "<< h.getT() << std::endl;
-    //std::cout << "texCoord after all intersect: " << h.getTexCoord() << std::endl;
     return result;
 }
 
+void Mesh::collectEmitters(const Matrix4f &toWorld, std::vector<EmissiveShape> &shapes) {
+    for(const TriangleIndices& t : _triangles) {
+        Material* m = t.material != -1 ? _materials[t.material] : material;
+        if(!(luminance(emissionOf(m)) > 0)) continue;
+        shapes.push_back(EmissiveShape::triangle(transformedPoint(toWorld, _v[t.v[0]]), transformedPoint(toWorld, _v[t.v[1]]),
+                                                 transformedPoint(toWorld, _v[t.v[2]]), m, _twoSided));
+    }
+}
+
+int Mesh::intersectPacket(const RayPacket &packet, Hit *hits, float tmin) {
+    if(!useBVH || !_packetTraversal) return Object3D::intersectPacket(packet, hits, tmin);
+    tmin = std::max(tmin, _selfIntersectionEps);
+    alignas(32) float tmax[RayPacket::SIZE];
+    for(int lane = 0; lane < RayPacket::SIZE; lane++) tmax[lane] = hits[lane].getT();
+    //the packet test only picks the candidate lanes, every candidate goes through the single ray
+    //test (attributes, bump mapped corners), so packets find exactly the hits single rays do
+    auto confirm = [&](const TriangleRef& triangle, int candidates) {
+        int hitMask = 0;
+        for(int m = candidates; m != 0; m &= m - 1) {
+            int lane = firstLane(m);
+            if(triangle.intersect(packet.ray(lane), hits[lane], tmin)) {
+                tmax[lane] = hits[lane].getT();
+                hitMask |= 1 << lane;
+            }
+        }
+        return hitMask;
+    };
+    return ::intersectPacket(_nodes.data(), packet, tmin, tmax, packet.mask, [&](int i, int mask) {
+        const TriangleIndices& t = _triangles[i];
+        TriangleRef triangle(*this, t);
+        if(popcount(mask) == 1 || triangle.hasBump()) return confirm(triangle, mask);
+        const float* a = _v[t.v[0]];
+        const float* b = _v[t.v[1]];
+        const float* c = _v[t.v[2]];
+        float E1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+        float E2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+        return confirm(triangle, packet.triangleMask(a, E1, E2, tmin, tmax, mask, _twoSided));
+    });
+}
+
 TraditionalMesh::TraditionalMesh(const char *filename, Material *m) {
     material = m;
 
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/mesh_cache.hpp"
+
+namespace {
+const char MAGIC[8] = {'M', 'P', 'T', 'M', 'E', 'S', 'H', '\0'};
+//bump whenever the layout of any section or the BVH builder changes
+const uint32_t VERSION = 4;
+const uint64_t ALIGNMENT = 64;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t smooth;
+    uint64_t objSize;
+    int64_t objMtime;
+    uint64_t count[MeshCache::SECTION_COUNT];
+    uint64_t offset[MeshCache::SECTION_COUNT];
+};
+
+const size_t ELEMENT_SIZE[MeshCache::SECTION_COUNT] = {
+    sizeof(float) * 3, sizeof(float) * 3, sizeof(float) * 2,
+    sizeof(TriangleIndices), 1, sizeof(PackedBVHNode), 1
+};
+
+static_assert(sizeof(Vector3f) == sizeof(float) * 3, "Vector3f is written to the cache as is");
+static_assert(sizeof(Vector2f) == sizeof(float) * 2, "Vector2f is written to the cache as is");
+
+bool statFile(const std::string& path, uint64_t& size, int64_t& mtime) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return false;
+    size = st.st_size;
+    mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+//materials are stored field by field, only the ones Mesh reads
+class BlobWriter {
+public:
+    std::string bytes;
+    void put(const void* p, size_t n) { bytes.append(static_cast<const char*>(p), n); }
+    void put(float f) { put(&f, sizeof(f)); }
+    void put(int32_t i) { put(&i, sizeof(i)); }
+    void put(uint64_t i) { put(&i, sizeof(i)); }
+    void put(int64_t i) { put(&i, sizeof(i)); }
+    void put(const std::string& s) {
+        put(int32_t(s.size()));
+        put(s.data(), s.size());
+    }
+    void putArray(const float* f, int n) { for(int i = 0; i < n; i++) put(f[i]); }
+};
+
+class BlobReader {
+public:
+    BlobReader(const unsigned char* p, size_t n) : p(p), end(p + n) {}
+    void get(void* dst, size_t n) {
+        if(n > size_t(end - p)) {
+            memset(dst, 0, n);
+            p = end;
+            overrun = true;
+            return;
+        }
+        memcpy(dst, p, n);
+        p += n;
+    }
+    float getFloat() { float f; get(&f, sizeof(f)); return f; }
+    int32_t getInt() { int32_t i; get(&i, sizeof(i)); return i; }
+    uint64_t getUint64() { uint64_t i; get(&i, sizeof(i)); return i; }
+    int64_t getInt64() { int64_t i; get(&i, sizeof(i)); return i; }
+    std::string getString() {
+        int32_t n = getInt();
+        if(n < 0 || size_t(n) > size_t(end - p)) {
+            overrun = overrun || n != 0;
+            n = 0;
+        }
+        std::string s(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return s;
+    }
+    void getArray(float* f, int n) { for(int i = 0; i < n; i++) f[i] = getFloat(); }
+    //false once a read went past the end
+    bool good() const { return !overrun; }
+    size_t remaining() const { return end - p; }
+private:
+    const unsigned char* p;
+    const unsigned char* end;
+    bool overrun = false;
+};
+
+//missing files are recorded as size 0, mtime -1: creating one later makes the cache stale
+std::string packMtlFiles(const std::vector<std::string>& files) {
+    BlobWriter w;
+    w.put(int32_t(files.size()));
+    for(const auto& file : files) {
+        uint64_t size = 0;
+        int64_t mtime = -1;
+        if(!statFile(file, size, mtime)) size = 0, mtime = -1;
+        w.put(file);
+        w.put(size);
+        w.put(mtime);
+    }
+    return w.bytes;
+}
+
+std::string packMaterials(const std::vector<tinyobj::material_t>& materials) {
+    BlobWriter w;
+    w.put(int32_t(materials.size()));
+    for(const auto& m : materials) {
+        w.put(m.name);
+        w.putArray(m.ambient, 3);
+        w.putArray(m.diffuse, 3);
+        w.putArray(m.specular, 3);
+        w.putArray(m.transmittance, 3);
+        w.putArray(m.emission, 3);
+        w.put(m.shininess);
+        w.put(m.ior);
+        w.put(m.dissolve);
+        w.put(int32_t(m.illum));
+        w.put(m.ambient_texname);
+        w.put(m.diffuse_texname);
+        w.put(m.specular_texname);
+        w.put(m.specular_highlight_texname);
+        w.put(m.bump_texname);
+        w.put(m.bump_texopt.bump_multiplier);
+        w.put(m.displacement_texname);
+        w.put(m.alpha_texname);
+        w.put(m.roughness);
+        w.put(m.metallic);
+        w.put(m.sheen);
+        w.put(m.clearcoat_thickness);
+        w.put(m.clearcoat_roughness);
+        w.put(m.anisotropy);
+        w.put(m.anisotropy_rotation);
+        w.put(m.roughness_texname);
+        w.put(m.metallic_texname);
+        w.put(m.sheen_texname);
+        w.put(m.emissive_texname);
+        w.put(m.normal_texname);
+    }
+    return w.bytes;
+}
+}
+
+MeshCache::MeshCache(const std::string& objPath) : objPath(objPath), path(objPath + ".cache") {}
+
+MeshCache::~MeshCache() {
+    if(base != nullptr) munmap(const_cast<unsigned char*>(base), size);
+}
+
+uint64_t MeshCache::offset(Section s) const {
+    return reinterpret_cast<const Header*>(base)->offset[s];
+}
+
+size_t MeshCache::count(Section s) const {
+    return reinterpret_cast<const Header*>(base)->count[s];
+}
+
+bool MeshCache::open(bool smooth) {
+    uint64_t objSize;
+    int64_t objMtime;
+    if(!statFile(objPath, objSize, objMtime)) return false;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return false;
+    base = static_cast<const unsigned char*>(p);
+    size = st.st_size;
+
+    const Header* header = reinterpret_cast<const Header*>(base);
+    bool valid = memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 && header->version == VERSION &&
+                 header->smooth == uint32_t(smooth) && header->objSize == objSize && header->objMtime == objMtime;
+    for(int s = 0; valid && s < SECTION_COUNT; s++) {
+        //sections must lie inside the file, also catches a truncated write
+        valid = header->offset[s] <= size && header->count[s] <= (size - header->offset[s]) / ELEMENT_SIZE[s];
+    }
+    valid = valid && mtlFilesUnchanged() && indicesValid();
+    if(!valid) {
+        munmap(p, size);
+        base = nullptr;
+        size = 0;
+        return false;
+    }
+    //every section is copied out right away, start reading ahead now
+    madvise(p, size, MADV_WILLNEED);
+    return true;
+}
+
+bool MeshCache::mtlFilesUnchanged() const {
+    BlobReader r(data<unsigned char>(MTL_FILES), count(MTL_FILES));
+    int32_t n = r.getInt();
+    for(int32_t i = 0; r.good() && i < n; i++) {
+        std::string file = r.getString();
+        uint64_t size = r.getUint64(), current = 0;
+        int64_t mtime = r.getInt64(), currentMtime = -1;
+        if(!statFile(file, current, currentMtime)) current = 0, currentMtime = -1;
+        if(!r.good() || current != size || currentMtime != mtime) return false;
+    }
+    return r.good() && n >= 0;
+}
+
+void MeshCache::readMtlFiles(std::vector<std::string>& files) const {
+    BlobReader r(data<unsigned char>(MTL_FILES), count(MTL_FILES));
+    int32_t n = r.getInt();
+    for(int32_t i = 0; r.good() && i < n; i++) {
+        files.push_back(r.getString());
+        r.getUint64();
+        r.getInt64();
+    }
+}
+
+bool MeshCache::indicesValid() const {
+    //the material table: the count must fit the blob and every entry must read back whole
+    std::vector<tinyobj::material_t> materials;
+    if(!readMaterials(materials)) return false;
+    for(Section s : {VERTICES, NORMALS, TEXCOORDS, TRIANGLES, BVH_NODES}) {
+        if(count(s) > size_t(INT32_MAX)) return false;
+    }
+    int vertices = count(VERTICES), normals = count(NORMALS), texcoords = count(TEXCOORDS);
+    int triangles = count(TRIANGLES), nodeCount = count(BVH_NODES), materialCount = materials.size();
+    auto inRange = [](int i, int n) { return i >= 0 && i < n; };
+    //normals and texcoords of a triangle are only read when its first index is set
+    auto corners = [&](const int* index, int n, bool optional) {
+        if(optional && index[0] == -1) return true;
+        return inRange(index[0], n) && inRange(index[1], n) && inRange(index[2], n);
+    };
+    const TriangleIndices* t = data<TriangleIndices>(TRIANGLES);
+    for(int i = 0; i < triangles; i++) {
+        if(!corners(t[i].v, vertices, false) || !corners(t[i].n, normals, true) || !corners(t[i].uv, texcoords, true))
+            return false;
+        if(t[i].material != -1 && !inRange(t[i].material, materialCount)) return false;
+    }
+    //a tree in preorder: children come after their parent and have no other parent, leaves stay inside
+    //the triangles; this also keeps unpack and the packet traversal from looping
+    const PackedBVHNode* nodes = data<PackedBVHNode>(BVH_NODES);
+    std::vector<char> referenced(nodeCount, 0);
+    for(int i = 0; i < nodeCount; i++) {
+        const PackedBVHNode& node = nodes[i];
+        for(int child : {node.left, node.right}) {
+            if(child == -1) continue;
+            if(child <= i || child >= nodeCount || referenced[child]) return false;
+            referenced[child] = 1;
+        }
+        if(node.left == -1 && node.right == -1 &&
+           (node.start < 0 || node.count < 0 || node.start > triangles - node.count)) return false;
+    }
+    for(int i = 1; i < nodeCount; i++) {
+        if(!referenced[i]) return false;
+    }
+    return true;
+}
+
+bool MeshCache::readMaterials(std::vector<tinyobj::material_t>& materials) const {
+    BlobReader r(data<unsigned char>(MATERIALS), count(MATERIALS));
+    int32_t n = r.getInt();
+    //a material takes far more than 4 bytes, a larger count is corrupt
+    if(!r.good() || n < 0 || size_t(n) > r.remaining() / 4) return false;
+    materials.resize(n);
+    for(auto& m : materials) {
+        m.name = r.getString();
+        r.getArray(m.ambient, 3);
+        r.getArray(m.diffuse, 3);
+        r.getArray(m.specular, 3);
+        r.getArray(m.transmittance, 3);
+        r.getArray(m.emission, 3);
+        m.shininess = r.getFloat();
+        m.ior = r.getFloat();
+        m.dissolve = r.getFloat();
+        m.illum = r.getInt();
+        m.ambient_texname = r.getString();
+        m.diffuse_texname = r.getString();
+        m.specular_texname = r.getString();
+        m.specular_highlight_texname = r.getString();
+        m.bump_texname = r.getString();
+        m.bump_texopt.bump_multiplier = r.getFloat();
+        m.displacement_texname = r.getString();
+        m.alpha_texname = r.getString();
+        m.roughness = r.getFloat();
+        m.metallic = r.getFloat();
+        m.sheen = r.getFloat();
+        m.clearcoat_thickness = r.getFloat();
+        m.clearcoat_roughness = r.getFloat();
+        m.anisotropy = r.getFloat();
+        m.anisotropy_rotation = r.getFloat();
+        m.roughness_texname = r.getString();
+        m.metallic_texname = r.getString();
+        m.sheen_texname = r.getString();
+        m.emissive_texname = r.getString();
+        m.normal_texname = r.getString();
+    }
+    return r.good();
+}
+
+bool MeshCache::write(bool smooth, const std::vector<Vector3f>& v, const std::vector<Vector3f>& n,
+                      const std::vector<Vector2f>& uv, const std::vector<TriangleIndices>& triangles,
+                      const std::vector<tinyobj::material_t>& materials,
+                      const std::vector<PackedBVHNode>& nodes, const std::vector<std::string>& mtlFiles) {
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.smooth = smooth;
+    if(!statFile(objPath, header.objSize, header.objMtime)) return false;
+
+    std::string blob = packMaterials(materials), mtl = packMtlFiles(mtlFiles);
+    const void* sections[SECTION_COUNT] = {
+        v.data(), n.data(), uv.data(), triangles.data(), blob.data(), nodes.data(), mtl.data()
+    };
+    header.count[VERTICES] = v.size();
+    header.count[NORMALS] = n.size();
+    header.count[TEXCOORDS] = uv.size();
+    header.count[TRIANGLES] = triangles.size();
+    header.count[MATERIALS] = blob.size();
+    header.count[BVH_NODES] = nodes.size();
+    header.count[MTL_FILES] = mtl.size();
+    uint64_t end = sizeof(Header);
+    for(int s = 0; s < SECTION_COUNT; s++) {
+        end = (end + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        header.offset[s] = end;
+        end += header.count[s] * ELEMENT_SIZE[s];
+    }
+
+    //write to a temporary file and rename, a concurrent reader never sees a partial cache
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if(f == nullptr) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint64_t position = sizeof(Header);
+    const char zeros[ALIGNMENT] = {};
+    for(int s = 0; ok && s < SECTION_COUNT; s++) {
+        ok = fwrite(zeros, 1, header.offset[s] - position, f) == header.offset[s] - position;
+        size_t bytes = header.count[s] * ELEMENT_SIZE[s];
+        if(ok && bytes > 0) ok = fwrite(sections[s], 1, bytes, f) == bytes;
+        position = header.offset[s] + bytes;
+    }
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
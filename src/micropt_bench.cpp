@@ -0,0 +1,267 @@
+#include <vecmath.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <sys/resource.h>
+
+#include "../include/utils.hpp"
+#include "../include/image.hpp"
+#include "../include/scene_parser.hpp"
+#include "../include/camera.hpp"
+#include "../include/material.hpp"
+#include "../include/triangle.hpp"
+#include "../include/classical_object.hpp"
+#include "../include/mesh.hpp"
+#include "../include/curve.hpp"
+#include "../include/hit.hpp"
+#include "../include/render.hpp"
+#include "../include/render_stats.hpp"
+#include "../include/bvh.hpp"
+
+//micropt_bench: fixed seed renders of the canonical testcases at several resolutions and microbenchmarks of the
+//intersection routines, the numbers are written as JSON to compare builds over time
+/* usage: micropt_bench --testcases ../testcases/ --output micropt_bench.json --threads 8 --quick 0
+      testcases: directory of the scene files, scenes that are missing are reported as skipped
+      quick: 1 only renders the smallest resolution
+   per render: scene load and BVH build time, render time, primary / shadow / secondary rays per second,
+   SPPM photons and photon segments per second (apart from the camera side rays, the total compares with PT)
+   and the peak resident memory so far
+   BVH build scaling: the binned SAH build over one million random triangles with 1, 2, 4, ... up to --threads
+   threads (the tree is the same for all of them), with the number of processors the numbers were taken on
+*/
+
+bool smooth = false; bool useBVH = true;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchScene {
+    const char* file;
+    RenderMode mode;
+    //PT: samples (4 per pixel each) and depth, SPPM: photons per iteration and iterations
+    int samples, depth;
+};
+
+const BenchScene SCENES[] = {
+    {"pt.txt", PT, 2, 5},
+    {"box.txt", PT, 2, 5},
+    {"environment.txt", PT, 2, 5},
+    {"sppm.txt", SPPM, 20000, 4},
+};
+const int RESOLUTIONS[] = {64, 128, 256};
+
+const char* modeName(RenderMode mode) {
+    switch(mode) {
+        case PT: return "PT";
+        case SPPM: return "SPPM";
+        default: return "other";
+    }
+}
+
+double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+double peakMemoryMB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+double perSecond(uint64_t n, double milliseconds) {
+    return milliseconds > 0 ? n * 1000.0 / milliseconds : 0;
+}
+
+//renders scene at width px (height keeps the aspect of the scene), one JSON object
+std::string benchRender(const BenchScene& bench, const std::string& path, int width, int threads) {
+    std::ostringstream json;
+    json << "{\"scene\": \"" << bench.file << "\", \"renderer\": \"" << modeName(bench.mode) << "\", ";
+    if(!std::ifstream(path).good()) {
+        json << "\"width\": " << width << ", \"skipped\": \"scene file not found\"}";
+        return json.str();
+    }
+    RenderStats& stats = RenderStats::instance();
+    stats.reset();
+    Clock::time_point start = Clock::now();
+    SceneParser scene(path.c_str());
+    double loadTime = millisecondsSince(start);
+    Camera* camera = scene.getCamera();
+    int height = std::max(1, int(width * float(camera->getHeight()) / camera->getWidth() + 0.5f));
+    camera->setResolution(width, height);
+
+    RENDER = bench.mode;
+    std::unique_ptr<Renderer> renderer = RendererFactory().createRenderer();
+    RgbImage* image = nullptr;
+    start = Clock::now();
+    renderer->render(scene, image, bench.samples, threads, bench.depth, false, 1, 5);
+    double renderTime = millisecondsSince(start);
+    delete image;
+
+    uint64_t primary = stats.total(RenderStats::PRIMARY_RAYS), shadow = stats.total(RenderStats::SHADOW_RAYS);
+    uint64_t secondary = stats.total(RenderStats::SECONDARY_RAYS), photons = stats.total(RenderStats::PHOTONS);
+    uint64_t photonRays = stats.total(RenderStats::PHOTON_RAYS);
+    json << "\"width\": " << width << ", \"height\": " << height << ", \"samples\": " << bench.samples
+         << ", \"depth\": " << bench.depth << ", \"scene_load_ms\": " << loadTime
+         << ", \"bvh_build_ms\": " << stats.getBVHBuildTime() << ", \"render_ms\": " << renderTime
+         << ", \"rays\": {\"primary\": " << primary << ", \"shadow\": " << shadow << ", \"secondary\": " << secondary
+         << "}, \"rays_per_sec\": {\"primary\": " << perSecond(primary, renderTime)
+         << ", \"shadow\": " << perSecond(shadow, renderTime) << ", \"secondary\": " << perSecond(secondary, renderTime)
+         << ", \"total\": " << perSecond(primary + shadow + secondary, renderTime)
+         << "}, \"photons\": " << photons << ", \"photons_per_sec\": " << perSecond(photons, renderTime)
+         << ", \"photon_rays\": " << photonRays << ", \"photon_rays_per_sec\": " << perSecond(photonRays, renderTime)
+         << ", \"peak_rss_mb\": " << peakMemoryMB() << "}";
+    return json.str();
+}
+
+//rays from a sphere of radius 4 around the origin towards random points of the box [-1, 1]^3, fixed seed
+std::vector<Ray> benchRays(int n) {
+    unsigned short Xi[3] = {0x330e, 0xabcd, 0x1234};
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for(int i = 0; i < n; i++) {
+        float z = 2 * erand48(Xi) - 1, phi = 2 * M_PI * erand48(Xi), r = std::sqrt(1 - z * z);
+        Vector3f origin = 4 * Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        Vector3f target(2 * erand48(Xi) - 1, 2 * erand48(Xi) - 1, 2 * erand48(Xi) - 1);
+        rays.push_back(Ray(origin, (target - origin).normalized()));
+    }
+    return rays;
+}
+
+//calls intersect of object over the rays until calls is reached, one JSON object
+std::string benchIntersect(const char* name, Object3D& object, const std::vector<Ray>& rays, int calls) {
+    int hits = 0;
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < calls; i++) {
+        Hit hit;
+        hits += object.intersect(rays[i % rays.size()], hit, 1e-4f);
+    }
+    double time = millisecondsSince(start);
+    std::ostringstream json;
+    json << "{\"name\": \"" << name << "\", \"calls\": " << calls << ", \"ns_per_call\": " << time * 1e6 / calls
+         << ", \"hit_rate\": " << double(hits) / calls << "}";
+    return json.str();
+}
+
+//the children of a tree built by BVHNode, the node itself stays with the caller
+void freeChildren(BVHNode* node) {
+    for(BVHNode* child : {node->left, node->right}) {
+        if(child == nullptr) continue;
+        freeChildren(child);
+        delete child;
+    }
+}
+
+//build time of BVHNode over n random triangles (edges up to 1% of the unit cube, fixed seed) for 1, 2, 4, ...
+//threads up to maxThreads (and maxThreads itself), the fastest of 3 builds each, one JSON object
+std::string benchBVHBuild(int n, int maxThreads) {
+    unsigned short Xi[3] = {0x330e, 0x4321, 0x8765};
+    std::vector<BVHBuilder::Bounds> bounds(n);
+    for(BVHBuilder::Bounds& b : bounds) {
+        Vector3f v[3];
+        v[0] = Vector3f(erand48(Xi), erand48(Xi), erand48(Xi));
+        for(int k = 1; k < 3; k++) v[k] = v[0] + 0.01f * Vector3f(erand48(Xi), erand48(Xi), erand48(Xi));
+        for(int a = 0; a < 3; a++) {
+            b.min[a] = std::min(v[0][a], std::min(v[1][a], v[2][a]));
+            b.max[a] = std::max(v[0][a], std::max(v[1][a], v[2][a]));
+        }
+    }
+    std::vector<int> counts;
+    for(int threads = 1; threads < maxThreads; threads *= 2) counts.push_back(threads);
+    counts.push_back(std::max(1, maxThreads));
+    std::vector<double> times;
+    for(int threads : counts) {
+        omp_set_num_threads(threads);
+        double best = 0;
+        for(int run = 0; run < 3; run++) {
+            std::vector<int> order;
+            Clock::time_point start = Clock::now();
+            BVHNode root(bounds, order);
+            double time = millisecondsSince(start);
+            freeChildren(&root);
+            if(run == 0 || time < best) best = time;
+        }
+        times.push_back(best);
+    }
+    omp_set_num_threads(maxThreads);
+    std::ostringstream json, ms, speedup;
+    for(size_t i = 0; i < counts.size(); i++) {
+        ms << (i > 0 ? ", " : "") << "\"" << counts[i] << "\": " << times[i];
+        speedup << (i > 0 ? ", " : "") << "\"" << counts[i] << "\": " << (times[i] > 0 ? times[0] / times[i] : 0);
+    }
+    json << "{\"name\": \"BVH build (random triangles)\", \"primitives\": " << n << ", \"processors\": "
+         << omp_get_num_procs() << ", \"ms\": {" << ms.str() << "}, \"speedup\": {" << speedup.str() << "}}";
+    return json.str();
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    std::string testcases = "../testcases/", output = "micropt_bench.json";
+    int threads = omp_get_max_threads();
+    bool quick = false;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if(arg == "--testcases") testcases = argv[i + 1];
+        else if(arg == "--output") output = argv[i + 1];
+        else if(arg == "--threads") threads = atoi(argv[i + 1]);
+        else if(arg == "--quick") quick = atoi(argv[i + 1]);
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if(!testcases.empty() && testcases.back() != '/')
+        testcases += '/';
+    //always parse the scenes, the load time should not depend on earlier runs
+    meshCache = false;
+    RenderStats::enabled = true;
+
+    std::vector<std::string> renders;
+    for(const BenchScene& bench : SCENES)
+        for(int width : RESOLUTIONS) {
+            renders.push_back(benchRender(bench, testcases + bench.file, width, threads));
+            std::cerr << renders.back() << std::endl;
+            if(quick)
+                break;
+        }
+
+    std::vector<std::string> micro;
+    DiscreteMaterial material(Vector3f(0.5), Vector3f(0), Vector3f(0), DIFFUSE);
+    std::vector<Ray> rays = benchRays(4096);
+    Triangle triangle(Vector3f(-1, -1, 0), Vector3f(1, -1, 0), Vector3f(0, 1, 0),
+                      Vector2f(0, 0), Vector2f(1, 0), Vector2f(0, 1), &material);
+    micro.push_back(benchIntersect("Triangle::intersect", triangle, rays, 4000000));
+    BoundingBox box(Vector3f(-0.5), Vector3f(0.5));
+    micro.push_back(benchIntersect("BoundingBox::intersect", box, rays, 4000000));
+    Sphere sphere(Vector3f(0), 0.8f, &material);
+    micro.push_back(benchIntersect("Sphere::intersect", sphere, rays, 4000000));
+    //a vase: the profile (x: radius, y: height) revolved around the y axis
+    std::vector<Vector3f> controls = {Vector3f(0, -1, 0), Vector3f(0.7, -1, 0), Vector3f(0.9, -0.5, 0),
+                                      Vector3f(0.4, 0, 0), Vector3f(0.5, 0.5, 0), Vector3f(0.8, 0.9, 0),
+                                      Vector3f(0.6, 1, 0)};
+    std::vector<float> knots = {0, 0, 0, 0, 0.25, 0.5, 0.75, 1, 1, 1, 1};
+    BSplineCurve curve(controls, knots, Vector3f(0), Vector3f(0, 1, 0), &material);
+    micro.push_back(benchIntersect("BSplineCurve::intersect", curve, rays, 200000));
+    //the scenes at hand have no obj meshes, the tessellated vase gives a BVH build of its own
+    RenderStats::instance().reset();
+    std::unique_ptr<Mesh> mesh(curve.tessellate(1e-4f));
+    std::ostringstream build;
+    build << "{\"name\": \"BVH build (tessellated BSplineCurve)\", \"ms\": " << RenderStats::instance().getBVHBuildTime() << "}";
+    micro.push_back(build.str());
+    if(mesh)
+        micro.push_back(benchIntersect("Mesh::intersect (tessellated BSplineCurve)", *mesh, rays, 1000000));
+    micro.push_back(benchBVHBuild(quick ? 100000 : 1000000, threads));
+    std::cerr << micro.back() << std::endl;
+
+    std::ofstream out(output);
+    out << "{\n  \"threads\": " << threads << ",\n  \"renders\": [\n";
+    for(size_t i = 0; i < renders.size(); i++)
+        out << "    " << renders[i] << (i + 1 < renders.size() ? ",\n" : "\n");
+    out << "  ],\n  \"micro\": [\n";
+    for(size_t i = 0; i < micro.size(); i++)
+        out << "    " << micro[i] << (i + 1 < micro.size() ? ",\n" : "\n");
+    out << "  ],\n  \"peak_rss_mb\": " << peakMemoryMB() << "\n}\n";
+    std::cout << "Benchmark written to " << output << std::endl;
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "../include/mlt.hpp"
+#include "../include/utils.hpp"
+#include "../include/scene_parser.hpp"
+#include "../include/camera.hpp"
+#include "../include/film.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+
+enum { CAMERA_STREAM, LIGHT_STREAM, CONNECTION_STREAM, STREAM_COUNT };
+
+MLTSampler::MLTSampler(int seed, float sigma, float largeStepProbability, int streamCount) : sigma(sigma),
+        largeStepProbability(largeStepProbability), streamCount(streamCount) {
+    Xi[0] = (unsigned short)seed;
+    Xi[1] = (unsigned short)(seed >> 16);
+    Xi[2] = (unsigned short)(unsigned(seed) * unsigned(seed) * unsigned(seed) + 0x330e);
+}
+
+void MLTSampler::startIteration() {
+    currentIteration++;
+    largeStep = uniform() < largeStepProbability;
+}
+
+void MLTSampler::accept() {
+    if(largeStep) lastLargeStepIteration = currentIteration;
+}
+
+void MLTSampler::reject() {
+    for(PrimarySample& x : X) {
+        if(x.lastModification == currentIteration) {
+            x.value = x.valueBackup;
+            x.lastModification = x.modifyBackup;
+        }
+    }
+    --currentIteration;
+}
+
+void MLTSampler::startStream(int index) {
+    streamIndex = index;
+    sampleIndex = 0;
+}
+
+float MLTSampler::next() {
+    int index = streamIndex + streamCount * sampleIndex++;
+    ensureReady(index);
+    return X[index].value;
+}
+
+void MLTSampler::ensureReady(int index) {
+    if(index >= int(X.size())) X.resize(index + 1);
+    PrimarySample& x = X[index];
+    //a large step since the last change replaced it
+    if(x.lastModification < lastLargeStepIteration) {
+        x.value = uniform();
+        x.lastModification = lastLargeStepIteration;
+    }
+    x.valueBackup = x.value;
+    x.modifyBackup = x.lastModification;
+    if(largeStep) {
+        x.value = uniform();
+    } else {
+        //the small steps it missed add up to one normal offset (Box-Muller), wrapped around [0, 1)
+        long steps = currentIteration - x.lastModification;
+        float u1 = uniform(), u2 = uniform();
+        float normal = std::sqrt(-2 * std::log(1 - u1)) * std::cos(2 * M_PI * u2);
+        x.value += normal * sigma * std::sqrt(float(steps));
+        x.value = std::min(x.value - std::floor(x.value), 0.99999994f);
+    }
+    x.lastModification = currentIteration;
+}
+
+MLTIntegrator::MLTIntegrator(const SceneParser& scene, int maxDepth, int bootstrapSamples, int chains,
+                             int mutationsPerPixel, float sigma, float largeStepProbability) : scene(scene),
+        bdpt(scene, maxDepth), width(scene.getCamera()->getWidth()), height(scene.getCamera()->getHeight()),
+        maxDepth(maxDepth), bootstrapSamples(bootstrapSamples), chains(chains), mutationsPerPixel(mutationsPerPixel),
+        sigma(sigma), largeStepProbability(largeStepProbability) {
+}
+
+Vector3f MLTIntegrator::L(MLTSampler& sampler, int depth, float& x, float& y) const {
+    sampler.startStream(CAMERA_STREAM);
+    //depth 0 has the single strategy s = 0 (emitters seen directly)
+    int s = 0, t = 2, strategies = 1;
+    if(depth > 0) {
+        strategies = depth + 2;
+        s = std::min(int(sampler.next() * strategies), strategies - 1);
+        t = strategies - s;
+    }
+    x = sampler.next() * width;
+    y = sampler.next() * height;
+    std::vector<PathVertex> cameraPath, lightPath;
+    bdpt.cameraSubpath(x, y, sampler, cameraPath, t);
+    if(int(cameraPath.size()) != t) return Vector3f::ZERO;
+    sampler.startStream(LIGHT_STREAM);
+    bdpt.lightSubpath(sampler, lightPath, s);
+    if(int(lightPath.size()) != s) return Vector3f::ZERO;
+    sampler.startStream(CONNECTION_STREAM);
+    return bdpt.connect(lightPath, cameraPath, s, t, sampler, x, y) * strategies;
+}
+
+void MLTIntegrator::render(Film& film) {
+    //bootstrap: sample i of depth d has the seed i * (maxDepth + 1) + d, so a chain can replay it
+    int depths = maxDepth + 1, n = bootstrapSamples * depths;
+    std::vector<float> cdf(n);
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int i = 0; i < n; ++i) {
+        MLTSampler sampler(i, sigma, largeStepProbability, STREAM_COUNT);
+        float x, y;
+        cdf[i] = luminance(L(sampler, i % depths, x, y));
+    }
+    for(int i = 1; i < n; ++i) cdf[i] += cdf[i - 1];
+    if(n == 0 || !(cdf.back() > 0)) {
+        std::cout << "no light found by the bootstrap samples" << std::endl;
+        return;
+    }
+    //mean brightness of a sample of all depths together
+    float b = cdf.back() / bootstrapSamples;
+    std::cout << "bootstrap: b = " << b << std::endl;
+
+    long totalMutations = long(mutationsPerPixel) * width * height;
+    int threads = omp_get_max_threads();
+    std::vector<std::vector<float>> buffers(threads, std::vector<float>(3 * width * height, 0.0f));
+    int chainsDone = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int chain = 0; chain < chains; ++chain) {
+        std::vector<float>& buffer = buffers[omp_get_thread_num()];
+        auto splat = [&](float x, float y, const Vector3f& value) {
+            int px = std::min(std::max(int(x), 0), width - 1), py = std::min(std::max(int(y), 0), height - 1);
+            for(int k = 0; k < 3; k++) buffer[3 * (py * width + px) + k] += value[k];
+        };
+        long mutations = std::min((chain + 1) * totalMutations / chains, totalMutations) - chain * totalMutations / chains;
+        unsigned short Xi[3] = {(unsigned short)chain, (unsigned short)(chain >> 16), (unsigned short)(chain * chain * chain)};
+        RandomSampler rng(Xi);
+        //start from a bootstrap sample chosen in proportion to its brightness
+        int start = std::upper_bound(cdf.begin(), cdf.end(), rng.next() * cdf.back()) - cdf.begin();
+        start = std::min(start, n - 1);
+        MLTSampler sampler(start, sigma, largeStepProbability, STREAM_COUNT);
+        int depth = start % depths;
+        float currentX, currentY;
+        Vector3f current = L(sampler, depth, currentX, currentY);
+        for(long j = 0; j < mutations; ++j) {
+            sampler.startIteration();
+            float proposedX, proposedY;
+            Vector3f proposed = L(sampler, depth, proposedX, proposedY);
+            float currentLuminance = luminance(current), proposedLuminance = luminance(proposed);
+            float accept = currentLuminance > 0 ? std::min(1.0f, proposedLuminance / currentLuminance) : 1;
+            //both states splat in expectation of the acceptance (expected values of Veach)
+            if(accept > 0 && proposedLuminance > 0) splat(proposedX, proposedY, proposed * (accept / proposedLuminance));
+            if(currentLuminance > 0) splat(currentX, currentY, current * ((1 - accept) / currentLuminance));
+            if(rng.next() < accept) {
+                currentX = proposedX;
+                currentY = proposedY;
+                current = proposed;
+                sampler.accept();
+            } else {
+                sampler.reject();
+            }
+        }
+        int done;
+#pragma omp atomic capture
+        done = ++chainsDone;
+        if(done % 10 == 0 || done == chains) fprintf(stderr, "\rRendering %5.2f%%", 100. * done / chains);
+    }
+    //a splat of brightness 1 stands for b / mutationsPerPixel of a pixel's value
+    film.setSplatScale(b / mutationsPerPixel);
+#pragma omp parallel for schedule(static)
+    for(int y = 0; y < height; ++y) {
+        for(int x = 0; x < width; ++x) {
+            Vector3f sum = Vector3f::ZERO;
+            for(const std::vector<float>& buffer : buffers) {
+                for(int k = 0; k < 3; k++) sum[k] += buffer[3 * (y * width + x) + k];
+            }
+            film.addSplat(x + 0.5f, y + 0.5f, sum);
+        }
+    }
+    //the AOVs come from the first hit of one camera ray per pixel
+    if(film.hasAOVs()) {
+#pragma omp parallel for schedule(static)
+        for(int y = 0; y < height; ++y) {
+            for(int x = 0; x < width; ++x) {
+                unsigned short Xi[3] = {(unsigned short)x, (unsigned short)y, 0};
+                RandomSampler sampler(Xi);
+                std::vector<PathVertex> cameraPath;
+                bdpt.cameraSubpath(x + 0.5f, y + 0.5f, sampler, cameraPath, 2);
+                AOVSample aov;
+                if(cameraPath.size() == 2 && cameraPath[1].type == PathVertex::SURFACE) {
+                    aov.albedo = cameraPath[1].bsdf.color;
+                    aov.normal = cameraPath[1].n;
+                    aov.depth = (cameraPath[1].p - cameraPath[0].p).length();
+                }
+                film.addAOVSample(x, y, aov);
+            }
+        }
+    }
+    std::cout << std::endl << "Rendering finished" << std::endl;
+}
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/obj_loader.hpp"
+
+namespace {
+//chunks smaller than this are not worth a thread
+const size_t MIN_CHUNK_SIZE = size_t(1) << 20;
+//only the chunks being parsed are resident, this bounds the file's share of the peak memory
+const size_t MAX_CHUNK_SIZE = size_t(8) << 20;
+
+struct Chunk {
+    const char* begin;
+    const char* end;
+    //filled by the counting pass
+    size_t v = 0;
+    size_t n = 0;
+    size_t uv = 0;
+    size_t triangles = 0;
+    std::vector<std::string> mtllib;
+    //usemtl names in order, consecutive repeats collapsed
+    std::vector<std::string> usemtl;
+    //filled by the parsing pass: first of the two triangles of every quad,
+    //split along the shorter diagonal once all positions are known
+    std::vector<size_t> quads;
+};
+
+//where a chunk writes in the output arrays
+struct Cursor {
+    size_t v, n, uv, triangle;
+    int material;
+};
+
+//all attribute indices of one corner
+struct Corner {
+    int v, n, uv;
+};
+
+inline Corner corner(const TriangleIndices& t, int c) {
+    return Corner{t.v[c], t.n[c], t.uv[c]};
+}
+
+inline void setCorner(TriangleIndices& t, int c, const Corner& k) {
+    t.v[c] = k.v;
+    t.n[c] = k.n;
+    t.uv[c] = k.uv;
+}
+
+inline bool isSpace(char c) { return c == ' ' || c == '\t'; }
+
+inline const char* skipSpace(const char* p, const char* end) {
+    while(p < end && isSpace(*p)) p++;
+    return p;
+}
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+//strtof without locale, allocation or the need for a terminating zero
+bool parseFloat(const char*& p, const char* end, float& out) {
+    static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    p = skipSpace(p, end);
+    const char* start = p;
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    double mantissa = 0;
+    int exponent = 0, digits = 0;
+    for(; p < end && isDigit(*p); p++, digits++) mantissa = mantissa * 10 + (*p - '0');
+    if(p < end && *p == '.') {
+        for(p++; p < end && isDigit(*p); p++, digits++) {
+            mantissa = mantissa * 10 + (*p - '0');
+            exponent--;
+        }
+    }
+    if(digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negativeExp = false;
+        if(q < end && (*q == '-' || *q == '+')) negativeExp = *q++ == '-';
+        if(q < end && isDigit(*q)) {
+            int e = 0;
+            for(; q < end && isDigit(*q); q++) e = std::min(e * 10 + (*q - '0'), 10000);
+            exponent += negativeExp ? -e : e;
+            p = q;
+        }
+    }
+    if(digits == 0 || digits > 18 || (p < end && !isSpace(*p))) {
+        //nan, inf, very long mantissas and other oddities
+        const char* tokenEnd = p;
+        while(tokenEnd < end && !isSpace(*tokenEnd)) tokenEnd++;
+        if(tokenEnd == start) return false;
+        std::string token(start, tokenEnd);
+        char* parsed = nullptr;
+        out = strtof(token.c_str(), &parsed);
+        p = tokenEnd;
+        return parsed != token.c_str();
+    }
+    double value;
+    if(exponent >= 0) value = exponent <= 22 ? mantissa * POW10[exponent] : mantissa * pow(10.0, exponent);
+    else value = exponent >= -22 ? mantissa / POW10[-exponent] : mantissa * pow(10.0, exponent);
+    out = float(negative ? -value : value);
+    return true;
+}
+
+bool parseInt(const char*& p, const char* end, int& out) {
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    if(p >= end || !isDigit(*p)) return false;
+    long value = 0;
+    for(; p < end && isDigit(*p); p++) value = std::min(value * 10 + (*p - '0'), long(1) << 40);
+    out = int(negative ? -value : value);
+    return true;
+}
+
+//rest of the line without surrounding white space
+std::string restOfLine(const char* p, const char* end) {
+    p = skipSpace(p, end);
+    while(end > p && isSpace(end[-1])) end--;
+    return std::string(p, end);
+}
+
+bool startsWith(const char* p, const char* end, const char* keyword) {
+    size_t n = strlen(keyword);
+    return size_t(end - p) > n && memcmp(p, keyword, n) == 0 && isSpace(p[n]);
+}
+
+//one vertex of a face as written in the file: v, v/t, v//n or v/t/n, 0 if absent
+//obj indices are 1-based, negative ones count back from the last attribute
+bool parseFaceVertex(const char*& p, const char* end, int raw[3]) {
+    raw[0] = raw[1] = raw[2] = 0;
+    if(!parseInt(p, end, raw[0])) return false;
+    if(p < end && *p == '/') {
+        p++;
+        if(p < end && *p != '/') parseInt(p, end, raw[2]);
+        if(p < end && *p == '/') {
+            p++;
+            parseInt(p, end, raw[1]);
+        }
+    }
+    return true;
+}
+
+//calls f(lineBegin, lineEnd) for every line with leading white space and '\r' stripped
+template<typename F>
+void forEachLine(const char* p, const char* end, F f) {
+    while(p < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if(lineEnd == nullptr) lineEnd = end;
+        const char* next = lineEnd + 1;
+        if(lineEnd > p && lineEnd[-1] == '\r') lineEnd--;
+        f(skipSpace(p, lineEnd), lineEnd);
+        p = next;
+    }
+}
+
+enum LineType { VERTEX, NORMAL, TEXCOORD, FACE, USEMTL, MTLLIB, OTHER };
+
+LineType lineType(const char*& p, const char* end) {
+    LineType type = OTHER;
+    if(end - p >= 2 && p[0] == 'v' && isSpace(p[1])) type = VERTEX;
+    else if(end - p >= 3 && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) type = NORMAL;
+    else if(end - p >= 3 && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) type = TEXCOORD;
+    else if(end - p >= 2 && p[0] == 'f' && isSpace(p[1])) type = FACE;
+    else if(startsWith(p, end, "usemtl")) type = USEMTL;
+    else if(startsWith(p, end, "mtllib")) type = MTLLIB;
+    //comments, groups, smoothing groups, lines and points are ignored
+    static const int KEYWORD_LENGTH[] = {2, 3, 3, 2, 6, 6, 0};
+    p += KEYWORD_LENGTH[type];
+    return type;
+}
+
+//first pass: sizes of the chunk and the material statements
+void countChunk(Chunk& chunk) {
+    forEachLine(chunk.begin, chunk.end, [&chunk](const char* p, const char* end) {
+        switch(lineType(p, end)) {
+        case VERTEX: chunk.v++; break;
+        case NORMAL: chunk.n++; break;
+        case TEXCOORD: chunk.uv++; break;
+        case FACE: {
+            int raw[3], corners = 0;
+            while((p = skipSpace(p, end)) < end && parseFaceVertex(p, end, raw)) corners++;
+            if(corners >= 3) chunk.triangles += corners - 2;
+            break;
+        }
+        case USEMTL: {
+            std::string name = restOfLine(p, end);
+            if(chunk.usemtl.empty() || chunk.usemtl.back() != name) chunk.usemtl.push_back(name);
+            break;
+        }
+        case MTLLIB:
+            //several files may follow, separated by white space
+            while((p = skipSpace(p, end)) < end) {
+                const char* nameEnd = p;
+                while(nameEnd < end && !isSpace(*nameEnd)) nameEnd++;
+                chunk.mtllib.push_back(std::string(p, nameEnd));
+                p = nameEnd;
+            }
+            break;
+        default: break;
+        }
+    });
+}
+
+//second pass: parse straight into the output arrays starting at the cursor
+void parseChunk(Chunk& chunk, Cursor cursor, const std::map<std::string, int>& materialMap,
+                Vector3f* vertices, Vector3f* normals, Vector2f* texcoords, TriangleIndices* triangles) {
+    std::vector<Corner> face;
+    forEachLine(chunk.begin, chunk.end, [&](const char* p, const char* end) {
+        switch(lineType(p, end)) {
+        case VERTEX: {
+            float x = 0, y = 0, z = 0;
+            parseFloat(p, end, x) && parseFloat(p, end, y) && parseFloat(p, end, z);
+            vertices[cursor.v++] = Vector3f(x, y, z);
+            break;
+        }
+        case NORMAL: {
+            float x = 0, y = 0, z = 0;
+            parseFloat(p, end, x) && parseFloat(p, end, y) && parseFloat(p, end, z);
+            normals[cursor.n++] = Vector3f(x, y, z);
+            break;
+        }
+        case TEXCOORD: {
+            float u = 0, v = 0;
+            parseFloat(p, end, u) && parseFloat(p, end, v);
+            texcoords[cursor.uv++] = Vector2f(u, v);
+            break;
+        }
+        case FACE: {
+            face.clear();
+            int raw[3];
+            while((p = skipSpace(p, end)) < end && parseFaceVertex(p, end, raw)) {
+                //relative indices count back from the attributes seen so far
+                const size_t counts[3] = {cursor.v, cursor.n, cursor.uv};
+                int index[3];
+                for(int a = 0; a < 3; a++) {
+                    index[a] = raw[a] > 0 ? raw[a] - 1 : raw[a] < 0 ? int(counts[a]) + raw[a] : -1;
+                }
+                face.push_back(Corner{index[0], index[1], index[2]});
+            }
+            //fan triangulation, quads may flip their diagonal later
+            if(face.size() == 4) chunk.quads.push_back(cursor.triangle);
+            for(size_t k = 1; k + 1 < face.size(); k++) {
+                TriangleIndices& t = triangles[cursor.triangle++];
+                setCorner(t, 0, face[0]);
+                setCorner(t, 1, face[k]);
+                setCorner(t, 2, face[k + 1]);
+                t.material = cursor.material;
+            }
+            break;
+        }
+        case USEMTL: {
+            auto it = materialMap.find(restOfLine(p, end));
+            cursor.material = it == materialMap.end() ? -1 : it->second;
+            break;
+        }
+        default: break;
+        }
+    });
+}
+
+//give the pages of a parsed chunk back, they are read again from the page cache if needed
+void dropPages(const char* begin, const char* end) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t(begin) + page - 1) / page * page;
+    uintptr_t last = uintptr_t(end) / page * page;
+    if(first < last) madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+}
+
+template<typename T>
+void release(std::vector<T>& v) {
+    std::vector<T>().swap(v);
+}
+}
+
+bool loadObj(const std::string& filename, const std::string& basepath,
+             std::vector<Vector3f>& vertices, std::vector<Vector3f>& normals, std::vector<Vector2f>& texcoords,
+             std::vector<TriangleIndices>& triangles, std::vector<tinyobj::material_t>& materials,
+             std::vector<std::string>& mtlFiles) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        std::cerr << "ERR: Cannot open file [" << filename << "]" << std::endl;
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const char* data = nullptr;
+    if(size > 0) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            std::cerr << "ERR: Cannot map file [" << filename << "]" << std::endl;
+            return false;
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(p);
+    }
+    close(fd);
+
+    //cut at line boundaries, a few chunks per thread to balance uneven lines
+    size_t numChunks = std::max<size_t>(std::min<size_t>(omp_get_max_threads() * 4, size / MIN_CHUNK_SIZE),
+                                        (size + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE);
+    numChunks = std::max<size_t>(numChunks, 1);
+    std::vector<Chunk> chunks(numChunks);
+    const char* fileEnd = data + size;
+    const char* begin = data;
+    for(size_t i = 0; i < numChunks; i++) {
+        const char* end = i + 1 == numChunks ? fileEnd : data + size * (i + 1) / numChunks;
+        if(end < begin) end = begin;
+        const char* newline = end < fileEnd ? static_cast<const char*>(memchr(end, '\n', fileEnd - end)) : nullptr;
+        if(i + 1 < numChunks) end = newline == nullptr ? fileEnd : newline + 1;
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        begin = end;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i = 0; i < int(numChunks); i++) {
+        countChunk(chunks[i]);
+        dropPages(chunks[i].begin, chunks[i].end);
+    }
+
+    //materials, in the order the mtllib statements appear
+    std::map<std::string, int> materialMap;
+    std::vector<std::string> loaded;
+    for(auto& chunk : chunks) {
+        for(auto& name : chunk.mtllib) {
+            if(std::find(loaded.begin(), loaded.end(), name) != loaded.end()) continue;
+            loaded.push_back(name);
+            mtlFiles.push_back(basepath + name);
+            std::ifstream mtl(basepath + name);
+            if(!mtl) {
+                std::cout << "WARN: Material file [ " << basepath + name << " ] not found." << std::endl;
+                continue;
+            }
+            std::string warn, err;
+            tinyobj::LoadMtl(&materialMap, &materials, &mtl, &warn, &err);
+            if(!warn.empty()) std::cout << "WARN: " << warn << std::endl;
+            if(!err.empty()) std::cerr << "ERR: " << err << std::endl;
+        }
+    }
+
+    //prefix sums give every chunk its place in the output, usemtl state carries over chunk borders
+    std::vector<Cursor> cursors(numChunks);
+    Cursor total = {0, 0, 0, 0, -1};
+    std::set<std::string> missing;
+    for(size_t i = 0; i < numChunks; i++) {
+        cursors[i] = total;
+        total.v += chunks[i].v;
+        total.n += chunks[i].n;
+        total.uv += chunks[i].uv;
+        total.triangle += chunks[i].triangles;
+        for(auto& name : chunks[i].usemtl) {
+            auto it = materialMap.find(name);
+            total.material = it == materialMap.end() ? -1 : it->second;
+            if(it == materialMap.end() && missing.insert(name).second) {
+                std::cout << "WARN: material [ " << name << " ] not found in .mtl" << std::endl;
+            }
+        }
+    }
+    vertices.resize(total.v);
+    normals.resize(total.n);
+    texcoords.resize(total.uv);
+    triangles.resize(total.triangle);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i = 0; i < int(numChunks); i++) {
+        parseChunk(chunks[i], cursors[i], materialMap, vertices.data(), normals.data(), texcoords.data(), triangles.data());
+        dropPages(chunks[i].begin, chunks[i].end);
+    }
+    if(data != nullptr) munmap(const_cast<char*>(data), size);
+
+    //like tinyobj, a quad is split along its shorter diagonal: [0, 1, 2] [0, 2, 3] or [0, 1, 3] [1, 2, 3]
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int i = 0; i < int(numChunks); i++) {
+        for(size_t q : chunks[i].quads) {
+            TriangleIndices& a = triangles[q];
+            TriangleIndices& b = triangles[q + 1];
+            Corner c[4] = {corner(a, 0), corner(a, 1), corner(a, 2), corner(b, 2)};
+            bool valid = true;
+            for(int k = 0; k < 4; k++) valid = valid && c[k].v >= 0 && c[k].v < int(vertices.size());
+            if(!valid) continue;
+            float d02 = (vertices[c[2].v] - vertices[c[0].v]).squaredLength();
+            float d13 = (vertices[c[3].v] - vertices[c[1].v]).squaredLength();
+            if(d02 < d13) continue;
+            setCorner(a, 2, c[3]);
+            setCorner(b, 0, c[1]);
+            setCorner(b, 1, c[2]);
+            setCorner(b, 2, c[3]);
+        }
+        release(chunks[i].quads);
+    }
+
+    //drop faces referencing missing vertices, missing normals/texcoords only lose the attribute
+    //an attribute is used for all three corners or for none
+    const int numVertices = vertices.size(), numNormals = normals.size(), numTexcoords = texcoords.size();
+    auto complete = [](const int index[3], int count) {
+        for(int c = 0; c < 3; c++) {
+            if(index[c] < 0 || index[c] >= count) return false;
+        }
+        return true;
+    };
+    size_t before = triangles.size();
+    triangles.erase(std::remove_if(triangles.begin(), triangles.end(), [&](TriangleIndices& t) {
+        if(!complete(t.n, numNormals)) t.n[0] = t.n[1] = t.n[2] = -1;
+        if(!complete(t.uv, numTexcoords)) t.uv[0] = t.uv[1] = t.uv[2] = -1;
+        return !complete(t.v, numVertices);
+    }), triangles.end());
+    if(triangles.size() != before) {
+        std::cout << "WARN: " << before - triangles.size() << " faces with invalid vertex indices ignored" << std::endl;
+    }
+    return true;
+}
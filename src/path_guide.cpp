@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cmath>
+
+#include "../include/path_guide.hpp"
+
+DTree::DTree() {
+    nodes.push_back(Node{{1, 1, 1, 1}, {0, 0, 0, 0}});
+}
+
+//point of the square of direction d
+static void cylindrical(const Vector3f& d, float& u, float& v) {
+    u = std::min(1.0f, std::max(0.0f, (d.z() + 1) / 2));
+    v = std::min(1.0f, std::max(0.0f, float((std::atan2(d.y(), d.x()) + M_PI) / (2 * M_PI))));
+}
+
+int DTree::locate(const Vector3f& d) const {
+    float u, v;
+    cylindrical(d, u, v);
+    int node = 0;
+    while(true) {
+        int qu = u >= 0.5f, qv = v >= 0.5f, q = qu + 2 * qv;
+        u = std::min(1.0f, 2 * u - qu), v = std::min(1.0f, 2 * v - qv);
+        if(!nodes[node].child[q])
+            return node * 4 + q;
+        node = nodes[node].child[q];
+    }
+}
+
+Vector3f DTree::sample(float u0, float u1, float u2, float& pdf) const {
+    float u = 0, v = 0, size = 1, p = 1;
+    int node = 0;
+    while(true) {
+        const Node& n = nodes[node];
+        float total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+        int q = 0;
+        if(total > 0) {
+            //quadrant in proportion to its radiance, u0 rescaled for the next level
+            float target = u0 * total, c = 0;
+            while(q < 3 && (n.sum[q] <= 0 || c + n.sum[q] <= target))
+                c += n.sum[q++];
+            //rounding past the last quadrant with radiance
+            while(n.sum[q] <= 0)
+                c -= n.sum[--q];
+            u0 = std::min(0.99999994f, std::max(0.0f, (target - c) / n.sum[q]));
+            p *= 4 * n.sum[q] / total;
+        } else {
+            q = std::min(3, int(u0 * 4));
+            u0 = u0 * 4 - q;
+        }
+        size /= 2;
+        u += (q & 1) * size, v += (q >> 1) * size;
+        if(!n.child[q])
+            break;
+        node = n.child[q];
+    }
+    //uniform inside the leaf quadrant, the square is equal area so the pdf per solid angle is constant there
+    u += u1 * size, v += u2 * size;
+    float z = 2 * u - 1, r = std::sqrt(std::max(0.0f, 1 - z * z)), phi = 2 * M_PI * v - M_PI;
+    pdf = p / (4 * M_PI);
+    return Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+float DTree::pdf(const Vector3f& d) const {
+    float u, v, p = 1;
+    cylindrical(d, u, v);
+    int node = 0;
+    while(true) {
+        const Node& n = nodes[node];
+        int qu = u >= 0.5f, qv = v >= 0.5f, q = qu + 2 * qv;
+        u = std::min(1.0f, 2 * u - qu), v = std::min(1.0f, 2 * v - qv);
+        float total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+        if(total > 0)
+            p *= 4 * n.sum[q] / total;
+        if(!n.child[q] || p <= 0)
+            break;
+        node = n.child[q];
+    }
+    return p / (4 * M_PI);
+}
+
+float DTree::sumUp(int node, const float* energy) {
+    float total = 0;
+    for(int q = 0; q < 4; q++) {
+        int c = nodes[node].child[q];
+        nodes[node].sum[q] = c ? sumUp(c, energy) : energy[node * 4 + q];
+        total += nodes[node].sum[q];
+    }
+    return total;
+}
+
+void DTree::refine(std::vector<Node>& out, int outNode, const float* sums, int node, float total, int depth) const {
+    for(int q = 0; q < 4; q++) {
+        out[outNode].sum[q] = sums[q];
+        out[outNode].child[q] = 0;
+        if(depth >= MAX_DEPTH || !(sums[q] > RHO * total))
+            continue;
+        int old = node >= 0 ? nodes[node].child[q] : 0;
+        float split[4] = {sums[q] / 4, sums[q] / 4, sums[q] / 4, sums[q] / 4};
+        int c = out.size();
+        out.push_back(Node());
+        out[outNode].child[q] = c;
+        refine(out, c, old ? nodes[old].sum : split, old ? old : -1, total, depth + 1);
+    }
+}
+
+void DTree::build(const float* energy) {
+    float total = sumUp(0, energy);
+    //nothing recorded: uniform again
+    if(!(total > 0) || !std::isfinite(total)) {
+        *this = DTree();
+        return;
+    }
+    std::vector<Node> out(1);
+    refine(out, 0, nodes[0].sum, 0, total, 1);
+    nodes.swap(out);
+}
+
+SDTree::SDTree(const Vector3f& center, float radius) : lo(center - Vector3f(radius)), hi(center + Vector3f(radius)) {
+    nodes.push_back(Node{{0, 0}, 0});
+    dtrees.push_back(DTree());
+}
+
+int SDTree::leaf(const Vector3f& p) const {
+    Vector3f a = lo, b = hi;
+    int node = 0;
+    for(int depth = 0; nodes[node].child[0]; depth++) {
+        int axis = depth % 3;
+        float mid = (a[axis] + b[axis]) / 2;
+        if(p[axis] < mid) {
+            b[axis] = mid;
+            node = nodes[node].child[0];
+        } else {
+            a[axis] = mid;
+            node = nodes[node].child[1];
+        }
+    }
+    return nodes[node].dtree;
+}
+
+void SDTree::beginPass(int threads) {
+    offsets.resize(dtrees.size());
+    int size = 0;
+    for(int i = 0; i < int(dtrees.size()); i++) {
+        offsets[i] = size;
+        size += dtrees[i].size();
+    }
+    Buffer empty;
+    empty.energy.assign(size, 0);
+    empty.records.assign(dtrees.size(), 0);
+    buffers.assign(threads, empty);
+}
+
+void SDTree::record(const Vector3f& p, const Vector3f& d, float value, int thread) {
+    int i = leaf(p);
+    Buffer& buffer = buffers[thread];
+    buffer.energy[offsets[i] + dtrees[i].locate(d)] += value;
+    buffer.records[i]++;
+}
+
+void SDTree::endPass(int passSamples) {
+    if(buffers.empty())
+        return;
+    Buffer& merged = buffers[0];
+    for(int t = 1; t < int(buffers.size()); t++) {
+        for(int i = 0; i < int(merged.energy.size()); i++)
+            merged.energy[i] += buffers[t].energy[i];
+        for(int i = 0; i < int(merged.records.size()); i++)
+            merged.records[i] += buffers[t].records[i];
+    }
+    for(int i = 0; i < int(dtrees.size()); i++)
+        dtrees[i].build(&merged.energy[offsets[i]]);
+    split(0, 0, -1, int(SPLIT * std::sqrt(float(passSamples))));
+    buffers.clear();
+}
+
+void SDTree::split(int node, int depth, int records, int threshold) {
+    if(nodes[node].child[0]) {
+        split(nodes[node].child[0], depth + 1, -1, threshold);
+        split(nodes[node].child[1], depth + 1, -1, threshold);
+        return;
+    }
+    int d = nodes[node].dtree;
+    if(records < 0)
+        records = buffers[0].records[d];
+    if(records <= threshold || depth >= MAX_DEPTH)
+        return;
+    //both halves start from the directions learned for the whole leaf, the records are taken as evenly spread
+    dtrees.push_back(dtrees[d]);
+    int c = nodes.size();
+    nodes.push_back(Node{{0, 0}, d});
+    nodes.push_back(Node{{0, 0}, int(dtrees.size()) - 1});
+    nodes[node] = Node{{c, c + 1}, -1};
+    split(c, depth + 1, records / 2, threshold);
+    split(c + 1, depth + 1, records / 2, threshold);
+}
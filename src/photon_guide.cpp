@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <cmath>
+
+#include "../include/photon_guide.hpp"
+
+//share of the average importance every bin keeps, photons of bins without useful photons so far are still emitted
+static const float MIX = 0.1f;
+
+PhotonGuide::PhotonGuide(const Vector3f& center, float radius) : lo(center - Vector3f(2 * radius)), cellSize(4 * radius / CELLS) {
+    int bins = CELLS * CELLS * CELLS * THETA * PHI;
+    sum.assign(bins, 0);
+    count.assign(bins, 0);
+    guide.assign(bins, 1);
+}
+
+int PhotonGuide::bin(const Vector3f& origin, const Vector3f& direction) const {
+    int cell = 0;
+    for(int a = 2; a >= 0; a--) {
+        int c = int((origin[a] - lo[a]) / cellSize);
+        cell = cell * CELLS + std::min(CELLS - 1, std::max(0, c));
+    }
+    //cos(theta) and phi are uniform over the sphere, so the bins have equal solid angles
+    float z = std::min(1.0f, std::max(-1.0f, direction.z()));
+    int t = std::min(THETA - 1, int((z + 1) / 2 * THETA));
+    int p = std::min(PHI - 1, std::max(0, int((std::atan2(direction.y(), direction.x()) + M_PI) / (2 * M_PI) * PHI)));
+    return (cell * THETA + t) * PHI + p;
+}
+
+void PhotonGuide::record(int bin, float usefulness) {
+    #pragma omp atomic
+    sum[bin] += usefulness;
+    #pragma omp atomic
+    count[bin] += 1;
+}
+
+void PhotonGuide::update() {
+    double total = 0, photons = 0;
+    for(int i = 0; i < int(sum.size()); i++) {
+        total += sum[i];
+        photons += count[i];
+    }
+    //nothing useful found yet: all bins alike
+    if(!(total > 0)) {
+        std::fill(guide.begin(), guide.end(), 1.0f);
+        return;
+    }
+    float mean = float(total / photons);
+    for(int i = 0; i < int(sum.size()); i++) {
+        float learned = count[i] > 0 ? sum[i] / count[i] : mean;
+        guide[i] = learned + MIX * mean;
+    }
+}
@@ -13,12 +13,225 @@
 #include "../include/utils.hpp"
 #include "../include/curve.hpp"
 #include "../include/sppm.hpp"
+#include "../include/bdpt.hpp"
+#include "../include/vcm.hpp"
+#include "../include/mlt.hpp"
+#include "../include/vrpt.hpp"
+#include "../include/emitter.hpp"
+#include "../include/environment.hpp"
+#include "../include/path_guide.hpp"
+#include "../include/film.hpp"
+#include "../include/denoiser.hpp"
+#include "../include/tonemap.hpp"
+#include "../include/render_stats.hpp"
 
-Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene) {
+//path guiding state of a path tracing pass: the SD-tree its diffuse bounces sample from and the one it trains,
+//nullptr: none; every pass hands its own down the recursion
+struct Guiding {
+    const SDTree* guide = nullptr;
+    SDTree* training = nullptr;
+};
+
+//emitted: receives the emission at the hit (the background on a miss)
+//direct: receives the part of the result that left a light at most one bounce before (AOVs)
+//bsdfPdf: pdf per solid angle of the diffuse bounce that sampled the ray, 0 if the emitters were not sampled there
+Vector3f radiance(const Ray &ray, const Hit &hit, int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* emitted = nullptr, Vector3f* direct = nullptr, float bsdfPdf = 0);
+
+Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* emitted = nullptr, float bsdfPdf = 0) {
     Hit hit;
+    RenderStats::count(RenderStats::SECONDARY_RAYS);
     if (!scene.getGroup()->intersect(ray, hit, EPS)) {
-        return scene.getBackgroundColor();
+        Vector3f background = scene.getBackground(ray.getDirection());
+        //weighted against sampling the environment map at the diffuse hit before
+        const EnvironmentMap* environment = scene.getEnvironment();
+        if(environment != nullptr && bsdfPdf > 0) {
+            float pdfLight = environment->pdf(ray.getDirection());
+            background = background * (bsdfPdf * bsdfPdf / (bsdfPdf * bsdfPdf + pdfLight * pdfLight));
+        }
+        if(emitted != nullptr) *emitted = background;
+        return background;
+    }
+    return radiance(ray, hit, currentDepth, depth, Xi, scene, guiding, emitted, nullptr, bsdfPdf);
+}
+
+//radiance along a bounce ray times weight; with direct, the emission the bounce finds times f * weight is added to it
+static Vector3f bounce(const Ray &ray, double weight, const Vector3f& f, int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* direct, float bsdfPdf = 0) {
+    if(direct == nullptr) return radiance(ray, currentDepth, depth, Xi, scene, guiding, nullptr, bsdfPdf) * weight;
+    Vector3f emitted = Vector3f::ZERO;
+    Vector3f result = radiance(ray, currentDepth, depth, Xi, scene, guiding, &emitted, bsdfPdf) * weight;
+    *direct += f * emitted * weight;
+    return result;
+}
+
+//albedo AOV: diffuse color at the hit, textured if the material has a texture
+static Vector3f albedo(const Hit &hit) {
+    EmpiricalMaterial* m = dynamic_cast<EmpiricalMaterial*>(hit.getMaterial());
+    if(m != nullptr && m->hasTexture()) return m->getDiffuseColor(hit.getTexCoord());
+    return hit.getMaterial() != nullptr ? hit.getMaterial()->getDiffuseColor() : Vector3f::ZERO;
+}
+
+//share of the guided diffuse bounces sampled from the cosine lobe, it keeps the directions the tree missed
+static const float BSDF_FRACTION = 0.5f;
+
+//pdf per solid angle of a diffuse bounce taking direction: cosine weighted, mixed with dtree (the guide at the hit,
+//nullptr without path guiding)
+static float diffusePdf(const DTree* dtree, const Vector3f& nl, const Vector3f& direction) {
+    float cosPdf = std::max(0.0f, Vector3f::dot(direction, nl)) / float(M_PI);
+    if(dtree == nullptr) return cosPdf;
+    return BSDF_FRACTION * cosPdf + (1 - BSDF_FRACTION) * dtree->pdf(direction);
+}
+
+//direction of a diffuse bounce and its pdf (diffusePdf); returns the weight cos / pi / pdf, 0 below the surface
+static double sampleDiffuse(const DTree* dtree, const Vector3f& nl, unsigned short *Xi, Vector3f& direction, float& pdf) {
+    if(dtree == nullptr || erand48(Xi) < BSDF_FRACTION) {
+        //cosine-weighted importance sampling
+        double angle = 2 * M_PI * erand48(Xi), distance = erand48(Xi), distanceSqrt = sqrt(distance);
+        //generate orthonormal basis (w, u, v) according to normal
+        Vector3f w = nl, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),w)).normalized(), v = Vector3f::cross(w,u);
+        direction = (u * cos(angle) * distanceSqrt + v * sin(angle) * distanceSqrt + w * sqrt(1 - distance)).normalized();
+        if(dtree == nullptr) {
+            pdf = Vector3f::dot(direction, nl) / M_PI;
+            return 1;
+        }
+    } else {
+        float u0 = erand48(Xi), u1 = erand48(Xi), u2 = erand48(Xi);
+        direction = dtree->sample(u0, u1, u2, pdf);
+    }
+    float cosine = Vector3f::dot(direction, nl);
+    if(cosine <= 0) return 0;
+    pdf = diffusePdf(dtree, nl, direction);
+    return pdf > 0 ? cosine / M_PI / pdf : 0;
+}
+
+//next event estimation at a diffuse hit x (normal nl on the side of the ray) with albedo f: a point on the
+//emissive geometry (EmitterSampler::sampleDirect), weighted against the diffuse bounce finding it, dtree: the
+//guide at x (diffusePdf)
+static Vector3f sampleEmitters(const Vector3f& x, const Vector3f& nl, const Vector3f& f, const DTree* dtree, unsigned short *Xi, const SceneParser& scene) {
+    const EmitterSampler* emitters = scene.getEmitters();
+    if(emitters->empty()) return Vector3f::ZERO;
+    float u0 = erand48(Xi), u1 = erand48(Xi), u2 = erand48(Xi);
+    Vector3f q, nq;
+    float pdf;
+    const EmissiveShape& shape = emitters->sampleDirect(x, u0, u1, u2, q, nq, pdf);
+    if(!(pdf > 0)) return Vector3f::ZERO;
+    Vector3f w = q - x;
+    float distance = w.length();
+    w = w / distance;
+    float cosSurface = Vector3f::dot(nl, w), cosLight = -Vector3f::dot(nq, w);
+    if(cosSurface <= 0 || cosLight == 0 || (!shape.twoSided && cosLight < 0)) return Vector3f::ZERO;
+    if(!visible(scene.getGroup(), x, q)) return Vector3f::ZERO;
+    float cosPdf = cosSurface / M_PI, bsdfPdf = diffusePdf(dtree, nl, w);
+    return f * shape.emission * (cosPdf * pdf / (pdf * pdf + bsdfPdf * bsdfPdf));
+}
+
+//next event estimation to the environment map, as sampleEmitters: a direction by the map's distribution
+static Vector3f sampleEnvironment(const Vector3f& x, const Vector3f& nl, const Vector3f& f, const DTree* dtree, unsigned short *Xi, const SceneParser& scene) {
+    const EnvironmentMap* environment = scene.getEnvironment();
+    if(environment == nullptr) return Vector3f::ZERO;
+    float u0 = erand48(Xi), u1 = erand48(Xi), u2 = erand48(Xi);
+    Vector3f w;
+    float pdf;
+    Vector3f Le = environment->sample(u0, u1, u2, w, pdf);
+    float cosSurface = Vector3f::dot(nl, w);
+    if(!(pdf > 0) || cosSurface <= 0 || isBlack(Le)) return Vector3f::ZERO;
+    Hit hit;
+    RenderStats::count(RenderStats::SHADOW_RAYS);
+    if(scene.getGroup()->intersect(Ray(x, w), hit, EPS)) return Vector3f::ZERO;
+    float cosPdf = cosSurface / M_PI, bsdfPdf = diffusePdf(dtree, nl, w);
+    return f * Le * (cosPdf * pdf / (pdf * pdf + bsdfPdf * bsdfPdf));
+}
+
+//a diffuse bounce: next event estimation, then the bounce ray, recorded into the SD-tree while training
+static Vector3f diffuse(const Vector3f& x, const Vector3f& nl, const Vector3f& f, int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* direct) {
+    const DTree* dtree = guiding.guide != nullptr ? &guiding.guide->dtree(x) : nullptr;
+    Vector3f direction;
+    float pdf;
+    double weight = sampleDiffuse(dtree, nl, Xi, direction, pdf);
+    Vector3f Ld = sampleEmitters(x, nl, f, dtree, Xi, scene) + sampleEnvironment(x, nl, f, dtree, Xi, scene);
+    if(direct != nullptr) *direct += Ld;
+    if(weight <= 0) return Ld;
+    Vector3f Li = bounce(Ray(x, direction), weight, f, currentDepth, depth, Xi, scene, guiding, direct, pdf);
+    if(guiding.training != nullptr) {
+        //incident radiance over its pdf, the emitters found by next event estimation are left out
+        float value = luminance(Li) / float(weight) / pdf;
+        if(std::isfinite(value) && value > 0) guiding.training->record(x, direction, value, omp_get_thread_num());
     }
+    return Ld + f * Li;
+}
+
+//emission at the hit, weighted against next event estimation if a diffuse bounce (bsdfPdf > 0) found it
+static Vector3f emission(const Ray &ray, const Vector3f& x, const Vector3f& n, Material* material, const Vector3f& Le, float bsdfPdf, const SceneParser& scene) {
+    if(bsdfPdf <= 0 || isBlack(Le)) return Le;
+    float pdfLight = scene.getEmitters()->pdfDirect(ray.getOrigin(), x, n, material);
+    return Le * (bsdfPdf * bsdfPdf / (bsdfPdf * bsdfPdf + pdfLight * pdfLight));
+}
+
+//reflection or refraction (chosen by Schlick's Fresnel weight) of direction d at a glass boundary with normal n
+static Vector3f fresnelBounce(const Vector3f& d, const Vector3f& n, unsigned short *Xi) {
+    Vector3f nl = Vector3f::dot(n, d) < 0 ? n : n * -1;
+    Vector3f reflectionDirection = d - n * 2 * Vector3f::dot(n, d);
+    bool into = Vector3f::dot(n, nl) > 0;
+    double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = Vector3f::dot(d, nl), cos2t;
+    if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) return reflectionDirection;
+    Vector3f refractionDirection = (d * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
+    double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractionDirection, n));
+    double Re = R0 + (1 - R0) * c * c * c * c * c;
+    return erand48(Xi) < Re ? reflectionDirection : refractionDirection;
+}
+
+//MEDIA and SUBSURFACE: the object is filled with a medium (medium.hpp) behind an index matched (MEDIA) or glass
+//(SUBSURFACE, ior 1.5 as REFRACTION) boundary; a ray that gets in random walks through the medium until it leaves
+//the object, Russian roulette on the throughput after depth scattering events; objects inside the medium are
+//shaded as if it was not there
+static Vector3f interior(const Ray &ray, const Hit &hit, const Medium* medium, bool dielectric, int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* direct) {
+    Vector3f x = ray.pointAtParameter(hit.getT());
+    Vector3f n = hit.getNormal().normalized();
+    Vector3f d = ray.getDirection();
+    bool entering = Vector3f::dot(n, d) < 0;
+    if(dielectric) {
+        Vector3f out = fresnelBounce(d, n, Xi);
+        //reflected
+        if(Vector3f::dot(out, n) * Vector3f::dot(d, n) < 0) return bounce(Ray(x, out), 1, Vector3f(1, 1, 1), currentDepth, depth, Xi, scene, guiding, direct);
+        d = out;
+    }
+    if(!entering || medium == nullptr) return bounce(Ray(x, d), 1, Vector3f(1, 1, 1), currentDepth, depth, Xi, scene, guiding, direct);
+    RandomSampler sampler(Xi);
+    Vector3f throughput(1, 1, 1);
+    for(int events = 0; ; ) {
+        Ray inside(x, d);
+        Hit next;
+        //the boundary is not closed
+        RenderStats::count(RenderStats::SECONDARY_RAYS);
+        if(!scene.getGroup()->intersect(inside, next, EPS)) return Vector3f::ZERO;
+        float t;
+        Vector3f weight;
+        bool scattered = medium->sample(inside, next.getT(), sampler, t, weight);
+        throughput = throughput * weight;
+        if(scattered) {
+            if(++events > depth) {
+                double p = std::min(1.0f, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+                if(events > 1000 || erand48(Xi) >= p) return Vector3f::ZERO;
+                throughput = throughput * (1 / p);
+            }
+            x = inside.pointAtParameter(t);
+            d = samplePhaseHG(d, medium->getG(), erand48(Xi), erand48(Xi));
+            continue;
+        }
+        if(next.getMaterial() != hit.getMaterial()) return throughput * radiance(inside, next, currentDepth, depth, Xi, scene, guiding);
+        x = inside.pointAtParameter(next.getT());
+        if(dielectric) {
+            Vector3f hn = next.getNormal().normalized();
+            Vector3f out = fresnelBounce(d, hn, Xi);
+            bool reflected = Vector3f::dot(out, hn) * Vector3f::dot(d, hn) < 0;
+            d = out;
+            if(reflected) continue;
+        }
+        return throughput * radiance(Ray(x, d), currentDepth, depth, Xi, scene, guiding);
+    }
+}
+
+//radiance along a ray whose closest hit is already known (camera rays traced as packets)
+Vector3f radiance(const Ray &ray, const Hit &hit, int currentDepth, int depth, unsigned short *Xi, const SceneParser& scene, const Guiding& guiding, Vector3f* emitted, Vector3f* direct, float bsdfPdf) {
     Vector3f x = ray.pointAtParameter(hit.getT());//hit point
     Vector3f n = hit.getNormal().normalized();
     Vector3f nl = Vector3f::dot(n,ray.getDirection()) < 0 ? n : n * -1; //orienting normal
@@ -36,6 +249,9 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             Vector2f texCoord = hit.getTexCoord();
             f = m->getDiffuseColor(texCoord);
         }
+        Vector3f Le = emission(ray, x, n, m, m->getEmissionColor(), bsdfPdf, scene);
+        if(emitted != nullptr) *emitted = Le;
+        if(direct != nullptr) *direct = Le;
         
         double p = f.x() > f.y() && f.x() > f.z() ? f.x() : f.y() > f.z() ? f.y() : f.z();// max reflectance
         currentDepth++;
@@ -44,7 +260,7 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             if (erand48(Xi) < p && currentDepth <= 10) {
                 f = f * (1 / p);
             } else {
-                return m->getEmissionColor();
+                return Le;
             }
         }
 
@@ -54,19 +270,14 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             Vector3f wi = m->sampleBRDF(wo, nl);
             Ray newRay(x, wi);
                      f = m->evalBRDF(wi, wo, nl);
-            return m->getEmissionColor() + f * radiance(newRay, currentDepth + 1, depth, Xi, scene);
+            return Le + f * bounce(newRay, 1, f, currentDepth + 1, depth, Xi, scene, guiding, direct);
         } else if (m->getMaterialType() == BRDFType::DIFFUSE) {
-            double angle = 2 * M_PI * erand48(Xi), distance = erand48(Xi), distanceSqrt = sqrt(distance);
-            //generate orthonormal basis (w, u, v) according to normal
-            Vector3f w = nl, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),w)).normalized(), v = Vector3f::cross(w,u);
-            //generate random reflection ray direction
-            Vector3f direction = (u * cos(angle) * distanceSqrt + v * sin(angle) * distanceSqrt + w * sqrt(1 - distance)).normalized();
-            return m->getEmissionColor() + f * (radiance(Ray(x, direction), currentDepth, depth, Xi, scene));
+            return Le + diffuse(x, nl, f, currentDepth, depth, Xi, scene, guiding, direct);
         } else if (m->getMaterialType() == BRDFType::SPECULAR) {
             // Ideal Specular Reflection
             Vector3f reflectionDirection = ray.getDirection() - n * 2 * Vector3f::dot(n,(ray.getDirection()));
             Ray reflectionRay(x, reflectionDirection);
-            return m->getEmissionColor() + f * (radiance(reflectionRay, currentDepth + 1, depth, Xi, scene));
+            return Le + f * (bounce(reflectionRay, 1, f, currentDepth + 1, depth, Xi, scene, guiding, direct));
         } else if (m->getMaterialType() == BRDFType::REFRACTION) {
             // Ideal Specular Refraction
             //judge whether ray is entering or leaving the material
@@ -80,7 +291,7 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = Vector3f::dot(ray.getDirection(),nl), cos2t;
             if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) {
                 //total internal reflection
-                return m->getEmissionColor() + f * (radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene));
+                return Le + f * (bounce(Ray(x, reflectionDirection), 1, f, currentDepth, depth, Xi, scene, guiding, direct));
             }
             Vector3f refractionDirection = (ray.getDirection() * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
             //R0: reflectance at normal incidence based on IOR
@@ -92,19 +303,21 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             //TP: probability of transmission
             double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractionDirection,n));
             double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = 0.25 + 0.5 * Re, RP = Re / P, TP = Tr / (1 - P);
-            return m->getEmissionColor() + f * (currentDepth > depth ? 
+            return Le + f * (currentDepth > depth ? 
                 (erand48(Xi) < P ?//Russian roulette
-                radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene) * RP :
-                radiance(Ray(x, refractionDirection), currentDepth, depth, Xi, scene) * TP) :
-                    radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene) * Re + 
-                    radiance(Ray(x, refractionDirection), currentDepth, depth, Xi, scene) * Tr);
+                bounce(Ray(x, reflectionDirection), RP, f, currentDepth, depth, Xi, scene, guiding, direct) :
+                bounce(Ray(x, refractionDirection), TP, f, currentDepth, depth, Xi, scene, guiding, direct)) :
+                    bounce(Ray(x, reflectionDirection), Re, f, currentDepth, depth, Xi, scene, guiding, direct) + 
+                    bounce(Ray(x, refractionDirection), Tr, f, currentDepth, depth, Xi, scene, guiding, direct));
         } else if (m->getMaterialType() == BRDFType::EMISSION) {
             // Emission
-            return m->getEmissionColor();
+            return Le;
         } else if (m->getMaterialType() == BRDFType::SUBSURFACE) {
-            // Subsurface Scattering
+            // Subsurface Scattering: mtl materials carry no medium, only the glass boundary
+            return Le + interior(ray, hit, nullptr, true, currentDepth, depth, Xi, scene, guiding, direct) * (currentDepth > depth ? 1 / p : 1);
         } else if (m->getMaterialType() == BRDFType::MEDIA) {
-            // Media
+            // Media: mtl materials carry no medium, the boundary is invisible
+            return Le + interior(ray, hit, nullptr, false, currentDepth, depth, Xi, scene, guiding, direct) * (currentDepth > depth ? 1 / p : 1);
         } else {
             // None
             std::cout << "Error: material type unexpected." << std::endl;
@@ -114,6 +327,9 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
     }else {//Discrete Material
 
         Vector3f f = m->getDiffuseColor();
+        Vector3f Le = emission(ray, x, n, m, m->getEmissionColor(), bsdfPdf, scene);
+        if(emitted != nullptr) *emitted = Le;
+        if(direct != nullptr) *direct = Le;
         
         double p = f.x() > f.y() && f.x() > f.z() ? f.x() : f.y() > f.z() ? f.y() : f.z();// max reflectance
         currentDepth++;
@@ -122,24 +338,21 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             if (erand48(Xi) < p && currentDepth <= 10) {
                 f = f * (1 / p);
             } else {
-                return m->getEmissionColor();
+                return Le;
             }
         }
         if (m->getMaterialType() == BRDFType::DIFFUSE) {
             //Ideal Diffuse Reflection
-            //cosine-weighted importance sampling
-            //sample hemisphere
-            double angle = 2 * M_PI * erand48(Xi), distance = erand48(Xi), distanceSqrt = sqrt(distance);
-            //generate orthonormal basis (w, u, v) according to normal
-            Vector3f w = nl, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),w)).normalized(), v = Vector3f::cross(w,u);
-            //generate random reflection ray direction
-            Vector3f direction = (u * cos(angle) * distanceSqrt + v * sin(angle) * distanceSqrt + w * sqrt(1 - distance)).normalized();
-            return m->getEmissionColor() + f * (radiance(Ray(x, direction), currentDepth, depth, Xi, scene));
+            //cosine-weighted importance sampling, mixed with the SD-tree under path guiding
+            return Le + diffuse(x, nl, f, currentDepth, depth, Xi, scene, guiding, direct);
         } else if (m->getMaterialType() == BRDFType::SPECULAR) {
             //Ideal Specular Reflection
             Vector3f reflectionDirection = ray.getDirection() - n * 2 * Vector3f::dot(n,(ray.getDirection()));
             Ray reflectionRay(x, reflectionDirection);
-            return m->getEmissionColor() + f * (radiance(reflectionRay, currentDepth, depth, Xi, scene));
+            return Le + f * (bounce(reflectionRay, 1, f, currentDepth, depth, Xi, scene, guiding, direct));
+        } else if (m->getMaterialType() == BRDFType::SUBSURFACE || m->getMaterialType() == BRDFType::MEDIA) {
+            //Participating media inside the object, subsurface scattering as a random walk in the medium
+            return Le + interior(ray, hit, m->getMedium(), m->getMaterialType() == BRDFType::SUBSURFACE, currentDepth, depth, Xi, scene, guiding, direct) * (currentDepth > depth ? 1 / p : 1);
         } else {
             //Ideal Specular Refraction
             //judge whether ray is entering or leaving the material
@@ -153,7 +366,7 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = Vector3f::dot(ray.getDirection(),nl), cos2t;
             if ((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0) {
                 //total internal reflection
-                return m->getEmissionColor() + f * (radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene));
+                return Le + f * (bounce(Ray(x, reflectionDirection), 1, f, currentDepth, depth, Xi, scene, guiding, direct));
             }
             Vector3f refractionDirection = (ray.getDirection() * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
             //R0: reflectance at normal incidence based on IOR
@@ -165,71 +378,141 @@ Vector3f radiance(const Ray &ray,int currentDepth, int depth, unsigned short *Xi
             //TP: probability of transmission
             double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractionDirection,n));
             double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = 0.25 + 0.5 * Re, RP = Re / P, TP = Tr / (1 - P);
-            return m->getEmissionColor() + f * (currentDepth > depth ? 
+            return Le + f * (currentDepth > depth ? 
                 (erand48(Xi) < P ?//Russian roulette
-                radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene) * RP :
-                radiance(Ray(x, refractionDirection), currentDepth, depth, Xi, scene) * TP) :
-                    radiance(Ray(x, reflectionDirection), currentDepth, depth, Xi, scene) * Re + 
-                    radiance(Ray(x, refractionDirection), currentDepth, depth, Xi, scene) * Tr);
+                bounce(Ray(x, reflectionDirection), RP, f, currentDepth, depth, Xi, scene, guiding, direct) :
+                bounce(Ray(x, refractionDirection), TP, f, currentDepth, depth, Xi, scene, guiding, direct)) :
+                    bounce(Ray(x, reflectionDirection), Re, f, currentDepth, depth, Xi, scene, guiding, direct) + 
+                    bounce(Ray(x, refractionDirection), Tr, f, currentDepth, depth, Xi, scene, guiding, direct));
         }
 
     }
     
 }
 
+void Renderer::createFilm(int width, int height) {
+    //the denoiser is guided by the AOVs
+    film = std::make_unique<Film>(width, height, FILTER, writeAOVs || denoiseIterations > 0);
+}
+
+RgbImage* Renderer::develop() {
+    if(denoiseIterations > 0) {
+        std::cout << "Denoising..." << std::endl;
+        Denoiser(denoiseIterations).denoise(*film);
+    }
+    return ToneMapper(TONEMAP, exposure).apply(*film);
+}
+
 void PathTracingRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
     std::cout << "Rendering with Path Tracing..." << std::endl;
     //set main parameters
     Camera *camera = scene.getCamera();
     camera->setDOF(DOF, aperture, focalLength);
     std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
-    image = new RgbImage(camera->getWidth(), camera->getHeight());
-    assert(image!=nullptr);
 
     //currently set material.
     Group* baseGroup = scene.getGroup();
 
     omp_set_num_threads(threads);
-    Vector3f finalColor = Vector3f::ZERO;
-    Vector3f color = Vector3f::ZERO;
-#pragma omp parallel for schedule(dynamic, 1) private(finalColor,color)
-    //Loop over screen space pixels
-    for(int y = 0; y < camera->getHeight(); ++y) {
-        unsigned short Xi[3] = {0, 0, y*y*y};
-        for(int x = 0; x < camera->getWidth(); ++x) {
-            //SAMPLER
-            //current: SMAA x4
-            for(int sy = 0; sy < 2; ++sy) {
-                for(int sx = 0; sx < 2; ++sx) {
-                    color = Vector3f::ZERO;
-                    for(int s = 0; s < samples; ++s) {
-                        //FILTER
-                        //current: tent filter
-                        double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-                        double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-                        //generate ray
-                        Vector2f pixel = Vector2f((sx + 0.5 + dx) / 2 + x, (sy + 0.5 + dy) / 2 + y);
-                        Ray camRay = camera->generateRay(pixel);
-                        //trace ray
-                        color += radiance(camRay, 0, depth, Xi, scene) * (1.0 / samples);
-                        //std::cout << "color: " << color << std::endl;
+    //the image is rendered in Film::TILE_SIZE tiles, each into a FilmTile of its own that is merged once done
+    createFilm(camera->getWidth(), camera->getHeight());
+    Film& film = *this->film;
+    int tilesX = (film.getWidth() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesY = (film.getHeight() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    //path guiding: passes of 1, 2, 4, ... samples train the SD-tree as long as the samples left after one are at
+    //least twice its own, the last pass takes the rest; every pass samples from the tree of the passes before, so
+    //all of them are unbiased and stay in the film
+    std::unique_ptr<SDTree> sdTree;
+    if(pathGuiding) {
+        Vector3f center;
+        float radius = visibleRadius(camera, baseGroup, &center);
+        sdTree.reset(new SDTree(center, radius));
+    }
+    Guiding guiding;
+    for(int pass = 0, remaining = samples; remaining > 0; ++pass) {
+        bool train = sdTree && remaining - (1 << pass) >= 2 << pass;
+        int passSamples = train ? 1 << pass : remaining;
+        remaining -= passSamples;
+        guiding.training = train ? sdTree.get() : nullptr;
+        if(train) sdTree->beginPass(omp_get_max_threads());
+        int tilesDone = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int tile = 0; tile < tilesX * tilesY; ++tile) {
+            int x0 = tile % tilesX * Film::TILE_SIZE, y0 = tile / tilesX * Film::TILE_SIZE;
+            int x1 = std::min(x0 + Film::TILE_SIZE, film.getWidth()), y1 = std::min(y0 + Film::TILE_SIZE, film.getHeight());
+            unsigned short Xi[3] = {(unsigned short)pass, (unsigned short)(tile >> 16), (unsigned short)(tile * tile * tile)};
+            FilmTile filmTile = film.tile(x0, y0, x1, y1);
+            //the 4 * passSamples camera rays of a pixel are generated as one batch and intersected
+            //RayPacket::SIZE at a time (they are nearly parallel), only the bounces are traced one by one
+            int pixelSamples = 4 * passSamples;
+            std::vector<float> sampleX(pixelSamples), sampleY(pixelSamples), lensU(pixelSamples), lensV(pixelSamples);
+            RayBatch camRays;
+            for(int y = y0; y < y1; ++y) for(int x = x0; x < x1; ++x) {
+                //SAMPLER
+                //current: 2 x 2 strata, jittered
+                for(int k = 0; k < pixelSamples; ++k) {
+                    int sub = k / passSamples, sx = sub % 2, sy = sub / 2;
+                    //FILTER: the samples are uniform over the pixel, the film weights them
+                    sampleX[k] = x + (sx + erand48(Xi)) / 2;
+                    sampleY[k] = y + (sy + erand48(Xi)) / 2;
+                    //every sample takes its own point on the lens
+                    if(DOF) {
+                        lensU[k] = erand48(Xi);
+                        lensV[k] = erand48(Xi);
+                    }
+                }
+                //generate ray
+                camera->generateRays(sampleX.data(), sampleY.data(), DOF ? lensU.data() : nullptr, DOF ? lensV.data() : nullptr, pixelSamples, camRays);
+                for(int first = 0; first < pixelSamples; first += RayPacket::SIZE) {
+                    int lanes = std::min(RayPacket::SIZE, pixelSamples - first);
+                    RayPacket packet;
+                    camRays.load(first, lanes, packet);
+                    RenderStats::count(RenderStats::PRIMARY_RAYS, lanes);
+                    //trace ray
+                    Hit hits[RayPacket::SIZE];
+                    int hitMask = 0;
+                    if(rayPackets) {
+                        hitMask = baseGroup->intersectPacket(packet, hits, EPS);
+                    } else {
+                        for(int lane = 0; lane < lanes; ++lane) {
+                            if(baseGroup->intersect(packet.ray(lane), hits[lane], EPS)) hitMask |= 1 << lane;
+                        }
+                    }
+                    for(int lane = 0; lane < lanes; ++lane) {
+                        if(!film.hasAOVs()) {
+                            Vector3f color = hitMask >> lane & 1 ? radiance(packet.ray(lane), hits[lane], 0, depth, Xi, scene, guiding) : scene.getBackground(packet.ray(lane).getDirection());
+                            filmTile.addSample(sampleX[first + lane], sampleY[first + lane], color);
+                            continue;
+                        }
+                        AOVSample aov;
+                        Vector3f color = scene.getBackground(packet.ray(lane).getDirection());
+                        aov.direct = color;
+                        if(hitMask >> lane & 1) {
+                            const Hit& hit = hits[lane];
+                            color = radiance(packet.ray(lane), hit, 0, depth, Xi, scene, guiding, nullptr, &aov.direct);
+                            aov.albedo = albedo(hit);
+                            aov.normal = hit.getNormal().normalized();
+                            aov.depth = hit.getT();
+                        }
+                        aov.indirect = color - aov.direct;
+                        filmTile.addSample(sampleX[first + lane], sampleY[first + lane], color, &aov);
                     }
-                    finalColor += color * 0.25;
-                    //std::cout << "finalColor: " << finalColor << std::endl;
                 }
             }
-            //convert linear color to sRGB color
-            //std::cout << "finalColor: " << finalColor << std::endl;
-            finalColor = clamp(finalColor); //TODO: use tone mapping
-            //std::cout << "finalColor: " << finalColor << std::endl;
-            finalColor = gammaCorrection(finalColor);
-            //std::cout << "finalColor: " << finalColor << std::endl;
-            image->SetPixel(x, camera->getHeight()-1-y, finalColor);
-            finalColor = Vector3f::ZERO;
+            film.merge(filmTile);
+            int done;
+#pragma omp atomic capture
+            done = ++tilesDone;
+            fprintf(stderr,"\r%s %5.2f%%", train ? "Training" : "Rendering",100.*done/(tilesX * tilesY));
+        }
+        if(train) {
+            std::cerr << std::endl;
+            sdTree->endPass(passSamples);
+            guiding.guide = sdTree.get();
         }
-        fprintf(stderr,"\rRendering %5.2f%%",100.*y/(image->Height()-1));
     }
-    std::cout<<"Rendering finished"<<std::endl;
+    std::cout<<std::endl<<"Rendering finished"<<std::endl;
+    image = develop();
 }
 
 void SPPMRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
@@ -238,9 +521,6 @@ void SPPMRenderer::render(const SceneParser& scene, RgbImage*& image, int sample
     Camera *camera = scene.getCamera();
     camera->setDOF(DOF, aperture, focalLength);
     std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
-    image = new RgbImage(camera->getWidth(), camera->getHeight());
-    assert(image!=nullptr);
-
     omp_set_num_threads(threads);
 
     //initialize SPPMIntegrator
@@ -248,11 +528,76 @@ void SPPMRenderer::render(const SceneParser& scene, RgbImage*& image, int sample
     //in SPPM, depth means number of iterations 
     SPPMIntegrator sppmIntegrator = SPPMIntegrator(camera->getWidth(), camera->getHeight(), samples, depth);
 
-    sppmIntegrator.render(scene, image);
+    createFilm(camera->getWidth(), camera->getHeight());
+    sppmIntegrator.render(scene, *film);
+    image = develop();
+}
+
+
+
+void BDPTRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
+    std::cout << "Rendering with Bidirectional Path Tracing..." << std::endl;
+    Camera *camera = scene.getCamera();
+    camera->setDOF(DOF, aperture, focalLength);
+    std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
+    omp_set_num_threads(threads);
+
+    //in BDPT, samples means the same as in PT (4 * samples path samples per pixel),
+    //depth means the maximal number of bounces (no Russian roulette)
+    BDPTIntegrator bdptIntegrator(scene, depth);
 
+    createFilm(camera->getWidth(), camera->getHeight());
+    bdptIntegrator.render(*film, 4 * samples);
+    image = develop();
 }
 
+void VCMRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
+    std::cout << "Rendering with Vertex Connection and Merging..." << std::endl;
+    Camera *camera = scene.getCamera();
+    camera->setDOF(DOF, aperture, focalLength);
+    std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
+    omp_set_num_threads(threads);
 
+    //in VCM, samples means the same as in PT (4 * samples iterations, one camera and one light path per pixel each),
+    //depth means the maximal number of bounces
+    VCMIntegrator vcmIntegrator(scene, depth);
+
+    createFilm(camera->getWidth(), camera->getHeight());
+    vcmIntegrator.render(*film, 4 * samples);
+    image = develop();
+}
+
+void MLTRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
+    std::cout << "Rendering with Metropolis Light Transport..." << std::endl;
+    Camera *camera = scene.getCamera();
+    camera->setDOF(DOF, aperture, focalLength);
+    std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
+    omp_set_num_threads(threads);
+
+    //in MLT, samples means the same as in PT (4 * samples mutations per pixel on average),
+    //depth means the maximal number of bounces
+    MLTIntegrator mltIntegrator(scene, depth, 100000, 1000, 4 * samples);
+
+    createFilm(camera->getWidth(), camera->getHeight());
+    mltIntegrator.render(*film);
+    image = develop();
+}
+
+void VRPTRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
+    std::cout << "Rendering with Volumetric Path Tracing..." << std::endl;
+    Camera *camera = scene.getCamera();
+    camera->setDOF(DOF, aperture, focalLength);
+    std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
+    omp_set_num_threads(threads);
+
+    //in VRPT, samples means the same as in PT (4 * samples paths per pixel),
+    //depth means the scattering events before Russian roulette
+    VolumetricPathIntegrator vrptIntegrator(scene, depth);
+
+    createFilm(camera->getWidth(), camera->getHeight());
+    vrptIntegrator.render(*film, 4 * samples);
+    image = develop();
+}
 
 void RayCastingRenderer::render(const SceneParser& scene, RgbImage*& image, int samples, int threads, int depth, bool DOF, float aperture, float focalLength) {
     std::cout << "Rendering with Ray Casting..." << std::endl;
@@ -260,24 +605,40 @@ void RayCastingRenderer::render(const SceneParser& scene, RgbImage*& image, int
     Camera *camera = scene.getCamera();
     camera->setDOF(false, aperture, focalLength);
     std::cout << "camera: " << camera->getWidth() << " " << camera->getHeight() << std::endl;
-    image = new RgbImage(camera->getWidth(), camera->getHeight());
-    //DynamicCastTest(image);
-    assert(image!=nullptr);
+    createFilm(camera->getWidth(), camera->getHeight());
     Group* baseGroup = scene.getGroup();
 
     //循环屏幕空间的像素
     omp_set_num_threads(threads);
 #pragma omp parallel for schedule(dynamic, 1)
     for(int y = 0; y < camera->getHeight(); ++y) {
-        fprintf(stderr,"\rRendering %5.2f%%",100.*y/(image->Height()-1)); 
-        for(int x = 0; x < camera->getWidth(); ++x) {
-        //计算当前像素(x,y)处相机出射光线camRay
-        Ray camRay = scene.getCamera()->generateRay(Vector2f(x, y));
-        Hit hit ;
+        fprintf(stderr,"\rRendering %5.2f%%",100.*y/(camera->getHeight()-1)); 
+        //计算整行像素的相机出射光线，每RayPacket::SIZE个相邻像素的光线组成一个光线包，一次求交
+        int width = camera->getWidth();
+        std::vector<float> pixelX(width), pixelY(width, y);
+        for(int x = 0; x < width; ++x) pixelX[x] = x;
+        RayBatch camRays;
+        camera->generateRays(pixelX.data(), pixelY.data(), nullptr, nullptr, width, camRays);
+        for(int x0 = 0; x0 < width; x0 += RayPacket::SIZE) {
+        int lanes = std::min(RayPacket::SIZE, width - x0);
+        RayPacket packet;
+        camRays.load(x0, lanes, packet);
+        RenderStats::count(RenderStats::PRIMARY_RAYS, lanes);
+        Hit hits[RayPacket::SIZE];
         //判断camRay是否和场景有交点，并返回最近交点的数据，存储在hit中
-        //fprintf(stderr,"\rRendering pixel (%d,%d)",x,y);
-        bool isIntersect = baseGroup->intersect (camRay, hit , 0) ;
-        if(isIntersect) {
+        int hitMask = 0;
+        if(rayPackets) {
+            hitMask = baseGroup->intersectPacket(packet, hits, 0);
+        } else {
+            for(int lane = 0; lane < lanes; ++lane) {
+                if(baseGroup->intersect(packet.ray(lane), hits[lane], 0)) hitMask |= 1 << lane;
+            }
+        }
+        for(int lane = 0; lane < lanes; ++lane) {
+        int x = x0 + lane;
+        Ray camRay = packet.ray(lane);
+        const Hit& hit = hits[lane];
+        if(hitMask >> lane & 1) {
             Vector3f finalColor = Vector3f ::ZERO;
             //找到交点之后，累加来自所有光源的光强影响
             for(int li = 0; li < scene.getNumLights() ; ++li) {
@@ -289,17 +650,30 @@ void RayCastingRenderer::render(const SceneParser& scene, RgbImage*& image, int
                 if(hit.getMaterial() != nullptr)
                 finalColor += hit.getMaterial()->Shade(camRay, hit , L, lightColor, light, depth, baseGroup) ;
             }
-            //convert linear color to sRGB color
-            finalColor = clamp(finalColor) ;//TODO: use tone mapping | gamma correction
+            film->setPixel(x, y, finalColor);
+            if(film->hasAOVs()) {
+                AOVSample aov;
+                aov.albedo = albedo(hit);
+                aov.normal = hit.getNormal().normalized();
+                aov.depth = hit.getT();
+                aov.direct = finalColor;
+                film->addAOVSample(x, y, aov);
+            }
             //hittimes++;
-            image->SetPixel(x, camera->getHeight()-1-y, finalColor * 255 ) ;
-            //image->SetPixel(x, camera->getHeight()-1-y, Vector3f(255, 0, 0) ) ;
         }else{
             //不存在交点，返回背景色
-            image->SetPixel(x, camera->getHeight()-1-y, scene.getBackgroundColor() * 255 ) ;
+            film->setPixel(x, y, scene.getBackground(camRay.getDirection()));
+            if(film->hasAOVs()) {
+                AOVSample aov;
+                aov.direct = scene.getBackground(camRay.getDirection());
+                film->addAOVSample(x, y, aov);
+            }
+        }
         }
         }
     }
     std::cout<<"Rendering finished"<<std::endl;
+    //convert linear color to sRGB color
+    image = develop();
     //std::cout << "hittimes: " << hittimes << std::endl;
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include "../include/render_stats.hpp"
+
+bool RenderStats::enabled = false;
+thread_local RenderStats::ThreadCounters* RenderStats::localCounters = nullptr;
+
+RenderStats& RenderStats::instance() {
+    static RenderStats stats;
+    return stats;
+}
+
+RenderStats::ThreadCounters* RenderStats::registerLocal() {
+    //the registry keeps the block alive after the thread is gone
+    localCounters = instance().registerThread().get();
+    return localCounters;
+}
+
+std::shared_ptr<RenderStats::ThreadCounters> RenderStats::registerThread() {
+    std::lock_guard<std::mutex> lock(mutex);
+    threadCounters.push_back(std::make_shared<ThreadCounters>());
+    return threadCounters.back();
+}
+
+void RenderStats::addBVHBuildTime(double milliseconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bvhBuildTime += milliseconds;
+}
+
+uint64_t RenderStats::total(Counter counter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t sum = 0;
+    for(auto& counters : threadCounters) sum += counters->values[counter].load(std::memory_order_relaxed);
+    return sum;
+}
+
+double RenderStats::getBVHBuildTime() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bvhBuildTime;
+}
+
+void RenderStats::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(auto& counters : threadCounters) {
+        for(auto& value : counters->values) value.store(0, std::memory_order_relaxed);
+    }
+    bvhBuildTime = 0;
+}
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cmath>
 #include <cassert>
+#include <cctype>
 
 #include <iostream>
 #include <fstream>
@@ -20,6 +21,8 @@
 #include "classical_object.hpp"
 #include "transform.hpp"
 #include "group.hpp"
+#include "emitter.hpp"
+#include "environment.hpp"
 //#include "sphere.hpp"
 //#include "plane.hpp"
 
@@ -35,6 +38,8 @@ SceneParser::SceneParser(const char *filename) {
 
     // initialize some reasonable default values
     group = nullptr;
+    emitters = nullptr;
+    environment = nullptr;
     camera = nullptr;
     background_color = Vector3f(0.5, 0.5, 0.5);
     num_lights = 0;
@@ -44,6 +49,7 @@ SceneParser::SceneParser(const char *filename) {
     current_material = nullptr;
     num_curves = 0;
     curves = std::vector<Curve *>();
+    curve_tolerance = 0;
     num_textures = 0;
     textures = std::vector<Texture *>();
 
@@ -64,14 +70,16 @@ SceneParser::SceneParser(const char *filename) {
     parseFile();
     fclose(file);
     file = nullptr;
+    emitters = new EmitterSampler(group);
 
-    if (num_lights == 0) {
+    if (num_lights == 0 && emitters->empty() && environment == nullptr) {
         printf("WARNING:    No lights specified\n");
     }
 
     #ifdef __DEBUG__
     std::cout << "background_color: " << background_color << std::endl;
     std::cout << "num_lights: " << num_lights << std::endl;
+    std::cout << "num_emitters: " << emitters->size() << std::endl;
     std::cout << "num_materials: " << num_materials << std::endl;
     std::cout << "num_curves: " << num_curves << std::endl;
     std::cout << "num_textures: " << num_textures << std::endl;
@@ -80,6 +88,8 @@ SceneParser::SceneParser(const char *filename) {
 
 SceneParser::~SceneParser() {
 
+    delete emitters;
+    delete environment;
     delete group;
     delete camera;
 
@@ -107,6 +117,8 @@ void SceneParser::parseFile() {
     while (getToken(token)) {
         if (!strcmp(token, "PerspectiveCamera")) {
             parsePerspectiveCamera();
+        } else if (!strcmp(token, "OrthographicCamera")) {
+            parseOrthographicCamera();
         } else if (!strcmp(token, "Background")) {
             parseBackground();
         } else if (!strcmp(token, "Lights")) {
@@ -156,8 +168,38 @@ void SceneParser::parsePerspectiveCamera() {
     camera = new PerspectiveCamera(center, direction, up, width, height, angle_radians);
 }
 
+void SceneParser::parseOrthographicCamera() {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    // read in the camera parameters, size is the height of the view in world units
+    getToken(token);
+    assert (!strcmp(token, "{"));
+    getToken(token);
+    assert (!strcmp(token, "center"));
+    Vector3f center = readVector3f();
+    getToken(token);
+    assert (!strcmp(token, "direction"));
+    Vector3f direction = readVector3f();
+    getToken(token);
+    assert (!strcmp(token, "up"));
+    Vector3f up = readVector3f();
+    getToken(token);
+    assert (!strcmp(token, "size"));
+    float size = readFloat();
+    getToken(token);
+    assert (!strcmp(token, "width"));
+    int width = readInt();
+    getToken(token);
+    assert (!strcmp(token, "height"));
+    int height = readInt();
+    getToken(token);
+    assert (!strcmp(token, "}"));
+    camera = new OrthographicCamera(center, direction, up, width, height, size);
+}
+
 void SceneParser::parseBackground() {
     char token[MAX_PARSER_TOKEN_LENGTH];
+    char filename[MAX_PARSER_TOKEN_LENGTH] = "";
+    float scale = 1;
     // read in the background color
     getToken(token);
     assert (!strcmp(token, "{"));
@@ -167,11 +209,32 @@ void SceneParser::parseBackground() {
             break;
         } else if (!strcmp(token, "color")) {
             background_color = readVector3f();
+        } else if (!strcmp(token, "environment")) {
+            //an HDR equirectangular image, replaces the color
+            getToken(filename);
+        } else if (!strcmp(token, "scale")) {
+            //multiplies the radiance of the environment
+            scale = readFloat();
         } else {
             printf("Unknown token in parseBackground: '%s'\n", token);
             assert(0);
         }
     }
+    if (filename[0] != 0) {
+        delete environment;
+        environment = new EnvironmentMap(filename, scale);
+        if (!environment->valid()) {
+            delete environment;
+            environment = nullptr;
+        }
+    }
+}
+
+// ====================================================================
+// ====================================================================
+
+Vector3f SceneParser::getBackground(const Vector3f &d) const {
+    return environment != nullptr ? environment->Le(d) : background_color;
 }
 
 // ====================================================================
@@ -326,7 +389,12 @@ void SceneParser::parseMaterials() {
 
 Material *SceneParser::parseGIMaterial() {
     char token[MAX_PARSER_TOKEN_LENGTH];
+    char densityGrid[MAX_PARSER_TOKEN_LENGTH];
+    densityGrid[0] = 0;
     Vector3f diffuseColor(1, 1, 1), specularColor(0, 0, 0), emissionColor(0, 0, 0);
+    //medium of MEDIA and SUBSURFACE materials
+    Vector3f sigmaA(0, 0, 0), sigmaS(1, 1, 1);
+    float anisotropy = 0, meanFreePath = 0;
     BRDFType type = BRDFType::DIFFUSE;
     getToken(token);
     assert (!strcmp(token, "{"));
@@ -346,6 +414,20 @@ Material *SceneParser::parseGIMaterial() {
             type = BRDFType::REFRACTION;
         } else if(!strcmp(token, "EMISSION")){
             type = BRDFType::EMISSION;
+        } else if(!strcmp(token, "MEDIA")){
+            type = BRDFType::MEDIA;
+        } else if(!strcmp(token, "SUBSURFACE")){
+            type = BRDFType::SUBSURFACE;
+        } else if(!strcmp(token, "sigmaA")){
+            sigmaA = readVector3f();
+        } else if(!strcmp(token, "sigmaS")){
+            sigmaS = readVector3f();
+        } else if(!strcmp(token, "anisotropy")){
+            anisotropy = readFloat();
+        } else if(!strcmp(token, "meanFreePath")){
+            meanFreePath = readFloat();
+        } else if(!strcmp(token, "densityGrid")){
+            getToken(densityGrid);
         } else if(!strcmp(token, "}")){
             break;
         } else {
@@ -354,6 +436,20 @@ Material *SceneParser::parseGIMaterial() {
         }
     }
     auto *answer = new DiscreteMaterial(diffuseColor, specularColor, emissionColor, type);
+    if(type == BRDFType::MEDIA || type == BRDFType::SUBSURFACE) {
+        //meanFreePath: the coefficients from the diffuse color as the single scattering albedo
+        if(meanFreePath > 0) {
+            sigmaS = diffuseColor / meanFreePath;
+            sigmaA = (Vector3f(1, 1, 1) - diffuseColor) / meanFreePath;
+        }
+        if(densityGrid[0] != 0) {
+            std::unique_ptr<GridMedium> grid = GridMedium::load(densityGrid, sigmaA, sigmaS, anisotropy);
+            if(grid == nullptr) exit(0);
+            answer->setMedium(std::move(grid));
+        } else {
+            answer->setMedium(std::unique_ptr<Medium>(new HomogeneousMedium(sigmaA, sigmaS, anisotropy)));
+        }
+    }
     return answer;
 }
 
@@ -448,13 +544,6 @@ Group *SceneParser::parseGroup() {
         } else {
             Object3D *object = parseObject(token);
             assert (object != nullptr);
-            if(dynamic_cast<Curve*>(object) != nullptr) {
-                for(int i = 0; i < num_curves; i++) {
-                    object = curves[i];
-                    answer->addObject(count, object);
-                    count++;
-                }
-            }
             answer->addObject(count, object);
 
             count++;
@@ -607,7 +696,8 @@ Transform *SceneParser::parseTransform() {
 // ====================================================================
 // ====================================================================
 
-Curve* SceneParser::parseCurves(){
+Object3D* SceneParser::parseCurves(){
+    // every curve becomes one object, tessellated ones as meshes
     char token[MAX_PARSER_TOKEN_LENGTH];
     getToken(token);
     assert (!strcmp(token, "{"));
@@ -616,6 +706,7 @@ Curve* SceneParser::parseCurves(){
     assert (!strcmp(token, "numCurves"));
     num_curves = readInt();
     curves = std::vector<Curve *>(num_curves);
+    auto *answer = new Group(num_curves);
     // read in the objects
     int count = 0;
     while (num_curves > count) {
@@ -626,6 +717,7 @@ Curve* SceneParser::parseCurves(){
             assert (index >= 0 && index <= getNumMaterials());
             current_material = getMaterial(index);
         } else {
+            curve_tolerance = 0;
             if (!strcmp(token, "BezierCurve")) {
                 curves[count] = parseBezierCurve();
             } else if (!strcmp(token, "BSplineCurve")) {
@@ -640,12 +732,28 @@ Curve* SceneParser::parseCurves(){
                 printf("Unknown token in parseCurve: '%s'\n", token);
                 exit(0);
             }
+            Object3D *object = curves[count];
+            if (curve_tolerance > 0) {
+                object = curves[count]->tessellate(curve_tolerance);
+                assert (object != nullptr);
+            }
+            answer->addObject(count, object);
             count++;
         }
     }
     getToken(token);
     assert (!strcmp(token, "}"));
-    return curves.size() > 0 ? curves[0] : nullptr;
+    if (num_curves == 1) return answer->getObject(0);
+    return answer;
+}
+
+// optional "tessellate <tolerance>" before the closing brace of a curve, token gets the brace
+float SceneParser::parseTessellation(char token[MAX_PARSER_TOKEN_LENGTH]) {
+    getToken(token);
+    if (strcmp(token, "tessellate") != 0) return 0;
+    float tolerance = readFloat();
+    getToken(token);
+    return tolerance;
 }
 
 Curve *SceneParser::parseBezierCurve(){
@@ -655,15 +763,7 @@ Curve *SceneParser::parseBezierCurve(){
     getToken(token);
     assert (!strcmp(token, "controls"));
     std::vector<Vector3f> controls;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        if(!strcmp(token, "]")){
-            break;
-        }
-        Vector3f control = readVector3f();
-        controls.push_back(control);
-    }
+    readVector3fs(controls);
     getToken(token);
     assert (!strcmp(token, "axis"));
     getToken(token);
@@ -676,10 +776,10 @@ Curve *SceneParser::parseBezierCurve(){
     Vector3f point2 = readVector3f();
     getToken(token);
     assert (!strcmp(token, "}"));
-    getToken(token);
+    curve_tolerance = parseTessellation(token);
     assert (!strcmp(token, "}"));
 
-    return new BezierCurve(controls, point1, point2);
+    return new BezierCurve(controls, point1, point2, current_material);
 }
 
 Curve *SceneParser::parseBSplineCurve(){
@@ -689,31 +789,11 @@ Curve *SceneParser::parseBSplineCurve(){
     getToken(token);
     assert (!strcmp(token, "controls"));
     std::vector<Vector3f> controls;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        Vector3f control = readVector3f();
-        if(control.x() != control.x()){
-            break;
-        }
-        controls.push_back(control);
-    }
-    getToken(token);
-    assert (!strcmp(token, "]"));
+    readVector3fs(controls);
     getToken(token);
     assert (!strcmp(token, "knots"));
     std::vector<float> knots;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        float knot = readFloat();
-        if(knot != knot){
-            break;
-        }
-        knots.push_back(knot);
-    }
-    getToken(token);
-    assert (!strcmp(token, "]"));
+    readFloats(knots);
     getToken(token);
     assert (!strcmp(token, "axis"));
     getToken(token);
@@ -726,7 +806,7 @@ Curve *SceneParser::parseBSplineCurve(){
     Vector3f point2 = readVector3f();
     getToken(token);
     assert (!strcmp(token, "}"));
-    getToken(token);
+    curve_tolerance = parseTessellation(token);
     assert (!strcmp(token, "}"));
 
     return new BSplineCurve(controls, knots, point1, point2, current_material);
@@ -741,15 +821,7 @@ Curve *SceneParser::parseCatmullRomCurve(){
     getToken(token);
     assert (!strcmp(token, "controls"));
     std::vector<Vector3f> controls;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        if(!strcmp(token, "]")){
-            break;
-        }
-        Vector3f control = readVector3f();
-        controls.push_back(control);
-    }
+    readVector3fs(controls);
     getToken(token);
     assert (!strcmp(token, "tension"));
     float tension = readFloat();
@@ -765,10 +837,10 @@ Curve *SceneParser::parseCatmullRomCurve(){
     Vector3f point2 = readVector3f();
     getToken(token);
     assert (!strcmp(token, "}"));
-    getToken(token);
+    curve_tolerance = parseTessellation(token);
     assert (!strcmp(token, "}"));
 
-    return new CatmullRomCurve(controls, tension, point1, point2);
+    return new CatmullRomCurve(controls, tension, point1, point2, current_material);
 }
 
 Surface *SceneParser::parseBezierSurface(){
@@ -781,25 +853,19 @@ Surface *SceneParser::parseBezierSurface(){
     getToken(token);
     assert(!strcmp(token, "["));
     while (true) {
+        getToken(token);
         if(!strcmp(token, "]")){
             break;
         }
-        std::vector<Vector3f> row;
-        getToken(token);
         assert(!strcmp(token, "["));
-        while (true) {
-            if(!strcmp(token, "]")){
-                break;
-            }
-            Vector3f control = readVector3f();
-            row.push_back(control);
-        }
+        std::vector<Vector3f> row;
+        readVector3fs(row);
         controls.push_back(row);
     }
-    getToken(token);
+    curve_tolerance = parseTessellation(token);
     assert (!strcmp(token, "}"));
 
-    return new BezierSurface(controls);
+    return new BezierSurface(controls, current_material);
 }
 
 Surface *SceneParser::parseBSplineSurface(){
@@ -812,50 +878,28 @@ Surface *SceneParser::parseBSplineSurface(){
     getToken(token);
     assert(!strcmp(token, "["));
     while (true) {
+        getToken(token);
         if(!strcmp(token, "]")){
             break;
         }
-        std::vector<Vector3f> row;
-        getToken(token);
         assert(!strcmp(token, "["));
-        while (true) {
-            if(!strcmp(token, "]")){
-                break;
-            }
-            Vector3f control = readVector3f();
-            row.push_back(control);
-        }
+        std::vector<Vector3f> row;
+        readVector3fs(row);
         controls.push_back(row);
     }
     //get knots
     getToken(token);
     assert (!strcmp(token, "uknots"));
     std::vector<float> uknots;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        if(!strcmp(token, "]")){
-            break;
-        }
-        float knot = readFloat();
-        uknots.push_back(knot);
-    }
+    readFloats(uknots);
     getToken(token);
     assert (!strcmp(token, "vknots"));
     std::vector<float> vknots;
-    getToken(token);
-    assert(!strcmp(token, "["));
-    while (true) {
-        if(!strcmp(token, "]")){
-            break;
-        }
-        float knot = readFloat();
-        vknots.push_back(knot);
-    }
-    getToken(token);
+    readFloats(vknots);
+    curve_tolerance = parseTessellation(token);
     assert (!strcmp(token, "}"));
     
-    return new BSplineSurface(controls, uknots, vknots);
+    return new BSplineSurface(controls, uknots, vknots, current_material);
 }
 
 // ====================================================================
@@ -933,6 +977,32 @@ Vector3f SceneParser::readVector3f() {
 }
 
 
+// "[ x y z x y z ... ]", the opening bracket is read here unless a row of a net is read
+void SceneParser::readVector3fs(std::vector<Vector3f> &list) {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    float x, y, z;
+    int c = fgetc(file);
+    while (c != EOF && isspace(c)) c = fgetc(file);
+    if (c != '[') ungetc(c, file);
+    while (fscanf(file, "%f %f %f", &x, &y, &z) == 3) {
+        list.push_back(Vector3f(x, y, z));
+    }
+    getToken(token);
+    assert (!strcmp(token, "]"));
+}
+
+void SceneParser::readFloats(std::vector<float> &list) {
+    char token[MAX_PARSER_TOKEN_LENGTH];
+    float x;
+    getToken(token);
+    assert (!strcmp(token, "["));
+    while (fscanf(file, "%f", &x) == 1) {
+        list.push_back(x);
+    }
+    getToken(token);
+    assert (!strcmp(token, "]"));
+}
+
 float SceneParser::readFloat() {
     float answer;
     int count = fscanf(file, "%f", &answer);
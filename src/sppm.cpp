@@ -5,11 +5,36 @@
 #include "../include/scene_parser.hpp"
 #include "../include/classical_object.hpp"
 #include "../include/camera.hpp"
+#include "../include/film.hpp"
+#include "../include/emitter.hpp"
+#include "../include/light_sampler.hpp"
+#include "../include/environment.hpp"
+#include "../include/photon_guide.hpp"
+#include "../include/render_stats.hpp"
 #include <iostream>
 #include <memory>
 #include <vector>
 
-void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
+//shadow rays of the packet (its mask) blocked before the light, distance[s] away along ray s
+static int occluded(Group* group, RayPacket& packet, const float* distance, int count, bool rayPackets) {
+    Hit hits[RayPacket::SIZE];
+    int blocked = 0;
+    RenderStats::count(RenderStats::SHADOW_RAYS, __builtin_popcount(packet.mask));
+    if(rayPackets){
+        blocked = group->intersectPacket(packet, hits, EPS);
+    }else{
+        for(int s = 0; s < count; s ++){
+            if((packet.mask >> s & 1) && group->intersect(packet.ray(s), hits[s], EPS)) blocked |= 1 << s;
+        }
+    }
+    //only hits clearly before the light block
+    for(int s = 0; s < count; s ++){
+        if((blocked >> s & 1) && hits[s].getT() >= distance[s] * (1 - 1e-3f)) blocked &= ~(1 << s);
+    }
+    return blocked;
+}
+
+void SPPMIntegrator::render(const SceneParser& scene, Film& film) {
     std::cout
             << "\npixel nums: " << PixelMap.size()
             << "\niteration nums: " << iteration
@@ -22,149 +47,367 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
     std::vector<Light*> lights = scene.getLights();
     Group* group = scene.getGroup();
     Camera* cam = scene.getCamera();
+    //photons leave the lights in proportion to their power, direct lighting of many lights picks some by a light BVH
+    Vector3f sceneCenter;
+    float sceneRadius = visibleRadius(cam, group, &sceneCenter);
+    LightSampler lightSampler(lights, sceneRadius);
+    //emissive spheres and triangles and the environment map light the scene as well: sampled directly at diffuse
+    //hits, and photons leave the emitters, the environment and the lights in proportion to their power
+    const EmitterSampler* emitters = scene.getEmitters();
+    const EnvironmentMap* environment = scene.getEnvironment();
+    enum { EMITTERS, ENVIRONMENT, LIGHTS };
+    bool hasSource[3] = {!emitters->empty(), environment != nullptr, !lights.empty()};
+    float sourcePower[3] = {emitters->totalPower(), environment != nullptr ? environment->power(sceneRadius) : 0, lightSampler.totalPower()};
+    float share[3], allPower = 0;
+    int numSources = 0;
+    for(int k = 0; k < 3; k ++){
+        if(!hasSource[k]) sourcePower[k] = 0;
+        allPower += sourcePower[k];
+        numSources += hasSource[k];
+    }
+    for(int k = 0; k < 3; k ++){
+        share[k] = allPower > 0 ? sourcePower[k] / allPower : numSources > 0 ? hasSource[k] / float(numSources) : 0;
+    }
     //Group* photonGroup = new Group();
     /* for(int i = 0; i < cam->getWidth() * cam->getHeight(); i ++){
         PixelMap.push_back(SPPMPixel());
     } */
+    //one photon from the emitters, the environment or the lights, false if the sample carries nothing
+    auto emitPhoton = [&](unsigned short* Xi, Ray& ray, Vector3f& throughput){
+        //a light in proportion to its power, the photon carries its flux over the probability of the choice
+        double u = erand48(Xi);
+        if(u < share[EMITTERS]){
+            //a point on the emissive geometry and a cosine weighted direction; the gather below takes the albedo
+            //as the BRDF (no 1 / pi), so the photon carries flux / pi
+            float pdfPoint, pdfDirection;
+            Vector3f p, n;
+            const EmissiveShape& shape = emitters->sample(erand48(Xi), erand48(Xi), erand48(Xi), p, n, pdfPoint);
+            Vector3f w = shape.sampleDirection(n, erand48(Xi), erand48(Xi), erand48(Xi), pdfDirection);
+            if(!(pdfPoint > 0 && pdfDirection > 0)) return false;
+            ray = Ray(p, w);
+            throughput = shape.emission * (std::fabs(Vector3f::dot(w, n)) / (M_PI * pdfPoint * pdfDirection * share[EMITTERS]));
+        }else if(u < share[EMITTERS] + share[ENVIRONMENT]){
+            //a direction from the environment map, then a point on the disk facing it just outside of the visible
+            //scene; flux / pi as the emitters
+            Vector3f w;
+            float pdfDirection;
+            Vector3f Le = environment->sample(erand48(Xi), erand48(Xi), erand48(Xi), w, pdfDirection);
+            if(!(pdfDirection > 0)) return false;
+            Vector3f a = Vector3f::cross(std::fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0), w).normalized(), b = Vector3f::cross(w, a);
+            double r = sceneRadius * sqrt(erand48(Xi)), phi = 2 * M_PI * erand48(Xi);
+            ray = Ray(sceneCenter + w * sceneRadius + a * (r * cos(phi)) + b * (r * sin(phi)), -w);
+            throughput = Le * (sceneRadius * sceneRadius / (pdfDirection * share[ENVIRONMENT]));
+        }else{
+            float lightPmf;
+            float rest = share[LIGHTS];
+            Light* light = rest > 0 ? lightSampler.samplePhoton(std::min(0.999999, (u - share[EMITTERS] - share[ENVIRONMENT]) / rest), lightPmf) : nullptr;
+            if(light == nullptr || lightPmf == 0) return false;
+            //flux / pi as the emitters, distant lights from the disk the environment map uses
+            LightSample e;
+            if(light->sampleEmission(erand48(Xi), erand48(Xi), erand48(Xi), erand48(Xi), sceneCenter, sceneRadius, e)){
+                ray = Ray(e.p, e.w);
+                throughput = e.Le * (std::fabs(Vector3f::dot(e.n, e.w)) / (M_PI * e.pdfPosition * e.pdfDirection * lightPmf * rest));
+                return true;
+            }
+            Photon photon = light->emitPhotonSampler();
+            ray = Ray(photon.p, photon.wi);
+            throughput = photon.alpha / (lightPmf * rest);
+        }
+        return true;
+    };
+    //photon emission guided towards the visible points, learned over the passes
+    PhotonGuide guide(sceneCenter, sceneRadius);
     PixelMap = std::vector<SPPMPixel>(cam->getWidth() * cam->getHeight(), SPPMPixel(sharedRadius));
+    //first hits of the camera rays of the first iteration
+    std::vector<AOVSample> aovs(film.hasAOVs() ? PixelMap.size() : 0);
     int numProcs = omp_get_num_procs();
     for(int iter = 0; iter < iteration; iter ++){
         //distributed ray tracing
         std::cout << "iteration " << iter << std::endl;
 
+        //camera rays of RayPacket::SIZE consecutive pixels are intersected as one packet,
+        //the bounces after the first hit are traced one by one
+        int numPackets = (PixelMap.size() + RayPacket::SIZE - 1) / RayPacket::SIZE;
         #pragma omp parallel for schedule(dynamic, 1)
-        for(int i = 0; i < PixelMap.size(); i ++){
-            //printf("\rray tracing progress: %.2f%%", (float)i / (float)PixelMap.size() * 100);
-            auto& pixel = PixelMap[i];
-            pixel.hasHit = false;
-            pixel.radius = iter == 0 ? sharedRadius : pixel.radius;
-            //generate ray
-            unsigned short Xi[3] = {0, 0, i * i * i};
-            double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-            double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-                        
-            Vector2f xy = Vector2f(i % cam->getWidth() + dx / 4 + 0.5, i / cam->getWidth() + dy / 4 + 0.5);
-            Ray ray = cam->generateRay(xy);
-            Hit hit;
-            //std::cout << "ray: " << ray << std::endl;
-            //ray tracing
-            //bounce until hit diffuse surface or reach max depth
-            Vector3f throughput = Vector3f(1, 1, 1);
-            int currentDepth = 0;
+        for(int packetIndex = 0; packetIndex < numPackets; packetIndex ++){
+            int begin = packetIndex * RayPacket::SIZE;
+            int lanes = std::min<int>(RayPacket::SIZE, PixelMap.size() - begin);
+            unsigned short Xis[RayPacket::SIZE][3];
+            float sampleX[RayPacket::SIZE], sampleY[RayPacket::SIZE], lensU[RayPacket::SIZE], lensV[RayPacket::SIZE];
+            for(int lane = 0; lane < lanes; lane ++){
+                int i = begin + lane;
+                //printf("\rray tracing progress: %.2f%%", (float)i / (float)PixelMap.size() * 100);
+                auto& pixel = PixelMap[i];
+                pixel.hasHit = false;
+                pixel.radius = iter == 0 ? sharedRadius : pixel.radius;
+                //generate ray
+                unsigned short* Xi = Xis[lane];
+                //a new sequence every iteration, otherwise the iterations repeat the same samples
+                Xi[0] = 0; Xi[1] = iter; Xi[2] = i * i * i;
+                double r1 = 2 * erand48(Xi), dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+                double r2 = 2 * erand48(Xi), dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
 
-            while(true){
-                if(!group->intersect(ray, hit, EPS)) break;
-                //std::cout << "hit: " << hit << std::endl;
-                Material* material = hit.getMaterial();
-                Vector3f hitPoint = ray.pointAtParameter(hit.getT());
-                Vector3f normal = hit.getNormal();
-                Vector3f wo = -ray.getDirection();
-                //std::cout << "hit point: " << hitPoint << std::endl;
+                sampleX[lane] = i % cam->getWidth() + dx / 4 + 0.5;
+                sampleY[lane] = i / cam->getWidth() + dy / 4 + 0.5;
+                //every camera ray takes its own point on the lens
+                lensU[lane] = cam->hasDOF() ? erand48(Xi) : 0.5;
+                lensV[lane] = cam->hasDOF() ? erand48(Xi) : 0.5;
+            }
+            RayBatch camRays;
+            cam->generateRays(sampleX, sampleY, lensU, lensV, lanes, camRays);
+            RayPacket packet;
+            camRays.load(0, lanes, packet);
+            RenderStats::count(RenderStats::PRIMARY_RAYS, lanes);
+            Hit hits[RayPacket::SIZE];
+            int hitMask = 0;
+            if(rayPackets){
+                hitMask = group->intersectPacket(packet, hits, EPS);
+            }else{
+                for(int lane = 0; lane < lanes; lane ++){
+                    if(group->intersect(packet.ray(lane), hits[lane], EPS)) hitMask |= 1 << lane;
+                }
+            }
+            for(int lane = 0; lane < lanes; lane ++){
+                auto& pixel = PixelMap[begin + lane];
+                unsigned short* Xi = Xis[lane];
+                Ray ray = packet.ray(lane);
+                Hit& hit = hits[lane];
+                //std::cout << "ray: " << ray << std::endl;
+                //ray tracing
+                //bounce until hit diffuse surface or reach max depth
+                Vector3f throughput = Vector3f(1, 1, 1);
+                int currentDepth = 0;
+                bool primary = true;
 
-            
-                DiscreteMaterial *m = dynamic_cast<DiscreteMaterial*>(material);
-                if(m != nullptr){
-                    if(m->getMaterialType() == BRDFType::DIFFUSE){
-                        //direct lighting
-                        for(auto light : lights){
-                            Vector3f dirToLight, col;
-                            light->getIllumination(hitPoint, dirToLight, col);
-                            Ray shadowRay = Ray(hitPoint, dirToLight);
-                            Hit shadowHit;
-                            if(!group->intersect(shadowRay, shadowHit, EPS) || shadowHit.getT() > Vector3f::dot(dirToLight, dirToLight)){
-                                pixel.Ld += throughput * col * m->getDiffuseColor() ;
-                            }
-                        }
-                        //indirect lighting
-                        pixel.hasHit = true;
-                        pixel.vp = SPPMPixel::VisiblePoint(hitPoint, normal, wo, m, throughput);
-                        //sample new direction
-                        //cosine weighted hemisphere sampling
-                        double r1 = 2 * M_PI * erand48(Xi), r2 = erand48(Xi), r2s = sqrt(r2);
-                        Vector3f w = normal, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),  w)).normalized(), v = Vector3f::cross(w, u);
-                        Vector3f newDirection = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).normalized();
-                        ray = Ray(hitPoint, newDirection);
-                        throughput *= m->getDiffuseColor() ;
-                        currentDepth ++;
-                        //Russian Roulette
-                        if(currentDepth > depth){
+                while(true){
+                    if(!primary) RenderStats::count(RenderStats::SECONDARY_RAYS);
+                    //the camera ray's hit comes from the packet
+                    if(primary){
+                        primary = false;
+                        if(!(hitMask >> lane & 1)){
+                            pixel.Ld += scene.getBackground(ray.getDirection());
                             break;
                         }
-                    
-                    }else if(m->getMaterialType() == BRDFType::SPECULAR){
-                        //specular reflection
-                        Vector3f wi = normal * (2 * Vector3f::dot(normal, wo)) - wo;
-                        throughput *= m->getDiffuseColor() ;
-                        ray = Ray(hitPoint, wi);
-                        currentDepth ++;
-                        if(currentDepth > depth){
+                        if(iter == 0 && !aovs.empty()){
+                            AOVSample& aov = aovs[begin + lane];
+                            aov.albedo = hit.getMaterial()->getDiffuseColor();
+                            aov.normal = hit.getNormal().normalized();
+                            aov.depth = hit.getT();
+                        }
+                    }else{
+                        //intersect only keeps hits nearer than the one it is given, every bounce starts anew
+                        hit = Hit();
+                        if(!group->intersect(ray, hit, EPS)){
+                            pixel.Ld += throughput * scene.getBackground(ray.getDirection());
                             break;
                         }
-                    }else if(m->getMaterialType() == BRDFType::REFRACTION){
-                        Vector3f nl = Vector3f::dot(normal, wo) < 0 ? normal : normal * -1;
-                        bool into = Vector3f::dot(normal, nl) > 0;
-                        Vector3f reflectionDirection = (- wo + normal * 2 * Vector3f::dot(normal, wo)).normalized();
-                        double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = Vector3f::dot(wo, nl), cos2t;
-                        if((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0){
-                            ray = Ray(hitPoint, reflectionDirection);
-                            throughput *= m->getDiffuseColor();
-                            currentDepth ++;
-                        }else{
-                            Vector3f refractDirection = (-wo * nnt - normal * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
-                            double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractDirection, normal));
-                            double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = 0.25 + 0.5 * Re, RP = Re / P, TP = Tr / (1 - P);
+                    }
+                    //std::cout << "hit: " << hit << std::endl;
+                    Material* material = hit.getMaterial();
+                    Vector3f hitPoint = ray.pointAtParameter(hit.getT());
+                    Vector3f normal = hit.getNormal();
+                    Vector3f wo = -ray.getDirection();
+                    //std::cout << "hit point: " << hitPoint << std::endl;
+
+            
+                    DiscreteMaterial *m = dynamic_cast<DiscreteMaterial*>(material);
+                    if(m != nullptr){
+                        pixel.Ld += throughput * m->getEmissionColor();
+                        if(m->getMaterialType() == BRDFType::DIFFUSE){
+                            //direct lighting
+                            //up to RayPacket::SIZE lights: all of them; more: RayPacket::SIZE of them chosen by the light BVH
+                            //(stratified), each weighted by 1 / (its probability * RayPacket::SIZE)
+                            //the shadow rays start together as one packet
+                            //the lights the bidirectional renderers sample (Light::type) give radiance, the Lambert BRDF
+                            //albedo / pi and the cosine at the surface apply to them; the others keep their shading
+                            Vector3f nl = Vector3f::dot(normal, wo) > 0 ? normal.normalized() : -normal.normalized();
+                            bool sampled = lights.size() > RayPacket::SIZE;
+                            int numShadow = sampled ? RayPacket::SIZE : lights.size();
+                            RayPacket shadowPacket;
+                            Vector3f dirToLight[RayPacket::SIZE], col[RayPacket::SIZE];
+                            float distance[RayPacket::SIZE];
+                            for(int s = 0; s < numShadow; s ++){
+                                Light* light = sampled ? nullptr : lights[s];
+                                float weight = 1;
+                                if(sampled){
+                                    float pmf;
+                                    light = lightSampler.sampleDirect(hitPoint, normal.normalized(), (s + erand48(Xi)) / numShadow, pmf);
+                                    if(light == nullptr) continue;
+                                    weight = 1 / (pmf * numShadow);
+                                }
+                                light->getIllumination(hitPoint, dirToLight[s], col[s], distance[s]);
+                                if(light->type() != Light::NONE) weight *= std::max(0.0f, Vector3f::dot(nl, dirToLight[s])) / float(M_PI);
+                                col[s] = col[s] * weight;
+                                shadowPacket.set(s, Ray(hitPoint, dirToLight[s]));
+                            }
+                            int blocked = occluded(group, shadowPacket, distance, numShadow, rayPackets);
+                            for(int s = 0; s < numShadow; s ++){
+                                if((shadowPacket.mask >> s & 1) && !(blocked >> s & 1)){
+                                    pixel.Ld += throughput * col[s] * m->getDiffuseColor() ;
+                                }
+                            }
+                            //the emissive geometry: RayPacket::SIZE points (EmitterSampler::sampleDirect, stratified over
+                            //the emitters), each weighted by 1 / RayPacket::SIZE
+                            if(!emitters->empty()){
+                                RayPacket emitterPacket;
+                                Vector3f Le[RayPacket::SIZE];
+                                for(int s = 0; s < RayPacket::SIZE; s ++){
+                                    Vector3f q, nq;
+                                    float pdf;
+                                    const EmissiveShape& shape = emitters->sampleDirect(hitPoint, (s + erand48(Xi)) / RayPacket::SIZE, erand48(Xi), erand48(Xi), q, nq, pdf);
+                                    Vector3f w = q - hitPoint;
+                                    distance[s] = w.length();
+                                    if(!(pdf > 0) || distance[s] == 0) continue;
+                                    w = w / distance[s];
+                                    float cosSurface = Vector3f::dot(nl, w), cosLight = -Vector3f::dot(nq, w);
+                                    if(cosSurface <= 0 || cosLight == 0 || (!shape.twoSided && cosLight < 0)) continue;
+                                    Le[s] = shape.emission * (cosSurface / (M_PI * pdf * RayPacket::SIZE));
+                                    emitterPacket.set(s, Ray(hitPoint, w));
+                                }
+                                blocked = occluded(group, emitterPacket, distance, RayPacket::SIZE, rayPackets);
+                                for(int s = 0; s < RayPacket::SIZE; s ++){
+                                    if((emitterPacket.mask >> s & 1) && !(blocked >> s & 1)){
+                                        pixel.Ld += throughput * Le[s] * m->getDiffuseColor();
+                                    }
+                                }
+                            }
+                            //the environment map: RayPacket::SIZE directions from its distribution, as the emitters
+                            if(environment != nullptr){
+                                RayPacket environmentPacket;
+                                Vector3f Le[RayPacket::SIZE];
+                                for(int s = 0; s < RayPacket::SIZE; s ++){
+                                    Vector3f w;
+                                    float pdf;
+                                    Le[s] = environment->sample((s + erand48(Xi)) / RayPacket::SIZE, erand48(Xi), erand48(Xi), w, pdf);
+                                    distance[s] = 1e30f;
+                                    float cosSurface = Vector3f::dot(nl, w);
+                                    if(!(pdf > 0) || cosSurface <= 0) continue;
+                                    Le[s] = Le[s] * (cosSurface / (M_PI * pdf * RayPacket::SIZE));
+                                    environmentPacket.set(s, Ray(hitPoint, w));
+                                }
+                                blocked = occluded(group, environmentPacket, distance, RayPacket::SIZE, rayPackets);
+                                for(int s = 0; s < RayPacket::SIZE; s ++){
+                                    if((environmentPacket.mask >> s & 1) && !(blocked >> s & 1)){
+                                        pixel.Ld += throughput * Le[s] * m->getDiffuseColor();
+                                    }
+                                }
+                            }
+                            //indirect lighting: the photons arriving around the visible point
+                            pixel.hasHit = true;
+                            pixel.vp = SPPMPixel::VisiblePoint(hitPoint, normal, wo, m, throughput);
+                            break;
+                        }else if(m->getMaterialType() == BRDFType::SPECULAR){
+                            //specular reflection
+                            Vector3f wi = normal * (2 * Vector3f::dot(normal, wo)) - wo;
+                            throughput *= m->getDiffuseColor() ;
+                            ray = Ray(hitPoint, wi);
                             currentDepth ++;
                             if(currentDepth > depth){
-                                if(erand48(Xi) < P){
-                                    throughput *= 2 * RP;
-                                    ray = Ray(hitPoint, reflectionDirection);   
-                                }else{
-                                    throughput *= 2 * TP;
-                                    ray = Ray(hitPoint, refractDirection);
+                                break;
+                            }
+                        }else if(m->getMaterialType() == BRDFType::REFRACTION){
+                            //the same as the photons: wi is the direction the ray travels, the side it comes from decides into
+                            Vector3f wi = -wo;
+                            Vector3f nl = Vector3f::dot(normal, wi) < 0 ? normal : normal * -1;
+                            bool into = Vector3f::dot(normal, nl) > 0;
+                            Vector3f reflectionDirection = (wi - normal * 2 * Vector3f::dot(normal, wi)).normalized();
+                            double nc = 1, nt = 1.5, nnt = into ? nc / nt : nt / nc, ddn = Vector3f::dot(wi, nl), cos2t;
+                            if((cos2t = 1 - nnt * nnt * (1 - ddn * ddn)) < 0){
+                                ray = Ray(hitPoint, reflectionDirection);
+                                throughput *= m->getDiffuseColor();
+                                currentDepth ++;
+                                //total internal reflection may go on forever, it ends as the mirrors
+                                if(currentDepth > depth){
+                                    break;
                                 }
                             }else{
-                                Ray reflectionRay = Ray(hitPoint, reflectionDirection);
-                                Ray refractRay = Ray(hitPoint, refractDirection);
-                                if(erand48(Xi) < 0.5f){
-                                    throughput *= Re;
-                                    ray = reflectionRay;
+                                Vector3f refractDirection = (wi * nnt - normal * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
+                                double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractDirection, normal));
+                                double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = 0.25 + 0.5 * Re, RP = Re / P, TP = Tr / (1 - P);
+                                //the glass tints both lobes, as in the path tracer
+                                throughput *= m->getDiffuseColor();
+                                currentDepth ++;
+                                if(currentDepth > depth){
+                                    if(erand48(Xi) < P){
+                                        throughput *= RP;
+                                        ray = Ray(hitPoint, reflectionDirection);   
+                                    }else{
+                                        throughput *= TP;
+                                        ray = Ray(hitPoint, refractDirection);
+                                    }
                                 }else{
-                                    throughput *= Tr;
-                                    ray = refractRay;
+                                    Ray reflectionRay = Ray(hitPoint, reflectionDirection);
+                                    Ray refractRay = Ray(hitPoint, refractDirection);
+                                    if(erand48(Xi) < 0.5f){
+                                        throughput *= 2 * Re;
+                                        ray = reflectionRay;
+                                    }else{
+                                        throughput *= 2 * Tr;
+                                        ray = refractRay;
+                                    }
                                 }
                             }
+                        }else if(m->getMaterialType() == BRDFType::EMISSION){
+                            //a light only, its emission is counted above
+                            break;
+                        }else{
+                            std::cout << "Unsupported material" << std::endl;
+                            exit(-1);
                         }
-                    }else{
-                        std::cout << "Unsupported material" << std::endl;
-                        exit(-1);
-                    }
-                }else {
-                    EmpiricalMaterial *m1 = dynamic_cast<EmpiricalMaterial*>(material);
-                    if(m1 != nullptr){
+                    }else {
+                        EmpiricalMaterial *m1 = dynamic_cast<EmpiricalMaterial*>(material);
+                        if(m1 != nullptr){
 
-                    }else{
-                        std::cout << "Unsupported material" << std::endl;
-                        exit(-1);
+                        }else{
+                            std::cout << "Unsupported material" << std::endl;
+                            exit(-1);
+                        }
                     }
                 }
             }
-
         }
         printf("\n");
         //photon tracing
+        //photons that reached a visible point, counted when guiding
+        int usefulPhotons = 0;
         #pragma omp parallel for schedule(dynamic, 1)
         for(int i = 0; i < photonCount; i++){
             //printf("\rphoton tracing progress: %.2f%%", (float)i / (float)photonCount * 100);
-            unsigned short Xi[3] = {0, 0, i * i * i};
-            int lightIndex = int(erand48(Xi) * lights.size());
-            Light* light = lights[lightIndex];
-            Photon photon = light->emitPhotonSampler();
-            Ray ray = Ray(photon.p, photon.wi);
-            Hit hit;
-            Vector3f throughput = photon.alpha ;
+            unsigned short Xi[3] = {0, (unsigned short)iter, (unsigned short)(i * i * i)};
+            Ray ray(Vector3f::ZERO, Vector3f::ZERO);
+            Vector3f throughput;
+            int bin = -1;
+            if(!photonGuiding){
+                if(!emitPhoton(Xi, ray, throughput)) continue;
+            }else{
+                //resampling: one of the candidates in proportion to flux * importance
+                float weightSum = 0, chosenWeight = 0;
+                for(int c = 0; c < PhotonGuide::CANDIDATES; c ++){
+                    Ray candidate(Vector3f::ZERO, Vector3f::ZERO);
+                    Vector3f flux;
+                    if(!emitPhoton(Xi, candidate, flux)) continue;
+                    int candidateBin = guide.bin(candidate.getOrigin(), candidate.getDirection());
+                    float weight = luminance(flux) * guide.importance(candidateBin);
+                    if(!(weight > 0)) continue;
+                    weightSum += weight;
+                    if(erand48(Xi) * weightSum < weight){
+                        ray = candidate;
+                        throughput = flux;
+                        bin = candidateBin;
+                        chosenWeight = weight;
+                    }
+                }
+                if(bin < 0) continue;
+                throughput = throughput * (weightSum / (PhotonGuide::CANDIDATES * chosenWeight));
+            }
+            //what the photon adds to the visible points, over its flux
+            float emitted = luminance(throughput), found = 0;
             int currentDepth = 0;
 
+            RenderStats::count(RenderStats::PHOTONS);
             while(true){
+                RenderStats::count(RenderStats::PHOTON_RAYS);
+                Hit hit;
                 if(!group->intersect(ray, hit, EPS)) break;
                 Material* material = hit.getMaterial();
                 Vector3f hitPoint = ray.pointAtParameter(hit.getT());
@@ -173,18 +416,24 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
                 DiscreteMaterial *m = dynamic_cast<DiscreteMaterial*>(material);
                 if(m!=nullptr){
                     if(m->getMaterialType() == BRDFType::DIFFUSE){
-                        for(auto& pixel : PixelMap){
-                            if(pixel.hasHit){
-                                if((hitPoint - pixel.vp.p).length() < pixel.radius){
-                                    pixel.tau += throughput * m->getDiffuseColor();
-                                    pixel.vp.cnt ++;
+                        //the first hit is direct lighting, the visible points have it already (Ld)
+                        if(currentDepth > 0){
+                            for(auto& pixel : PixelMap){
+                                if(pixel.hasHit){
+                                    if((hitPoint - pixel.vp.p).length() < pixel.radius){
+                                        //the BRDF of the visible point, weighted by the camera path up to it
+                                        Vector3f contribution = pixel.vp.beta * throughput * pixel.vp.m->getDiffuseColor();
+                                        pixel.tau += contribution;
+                                        pixel.vp.cnt ++;
+                                        found += luminance(contribution) / (pixel.radius * pixel.radius);
+                                    }
                                 }
                             }
                         }
                         //sample new direction
-                        //cosine weighted hemisphere sampling
+                        //cosine weighted hemisphere sampling, on the side the photon arrives from
                         double r1 = 2 * M_PI * erand48(Xi), r2 = erand48(Xi), r2s = sqrt(r2);
-                        Vector3f w = normal, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),  w)).normalized(), v = Vector3f::cross(w, u);
+                        Vector3f w = Vector3f::dot(normal, wi) < 0 ? normal : -normal, u = (Vector3f::cross((fabs(w.x()) > 0.1 ? Vector3f(0, 1, 0) : Vector3f(1, 0, 0)),  w)).normalized(), v = Vector3f::cross(w, u);
                         Vector3f newDirection = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2)).normalized();
                         ray = Ray(hitPoint, newDirection);
                         throughput *= m->getDiffuseColor() ;
@@ -211,10 +460,15 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
                             ray = Ray(hitPoint, reflectionDirection);
                             throughput *= m->getDiffuseColor();
                             currentDepth ++;
+                            //total internal reflection may go on forever, it ends as the mirrors
+                            if(currentDepth > depth){
+                                break;
+                            }
                         }else{
                             Vector3f refractDirection = (wi * nnt - normal * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
                             double a = nt - nc, b = nt + nc, R0 = a * a / (b * b), c = 1 - (into ? -ddn : Vector3f::dot(refractDirection, normal));
                             double Re = R0 + (1 - R0) * c * c * c * c * c, Tr = 1 - Re, P = 0.25 + 0.5 * Re, RP = Re / P, TP = Tr / (1 - P);
+                            throughput *= m->getDiffuseColor();
                             currentDepth ++;
                             if(currentDepth > depth){
                                 if(erand48(Xi) < P){
@@ -236,6 +490,9 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
                                 }
                             }
                         }
+                    }else{
+                        //absorbed (emitters and the materials SPPM does not trace)
+                        break;
                     }
                 }else{
                     EmpiricalMaterial *m1 = dynamic_cast<EmpiricalMaterial*>(material);
@@ -247,7 +504,13 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
                     }
                 }
             }
+            if(photonGuiding && found > 0){
+                #pragma omp atomic
+                usefulPhotons ++;
+            }
+            if(bin >= 0 && emitted > 0) guide.record(bin, found / emitted);
         }
+        if(photonGuiding) guide.update();
 
         //update pixel map
         #pragma omp parallel for schedule(dynamic, 1)
@@ -260,22 +523,27 @@ void SPPMIntegrator::render(const SceneParser& scene, RgbImage *&image) {
             pixel.vp = SPPMPixel::VisiblePoint();
         }
 
-        std::cout << "iteration " << iter << " finished" << std::endl;
+        std::cout << "iteration " << iter << " finished";
+        if(photonGuiding) std::cout << ", useful photons: " << 100.0 * usefulPhotons / photonCount << "%";
+        std::cout << std::endl;
         std::cout << "pixel radius: " << PixelMap[0].radius << std::endl;
         std::cout << "pixel n: " << PixelMap[0].n << std::endl;
         std::cout << "pixel tau: " << PixelMap[0].tau << std::endl;
 
     }
     std::cout << "rendering finished" << std::endl;
-    //write image
+    //write film
     for(int i = 0; i < cam->getWidth(); i ++){
         for(int j = 0; j < cam->getHeight(); j ++){
             int index = j * cam->getWidth() + i;
             auto pixel = PixelMap[index];
             Vector3f color = pixel.tau / (M_PI * pixel.radius * pixel.radius * photonCount * iteration) + pixel.Ld / (iteration);
-            color = clamp(color);
-            //std::cout << "color: " << color * 255 << std::endl;
-            image->SetPixel(i, cam->getHeight() - j - 1, color * 255);
+            film.setPixel(i, j, color);
+            if(!aovs.empty()){
+                aovs[index].direct = pixel.Ld / (iteration);
+                aovs[index].indirect = color - aovs[index].direct;
+                film.addAOVSample(i, j, aovs[index]);
+            }
         }
     }
 
@@ -0,0 +1,40 @@
+#include <algorithm>
+#include <iostream>
+
+#include "../include/tessellation.hpp"
+
+namespace tessellation {
+
+Mesh* gridMesh(int rows, int cols, std::vector<Vector3f>& points, std::vector<Vector3f>& normals,
+               std::vector<Vector2f>& texCoords, Material* material) {
+    std::vector<TriangleIndices> triangles;
+    triangles.reserve(2 * (rows - 1) * (cols - 1));
+    auto addTriangle = [&](int a, int b, int c) {
+        if(Vector3f::cross(points[b] - points[a], points[c] - points[a]).squaredLength() <= 0) return;
+        TriangleIndices t;
+        int corners[3] = {a, b, c};
+        for(int k = 0; k < 3; k++) {
+            t.v[k] = corners[k];
+            t.n[k] = corners[k];
+            t.uv[k] = corners[k];
+        }
+        t.material = -1;
+        triangles.push_back(t);
+    };
+    for(int i = 0; i + 1 < rows; i++) {
+        for(int j = 0; j + 1 < cols; j++) {
+            int a = i * cols + j, b = a + 1, c = a + cols, d = c + 1;
+            if((points[d] - points[a]).squaredLength() <= (points[c] - points[b]).squaredLength()) {
+                addTriangle(a, b, d);
+                addTriangle(a, d, c);
+            } else {
+                addTriangle(a, b, c);
+                addTriangle(b, d, c);
+            }
+        }
+    }
+    std::cout << "Tessellated into " << rows << " x " << cols << " vertices, " << triangles.size() << " triangles" << std::endl;
+    return new Mesh(points, normals, texCoords, triangles, material, true);
+}
+
+}
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sys/mman.h>
+
+#include "../include/texture_cache.hpp"
+#include "../include/stb_image.h"
+
+namespace {
+//direct-mapped table of the tiles a thread touched recently
+//a slot keeps its tile alive even if the shared cache evicts it meanwhile,
+//TextureCache::registerThread reserves PINNED_BYTES of the budget for that
+struct LocalSlot {
+    CachedImage* image = nullptr;
+    int tile = -1;
+    std::shared_ptr<const std::vector<unsigned char>> texels;
+};
+
+struct LocalTable {
+    static const int SIZE = 64;
+    //largest tile is TILE_SIZE^2 rgb texels
+    static const size_t PINNED_BYTES = size_t(SIZE) * TextureCache::TILE_SIZE * TextureCache::TILE_SIZE * 3;
+    LocalSlot slots[SIZE];
+    std::shared_ptr<TextureCache::ThreadStats> stats;
+};
+
+thread_local LocalTable localTable;
+}
+
+// CachedImage
+
+CachedImage::~CachedImage() {
+    if(backing != nullptr) munmap(const_cast<unsigned char*>(backing), backingSize);
+}
+
+int CachedImage::Width() {
+    std::call_once(infoFlag, [this] { loadInfo(); });
+    return width;
+}
+
+int CachedImage::Height() {
+    std::call_once(infoFlag, [this] { loadInfo(); });
+    return height;
+}
+
+void CachedImage::loadInfo() {
+    int comp = 0;
+    if(!stbi_info(path.c_str(), &width, &height, &comp)) {
+        printf("load image failed: %s\n", path.c_str());
+        //a single black texel keeps lookups well defined
+        width = 1;
+        height = 1;
+    }
+    tilesX = (width + TextureCache::TILE_SIZE - 1) / TextureCache::TILE_SIZE;
+    tilesY = (height + TextureCache::TILE_SIZE - 1) / TextureCache::TILE_SIZE;
+    tiles.resize(tilesX * tilesY);
+    lruPosition.resize(tilesX * tilesY);
+}
+
+const unsigned char* CachedImage::texel(int x, int y) {
+    std::call_once(infoFlag, [this] { loadInfo(); });
+    assert(x >= 0 && x < width);
+    assert(y >= 0 && y < height);
+    const int TILE = TextureCache::TILE_SIZE;
+    int tx = x / TILE, ty = y / TILE;
+    int tile = ty * tilesX + tx;
+
+    LocalTable& table = localTable;
+    if(!table.stats) table.stats = TextureCache::instance().registerThread();
+    TextureCache::ThreadStats::add(table.stats->lookups);
+    LocalSlot& slot = table.slots[(id * 31 + tile) & (LocalTable::SIZE - 1)];
+    if(slot.image == this && slot.tile == tile) {
+        TextureCache::ThreadStats::add(table.stats->localHits);
+    } else {
+        slot.texels = TextureCache::instance().fetchTile(this, tile);
+        slot.image = this;
+        slot.tile = tile;
+    }
+    int tileWidth = std::min(TILE, width - tx * TILE);
+    return slot.texels->data() + ((y - ty * TILE) * tileWidth + (x - tx * TILE)) * channels;
+}
+
+Vector3f CachedImage::GetPixel(int x, int y) {
+    const unsigned char* t = texel(x, y);
+    if(channels < 3) return Vector3f(t[0], t[0], t[0]);
+    return Vector3f(t[0], t[1], t[2]);
+}
+
+float CachedImage::GetGray(int x, int y) {
+    return texel(x, y)[0];
+}
+
+// TextureCache
+
+TextureCache& TextureCache::instance() {
+    static TextureCache cache;
+    return cache;
+}
+
+CachedImage* TextureCache::acquire(const std::string& path, int channels) {
+    //canonical path so that the same file referenced by several materials is shared
+    std::string key = path;
+    char resolved[PATH_MAX];
+    if(realpath(path.c_str(), resolved) != nullptr) key = resolved;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = images.find(std::make_pair(key, channels));
+    if(it != images.end()) return it->second.get();
+    CachedImage* image = new CachedImage(imageList.size(), key, channels);
+    images[std::make_pair(key, channels)] = std::unique_ptr<CachedImage>(image);
+    imageList.push_back(image);
+    return image;
+}
+
+void TextureCache::setBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = bytes;
+    while(resident > sharedBudget() && !lru.empty()) evictOne();
+}
+
+size_t TextureCache::sharedBudget() const {
+    return budget > pinnedReserve ? budget - pinnedReserve : 0;
+}
+
+std::shared_ptr<TextureCache::ThreadStats> TextureCache::registerThread() {
+    std::lock_guard<std::mutex> lock(mutex);
+    threadStats.push_back(std::make_shared<ThreadStats>());
+    //the new table may pin up to PINNED_BYTES of tiles the shared cache already evicted
+    pinnedReserve += LocalTable::PINNED_BYTES;
+    while(resident > sharedBudget() && !lru.empty()) evictOne();
+    return threadStats.back();
+}
+
+void TextureCache::touch(CachedImage* image, int tile) {
+    lru.splice(lru.begin(), lru, image->lruPosition[tile]);
+}
+
+void TextureCache::evictOne() {
+    std::pair<int, int> victim = lru.back();
+    lru.pop_back();
+    CachedImage* image = imageList[victim.first];
+    resident -= image->tiles[victim.second]->size();
+    image->tiles[victim.second].reset();
+    evictions++;
+}
+
+void TextureCache::insertTile(CachedImage* image, int tile, std::vector<unsigned char>&& texels, bool evict) {
+    if(image->tiles[tile]) return;
+    size_t size = texels.size();
+    if(evict) {
+        while(resident + size > sharedBudget() && !lru.empty()) evictOne();
+    } else if(resident + size > sharedBudget()) {
+        return;
+    }
+    image->tiles[tile] = std::make_shared<const std::vector<unsigned char>>(std::move(texels));
+    lru.push_front(std::make_pair(image->id, tile));
+    image->lruPosition[tile] = lru.begin();
+    resident += size;
+    peakResident = std::max(peakResident, resident);
+}
+
+std::shared_ptr<const std::vector<unsigned char>> TextureCache::fetchTile(CachedImage* image, int tile) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(image->tiles[tile]) {
+            sharedHits++;
+            touch(image, tile);
+            return image->tiles[tile];
+        }
+    }
+    //one decode per image at a time, other threads wait for it instead of decoding twice
+    std::lock_guard<std::mutex> decodeLock(image->decodeMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(image->tiles[tile]) {
+            sharedHits++;
+            touch(image, tile);
+            return image->tiles[tile];
+        }
+        misses++;
+    }
+
+    if(image->backing != nullptr) {
+        const unsigned char* begin = image->backing + image->tileOffsets[tile];
+        std::vector<unsigned char> texels(begin, image->backing + image->tileOffsets[tile + 1]);
+        std::lock_guard<std::mutex> lock(mutex);
+        backingReads++;
+        insertTile(image, tile, std::move(texels), true);
+        return image->tiles[tile];
+    }
+
+    //stb cannot decode a sub-rectangle, so the first miss decodes the whole image,
+    //keeps every tile that still fits into the budget and writes all of them to the backing file
+    std::vector<std::vector<unsigned char>> decoded = decode(image);
+    if(!writeBacking(image, decoded)) {
+        printf("texture cache: no backing file for %s, misses decode it again\n", image->path.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    decodes++;
+    insertTile(image, tile, std::move(decoded[tile]), true);
+    std::shared_ptr<const std::vector<unsigned char>> result = image->tiles[tile];
+    for(size_t i = 0; i < decoded.size(); i++) {
+        if(int(i) == tile || image->tiles[i]) continue;
+        insertTile(image, i, std::move(decoded[i]), false);
+    }
+    return result;
+}
+
+std::vector<std::vector<unsigned char>> TextureCache::decode(CachedImage* image) {
+    int w = 0, h = 0, n = 0;
+    unsigned char* pixels = stbi_load(image->path.c_str(), &w, &h, &n, image->channels);
+    if(pixels != nullptr && (w != image->width || h != image->height)) {
+        stbi_image_free(pixels);
+        pixels = nullptr;
+    }
+
+    const int TILE = TILE_SIZE;
+    const int c = image->channels;
+    std::vector<std::vector<unsigned char>> decoded(image->tiles.size());
+    for(int ty = 0; ty < image->tilesY; ty++) {
+        for(int tx = 0; tx < image->tilesX; tx++) {
+            int tileWidth = std::min(TILE, image->width - tx * TILE);
+            int tileHeight = std::min(TILE, image->height - ty * TILE);
+            std::vector<unsigned char>& texels = decoded[ty * image->tilesX + tx];
+            texels.assign(tileWidth * tileHeight * c, 0);
+            if(pixels == nullptr) continue;
+            for(int y = 0; y < tileHeight; y++) {
+                const unsigned char* row = pixels + ((ty * TILE + y) * image->width + tx * TILE) * c;
+                std::copy(row, row + tileWidth * c, texels.begin() + y * tileWidth * c);
+            }
+        }
+    }
+    if(pixels != nullptr) stbi_image_free(pixels);
+    return decoded;
+}
+
+bool TextureCache::writeBacking(CachedImage* image, const std::vector<std::vector<unsigned char>>& decoded) {
+    //tmpfile is unlinked already, the mapping keeps the data reachable until the image is destroyed
+    //its pages belong to the page cache, not to the budget
+    std::vector<size_t> offsets(decoded.size() + 1, 0);
+    for(size_t i = 0; i < decoded.size(); i++) offsets[i + 1] = offsets[i] + decoded[i].size();
+    size_t size = offsets.back();
+    if(size == 0) return false;
+    FILE* f = std::tmpfile();
+    if(f == nullptr) return false;
+    bool ok = true;
+    for(auto& texels : decoded) {
+        if(fwrite(texels.data(), 1, texels.size(), f) != texels.size()) {
+            ok = false;
+            break;
+        }
+    }
+    ok = ok && fflush(f) == 0;
+    void* p = ok ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fileno(f), 0) : MAP_FAILED;
+    fclose(f);
+    if(p == MAP_FAILED) return false;
+    image->backing = static_cast<const unsigned char*>(p);
+    image->backingSize = size;
+    image->tileOffsets = std::move(offsets);
+    return true;
+}
+
+void TextureCache::printStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t lookups = 0, localHits = 0;
+    for(auto& stats : threadStats) {
+        lookups += stats->lookups.load(std::memory_order_relaxed);
+        localHits += stats->localHits.load(std::memory_order_relaxed);
+    }
+    size_t used = 0;
+    for(auto image : imageList) {
+        if(!image->tiles.empty()) used++;
+    }
+    double hitRate = lookups == 0 ? 0 : 100.0 * (localHits + sharedHits) / lookups;
+    double localRate = lookups == 0 ? 0 : 100.0 * localHits / lookups;
+    printf("texture cache: %zu textures referenced, %zu accessed, %llu decodes, %llu tiles read from backing files\n",
+           imageList.size(), used, (unsigned long long) decodes, (unsigned long long) backingReads);
+    printf("texture cache: %llu lookups, hit rate %.2f%% (thread-local %.2f%%), %llu misses, %llu evictions\n",
+           (unsigned long long) lookups, hitRate, localRate, (unsigned long long) misses, (unsigned long long) evictions);
+    printf("texture cache: resident %.2f MB, peak %.2f MB, budget %.2f MB (%.2f MB reserved for %zu thread-local tables)\n",
+           resident / 1048576.0, peakResident / 1048576.0, budget / 1048576.0,
+           pinnedReserve / 1048576.0, threadStats.size());
+}
@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "../include/tonemap.hpp"
+#include "../include/film.hpp"
+#include "../include/image.hpp"
+
+ToneMapper::ToneMapper(ToneMapType type, float exposure) : type(type), scale(std::pow(2.0f, exposure)) {
+    for(int i = 0; i < LUT_SIZE; i++) {
+        double v = double(i) / (LUT_SIZE - 1);
+        //sRGB transfer function
+        double encoded = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+        lut[i] = (unsigned char)(std::min(255.0, encoded * 255 + 0.5));
+    }
+}
+
+void ToneMapper::map(float* rgb, int n) const {
+    for(int i = 0; i < 3 * n; i++) rgb[i] *= scale;
+    switch(type) {
+        case REINHARD:
+            for(int i = 0; i < n; i++) {
+                float luminance = 0.2126f * rgb[3 * i] + 0.7152f * rgb[3 * i + 1] + 0.0722f * rgb[3 * i + 2];
+                float s = 1 / (1 + luminance);
+                rgb[3 * i] *= s;
+                rgb[3 * i + 1] *= s;
+                rgb[3 * i + 2] *= s;
+            }
+            break;
+        case ACES:
+            for(int i = 0; i < 3 * n; i++) {
+                float x = rgb[i];
+                rgb[i] = x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f);
+            }
+            break;
+        default:
+            break;
+    }
+    for(int i = 0; i < 3 * n; i++) rgb[i] = std::min(1.0f, std::max(0.0f, rgb[i]));
+}
+
+RgbImage* ToneMapper::apply(const Film& film) const {
+    int width = film.getWidth(), height = film.getHeight();
+    RgbImage* image = new RgbImage(width, height);
+#pragma omp parallel
+    {
+        std::vector<float> row(3 * width);
+#pragma omp for schedule(dynamic, 16)
+        for(int y = 0; y < height; y++) {
+            film.getRow(y, row.data());
+            map(row.data(), width);
+            for(int x = 0; x < width; x++) {
+                image->SetPixel(x, height - 1 - y, Vector3f(encode(row[3 * x]), encode(row[3 * x + 1]), encode(row[3 * x + 2])));
+            }
+        }
+    }
+    return image;
+}
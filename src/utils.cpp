@@ -2,7 +2,16 @@
 
 RenderMode RENDER;
 SamplerType SAMPLER;
-FilterType FILTER;
+FilterType FILTER = BOX;
+ToneMapType TONEMAP = CLIP;
+float exposure = 0;
+int textureCacheMB = 512;
+bool meshCache = false;
+bool rayPackets = true;
+bool photonGuiding = false;
+bool pathGuiding = false;
+bool writeAOVs = false;
+int denoiseIterations = 0;
 
 void parse_arg(int argc, char *argv[], int& width, int& height, int& samples, int& threads, int& depth, int& quality, std::string& input, std::string& output, bool& DOF, float& aperture, float& focus_length){
     for(int i = 1; i < argc; i++){
@@ -45,6 +54,9 @@ void parse_arg(int argc, char *argv[], int& width, int& height, int& samples, in
           case 5:
             RENDER = RC;
             break;
+          case 6:
+            RENDER = VRPT;
+            break;
           default:
             std::cout << "Invalid render mode" << std::endl;
         }
@@ -106,6 +118,25 @@ void parse_arg(int argc, char *argv[], int& width, int& height, int& samples, in
             std::cout << "Invalid filter mode" << std::endl;
         }
       }
+      else if(std::string(argv[i]) == "--tonemap"){
+        int tonemap = atoi(argv[i+1]);
+        switch(tonemap){
+          case 0:
+            TONEMAP = CLIP;
+            break;
+          case 1:
+            TONEMAP = REINHARD;
+            break;
+          case 2:
+            TONEMAP = ACES;
+            break;
+          default:
+            std::cout << "Invalid tonemap mode" << std::endl;
+        }
+      }
+      else if(std::string(argv[i]) == "--exposure"){
+        exposure = atof(argv[i+1]);
+      }
       else if(std::string(argv[i]) == "--aperture"){
         aperture = atof(argv[i+1]);
       }
@@ -122,6 +153,37 @@ void parse_arg(int argc, char *argv[], int& width, int& height, int& samples, in
         if(s == 0) useBVH = false;
         else useBVH = true;
       }
+      else if(std::string(argv[i]) == "--texture-cache"){
+        textureCacheMB = atoi(argv[i+1]);
+      }
+      else if(std::string(argv[i]) == "--mesh-cache"){
+        int s = atoi(argv[i+1]);
+        if(s == 0) meshCache = false;
+        else meshCache = true;
+      }
+      else if(std::string(argv[i]) == "--packets"){
+        int s = atoi(argv[i+1]);
+        if(s == 0) rayPackets = false;
+        else rayPackets = true;
+      }
+      else if(std::string(argv[i]) == "--photon-guiding"){
+        int s = atoi(argv[i+1]);
+        if(s == 0) photonGuiding = false;
+        else photonGuiding = true;
+      }
+      else if(std::string(argv[i]) == "--path-guiding"){
+        int s = atoi(argv[i+1]);
+        if(s == 0) pathGuiding = false;
+        else pathGuiding = true;
+      }
+      else if(std::string(argv[i]) == "--aov"){
+        int s = atoi(argv[i+1]);
+        if(s == 0) writeAOVs = false;
+        else writeAOVs = true;
+      }
+      else if(std::string(argv[i]) == "--denoise"){
+        denoiseIterations = atoi(argv[i+1]);
+      }
     }
 }
 
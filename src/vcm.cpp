@@ -0,0 +1,377 @@
+#include "../include/vcm.hpp"
+#include "../include/utils.hpp"
+#include "../include/group.hpp"
+#include "../include/scene_parser.hpp"
+#include "../include/camera.hpp"
+#include "../include/material.hpp"
+#include "../include/light.hpp"
+#include "../include/film.hpp"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+
+void HashGrid::build(const std::vector<Vector3f>& points, float radius) {
+    this->points = &points;
+    radius2 = radius * radius;
+    invCellSize = 1 / (2 * radius);
+    indices.clear();
+    bucketEnds.assign(std::max<size_t>(points.size(), 1), 0);
+    if(points.empty()) return;
+    boundsMin = points[0];
+    for(const Vector3f& p : points) {
+        for(int a = 0; a < 3; a++) boundsMin[a] = std::min(boundsMin[a], p[a]);
+    }
+    //counting sort: sizes of the buckets, their ends, then every point into its place from the back
+    std::vector<int> buckets(points.size());
+    for(size_t i = 0; i < points.size(); i++) {
+        Vector3f c = (points[i] - boundsMin) * invCellSize;
+        buckets[i] = bucket(int(std::floor(c.x())), int(std::floor(c.y())), int(std::floor(c.z())));
+        bucketEnds[buckets[i]]++;
+    }
+    for(size_t b = 1; b < bucketEnds.size(); b++) bucketEnds[b] += bucketEnds[b - 1];
+    indices.resize(points.size());
+    std::vector<int> fill = bucketEnds;
+    for(int i = int(points.size()) - 1; i >= 0; i--) indices[--fill[buckets[i]]] = i;
+}
+
+VCMIntegrator::VCMIntegrator(const SceneParser& scene, int maxDepth, float radiusFactor, float alpha) : scene(scene),
+        camera(scene.getCamera()), group(scene.getGroup()), sources(scene), emitters(sources.getEmitters()), maxDepth(maxDepth),
+        radiusFactor(radiusFactor), alpha(alpha) {
+}
+
+void VCMIntegrator::render(Film& film, int iterations) {
+    std::cout << "emitters: " << emitters.size() << ", lights: " << sources.numLights() << std::endl;
+    int width = film.getWidth(), height = film.getHeight();
+    lightPaths = float(width) * height;
+    float baseRadius = radiusFactor * sources.sceneRadius;
+    std::cout << "merging radius: " << baseRadius << std::endl;
+    film.setSplatScale(1.0f / iterations);
+    const int BLOCK = 256;
+    int blocks = (width * height + BLOCK - 1) / BLOCK;
+    int tilesX = (width + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesY = (height + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    std::vector<std::vector<LightVertex>> blockVertices(blocks);
+    std::vector<std::vector<int>> blockEnds(blocks);
+    for(int iter = 0; iter < iterations; iter++) {
+        radius = baseRadius / std::pow(float(iter + 1), 0.5f * (1 - alpha));
+        float etaVCM = float(M_PI) * radius * radius * lightPaths;
+        vmWeight = etaVCM;
+        vcWeight = 1 / etaVCM;
+        vmNormalization = 1 / etaVCM;
+
+        //light pass: one path per pixel, traced in blocks and concatenated in order
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int block = 0; block < blocks; ++block) {
+            unsigned short Xi[3] = {(unsigned short)(2 * iter), (unsigned short)(block >> 16), (unsigned short)(block * block * block)};
+            RandomSampler sampler(Xi);
+            blockVertices[block].clear();
+            blockEnds[block].clear();
+            int end = std::min(width * height, (block + 1) * BLOCK);
+            for(int i = block * BLOCK; i < end; ++i) {
+                traceLightPath(sampler, blockVertices[block], film);
+                blockEnds[block].push_back(blockVertices[block].size());
+            }
+        }
+        lightVertices.clear();
+        pathEnds.clear();
+        for(int block = 0; block < blocks; ++block) {
+            int offset = lightVertices.size();
+            lightVertices.insert(lightVertices.end(), blockVertices[block].begin(), blockVertices[block].end());
+            for(int end : blockEnds[block]) pathEnds.push_back(offset + end);
+        }
+        lightPoints.resize(lightVertices.size());
+        for(size_t i = 0; i < lightVertices.size(); i++) lightPoints[i] = lightVertices[i].p;
+        grid.build(lightPoints, radius);
+
+        //camera pass: one path per pixel, jittered in the 2 x 2 stratum of the iteration
+#pragma omp parallel for schedule(dynamic, 1)
+        for(int tile = 0; tile < tilesX * tilesY; ++tile) {
+            int x0 = tile % tilesX * Film::TILE_SIZE, y0 = tile / tilesX * Film::TILE_SIZE;
+            int x1 = std::min(x0 + Film::TILE_SIZE, width), y1 = std::min(y0 + Film::TILE_SIZE, height);
+            unsigned short Xi[3] = {(unsigned short)(2 * iter + 1), (unsigned short)(tile >> 16), (unsigned short)(tile * tile * tile)};
+            RandomSampler sampler(Xi);
+            FilmTile filmTile = film.tile(x0, y0, x1, y1);
+            int sub = iter % 4;
+            for(int y = y0; y < y1; ++y) for(int x = x0; x < x1; ++x) {
+                float sx = x + (sub % 2 + sampler.next()) / 2, sy = y + (sub / 2 + sampler.next()) / 2;
+                int path = y * width + x;
+                const LightVertex* begin = lightVertices.data() + (path > 0 ? pathEnds[path - 1] : 0);
+                const LightVertex* end = lightVertices.data() + pathEnds[path];
+                AOVSample aov;
+                Vector3f color = traceCameraPath(sx, sy, sampler, begin, end, film.hasAOVs() ? &aov : nullptr);
+                filmTile.addSample(sx, sy, color, &aov);
+            }
+            film.merge(filmTile);
+        }
+        fprintf(stderr, "\rRendering %5.2f%%", 100. * (iter + 1) / iterations);
+    }
+    std::cout << std::endl << "Rendering finished" << std::endl;
+}
+
+bool VCMIntegrator::lightSample(PathSampler& sampler, SubpathState& state) const {
+    if(sources.empty()) return false;
+    float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+    float u3 = sampler.next(), u4 = sampler.next(), u5 = sampler.next();
+    float pdfChoice;
+    const Light* light = sources.choose(u0, pdfChoice);
+    if(light != nullptr) {
+        LightSample e;
+        if(!light->sampleEmission(u1, u2, u3, u4, sources.sceneCenter, sources.sceneRadius, e)) return false;
+        bool infinite = light->type() == Light::DELTA_DIRECTION;
+        float emissionPdf = pdfChoice * e.pdfPosition * e.pdfDirection;
+        //s = 1 samples the points of area lights, the other lights are a single point (per direction)
+        float directPdfA = pdfChoice * (infinite ? 1 : e.pdfPosition);
+        state.origin = e.p;
+        state.direction = e.w;
+        state.throughput = e.Le * (std::fabs(Vector3f::dot(e.w, e.n)) / emissionPdf);
+        state.length = 1;
+        state.infiniteLight = infinite;
+        state.dVCM = directPdfA / emissionPdf;
+        //the lights cannot be hit, the camera subpaths never end on them
+        state.dVC = 0;
+        state.dVM = 0;
+        return true;
+    }
+    Vector3f p, n;
+    float pdfA;
+    const EmissiveShape& shape = emitters.sample(u0, u1, u2, p, n, pdfA);
+    pdfA *= pdfChoice;
+    float pdfDir;
+    Vector3f w = shape.sampleDirection(n, u3, u4, u5, pdfDir);
+    if(!(pdfDir > 0)) return false;
+    float cosine = std::fabs(Vector3f::dot(w, n));
+    float emissionPdf = pdfA * pdfDir;
+    state.origin = p;
+    state.direction = w;
+    state.throughput = shape.emission * (cosine / emissionPdf);
+    state.length = 1;
+    state.dVCM = pdfA / emissionPdf;
+    state.dVC = cosine / emissionPdf;
+    state.dVM = state.dVC * vcWeight;
+    return true;
+}
+
+bool VCMIntegrator::advance(SubpathState& state, Hit& hit, Vector3f& p) const {
+    Ray ray(state.origin, state.direction);
+    if(!group->intersect(ray, hit, EPS)) return false;
+    p = ray.pointAtParameter(hit.getT());
+    //grazing hits would divide by zero
+    float cosine = std::max(std::fabs(Vector3f::dot(hit.getNormal().normalized(), state.direction)), 1e-6f);
+    if(state.length > 1 || !state.infiniteLight) state.dVCM *= hit.getT() * hit.getT();
+    state.dVCM /= cosine;
+    state.dVC /= cosine;
+    state.dVM /= cosine;
+    return true;
+}
+
+bool VCMIntegrator::scatter(const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, PathSampler& sampler, SubpathState& state) const {
+    Vector3f wi;
+    float pdfDir;
+    Vector3f weight = bsdf.sample(wo, sampler, wi, pdfDir);
+    if(isBlack(weight) || !(pdfDir > 0)) return false;
+    float cosOut = std::fabs(Vector3f::dot(wi, bsdf.n));
+    if(bsdf.isDelta()) {
+        //the reverse pdf equals the forward one and cancels
+        state.dVCM = 0;
+        state.dVC *= cosOut;
+        state.dVM *= cosOut;
+    } else {
+        float pdfRev = bsdf.pdf(wi, wo);
+        state.dVC = cosOut / pdfDir * (state.dVC * pdfRev + state.dVCM + vmWeight);
+        state.dVM = cosOut / pdfDir * (state.dVM * pdfRev + state.dVCM * vcWeight + 1);
+        state.dVCM = 1 / pdfDir;
+    }
+    state.origin = p;
+    state.direction = wi;
+    state.throughput = state.throughput * weight;
+    state.length++;
+    return true;
+}
+
+void VCMIntegrator::traceLightPath(PathSampler& sampler, std::vector<LightVertex>& vertices, Film& film) const {
+    SubpathState state;
+    if(!lightSample(sampler, state)) return;
+    int maxLength = maxDepth + 1;
+    while(true) {
+        Hit hit;
+        Vector3f p;
+        if(!advance(state, hit, p)) return;
+        VertexBSDF bsdf(hit);
+        Vector3f wo = -state.direction;
+        if(!bsdf.isDelta()) {
+            if(bsdf.lobe != VertexBSDF::NONE) {
+                LightVertex v;
+                v.p = p;
+                v.wo = wo;
+                v.bsdf = bsdf;
+                v.throughput = state.throughput;
+                v.length = state.length;
+                v.dVCM = state.dVCM;
+                v.dVC = state.dVC;
+                v.dVM = state.dVM;
+                vertices.push_back(v);
+            }
+            if(camera->connectible()) connectToCamera(state, bsdf, p, wo, film);
+        }
+        if(state.length + 2 > maxLength || !scatter(bsdf, p, wo, sampler, state)) return;
+    }
+}
+
+void VCMIntegrator::connectToCamera(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, Film& film) const {
+    float x, y;
+    if(!camera->rasterPosition(p, x, y)) return;
+    Vector3f w = camera->getCenter() - p;
+    float d2 = w.squaredLength();
+    w = w / std::sqrt(d2);
+    Vector3f f = bsdf.f(wo, w);
+    if(isBlack(f)) return;
+    //pdf per area at p of the camera's pixel sample
+    float pixelPdf = camera->directionPdf(-w) * camera->getWidth() * camera->getHeight();
+    float cosine = std::fabs(Vector3f::dot(w, bsdf.n));
+    float cameraPdfA = pixelPdf * cosine / d2;
+    float wLight = cameraPdfA / lightPaths * (vmWeight + state.dVCM + state.dVC * bsdf.pdf(w, wo));
+    if(!visible(group, p, camera->getCenter())) return;
+    film.addSplat(x, y, state.throughput * f * (cameraPdfA / lightPaths / (wLight + 1)));
+}
+
+Vector3f VCMIntegrator::traceCameraPath(float x, float y, PathSampler& sampler, const LightVertex* lightBegin, const LightVertex* lightEnd, AOVSample* aov) const {
+    float lensU = sampler.next(), lensV = sampler.next();
+    SubpathState state;
+    Ray cameraRay = camera->generateRay(Vector2f(x, y), Vector2f(lensU, lensV));
+    state.origin = cameraRay.getOrigin();
+    state.direction = cameraRay.getDirection();
+    state.throughput = Vector3f(1);
+    state.length = 1;
+    //a camera that cannot be connected to takes no part in the weights
+    //SmallVCM's lightPaths / pdf per pixel of the camera ray
+    float pixelPdf = camera->directionPdf(state.direction) * camera->getWidth() * camera->getHeight();
+    state.dVCM = camera->connectible() && pixelPdf > 0 ? lightPaths / pixelPdf : 0;
+    int maxLength = maxDepth + 1;
+    Vector3f L = Vector3f::ZERO, direct = Vector3f::ZERO;
+    while(true) {
+        Hit hit;
+        Vector3f p;
+        if(!advance(state, hit, p)) {
+            //the background is found by this strategy only
+            Vector3f background = state.throughput * scene.getBackground(state.direction);
+            L += background;
+            if(state.length <= 2) direct += background;
+            break;
+        }
+        VertexBSDF bsdf(hit);
+        Vector3f wo = -state.direction;
+        if(aov != nullptr && state.length == 1) {
+            aov->albedo = bsdf.color;
+            aov->normal = bsdf.n;
+            aov->depth = hit.getT();
+        }
+        Vector3f Le = state.throughput * emitted(state, hit.getMaterial(), bsdf.n);
+        L += Le;
+        if(state.length <= 2) direct += Le;
+        if(state.length >= maxLength) break;
+        if(!bsdf.isDelta() && bsdf.lobe != VertexBSDF::NONE) {
+            //s = 1: a new point on the emitters or a light
+            Vector3f nee = state.throughput * directIllumination(state, bsdf, p, wo, sampler);
+            L += nee;
+            if(state.length <= 1) direct += nee;
+            //s > 1: the vertices of the pixel's light path, in increasing length
+            for(const LightVertex* v = lightBegin; v != lightEnd && v->length + 1 + state.length <= maxLength; ++v) {
+                L += state.throughput * v->throughput * connectVertices(state, bsdf, p, wo, *v);
+            }
+            //merging with the light vertices around p
+            Vector3f merged = Vector3f::ZERO, mergedDirect = Vector3f::ZERO;
+            grid.query(p, [&](int i) {
+                const LightVertex& v = lightVertices[i];
+                if(v.length + state.length > maxLength) return;
+                Vector3f f = bsdf.f(wo, v.wo);
+                if(isBlack(f)) return;
+                float wLight = v.dVCM * vcWeight + v.dVM * bsdf.pdf(wo, v.wo);
+                float wCamera = state.dVCM * vcWeight + state.dVM * bsdf.pdf(v.wo, wo);
+                Vector3f c = f * v.throughput / (wLight + 1 + wCamera);
+                merged += c;
+                if(v.length + state.length <= 2) mergedDirect += c;
+            });
+            L += state.throughput * merged * vmNormalization;
+            direct += state.throughput * mergedDirect * vmNormalization;
+        }
+        if(!scatter(bsdf, p, wo, sampler, state)) break;
+    }
+    if(aov != nullptr) {
+        aov->direct = direct;
+        aov->indirect = L - direct;
+    }
+    return L;
+}
+
+Vector3f VCMIntegrator::emitted(const SubpathState& state, const Material* material, const Vector3f& n) const {
+    Vector3f Le = emissionOf(material);
+    if(isBlack(Le) || state.length == 1) return Le;
+    //emitters that are not sampled are found by this strategy only
+    float pdfA = sources.pdfPoint(material);
+    if(pdfA == 0) return Le;
+    float emissionPdf = pdfA * emitters.pdfDirection(material, Vector3f::dot(n, -state.direction));
+    float wCamera = pdfA * state.dVCM + emissionPdf * state.dVC;
+    return Le / (1 + wCamera);
+}
+
+Vector3f VCMIntegrator::directIllumination(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, PathSampler& sampler) const {
+    if(sources.empty()) return Vector3f::ZERO;
+    float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+    float pdfChoice;
+    const Light* light = sources.choose(u0, pdfChoice);
+    if(light != nullptr) {
+        Vector3f q, nq, col;
+        if(!light->sampleIncident(p, u1, u2, sources.sceneRadius, q, nq, col)) return Vector3f::ZERO;
+        Vector3f w = q - p;
+        float d2 = w.squaredLength();
+        if(d2 == 0) return Vector3f::ZERO;
+        w = w / std::sqrt(d2);
+        Vector3f f = bsdf.f(wo, w);
+        if(isBlack(f)) return Vector3f::ZERO;
+        float pdfPosition, pdfDirection;
+        light->pdfEmission(-w, sources.sceneRadius, pdfPosition, pdfDirection);
+        float cosine = std::fabs(Vector3f::dot(w, bsdf.n));
+        //the lights cannot be hit (wLight = 0); the emission pdf per area at p over the pdf of the point q
+        float emissionPdfA = (light->type() == Light::DELTA_DIRECTION ? pdfPosition : pdfDirection / d2) * cosine;
+        float wCamera = emissionPdfA * (vmWeight + state.dVCM + state.dVC * bsdf.pdf(w, wo));
+        if(!visible(group, p, q)) return Vector3f::ZERO;
+        return col * f * (cosine / pdfChoice / (1 + wCamera));
+    }
+    Vector3f q, nq;
+    float pdfA;
+    const EmissiveShape& shape = emitters.sample(u0, u1, u2, q, nq, pdfA);
+    pdfA *= pdfChoice;
+    Vector3f w = q - p;
+    float d2 = w.squaredLength();
+    if(d2 == 0) return Vector3f::ZERO;
+    w = w / std::sqrt(d2);
+    float cosLight = Vector3f::dot(nq, -w);
+    if(!shape.twoSided && cosLight <= 0) return Vector3f::ZERO;
+    Vector3f f = bsdf.f(wo, w);
+    if(isBlack(f)) return Vector3f::ZERO;
+    float directPdf = pdfA * d2 / std::fabs(cosLight);
+    float emissionPdf = pdfA * EmissiveShape::pdfDirection(shape.twoSided, cosLight);
+    float cosine = std::fabs(Vector3f::dot(w, bsdf.n));
+    float wLight = bsdf.pdf(wo, w) / directPdf;
+    float wCamera = emissionPdf * cosine / (directPdf * std::fabs(cosLight)) * (vmWeight + state.dVCM + state.dVC * bsdf.pdf(w, wo));
+    if(!visible(group, p, q)) return Vector3f::ZERO;
+    return shape.emission * f * (cosine / directPdf / (wLight + 1 + wCamera));
+}
+
+Vector3f VCMIntegrator::connectVertices(const SubpathState& state, const VertexBSDF& bsdf, const Vector3f& p, const Vector3f& wo, const LightVertex& vertex) const {
+    Vector3f w = vertex.p - p;
+    float d2 = w.squaredLength();
+    if(d2 == 0) return Vector3f::ZERO;
+    w = w / std::sqrt(d2);
+    Vector3f fCamera = bsdf.f(wo, w), fLight = vertex.bsdf.f(vertex.wo, -w);
+    if(isBlack(fCamera) || isBlack(fLight)) return Vector3f::ZERO;
+    float cosCamera = std::fabs(Vector3f::dot(w, bsdf.n)), cosLight = std::fabs(Vector3f::dot(w, vertex.bsdf.n));
+    //pdfs per area of either vertex scattering towards the other one
+    float cameraPdfA = bsdf.pdf(wo, w) * cosLight / d2;
+    float lightPdfA = vertex.bsdf.pdf(vertex.wo, -w) * cosCamera / d2;
+    float wLight = cameraPdfA * (vmWeight + vertex.dVCM + vertex.dVC * vertex.bsdf.pdf(-w, vertex.wo));
+    float wCamera = lightPdfA * (vmWeight + state.dVCM + state.dVC * bsdf.pdf(w, wo));
+    if(!visible(group, p, vertex.p)) return Vector3f::ZERO;
+    return fCamera * fLight * (cosCamera * cosLight / d2 / (wLight + 1 + wCamera));
+}
@@ -0,0 +1,255 @@
+#include "../include/vrpt.hpp"
+#include "../include/utils.hpp"
+#include "../include/group.hpp"
+#include "../include/scene_parser.hpp"
+#include "../include/camera.hpp"
+#include "../include/material.hpp"
+#include "../include/light.hpp"
+#include "../include/environment.hpp"
+#include "../include/film.hpp"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+
+static const int MAX_EVENTS = 1024;
+//MEDIA boundaries a ray may cross without scattering
+static const int MAX_CROSSINGS = 256;
+
+//the material if it bounds a medium of the given type
+static const DiscreteMaterial* boundary(const Material* material, BRDFType type) {
+    const DiscreteMaterial* m = dynamic_cast<const DiscreteMaterial*>(material);
+    return m != nullptr && m->getMaterialType() == type ? m : nullptr;
+}
+
+//medium on the side of the boundary (normal n) that direction d goes to
+static const Medium* mediumAfter(const DiscreteMaterial* m, const Vector3f& n, const Vector3f& d) {
+    return Vector3f::dot(n, d) < 0 ? m->getMedium() : nullptr;
+}
+
+static float powerHeuristic(float a, float b) {
+    return a * a / (a * a + b * b);
+}
+
+VolumetricPathIntegrator::VolumetricPathIntegrator(const SceneParser& scene, int maxDepth) : scene(scene),
+        camera(scene.getCamera()), group(scene.getGroup()), sources(scene), emitters(sources.getEmitters()), maxDepth(maxDepth) {
+}
+
+void VolumetricPathIntegrator::render(Film& film, int pixelSamples) const {
+    std::cout << "emitters: " << emitters.size() << ", lights: " << sources.numLights() << std::endl;
+    int tilesX = (film.getWidth() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesY = (film.getHeight() + Film::TILE_SIZE - 1) / Film::TILE_SIZE;
+    int tilesDone = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+    for(int tile = 0; tile < tilesX * tilesY; ++tile) {
+        int x0 = tile % tilesX * Film::TILE_SIZE, y0 = tile / tilesX * Film::TILE_SIZE;
+        int x1 = std::min(x0 + Film::TILE_SIZE, film.getWidth()), y1 = std::min(y0 + Film::TILE_SIZE, film.getHeight());
+        unsigned short Xi[3] = {0, (unsigned short)(tile >> 16), (unsigned short)(tile * tile * tile)};
+        RandomSampler sampler(Xi);
+        FilmTile filmTile = film.tile(x0, y0, x1, y1);
+        //2 x 2 strata, jittered, as the path tracer
+        int perStratum = std::max(1, pixelSamples / 4);
+        for(int y = y0; y < y1; ++y) for(int x = x0; x < x1; ++x) {
+            for(int k = 0; k < pixelSamples; ++k) {
+                int sub = k / perStratum % 4;
+                float sx = x + (sub % 2 + sampler.next()) / 2, sy = y + (sub / 2 + sampler.next()) / 2;
+                float lensU = sampler.next(), lensV = sampler.next();
+                AOVSample aov;
+                Vector3f color = Li(camera->generateRay(Vector2f(sx, sy), Vector2f(lensU, lensV)), sampler, film.hasAOVs() ? &aov : nullptr);
+                filmTile.addSample(sx, sy, color, &aov);
+            }
+        }
+        film.merge(filmTile);
+        int done;
+#pragma omp atomic capture
+        done = ++tilesDone;
+        fprintf(stderr, "\rRendering %5.2f%%", 100. * done / (tilesX * tilesY));
+    }
+    std::cout << std::endl << "Rendering finished" << std::endl;
+}
+
+bool VolumetricPathIntegrator::survive(int& events, Vector3f& beta, PathSampler& sampler) const {
+    if(++events <= maxDepth) return true;
+    float q = std::min(1.0f, std::max(beta.x(), std::max(beta.y(), beta.z())));
+    if(events > MAX_EVENTS || sampler.next() >= q) return false;
+    beta = beta / q;
+    return true;
+}
+
+Vector3f VolumetricPathIntegrator::Li(const Ray& cameraRay, PathSampler& sampler, AOVSample* aov) const {
+    Vector3f L = Vector3f::ZERO, direct = Vector3f::ZERO, beta(1);
+    //the ray of the current segment
+    Vector3f origin = cameraRay.getOrigin(), direction = cameraRay.getDirection();
+    //the camera is outside of all media
+    const Medium* medium = nullptr;
+    //the last scattering vertex: whether it was a delta lobe (or the camera), its pdf towards ray, its position
+    bool specular = true;
+    float pdfPrevious = 0;
+    Vector3f previous = origin;
+    int events = 0, crossings = 0;
+    while(true) {
+        Ray ray(origin, direction);
+        Hit hit;
+        bool found = group->intersect(ray, hit, EPS);
+        if(medium != nullptr) {
+            float t;
+            Vector3f weight;
+            bool scattered = medium->sample(ray, found ? hit.getT() : 1e30f, sampler, t, weight);
+            beta = beta * weight;
+            if(isBlack(beta)) break;
+            if(scattered) {
+                if(!survive(events, beta, sampler)) break;
+                Vector3f p = ray.pointAtParameter(t), d = ray.getDirection();
+                Vector3f Ld = beta * sampleLight(p, -d, nullptr, medium, sampler);
+                L += Ld;
+                if(events <= 1) direct += Ld;
+                float u1 = sampler.next(), u2 = sampler.next();
+                Vector3f wi = samplePhaseHG(d, medium->getG(), u1, u2);
+                pdfPrevious = phaseHG(Vector3f::dot(d, wi), medium->getG());
+                specular = false;
+                previous = p;
+                origin = p;
+                direction = wi;
+                continue;
+            }
+        }
+        if(!found) {
+            Vector3f background = beta * scene.getBackground(ray.getDirection());
+            //weighted against sampling the environment map at the vertex before
+            const EnvironmentMap* environment = scene.getEnvironment();
+            if(environment != nullptr && !specular) background = background * powerHeuristic(pdfPrevious, environment->pdf(ray.getDirection()));
+            L += background;
+            if(events <= 1) direct += background;
+            break;
+        }
+        Vector3f p = ray.pointAtParameter(hit.getT()), d = ray.getDirection();
+        Vector3f n = hit.getNormal().normalized();
+        const Material* material = hit.getMaterial();
+        VertexBSDF bsdf(hit);
+        if(aov != nullptr && events == 0 && crossings == 0) {
+            aov->albedo = bsdf.color;
+            aov->normal = n;
+            aov->depth = hit.getT();
+        }
+        Vector3f Le = emissionOf(material);
+        if(!isBlack(Le)) {
+            float weight = 1;
+            float pdfLight = sources.pdfPoint(material);
+            if(!specular && pdfLight > 0) {
+                float cosine = std::fabs(Vector3f::dot(n, d));
+                weight = cosine > 0 ? powerHeuristic(pdfPrevious, pdfLight * (p - previous).squaredLength() / cosine) : 0;
+            }
+            Vector3f contribution = beta * Le * weight;
+            L += contribution;
+            if(events <= 1) direct += contribution;
+        }
+        //index matched: only the medium changes
+        if(const DiscreteMaterial* m = boundary(material, BRDFType::MEDIA)) {
+            if(++crossings > MAX_CROSSINGS) break;
+            medium = mediumAfter(m, n, d);
+            origin = p;
+            continue;
+        }
+        const DiscreteMaterial* subsurface = boundary(material, BRDFType::SUBSURFACE);
+        //the color of a subsurface material is the albedo of its medium, the boundary itself is clear
+        if(subsurface != nullptr && subsurface->getMedium() != nullptr) bsdf.color = Vector3f(1);
+        if(bsdf.lobe == VertexBSDF::NONE || !survive(events, beta, sampler)) break;
+        Vector3f wo = -d;
+        if(!bsdf.isDelta()) {
+            Vector3f Ld = beta * sampleLight(p, wo, &bsdf, medium, sampler);
+            L += Ld;
+            if(events <= 1) direct += Ld;
+        }
+        Vector3f wi;
+        float pdf;
+        Vector3f weight = bsdf.sample(wo, sampler, wi, pdf);
+        if(isBlack(weight)) break;
+        beta = beta * weight;
+        specular = bsdf.isDelta();
+        pdfPrevious = pdf;
+        previous = p;
+        if(subsurface != nullptr) medium = mediumAfter(subsurface, n, wi);
+        origin = p;
+        direction = wi;
+    }
+    if(aov != nullptr) {
+        aov->direct = direct;
+        aov->indirect = L - direct;
+    }
+    return L;
+}
+
+//bsdf (nullptr: the phase function of medium) from wo to w, times |cos| at surfaces; pdf: of sampling w from wo
+static Vector3f scattering(const Vector3f& wo, const Vector3f& w, const VertexBSDF* bsdf, const Medium* medium, float& pdf) {
+    if(bsdf != nullptr) {
+        pdf = bsdf->pdf(wo, w);
+        return bsdf->f(wo, w) * std::fabs(Vector3f::dot(w, bsdf->n));
+    }
+    pdf = phaseHG(Vector3f::dot(-wo, w), medium->getG());
+    return Vector3f(pdf);
+}
+
+Vector3f VolumetricPathIntegrator::sampleLight(const Vector3f& p, const Vector3f& wo, const VertexBSDF* bsdf, const Medium* medium, PathSampler& sampler) const {
+    Vector3f L = Vector3f::ZERO;
+    float pdfScatter;
+    if(!sources.empty()) {
+        float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+        float pdfChoice;
+        const Light* light = sources.choose(u0, pdfChoice);
+        if(light != nullptr) {
+            //col: what reaches p over the pdf of the point on the light
+            Vector3f q, nq, col;
+            if(light->sampleIncident(p, u1, u2, sources.sceneRadius, q, nq, col)) {
+                Vector3f f = scattering(wo, (q - p).normalized(), bsdf, medium, pdfScatter);
+                if(!isBlack(f)) L += f * transmittance(p, q, medium, sampler) * col / pdfChoice;
+            }
+        } else {
+            Vector3f q, nq;
+            float pdfA;
+            const EmissiveShape& shape = emitters.sample(u0, u1, u2, q, nq, pdfA);
+            Vector3f w = q - p;
+            float d2 = w.squaredLength();
+            w = w / std::sqrt(d2);
+            float cosLight = Vector3f::dot(nq, -w);
+            if(d2 > 0 && cosLight != 0 && (shape.twoSided || cosLight > 0)) {
+                Vector3f f = scattering(wo, w, bsdf, medium, pdfScatter);
+                float pdfLight = pdfChoice * pdfA * d2 / std::fabs(cosLight);
+                if(!isBlack(f)) L += f * transmittance(p, q, medium, sampler) * shape.emission * (powerHeuristic(pdfLight, pdfScatter) / pdfLight);
+            }
+        }
+    }
+    const EnvironmentMap* environment = scene.getEnvironment();
+    if(environment != nullptr) {
+        float u0 = sampler.next(), u1 = sampler.next(), u2 = sampler.next();
+        Vector3f w;
+        float pdfLight;
+        Vector3f Le = environment->sample(u0, u1, u2, w, pdfLight);
+        if(pdfLight > 0 && !isBlack(Le)) {
+            Vector3f f = scattering(wo, w, bsdf, medium, pdfScatter);
+            //the shadow ray ends outside the visible scene, as the one to a directional light (sampleIncident)
+            Vector3f q = p + w * (2 * sources.sceneRadius + (p - sources.sceneCenter).length());
+            if(!isBlack(f)) L += f * transmittance(p, q, medium, sampler) * Le * (powerHeuristic(pdfLight, pdfScatter) / pdfLight);
+        }
+    }
+    return L;
+}
+
+Vector3f VolumetricPathIntegrator::transmittance(Vector3f a, const Vector3f& b, const Medium* medium, PathSampler& sampler) const {
+    Vector3f Tr(1);
+    for(int crossings = 0; crossings <= MAX_CROSSINGS; crossings++) {
+        Vector3f d = b - a;
+        float distance = d.length();
+        d = d / distance;
+        //only hits clearly before b block, as in visible
+        Hit hit(distance * (1 - 1e-3f), nullptr, Vector3f::ZERO);
+        Ray ray(a, d);
+        bool blocked = group->intersect(ray, hit, EPS);
+        if(medium != nullptr) Tr = Tr * medium->transmittance(ray, blocked ? hit.getT() : distance, sampler);
+        if(!blocked) return Tr;
+        const DiscreteMaterial* m = boundary(hit.getMaterial(), BRDFType::MEDIA);
+        if(m == nullptr || isBlack(Tr)) return Vector3f::ZERO;
+        medium = mediumAfter(m, hit.getNormal().normalized(), d);
+        a = ray.pointAtParameter(hit.getT());
+    }
+    return Vector3f::ZERO;
+}